@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <errno.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * CPU and NUMA placement
+ *
+ * A group may ask for its processes to be pinned. The topology is read from
+ * /sys once when the daemon starts, limited to the CPUs the daemon itself
+ * may run on, and cut into slots for each strategy:
+ *
+ *   core    one slot per physical core, holding its hyperthreads
+ *   spread  the same slots, taking a core of every NUMA node in turn
+ *   pack    one slot per CPU, hyperthreads of a core next to each other
+ *   node:N  the CPUs of NUMA node N, memory is bound to the node
+ *   cpus:L  the CPUs in the list L, like 0-3,8
+ *
+ * A process takes the slot with the fewest processes on its CPUs, the first
+ * one of those, so instances of every group share out the machine before
+ * any two land on the same CPUs. The slot is kept in the process record and
+ * in the journal: a process keeps it across restarts and daemon upgrades
+ * and gives it back when it is removed or retired.
+ *
+ * posix_spawn cannot pin a child, but a child inherits the CPUs and the
+ * memory policy of the thread that started it. The daemon moves itself to
+ * the slot for the spawn and back right after, so the program runs on its
+ * CPUs and allocates on their node from its very first instruction. With
+ * more than one node the memory of a slot prefers the node of its CPUs.
+ */
+
+extern pm_configuration config;
+
+typedef struct cpu_slot {
+        cpu_set_t cpus;
+        // node the memory of the slot comes from, -1 for the default policy
+        int node;
+        int mode;
+} cpu_slot;
+
+typedef struct cpu_info {
+        int cpu;
+        int core;
+        int package;
+        int node;
+} cpu_info;
+
+typedef enum placement_kind { PLACE_CORE, PLACE_SPREAD, PLACE_PACK, PLACE_NODE, PLACE_CPUS, PLACE_KINDS } placement_kind;
+
+static char *kind_names[PLACE_KINDS] = { "core", "spread", "pack", "node", "cpus" };
+
+static cpu_info *cpus;
+static int cpu_count;
+static int node_count;
+static cpu_set_t daemon_cpus;
+
+// slots of the strategies that have them, built once
+static cpu_slot *slots[PLACE_PACK + 1];
+static int slot_counts[PLACE_PACK + 1];
+
+// number of placed processes on each CPU
+static uint32_t cpu_load[CPU_SETSIZE];
+
+static int read_number (char *format, int a, int fallback)
+{
+        char path[PATH_MAX];
+        int value;
+
+        snprintf (path, sizeof (path), format, a);
+        FILE *file = fopen (path, "re");
+
+        if (!file)
+                return fallback;
+
+        if (fscanf (file, "%d", &value) != 1)
+                value = fallback;
+
+        fclose (file);
+
+        return value;
+}
+
+/**
+ * Parses a CPU or node list like 0-3,8 into set. Returns false if it is
+ * malformed or names a number of CPU_SETSIZE or more.
+ */
+static bool parse_cpu_list (char *list, cpu_set_t *set)
+{
+        char *end;
+
+        CPU_ZERO (set);
+
+        for (char *item = list; *item && *item != '\n'; item = *end == ',' ? end + 1 : end) {
+                errno = 0;
+                long first = strtol (item, &end, 10), last = first;
+
+                if (end == item || errno || first < 0)
+                        return false;
+
+                if (*end == '-') {
+                        char *from = end + 1;
+
+                        last = strtol (from, &end, 10);
+
+                        if (end == from || last < first)
+                                return false;
+                }
+
+                if (last >= CPU_SETSIZE || (*end && *end != ',' && *end != '\n'))
+                        return false;
+
+                for (long cpu = first; cpu <= last; cpu++)
+                        CPU_SET (cpu, set);
+        }
+
+        return CPU_COUNT (set) > 0;
+}
+
+static bool read_cpu_list (char *path, cpu_set_t *set)
+{
+        char list[4096];
+        FILE *file = fopen (path, "re");
+
+        if (!file)
+                return false;
+
+        bool ok = fgets (list, sizeof (list), file) && parse_cpu_list (list, set);
+
+        fclose (file);
+
+        return ok;
+}
+
+/**
+ * Checks that a placement is one of core, spread, pack, node:N or cpus:L.
+ * Whether the host has the node or CPUs it names is only known to the
+ * daemon.
+ */
+bool parse_placement_spec (char *spec)
+{
+        cpu_set_t set;
+        char *end;
+
+        if (strlen (spec) >= PM_PLACEMENT_SPEC_MAX)
+                return false;
+
+        if (strcmp (spec, "core") == 0 || strcmp (spec, "spread") == 0 || strcmp (spec, "pack") == 0)
+                return true;
+
+        if (strncmp (spec, "node:", 5) == 0) {
+                long node = strtol (spec + 5, &end, 10);
+
+                return end != spec + 5 && !*end && node >= 0 && node < PM_NUMA_NODES_MAX;
+        }
+
+        return strncmp (spec, "cpus:", 5) == 0 && parse_cpu_list (spec + 5, &set);
+}
+
+static placement_kind get_kind (char *spec)
+{
+        for (int kind = 0; kind < PLACE_KINDS; kind++)
+                if (strncmp (spec, kind_names[kind], strlen (kind_names[kind])) == 0)
+                        return kind;
+
+        return PLACE_KINDS;
+}
+
+static int compare_cpus (const void *a, const void *b)
+{
+        const cpu_info *x = a, *y = b;
+
+        if (x->node != y->node)
+                return x->node - y->node;
+
+        if (x->package != y->package)
+                return x->package - y->package;
+
+        if (x->core != y->core)
+                return x->core - y->core;
+
+        return x->cpu - y->cpu;
+}
+
+static cpu_slot *add_slot (placement_kind kind, int node)
+{
+        slots[kind] = realloc_nofail (slots[kind], (slot_counts[kind] + 1) * sizeof (cpu_slot));
+
+        cpu_slot *slot = &slots[kind][slot_counts[kind]++];
+
+        CPU_ZERO (&slot->cpus);
+        slot->node = node_count > 1 ? node : -1;
+        slot->mode = MPOL_PREFERRED;
+
+        return slot;
+}
+
+/**
+ * Cuts the CPUs, sorted by node and core, into the slots of each strategy.
+ */
+static void build_slots ()
+{
+        int *core_node = calloc_nofail (cpu_count, sizeof (int));
+        int cores = 0;
+
+        for (int i = 0; i < cpu_count; i++) {
+                cpu_info *cpu = &cpus[i], *prev = i > 0 ? &cpus[i - 1] : NULL;
+
+                // hyperthreads follow each other, the first one opens the core
+                if (!prev || cpu->node != prev->node || cpu->package != prev->package || cpu->core != prev->core) {
+                        add_slot (PLACE_CORE, cpu->node);
+                        core_node[cores++] = cpu->node;
+                }
+
+                CPU_SET (cpu->cpu, &slots[PLACE_CORE][cores - 1].cpus);
+                CPU_SET (cpu->cpu, &add_slot (PLACE_PACK, cpu->node)->cpus);
+        }
+
+        // a core of every node in turn, the next core of each node every round
+        for (int round = 0; slot_counts[PLACE_SPREAD] < cores; round++) {
+                for (int node = 0; node < PM_NUMA_NODES_MAX; node++) {
+                        int seen = 0;
+
+                        for (int core = 0; core < cores; core++) {
+                                if (core_node[core] == node && seen++ == round) {
+                                        *add_slot (PLACE_SPREAD, node) = slots[PLACE_CORE][core];
+                                        break;
+                                }
+                        }
+                }
+        }
+
+        free (core_node);
+}
+
+/**
+ * Reads the topology of the CPUs the daemon may run on and builds the slots
+ * of every strategy.
+ */
+void affinity_init ()
+{
+        cpu_set_t online;
+
+        if (sched_getaffinity (0, sizeof (daemon_cpus), &daemon_cpus) < 0)
+                CPU_ZERO (&daemon_cpus);
+
+        if (!read_cpu_list ("/sys/devices/system/cpu/online", &online))
+                online = daemon_cpus;
+
+        cpus = calloc_nofail (CPU_COUNT (&online) + 1, sizeof (cpu_info));
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET (cpu, &online) || !CPU_ISSET (cpu, &daemon_cpus))
+                        continue;
+
+                // without topology every CPU is a core of its own
+                cpus[cpu_count++] = (cpu_info) {
+                        .cpu = cpu,
+                        .core = read_number ("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu, cpu),
+                        .package = read_number ("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu, 0),
+                };
+        }
+
+        for (int node = 0; node < PM_NUMA_NODES_MAX; node++) {
+                char path[PATH_MAX];
+                cpu_set_t node_cpus;
+
+                snprintf (path, sizeof (path), "/sys/devices/system/node/node%d/cpulist", node);
+
+                if (access (path, R_OK) != 0)
+                        continue;
+
+                node_count = node + 1;
+
+                if (!read_cpu_list (path, &node_cpus))
+                        continue;
+
+                for (int i = 0; i < cpu_count; i++)
+                        if (CPU_ISSET (cpus[i].cpu, &node_cpus))
+                                cpus[i].node = node;
+        }
+
+        qsort (cpus, cpu_count, sizeof (cpu_info), compare_cpus);
+        build_slots ();
+
+        log_info ("placing processes on %d cpus in %d cores and %d numa nodes", cpu_count, slot_counts[PLACE_CORE], node_count ? node_count : 1);
+}
+
+/**
+ * Fills in the slot a process with a node or CPU list placement gets.
+ * Returns false if the host does not have them.
+ */
+static bool fixed_slot (char *spec, cpu_slot *slot)
+{
+        placement_kind kind = get_kind (spec);
+
+        CPU_ZERO (&slot->cpus);
+        slot->node = -1;
+
+        if (kind == PLACE_CPUS) {
+                cpu_set_t wanted;
+
+                parse_cpu_list (spec + 5, &wanted);
+                CPU_AND (&slot->cpus, &wanted, &daemon_cpus);
+
+                return CPU_EQUAL (&slot->cpus, &wanted);
+        }
+
+        int node = atoi (spec + 5);
+
+        for (int i = 0; i < cpu_count; i++)
+                if (cpus[i].node == node)
+                        CPU_SET (cpus[i].cpu, &slot->cpus);
+
+        slot->node = node_count > 1 ? node : -1;
+        slot->mode = MPOL_BIND;
+
+        return CPU_COUNT (&slot->cpus) > 0;
+}
+
+/**
+ * Returns the CPUs and memory node of the slot a process holds, NULL if it
+ * holds none.
+ */
+static cpu_slot *process_slot (pm_process *process)
+{
+        static cpu_slot fixed;
+
+        if (!process->placement || process->cpu_slot < 0)
+                return NULL;
+
+        placement_kind kind = get_kind (process->placement);
+
+        if (kind == PLACE_NODE || kind == PLACE_CPUS)
+                return fixed_slot (process->placement, &fixed) ? &fixed : NULL;
+
+        return process->cpu_slot < slot_counts[kind] ? &slots[kind][process->cpu_slot] : NULL;
+}
+
+static void add_load (cpu_slot *slot, int delta)
+{
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET (cpu, &slot->cpus))
+                        cpu_load[cpu] += delta;
+}
+
+/**
+ * Gives a process that has a placement a slot of its own, unless it holds
+ * one already. Returns false with errno set to EINVAL if the host has
+ * nothing matching the placement.
+ */
+bool affinity_assign (pm_process *process)
+{
+        if (!process->placement || process->cpu_slot >= 0)
+                return true;
+
+        placement_kind kind = get_kind (process->placement);
+
+        if (kind == PLACE_NODE || kind == PLACE_CPUS) {
+                process->cpu_slot = 0;
+        } else if (kind < PLACE_KINDS && slot_counts[kind] > 0) {
+                uint64_t best = UINT64_MAX;
+
+                // the least loaded slot, the earliest one of those
+                for (int i = 0; i < slot_counts[kind]; i++) {
+                        uint64_t load = 0;
+
+                        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                                if (CPU_ISSET (cpu, &slots[kind][i].cpus))
+                                        load += cpu_load[cpu];
+
+                        if (load < best) {
+                                best = load;
+                                process->cpu_slot = i;
+                        }
+                }
+        }
+
+        cpu_slot *slot = process_slot (process);
+
+        if (!slot) {
+                log_error ("no cpus on this host match placement %s of %s", process->placement, process->name);
+                process->cpu_slot = -1;
+                errno = EINVAL;
+                return false;
+        }
+
+        add_load (slot, 1);
+
+        return true;
+}
+
+/**
+ * Takes back the slot a process held under an earlier daemon. A slot that no
+ * longer exists is dropped, the process gets another one when it restarts.
+ */
+void affinity_adopt (pm_process *process, int slot)
+{
+        process->cpu_slot = slot;
+
+        cpu_slot *held = process_slot (process);
+
+        if (held)
+                add_load (held, 1);
+        else
+                process->cpu_slot = -1;
+}
+
+/**
+ * Gives back the slot of a process, if it holds one.
+ */
+void affinity_release (pm_process *process)
+{
+        cpu_slot *slot = process_slot (process);
+
+        if (slot)
+                add_load (slot, -1);
+
+        process->cpu_slot = -1;
+}
+
+static void set_memory_policy (int mode, int node)
+{
+        // the kernel counts one bit less than it is given
+        unsigned long nodes = 1UL << node;
+        syscall (SYS_set_mempolicy, mode, mode == MPOL_DEFAULT ? NULL : &nodes, mode == MPOL_DEFAULT ? 0 : sizeof (nodes) * 8 + 1);
+}
+
+/**
+ * Moves the calling thread to the slot of a process, which a child it
+ * starts inherits. Every call has to be followed by affinity_leave once the
+ * child is started.
+ */
+void affinity_enter (pm_process *process)
+{
+        cpu_slot *slot = process_slot (process);
+
+        if (!slot)
+                return;
+
+        if (sched_setaffinity (0, sizeof (slot->cpus), &slot->cpus) < 0)
+                log_warn ("failed to pin %s to its cpus: %s", process->name, strerror (errno));
+
+        if (slot->node >= 0)
+                set_memory_policy (slot->mode, slot->node);
+}
+
+/**
+ * Moves the calling thread back to the daemon's CPUs and memory policy.
+ */
+void affinity_leave (pm_process *process)
+{
+        cpu_slot *slot = process_slot (process);
+
+        if (!slot)
+                return;
+
+        sched_setaffinity (0, sizeof (daemon_cpus), &daemon_cpus);
+
+        if (slot->node >= 0)
+                set_memory_policy (MPOL_DEFAULT, 0);
+}
+
+/**
+ * Writes the CPUs of the slot a process holds to buf as a list like 0-3,8,
+ * empty if it holds none.
+ */
+void affinity_format (pm_process *process, char *buf, size_t size)
+{
+        cpu_slot *slot = process_slot (process);
+        size_t len = 0;
+
+        *buf = '\0';
+
+        for (int cpu = 0; slot && cpu < CPU_SETSIZE && len < size; cpu++) {
+                if (!CPU_ISSET (cpu, &slot->cpus) || (cpu > 0 && CPU_ISSET (cpu - 1, &slot->cpus)))
+                        continue;
+
+                int last = cpu;
+
+                while (last + 1 < CPU_SETSIZE && CPU_ISSET (last + 1, &slot->cpus))
+                        last++;
+
+                if (last == cpu)
+                        len += snprintf (buf + len, size - len, "%s%d", len ? "," : "", cpu);
+                else
+                        len += snprintf (buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        }
+}
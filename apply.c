@@ -0,0 +1,673 @@
+#include "pm.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Declarative apply
+ *
+ * An APPLY request describes groups of processes the way they should be.
+ * The daemon works out how that differs from the groups it runs and changes
+ * only that: a group that does not run yet is started, one that only has
+ * instances to add or to stop gets them added or stopped, and one whose
+ * command or settings changed has every instance replaced. Its new
+ * instances are started and the old ones drained once the new ones are
+ * ready, like in a rolling restart. A group that matches is left alone.
+ *
+ * Groups may depend on others. A group starts once every group it depends
+ * on is ready, groups that do not depend on each other start together, so
+ * bringing up a host takes as long as its longest chain of dependencies
+ * rather than as long as all of its starts. A group fails if one of its
+ * instances exits or is not ready within the timeout, the groups depending
+ * on it are skipped. The request is rejected before anything is started if
+ * it names a dependency it does not describe or its dependencies form a
+ * cycle.
+ *
+ * The request holds a u32 count of entries, each of them
+ *
+ *     string name, u32 instances, 0 for a single process without
+ *     PM_INSTANCE_ID, u32 retries, -1 for the daemon's, string stdout and
+ *     string stderr, empty for the daemon's, u32 size and the null
+ *     terminated arguments, the liveness and the readiness probe, string
+ *     listen, u16 count and the names of the groups it depends on, string
+ *     placement
+ *
+ * The response lists every group with what was done to it, preceded by a
+ * message if any group failed.
+ */
+
+extern pm_configuration config;
+
+// requests are applied one at a time
+static pm_apply *current;
+
+char *get_apply_action_name (pm_apply_action action)
+{
+        switch (action) {
+        case APPLY_UNCHANGED: return "unchanged";
+        case APPLY_STARTED: return "started";
+        case APPLY_SCALED: return "scaled";
+        case APPLY_REPLACED: return "replaced";
+        case APPLY_REMOVED: return "removed";
+        case APPLY_FAILED: return "failed";
+        case APPLY_SKIPPED: return "skipped";
+        default: return "unknown";
+        }
+}
+
+void free_apply (pm_apply *apply)
+{
+        for (uint32_t i = 0; i < apply->count; i++) {
+                apply_node *node = &apply->nodes[i];
+
+                free (node->stdout_file);
+                free (node->stderr_file);
+                free (node->command);
+                free (node->argv);
+                free (node->listen);
+                free (node->placement);
+                free (node->depends_on);
+                free (node->dependents);
+                free (node->missing);
+                free (node->started);
+                free (node->kept);
+                free (node->retiring);
+        }
+
+        timer_cancel (&apply->timer);
+        free (apply->nodes);
+        free (apply->removed);
+        free (apply);
+}
+
+static apply_node *find_node (pm_apply *apply, char *name)
+{
+        for (uint32_t i = 0; i < apply->count; i++)
+                if (strcmp (apply->nodes[i].name, name) == 0)
+                        return &apply->nodes[i];
+
+        return NULL;
+}
+
+// an empty string reads as NULL
+static char *get_optional_string (pm_reader *reader)
+{
+        char value[PATH_MAX];
+
+        reader_get_string (reader, value, sizeof (value));
+
+        return *value ? strdup (value) : NULL;
+}
+
+/**
+ * Reads an entry of the request into node. Returns false with a message in
+ * error if it is malformed.
+ */
+static bool decode_node (pm_reader *reader, apply_node *node, char *error, size_t size)
+{
+        reader_get_string (reader, node->name, sizeof (node->name));
+        node->instances = reader_get_u32 (reader);
+        node->max_retries = (int32_t)reader_get_u32 (reader);
+        node->stdout_file = get_optional_string (reader);
+        node->stderr_file = get_optional_string (reader);
+
+        uint32_t command_size = reader_get_u32 (reader);
+        char *command = reader_get_bytes (reader, command_size);
+
+        for (int kind = 0; kind < PM_PROBE_KINDS; kind++) {
+                pm_probe_spec *spec = &node->probes[kind];
+
+                get_probe (reader, spec, node->probe_targets[kind]);
+
+                // the defaults are filled in to compare with running processes
+                spec->interval_ms = spec->interval_ms ? spec->interval_ms : PM_PROBE_INTERVAL_MS;
+                spec->timeout_ms = spec->timeout_ms ? spec->timeout_ms : PM_PROBE_TIMEOUT_MS;
+                spec->threshold = spec->threshold ? spec->threshold : PM_PROBE_THRESHOLD;
+        }
+
+        node->listen = get_optional_string (reader);
+        node->depends_count = reader_get_u16 (reader);
+
+        if (reader->error) {
+                snprintf (error, size, "the request is truncated");
+                return false;
+        }
+
+        if (!*node->name || node->instances > PM_MAX_INSTANCES || node->depends_count > PM_APPLY_DEPENDENCIES) {
+                snprintf (error, size, "group %s has no name, more than %d instances or more than %d dependencies",
+                          node->name,
+                          PM_MAX_INSTANCES,
+                          PM_APPLY_DEPENDENCIES);
+                return false;
+        }
+
+        if (command_size == 0 || command[command_size - 1] != '\0') {
+                snprintf (error, size, "the command of %s must be a null terminated argument list", node->name);
+                return false;
+        }
+
+        node->depends_on = calloc_nofail (node->depends_count ? node->depends_count : 1, PM_NAME_MAX);
+
+        for (uint16_t i = 0; i < node->depends_count; i++)
+                reader_get_string (reader, node->depends_on[i], PM_NAME_MAX);
+
+        node->placement = get_optional_string (reader);
+
+        if (node->placement && !parse_placement_spec (node->placement)) {
+                snprintf (error, size, "invalid placement %s of %s", node->placement, node->name);
+                return false;
+        }
+
+        int args = 0;
+        for (uint32_t i = 0; i < command_size; i++)
+                if (!command[i])
+                        args++;
+
+        node->command = malloc_nofail (command_size);
+        memcpy (node->command, command, command_size);
+        node->argv = malloc_nofail ((args + 1) * sizeof (char *));
+
+        char *arg = node->command;
+
+        for (int i = 0; i < args; arg += strlen (arg) + 1)
+                node->argv[i++] = arg;
+
+        node->argv[args] = NULL;
+
+        if (reader->error) {
+                snprintf (error, size, "the request is truncated");
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Links every group to the groups that depend on it. Returns false with a
+ * message in error if a dependency is unknown or the dependencies form a
+ * cycle.
+ */
+bool link_nodes (pm_apply *apply, char *error, size_t size)
+{
+        for (uint32_t i = 0; i < apply->count; i++) {
+                apply_node *node = &apply->nodes[i];
+
+                for (uint16_t d = 0; d < node->depends_count; d++) {
+                        apply_node *dependency = find_node (apply, node->depends_on[d]);
+
+                        if (!dependency) {
+                                snprintf (error, size, "%s depends on %s, which is not described", node->name, node->depends_on[d]);
+                                return false;
+                        }
+
+                        dependency->dependents = realloc_nofail (dependency->dependents,
+                                                                 (dependency->dependent_count + 1) * sizeof (uint32_t));
+                        dependency->dependents[dependency->dependent_count++] = i;
+                        node->pending++;
+                }
+        }
+
+        // a group is taken off the graph once all of its dependencies are,
+        // whatever is left over sits on a cycle
+        uint32_t *pending = malloc_nofail (apply->count * sizeof (uint32_t));
+        uint32_t *queue = malloc_nofail (apply->count * sizeof (uint32_t));
+        uint32_t head = 0, tail = 0;
+
+        for (uint32_t i = 0; i < apply->count; i++)
+                if ((pending[i] = apply->nodes[i].pending) == 0)
+                        queue[tail++] = i;
+
+        while (head < tail) {
+                apply_node *node = &apply->nodes[queue[head++]];
+
+                for (uint32_t d = 0; d < node->dependent_count; d++)
+                        if (--pending[node->dependents[d]] == 0)
+                                queue[tail++] = node->dependents[d];
+        }
+
+        for (uint32_t i = 0; tail < apply->count && i < apply->count; i++) {
+                if (pending[i] > 0) {
+                        snprintf (error, size, "the dependencies of %s form a cycle", apply->nodes[i].name);
+                        break;
+                }
+        }
+
+        bool acyclic = tail == apply->count;
+
+        free (pending);
+        free (queue);
+
+        return acyclic;
+}
+
+static bool is_live (pm_process *process)
+{
+        return process->state != PROCESS_EXITED && !process->replaced;
+}
+
+static bool same_string (char *a, char *b)
+{
+        return a == b || (a && b && strcmp (a, b) == 0);
+}
+
+/**
+ * Returns whether a running process was started with the settings of a
+ * group.
+ */
+static bool same_settings (apply_node *node, pm_process *process)
+{
+        if (!same_string (node->stdout_file ? node->stdout_file : config.stdout_file, process->stdout_file) ||
+            !same_string (node->stderr_file ? node->stderr_file : config.stderr_file, process->stderr_file) ||
+            !same_string (node->listen, process->listen) || !same_string (node->placement, process->placement))
+                return false;
+
+        int i = 0;
+
+        for (; node->argv[i] && process->argv[i]; i++)
+                if (strcmp (node->argv[i], process->argv[i]) != 0)
+                        return false;
+
+        if (node->argv[i] || process->argv[i])
+                return false;
+
+        for (int kind = 0; kind < PM_PROBE_KINDS; kind++) {
+                pm_probe_spec *a = &node->probes[kind], *b = &process->probes[kind];
+
+                if (a->type != b->type)
+                        return false;
+
+                if (a->type != PROBE_NONE &&
+                    (strcmp (a->target, b->target) != 0 || a->interval_ms != b->interval_ms || a->timeout_ms != b->timeout_ms ||
+                     a->threshold != b->threshold))
+                        return false;
+        }
+
+        return true;
+}
+
+/**
+ * Works out what has to be done to bring the running group to the state a
+ * node describes.
+ */
+static void plan_node (apply_node *node)
+{
+        uint32_t wanted = node->instances ? node->instances : 1;
+        uint32_t live = 0;
+        pm_process *first = NULL;
+
+        for (pm_process *p = find_processes_with_name (node->name); p != NULL; p = p->name_next) {
+                if (is_live (p)) {
+                        first = p;
+                        live++;
+                }
+        }
+
+        node->missing = calloc_nofail (wanted, sizeof (int));
+        node->started = calloc_nofail (wanted, sizeof (pm_handle));
+        node->kept = calloc_nofail (live ? live : 1, sizeof (pm_handle));
+        node->retiring = calloc_nofail (live ? live : 1, sizeof (pm_handle));
+
+        bool replace = first && !same_settings (node, first);
+        bool *present = calloc_nofail (wanted, sizeof (bool));
+
+        for (pm_process *p = find_processes_with_name (node->name); p != NULL; p = p->name_next) {
+                if (!is_live (p))
+                        continue;
+
+                // without instances the group is the single process -1
+                int slot = node->instances ? p->instance : p->instance + 1;
+
+                if (!replace && slot >= 0 && (uint32_t)slot < wanted && !present[slot]) {
+                        present[slot] = true;
+                        node->kept[node->kept_count++] = p->handle;
+                } else {
+                        node->retiring[node->retiring_count++] = p->handle;
+                }
+        }
+
+        for (uint32_t slot = 0; slot < wanted; slot++)
+                if (!present[slot])
+                        node->missing[node->missing_count++] = node->instances ? (int)slot : -1;
+
+        free (present);
+
+        if (live == 0)
+                node->action = APPLY_STARTED;
+        else if (replace)
+                node->action = APPLY_REPLACED;
+        else if (node->missing_count > 0 || node->retiring_count > 0)
+                node->action = APPLY_SCALED;
+        else
+                node->action = APPLY_UNCHANGED;
+}
+
+static void drain_handles (pm_handle *handles, uint32_t count, uint32_t grace_ms)
+{
+        for (uint32_t i = 0; i < count; i++) {
+                pm_process *process = find_process_with_handle (handles[i]);
+
+                if (process && !process->replaced)
+                        drain_process (process, grace_ms);
+        }
+}
+
+// marks the groups waiting for node as skipped, and the ones waiting for those
+static void skip_dependents (pm_apply *apply, apply_node *node)
+{
+        for (uint32_t d = 0; d < node->dependent_count; d++) {
+                apply_node *dependent = &apply->nodes[node->dependents[d]];
+
+                if (dependent->state != NODE_BLOCKED)
+                        continue;
+
+                dependent->state = NODE_SETTLED;
+                dependent->action = APPLY_SKIPPED;
+                snprintf (dependent->detail, sizeof (dependent->detail), "depends on %s, which did not come up", node->name);
+                skip_dependents (apply, dependent);
+        }
+}
+
+/**
+ * Fails a group. The instances started for it, whether to start, scale up
+ * or replace it, are stopped again, the ones that ran before stay.
+ */
+static void fail_node (pm_apply *apply, apply_node *node)
+{
+        log_error ("applying %s failed: %s", node->name, node->detail);
+
+        drain_handles (node->started, node->started_count, apply->grace_ms);
+        node->started_count = 0;
+
+        node->state = NODE_SETTLED;
+        node->action = APPLY_FAILED;
+        skip_dependents (apply, node);
+}
+
+static void launch_node (pm_apply *apply, apply_node *node)
+{
+        node->state = NODE_STARTING;
+        node->launched = monotonic_ms ();
+        node->deadline = node->launched + apply->timeout_ms;
+
+        if (node->action != APPLY_UNCHANGED)
+                log_info ("applying %s: %s", node->name, get_apply_action_name (node->action));
+
+        // scaling down has nothing to wait for
+        if (node->action == APPLY_SCALED) {
+                drain_handles (node->retiring, node->retiring_count, apply->grace_ms);
+                node->retiring_count = 0;
+        }
+
+        pm_process_options options = { .name = node->name,
+                                       .stdout_file = node->stdout_file ? node->stdout_file : config.stdout_file,
+                                       .stderr_file = node->stderr_file ? node->stderr_file : config.stderr_file,
+                                       .max_retries = node->max_retries < 0 ? config.max_retries : node->max_retries,
+                                       .rotation = config.rotation,
+                                       .listen = node->listen,
+                                       .placement = node->placement };
+
+        memcpy (options.probes, node->probes, sizeof (options.probes));
+
+        for (uint32_t i = 0; i < node->missing_count; i++) {
+                options.instance = node->missing[i];
+
+                pid_t pid = new_process (node->argv, &options);
+
+                if (pid < 0) {
+                        snprintf (node->detail, sizeof (node->detail), "failed to start %s: %s", node->argv[0], strerror (errno));
+                        fail_node (apply, node);
+                        return;
+                }
+
+                node->started[node->started_count++] = find_process_with_pid (pid)->handle;
+        }
+}
+
+static bool is_ready (pm_process *process)
+{
+        return process->state == PROCESS_RUNNING && (process->readiness == READINESS_NONE || process->readiness == READINESS_READY);
+}
+
+/**
+ * Checks on a group that was started. Once all of its instances are ready
+ * the instances it replaces are stopped and the groups waiting for it
+ * start. Returns whether it settled.
+ */
+static bool check_node (pm_apply *apply, apply_node *node)
+{
+        bool ready = true;
+
+        for (uint32_t i = 0; i < node->started_count; i++) {
+                pm_process *process = find_process_with_handle (node->started[i]);
+
+                if (!process || process->state != PROCESS_RUNNING) {
+                        snprintf (node->detail, sizeof (node->detail), "an instance exited before it was ready");
+                        fail_node (apply, node);
+                        return true;
+                }
+
+                ready = ready && is_ready (process);
+        }
+
+        for (uint32_t i = 0; i < node->kept_count; i++) {
+                pm_process *process = find_process_with_handle (node->kept[i]);
+
+                if (!process) {
+                        snprintf (node->detail, sizeof (node->detail), "an instance was removed");
+                        fail_node (apply, node);
+                        return true;
+                }
+
+                ready = ready && is_ready (process);
+        }
+
+        if (!ready && monotonic_ms () >= node->deadline) {
+                snprintf (node->detail, sizeof (node->detail), "not ready within %u ms", apply->timeout_ms);
+                fail_node (apply, node);
+                return true;
+        }
+
+        // without a readiness probe a process is ready once it runs, give one
+        // that fails right away a tick to do so
+        if (!ready || monotonic_ms () < node->launched + PM_TIMER_TICK_MS)
+                return false;
+
+        drain_handles (node->retiring, node->retiring_count, apply->grace_ms);
+        node->state = NODE_SETTLED;
+
+        for (uint32_t d = 0; d < node->dependent_count; d++) {
+                apply_node *dependent = &apply->nodes[node->dependents[d]];
+
+                if (--dependent->pending == 0 && dependent->state == NODE_BLOCKED)
+                        launch_node (apply, dependent);
+        }
+
+        return true;
+}
+
+/**
+ * Stops every group the request does not describe.
+ */
+static void prune (pm_apply *apply)
+{
+        pm_process *next;
+
+        apply->removed = calloc_nofail (config.processes.count ? config.processes.count : 1, PM_NAME_MAX);
+
+        for (pm_process *p = config.processes.head; p != NULL; p = next) {
+                next = p->next;
+
+                if (!is_live (p) || find_node (apply, p->name))
+                        continue;
+
+                uint32_t i = 0;
+
+                while (i < apply->removed_count && strcmp (apply->removed[i], p->name) != 0)
+                        i++;
+
+                if (i == apply->removed_count) {
+                        snprintf (apply->removed[apply->removed_count++], PM_NAME_MAX, "%s", p->name);
+                        log_info ("applying %s: removed", p->name);
+                }
+
+                drain_process (p, apply->grace_ms);
+        }
+}
+
+static void finish (pm_apply *apply)
+{
+        pm_buffer response = { 0 };
+        uint32_t failed = 0;
+
+        for (uint32_t i = 0; i < apply->count; i++)
+                if (apply->nodes[i].action == APPLY_FAILED || apply->nodes[i].action == APPLY_SKIPPED)
+                        failed++;
+
+        if (failed > 0) {
+                char message[128];
+
+                snprintf (message, sizeof (message), "%u of %u groups did not come up", failed, apply->count);
+                buffer_put_string (&response, message);
+        }
+
+        buffer_put_u32 (&response, apply->count + apply->removed_count);
+
+        for (uint32_t i = 0; i < apply->count; i++) {
+                buffer_put_string (&response, apply->nodes[i].name);
+                buffer_put_u8 (&response, apply->nodes[i].action);
+                buffer_put_string (&response, apply->nodes[i].detail);
+        }
+
+        for (uint32_t i = 0; i < apply->removed_count; i++) {
+                buffer_put_string (&response, apply->removed[i]);
+                buffer_put_u8 (&response, APPLY_REMOVED);
+                buffer_put_string (&response, "");
+        }
+
+        log_info ("applied %u groups, %u did not come up", apply->count, failed);
+
+        if (apply->conn) {
+                send_response_data (apply->conn, apply->id, failed ? SPAWN_FAILED : OK, response.data, response.len);
+
+                // not answered from a request, nothing else sends it
+                connection_flush (apply->conn);
+        }
+
+        buffer_free (&response);
+        current = NULL;
+        free_apply (apply);
+}
+
+static void handle_apply_timer (pm_timer *timer)
+{
+        pm_apply *apply = timer->data;
+
+        if (!apply->begun) {
+                apply->begun = true;
+
+                if (apply->flags & PM_APPLY_PRUNE)
+                        prune (apply);
+
+                for (uint32_t i = 0; i < apply->count; i++)
+                        if (apply->nodes[i].state == NODE_BLOCKED && apply->nodes[i].pending == 0)
+                                launch_node (apply, &apply->nodes[i]);
+        }
+
+        // a group that settles may start others that are ready right away
+        bool progress = true;
+
+        while (progress) {
+                progress = false;
+
+                for (uint32_t i = 0; i < apply->count; i++)
+                        if (apply->nodes[i].state == NODE_STARTING && check_node (apply, &apply->nodes[i]))
+                                progress = true;
+        }
+
+        for (uint32_t i = 0; i < apply->count; i++) {
+                if (apply->nodes[i].state != NODE_SETTLED) {
+                        timer_schedule (timer, PM_TIMER_TICK_MS);
+                        return;
+                }
+        }
+
+        finish (apply);
+}
+
+/**
+ * Starts applying an APPLY request. It is checked as a whole first, then
+ * the groups are brought up from the timer wheel and the request is
+ * answered once every group is ready or failed.
+ */
+void apply_start (pm_connection *conn, pm_cmd *cmd)
+{
+        if (current) {
+                send_error (conn, cmd->id, INVALID_COMMAND, "another apply is in progress");
+                return;
+        }
+
+        pm_reader reader = { .data = cmd->apply.entries, .len = cmd->apply.size };
+        uint32_t count = reader_get_u32 (&reader);
+        char error[512];
+
+        if (reader.error || count > PM_APPLY_MAX) {
+                send_error (conn, cmd->id, INVALID_COMMAND, "a request describes at most %d groups", PM_APPLY_MAX);
+                return;
+        }
+
+        pm_apply *apply = calloc_nofail (1, sizeof (pm_apply));
+
+        *apply = (pm_apply) { .conn = conn,
+                              .id = cmd->id,
+                              .flags = cmd->apply.flags,
+                              .timeout_ms = cmd->apply.timeout_ms ? cmd->apply.timeout_ms : PM_ROLLOUT_TIMEOUT_MS,
+                              .grace_ms = cmd->apply.grace_ms ? cmd->apply.grace_ms : PM_SHUTDOWN_GRACE_MS,
+                              .nodes = calloc_nofail (count ? count : 1, sizeof (apply_node)) };
+
+        for (; apply->count < count; apply->count++) {
+                apply_node *node = &apply->nodes[apply->count];
+
+                if (!decode_node (&reader, node, error, sizeof (error))) {
+                        apply->count++;
+                        send_error (conn, cmd->id, INVALID_COMMAND, "%s", error);
+                        free_apply (apply);
+                        return;
+                }
+
+                // the node is not counted yet, only the ones before it are searched
+                if (find_node (apply, node->name)) {
+                        apply->count++;
+                        send_error (conn, cmd->id, INVALID_COMMAND, "group %s is described twice", node->name);
+                        free_apply (apply);
+                        return;
+                }
+        }
+
+        if (!link_nodes (apply, error, sizeof (error))) {
+                send_error (conn, cmd->id, INVALID_COMMAND, "%s", error);
+                free_apply (apply);
+                return;
+        }
+
+        // every group is compared with what runs before anything changes
+        for (uint32_t i = 0; i < apply->count; i++)
+                plan_node (&apply->nodes[i]);
+
+        log_info ("applying %u groups...", apply->count);
+
+        current = apply;
+        apply->timer.callback = handle_apply_timer;
+        apply->timer.data = apply;
+        timer_schedule (&apply->timer, 0);
+}
+
+/**
+ * Forgets a client that is going away, the request it sent is still
+ * applied.
+ */
+void apply_detach (pm_connection *conn)
+{
+        if (current && current->conn == conn)
+                current->conn = NULL;
+}
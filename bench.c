@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Benchmarks
+ *
+ * pm bench capture measures output capture on its own, without a daemon:
+ * writers write lines to pipes handed to the capture thread as fast as they
+ * can, one write per line like a process logging line by line, and the
+ * thread appends them to a log file per writer. It runs once with io_uring
+ * and once with read and write, each in a child of its own so both start
+ * from a fresh capture thread, and compares the time, the CPU and the
+ * system calls it took to move the output.
+ *
+ * pm bench requests measures the event loop serving clients: a daemon's
+ * event loop answers LIST_PROCESS to clients that send one request after
+ * another over a connection of their own, like the client does, and the
+ * time, the CPU and the system calls the loop took are compared the same
+ * way.
+ */
+
+#define BENCH_LINE_SIZE 100
+#define BENCH_WRITERS 16
+#define BENCH_LINES 100000
+
+// like the pipes capture_open makes
+#define BENCH_PIPE_SIZE (256 * 1024)
+
+// how long the files may take to get everything the writers wrote
+#define BENCH_DRAIN_TIMEOUT_MS 60000
+
+#define BENCH_CLIENTS 16
+#define BENCH_REQUESTS 20000
+
+extern pm_configuration config;
+
+typedef struct bench_result {
+        pm_capture_stats stats;
+        double seconds;
+        double cpu_seconds;
+        bool ok;
+} bench_result;
+
+typedef struct requests_result {
+        pm_io_stats stats;
+        double cpu_seconds;
+} requests_result;
+
+// seconds since start, a monotonic_usec reading
+static double elapsed (uint64_t start)
+{
+        return (monotonic_usec () - start) / 1e6;
+}
+
+static double cpu_seconds ()
+{
+        struct rusage usage;
+        getrusage (RUSAGE_SELF, &usage);
+
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Waits until the files in dir add up to size bytes. Returns false if they
+ * did not within BENCH_DRAIN_TIMEOUT_MS.
+ */
+static bool wait_for_files (char *dir, uint32_t writers, uint64_t size)
+{
+        for (int waited = 0; waited < BENCH_DRAIN_TIMEOUT_MS; waited++) {
+                uint64_t total = 0;
+
+                for (uint32_t i = 0; i < writers; i++) {
+                        char path[PATH_MAX];
+                        struct stat st;
+
+                        snprintf (path, sizeof (path), "%s/writer-%u.log", dir, i);
+
+                        if (stat (path, &st) == 0)
+                                total += st.st_size;
+                }
+
+                if (total >= size)
+                        return true;
+
+                usleep (1000);
+        }
+
+        return false;
+}
+
+static void run_writer (int fd, uint64_t lines)
+{
+        char line[BENCH_LINE_SIZE];
+
+        memset (line, 'x', sizeof (line) - 1);
+        line[sizeof (line) - 1] = '\n';
+
+        for (uint64_t i = 0; i < lines; i++)
+                if (write (fd, line, sizeof (line)) != sizeof (line))
+                        _exit (EXIT_FAILURE);
+
+        _exit (EXIT_SUCCESS);
+}
+
+/**
+ * Captures the output of the writers into files in dir and reports how it
+ * went to result_fd. Runs in a child, it never returns.
+ */
+static void run_capture (bool io_uring, uint32_t writers, uint64_t lines, char *dir, int result_fd)
+{
+        pm_rotation_policy rotation = { 0 };
+        bench_result result = { .ok = true };
+        int *pipes = malloc_nofail (writers * sizeof (int));
+        uint64_t start = monotonic_usec ();
+
+        // the writers are forked before the ring pins its buffers, a fork
+        // copies pinned pages right away
+        for (uint32_t i = 0; i < writers; i++) {
+                int fds[2];
+
+                if (pipe2 (fds, O_CLOEXEC) < 0) {
+                        perror ("pipe");
+                        _exit (EXIT_FAILURE);
+                }
+
+                fcntl (fds[1], F_SETPIPE_SZ, BENCH_PIPE_SIZE);
+
+                pid_t pid = fork ();
+
+                if (pid == 0)
+                        run_writer (fds[1], lines);
+
+                close (fds[1]);
+                pipes[i] = fds[0];
+
+                if (pid < 0) {
+                        perror ("fork");
+                        _exit (EXIT_FAILURE);
+                }
+        }
+
+        config.no_io_uring = !io_uring;
+        capture_init ();
+
+        for (uint32_t i = 0; i < writers; i++) {
+                char path[PATH_MAX];
+                snprintf (path, sizeof (path), "%s/writer-%u.log", dir, i);
+
+                if (capture_attach (pipes[i], path, false, &rotation) < 0) {
+                        log_error ("failed to capture %s: %s", path, strerror (errno));
+                        _exit (EXIT_FAILURE);
+                }
+        }
+
+        int status;
+
+        while (wait (&status) > 0)
+                if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+                        result.ok = false;
+
+        // stopping only writes out what was read, the pipes are drained first
+        if (!wait_for_files (dir, writers, (uint64_t)writers * lines * BENCH_LINE_SIZE))
+                result.ok = false;
+
+        capture_stop ();
+
+        result.seconds = elapsed (start);
+        result.cpu_seconds = cpu_seconds ();
+        capture_stats (&result.stats);
+
+        for (uint32_t i = 0; i < writers; i++) {
+                char path[PATH_MAX];
+                snprintf (path, sizeof (path), "%s/writer-%u.log", dir, i);
+                unlink (path);
+        }
+
+        _exit (write (result_fd, &result, sizeof (result)) == sizeof (result) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Runs one round of the benchmark in a child. Returns false if it failed.
+ */
+static bool bench_capture_round (bool io_uring, uint32_t writers, uint64_t lines, char *dir, bench_result *result)
+{
+        int fds[2];
+
+        if (pipe (fds) < 0) {
+                perror ("pipe");
+                return false;
+        }
+
+        pid_t pid = fork ();
+
+        if (pid < 0) {
+                perror ("fork");
+                close (fds[0]);
+                close (fds[1]);
+                return false;
+        }
+
+        if (pid == 0) {
+                close (fds[0]);
+                run_capture (io_uring, writers, lines, dir, fds[1]);
+        }
+
+        close (fds[1]);
+
+        bool ok = read (fds[0], result, sizeof (*result)) == sizeof (*result);
+        int status;
+
+        close (fds[0]);
+        waitpid (pid, &status, 0);
+
+        return ok && result->ok && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+static void bench_capture ()
+{
+        uint32_t writers = config.bench_writers ? config.bench_writers : BENCH_WRITERS;
+        uint64_t lines = config.has_log_lines ? config.log_lines : BENCH_LINES;
+        uint64_t expected = (uint64_t)writers * lines * BENCH_LINE_SIZE;
+        char dir[] = "/tmp/pm-bench-XXXXXX";
+
+        if (!mkdtemp (dir)) {
+                perror ("mkdtemp");
+                exit (EXIT_FAILURE);
+        }
+
+        printf ("%u writers, %llu lines of %d bytes each\n", writers, (unsigned long long)lines, BENCH_LINE_SIZE);
+        printf ("%-10s %10s %9s %9s %10s %12s %9s\n", "backend", "MB", "seconds", "MB/s", "syscalls", "syscalls/MB", "cpu");
+
+        bool failed = false;
+
+        for (int round = 0; round < 2; round++) {
+                bench_result result;
+                bool io_uring = round == 0;
+
+                if (!bench_capture_round (io_uring, writers, lines, dir, &result)) {
+                        log_error ("benchmark with %s failed", io_uring ? "io_uring" : "read and write");
+                        failed = true;
+                        continue;
+                }
+
+                // the kernel may lack io_uring, the round measured read and write then
+                if (io_uring && !result.stats.io_uring) {
+                        log_warn ("io_uring is not available, skipping it");
+                        continue;
+                }
+
+                if (result.stats.bytes != expected) {
+                        log_error ("captured %llu bytes of %llu", (unsigned long long)result.stats.bytes, (unsigned long long)expected);
+                        failed = true;
+                }
+
+                double mb = result.stats.bytes / (1024.0 * 1024.0);
+
+                printf ("%-10s %10.1f %9.3f %9.1f %10llu %12.1f %8.3fs\n",
+                        io_uring ? "io_uring" : "read/write",
+                        mb,
+                        result.seconds,
+                        result.seconds > 0 ? mb / result.seconds : 0,
+                        (unsigned long long)result.stats.syscalls,
+                        mb > 0 ? result.stats.syscalls / mb : 0,
+                        result.cpu_seconds);
+        }
+
+        rmdir (dir);
+
+        if (failed)
+                exit (EXIT_FAILURE);
+}
+
+static void handle_stop_event (pm_watch *watch, uint32_t events)
+{
+        config.shutdown = true;
+}
+
+/**
+ * Serves clients on socket_file until stop_fd is closed, then reports what
+ * the event loop took to result_fd. Closes ready_fd once clients can
+ * connect. Runs in a child, it never returns.
+ */
+static void run_server (bool io_uring, char *socket_file, int ready_fd, int stop_fd, int result_fd)
+{
+        pm_watch listen_watch, stop_watch = { .fd = stop_fd, .callback = handle_stop_event };
+        requests_result result;
+
+        config.no_io_uring = !io_uring;
+        event_loop_init ();
+
+        watch_listen_socket (&listen_watch, setup_unix_domain_server_socket (socket_file));
+        watch_add (&stop_watch, EPOLLIN);
+        close (ready_fd);
+
+        run_event_loop ();
+
+        result.cpu_seconds = cpu_seconds ();
+        io_stats (&result.stats);
+
+        _exit (write (result_fd, &result, sizeof (result)) == sizeof (result) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Sends requests one after another, each once the previous one was
+ * answered. Runs in a child, it never returns.
+ */
+static void run_client (char *socket_file, uint32_t requests)
+{
+        int fd = setup_unix_domain_client_socket (socket_file);
+        pm_cmd cmd = { .instruction = LIST_PROCESS };
+        pm_buffer request = { 0 };
+        char response[4096];
+
+        encode_request (&request, &cmd);
+
+        for (uint32_t i = 0; i < requests; i++) {
+                pm_frame_header header;
+
+                if (write (fd, request.data, request.len) != request.len)
+                        _exit (EXIT_FAILURE);
+
+                read_nofail (fd, response, PM_FRAME_HEADER_SIZE);
+                decode_frame_header (response, &header);
+
+                if (header.type != OK || header.size > sizeof (response))
+                        _exit (EXIT_FAILURE);
+
+                read_nofail (fd, response, header.size);
+        }
+
+        _exit (EXIT_SUCCESS);
+}
+
+/**
+ * Runs one round of the request benchmark: a server in a child and the
+ * clients in children of their own. Returns false if it failed.
+ */
+static bool bench_requests_round (bool io_uring, uint32_t clients, uint32_t requests, char *socket_file, requests_result *result, double *seconds)
+{
+        int ready[2], stop[2], results[2];
+
+        if (pipe2 (ready, O_CLOEXEC) < 0 || pipe2 (stop, O_CLOEXEC) < 0 || pipe2 (results, O_CLOEXEC) < 0) {
+                perror ("pipe");
+                return false;
+        }
+
+        pid_t server = fork ();
+
+        if (server < 0) {
+                perror ("fork");
+                return false;
+        }
+
+        if (server == 0) {
+                close (ready[0]);
+                close (stop[1]);
+                close (results[0]);
+                run_server (io_uring, socket_file, ready[1], stop[0], results[1]);
+        }
+
+        close (ready[1]);
+        close (stop[0]);
+        close (results[1]);
+
+        // the server closes its end once it listens
+        char byte;
+        bool ok = read (ready[0], &byte, 1) == 0;
+        close (ready[0]);
+
+        uint64_t start = monotonic_usec ();
+
+        pid_t *pids = calloc_nofail (clients, sizeof (pid_t));
+
+        for (uint32_t i = 0; ok && i < clients; i++) {
+                pids[i] = fork ();
+
+                if (pids[i] == 0) {
+                        close (stop[1]);
+                        close (results[0]);
+                        run_client (socket_file, requests);
+                }
+
+                if (pids[i] < 0) {
+                        perror ("fork");
+                        ok = false;
+                }
+        }
+
+        for (uint32_t i = 0; i < clients; i++) {
+                int status;
+
+                if (pids[i] > 0 && (waitpid (pids[i], &status, 0) < 0 || !WIFEXITED (status) || WEXITSTATUS (status) != 0))
+                        ok = false;
+        }
+
+        *seconds = elapsed (start);
+        free (pids);
+
+        // the server stops once it sees the end of the pipe
+        close (stop[1]);
+
+        ok = read (results[0], result, sizeof (*result)) == sizeof (*result) && ok;
+
+        int status;
+
+        close (results[0]);
+        waitpid (server, &status, 0);
+        unlink (socket_file);
+
+        return ok && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+static void bench_requests ()
+{
+        uint32_t clients = config.bench_clients ? config.bench_clients : BENCH_CLIENTS;
+        uint32_t requests = config.bench_requests ? config.bench_requests : BENCH_REQUESTS;
+        uint64_t total = (uint64_t)clients * requests;
+        char dir[] = "/tmp/pm-bench-XXXXXX";
+        char socket_file[PATH_MAX];
+
+        if (!mkdtemp (dir)) {
+                perror ("mkdtemp");
+                exit (EXIT_FAILURE);
+        }
+
+        snprintf (socket_file, sizeof (socket_file), "%s/bench.sock", dir);
+
+        printf ("%u clients, %u requests each\n", clients, requests);
+        printf ("%-10s %10s %9s %10s %10s %13s %9s\n", "backend", "requests", "seconds", "requests/s", "syscalls", "syscalls/req", "cpu");
+
+        bool failed = false;
+
+        for (int round = 0; round < 2; round++) {
+                requests_result result;
+                bool io_uring = round == 0;
+                double seconds;
+
+                if (!bench_requests_round (io_uring, clients, requests, socket_file, &result, &seconds)) {
+                        log_error ("benchmark with %s failed", io_uring ? "io_uring" : "plain system calls");
+                        failed = true;
+                        continue;
+                }
+
+                // the kernel may lack io_uring, the round measured plain calls then
+                if (io_uring && !result.stats.io_uring) {
+                        log_warn ("io_uring is not available, skipping it");
+                        continue;
+                }
+
+                printf ("%-10s %10llu %9.3f %10.0f %10llu %13.2f %8.3fs\n",
+                        io_uring ? "io_uring" : "plain",
+                        (unsigned long long)total,
+                        seconds,
+                        seconds > 0 ? total / seconds : 0,
+                        (unsigned long long)result.stats.syscalls,
+                        (double)result.stats.syscalls / total,
+                        result.cpu_seconds);
+        }
+
+        rmdir (dir);
+
+        if (failed)
+                exit (EXIT_FAILURE);
+}
+
+void process_bench_command (char *command)
+{
+        if (strcmp (command, "capture") == 0) {
+                bench_capture ();
+        } else if (strcmp (command, "requests") == 0) {
+                bench_requests ();
+        } else {
+                print_usage_statement ();
+                exit (EXIT_FAILURE);
+        }
+}
@@ -0,0 +1,162 @@
+#include "pm.h"
+#include <string.h>
+
+/*
+ * Growable byte buffers and the little endian encoding used for data sent
+ * between the client and the daemon. Multi-byte integers are always written
+ * least significant byte first, strings are prefixed with their length.
+ */
+
+void buffer_reserve (pm_buffer *buf, size_t size)
+{
+        if (buf->len + size <= buf->cap)
+                return;
+
+        size_t cap = buf->cap ? buf->cap : 256;
+        while (cap < buf->len + size)
+                cap *= 2;
+
+        buf->data = realloc_nofail (buf->data, cap);
+        buf->cap = cap;
+}
+
+void buffer_put_bytes (pm_buffer *buf, void *data, size_t size)
+{
+        if (size == 0)
+                return;
+
+        buffer_reserve (buf, size);
+        memcpy (buf->data + buf->len, data, size);
+        buf->len += size;
+}
+
+static void buffer_put_le (pm_buffer *buf, uint64_t value, int size)
+{
+        buffer_reserve (buf, size);
+
+        for (int i = 0; i < size; i++)
+                buf->data[buf->len++] = (char)(value >> (8 * i));
+}
+
+void buffer_put_u8 (pm_buffer *buf, uint8_t value)
+{
+        buffer_put_le (buf, value, 1);
+}
+
+void buffer_put_u16 (pm_buffer *buf, uint16_t value)
+{
+        buffer_put_le (buf, value, 2);
+}
+
+void buffer_put_u32 (pm_buffer *buf, uint32_t value)
+{
+        buffer_put_le (buf, value, 4);
+}
+
+void buffer_put_u64 (pm_buffer *buf, uint64_t value)
+{
+        buffer_put_le (buf, value, 8);
+}
+
+/**
+ * Writes a string with a 16 bit length prefix, longer strings are cut short.
+ */
+void buffer_put_string (pm_buffer *buf, char *str)
+{
+        size_t len = str ? strlen (str) : 0;
+
+        if (len > UINT16_MAX)
+                len = UINT16_MAX;
+
+        buffer_put_u16 (buf, len);
+        buffer_put_bytes (buf, str, len);
+}
+
+void buffer_clear (pm_buffer *buf)
+{
+        buf->len = 0;
+}
+
+void buffer_free (pm_buffer *buf)
+{
+        free (buf->data);
+        *buf = (pm_buffer) { 0 };
+}
+
+static uint64_t reader_get_le (pm_reader *reader, int size)
+{
+        if (reader->len - reader->off < size) {
+                reader->error = true;
+                reader->off = reader->len;
+                return 0;
+        }
+
+        uint64_t value = 0;
+        unsigned char *p = (unsigned char *)reader->data + reader->off;
+
+        for (int i = 0; i < size; i++)
+                value |= (uint64_t)p[i] << (8 * i);
+
+        reader->off += size;
+
+        return value;
+}
+
+uint8_t reader_get_u8 (pm_reader *reader)
+{
+        return reader_get_le (reader, 1);
+}
+
+uint16_t reader_get_u16 (pm_reader *reader)
+{
+        return reader_get_le (reader, 2);
+}
+
+uint32_t reader_get_u32 (pm_reader *reader)
+{
+        return reader_get_le (reader, 4);
+}
+
+uint64_t reader_get_u64 (pm_reader *reader)
+{
+        return reader_get_le (reader, 8);
+}
+
+/**
+ * Reads a length prefixed string into dst, always null terminating it. A
+ * string that does not fit is truncated.
+ */
+void reader_get_string (pm_reader *reader, char *dst, size_t size)
+{
+        size_t len = reader_get_u16 (reader);
+
+        if (reader->len - reader->off < len) {
+                reader->error = true;
+                reader->off = reader->len;
+                len = 0;
+        }
+
+        size_t copy = len < size ? len : size - 1;
+
+        memcpy (dst, reader->data + reader->off, copy);
+        dst[copy] = '\0';
+        reader->off += len;
+}
+
+/**
+ * Returns a pointer to the next size bytes, or NULL if fewer are left. The
+ * bytes are not copied, they live as long as the reader's data.
+ */
+char *reader_get_bytes (pm_reader *reader, size_t size)
+{
+        if (reader->len - reader->off < size) {
+                reader->error = true;
+                reader->off = reader->len;
+                return NULL;
+        }
+
+        char *bytes = reader->data + reader->off;
+        reader->off += size;
+
+        return bytes;
+}
@@ -0,0 +1,1451 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Output capture
+ *
+ * Managed processes write their stdout and stderr into pipes owned by the
+ * daemon. A dedicated thread drains the pipes and appends the output to the
+ * log files, so neither the event loop nor the children ever wait on the
+ * disk. Only whole lines are handed to a file, output of processes sharing a
+ * file is interleaved line by line instead of byte by byte.
+ *
+ * Log files are rotated by the same thread right before a write, so a
+ * rotation always falls between two writes and never splits or loses a
+ * line. The rotated segment is compressed later by the compression thread.
+ *
+ * Clients following a log file are served by this thread too. Their socket
+ * is handed over by the event loop, and whatever is appended to the file is
+ * sent to them with sendfile right after it was written, straight from the
+ * page cache. A follower that cannot keep up only falls behind in the file,
+ * the writer never waits for it.
+ *
+ * Where the kernel has io_uring the pipes and files are read and written
+ * through a ring instead of one system call at a time. The streams epoll
+ * reports readable queue a read each, and all of them are submitted with a
+ * single call once the events are dispatched. The writes of the files they
+ * filled go out together the same way. The pipes and files are registered
+ * with the ring, and the first streams read into buffers registered with it
+ * too. Followers stay on epoll and plain calls.
+ *
+ * The event loop hands streams and followers over through a locked queue and
+ * wakes the thread with an eventfd, so handing one over never waits on the
+ * capture thread.
+ */
+
+// pipes are enlarged so children can get ahead of a slow disk
+#define CAPTURE_PIPE_SIZE (256 * 1024)
+
+// partial line buffered per stream, a longer line is written in pieces
+#define CAPTURE_STREAM_BUFFER (16 * 1024)
+
+// output queued per file before newer output is dropped
+#define CAPTURE_FILE_PENDING_MAX (4 * 1024 * 1024)
+
+#define CAPTURE_FILE_BUCKETS 1024
+#define CAPTURE_EVENT_BATCH 64
+
+// submissions queued at once, stream buffers registered with the ring, and
+// descriptors registered with it for the pipes and files
+#define CAPTURE_RING_ENTRIES 256
+#define CAPTURE_RING_BUFFERS 64
+#define CAPTURE_RING_FILES 1024
+
+// a pending partial line is written out after this many milliseconds
+#define CAPTURE_PARTIAL_FLUSH_MS 1000
+
+// log data sent to a follower per frame, and per turn before other
+// followers and streams get theirs
+#define FOLLOW_FRAME_SIZE (64 * 1024)
+#define FOLLOW_TURN_SIZE (1024 * 1024)
+
+// the file is searched backwards for the last lines in blocks this large
+#define FOLLOW_SCAN_BLOCK (64 * 1024)
+
+typedef struct capture_file capture_file;
+typedef struct capture_follower capture_follower;
+
+typedef struct capture_file {
+        capture_file *next;
+        capture_file *dirty_next;
+        char *path;
+        uint32_t hash;
+        int fd;
+        // the descriptor's slot in the ring, -1 if it has none
+        int slot;
+        int refs;
+        bool dirty;
+        uint64_t dropped;
+        pm_buffer pending;
+        // bytes of pending written so far
+        size_t written;
+        // bytes in the current file and when it was started
+        uint64_t size;
+        time_t opened_at;
+        pm_rotation_policy rotation;
+        capture_follower *followers;
+} capture_file;
+
+typedef struct capture_stream capture_stream;
+
+typedef struct capture_stream {
+        // the read end of the pipe, must stay first
+        pm_watch watch;
+        // links of the list of streams holding a partial line
+        capture_stream *partial_next;
+        capture_stream *partial_prev;
+        bool partial;
+        capture_file *file;
+        bool timestamps;
+        // the next byte emitted starts a new line and gets a timestamp
+        bool line_start;
+        // the pipe's slot in the ring, -1 if it has none
+        int slot;
+        // a buffer registered with the ring and its index, or one of its own
+        // and -1
+        char *buf;
+        int buf_index;
+        size_t len;
+        // bytes the read queued on the ring asked for, and read since epoll
+        // last reported the pipe
+        size_t requested;
+        size_t turn;
+} capture_stream;
+
+/**
+ * A client the log file at path is streamed to. Log data goes out as frames
+ * answering the client's LOGS request, the header of a frame is sent with
+ * send and its body with sendfile from log_fd.
+ */
+typedef struct capture_follower {
+        // the client's socket, must stay first
+        pm_watch watch;
+        // links of the followers of a file, or of the orphans
+        capture_follower *next;
+        capture_follower *prev;
+        // the file being written to path, NULL while nothing is
+        capture_file *file;
+        char *path;
+        uint32_t hash;
+        int log_fd;
+        uint64_t offset;
+        uint32_t id;
+        bool follow;
+        // path was rotated, log_fd is reopened once it has been sent
+        bool rotated;
+        // the socket is full, waiting for it to become writable
+        bool blocked;
+        // output queued by the event loop before the handover
+        pm_buffer unsent;
+        size_t unsent_off;
+        char header[PM_FRAME_HEADER_SIZE];
+        size_t header_sent;
+        // bytes of the current frame's body still to be sent
+        uint64_t frame_left;
+} capture_follower;
+
+// a stream or a follower handed from the event loop to the capture thread
+typedef struct capture_request capture_request;
+
+typedef struct capture_request {
+        capture_request *next;
+        int pipe_fd;
+        // appended to by a stream, read by a follower
+        int file_fd;
+        bool timestamps;
+        pm_rotation_policy rotation;
+        // a follower's socket, -1 for a stream
+        int socket_fd;
+        uint32_t id;
+        uint32_t lines;
+        bool follow;
+        pm_buffer unsent;
+        char path[];
+} capture_request;
+
+extern pm_configuration config;
+
+static pthread_t capture_thread;
+static int capture_epoll_fd = -1;
+
+// requests handed over by the event loop, the eventfd wakes the thread up
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static capture_request *control_head;
+static capture_request *control_tail;
+static bool stop_requested;
+static int control_fd = -1;
+
+// only touched by the capture thread
+static capture_file *files[CAPTURE_FILE_BUCKETS];
+static capture_file *dirty_files;
+static capture_stream *partial_streams;
+// followers of paths no process writes to at the moment
+static capture_follower *orphans;
+static bool stopping;
+
+// the ring, its fd is -1 if output is captured with plain calls
+static pm_uring ring = { .fd = -1 };
+static char *ring_buffers;
+static int free_buffers[CAPTURE_RING_BUFFERS];
+static int free_buffer_count;
+static pm_capture_stats stats;
+
+static void attach_orphans (capture_file *file);
+static void pump_follower (capture_follower *follower);
+
+static capture_file *find_file (char *path, uint32_t hash)
+{
+        for (capture_file *file = files[hash % CAPTURE_FILE_BUCKETS]; file != NULL; file = file->next)
+                if (file->hash == hash && strcmp (file->path, path) == 0)
+                        return file;
+
+        return NULL;
+}
+
+/**
+ * Returns the file for path, fd is an open descriptor for it that is kept if
+ * the file is not open yet. A file shared by several processes follows the
+ * rotation policy of the one that opened it last.
+ */
+static capture_file *acquire_file (char *path, int fd, pm_rotation_policy *rotation)
+{
+        uint32_t hash = hash_name (path);
+        capture_file **bucket = &files[hash % CAPTURE_FILE_BUCKETS];
+        capture_file *file = find_file (path, hash);
+
+        if (file) {
+                // the file is already open, keep one descriptor for it
+                close (fd);
+                file->refs++;
+                file->rotation = *rotation;
+                return file;
+        }
+
+        file = calloc_nofail (1, sizeof (capture_file));
+
+        file->path = strdup (path);
+        file->hash = hash;
+        file->fd = fd;
+        file->slot = ring.fd >= 0 ? uring_add_file (&ring, fd) : -1;
+        file->refs = 1;
+        file->opened_at = time (NULL);
+        file->rotation = *rotation;
+        file->next = *bucket;
+        *bucket = file;
+
+        struct stat st;
+
+        if (fstat (fd, &st) == 0)
+                file->size = st.st_size;
+
+        attach_orphans (file);
+
+        return file;
+}
+
+static void mark_dirty (capture_file *file)
+{
+        if (file->dirty)
+                return;
+
+        file->dirty = true;
+        file->dirty_next = dirty_files;
+        dirty_files = file;
+}
+
+static void release_file (capture_file *file)
+{
+        if (--file->refs > 0)
+                return;
+
+        // make sure the last of the output gets out before closing
+        mark_dirty (file);
+}
+
+/**
+ * Queues output for a file. When the writer has fallen too far behind the
+ * output is dropped rather than stalling the processes producing it, a note
+ * with the amount lost is written once there is room again.
+ */
+static void file_append (capture_file *file, char *data, size_t size)
+{
+        if (file->pending.len + size > CAPTURE_FILE_PENDING_MAX) {
+                file->dropped += size;
+                return;
+        }
+
+        if (file->dropped > 0) {
+                char note[96];
+                int n = snprintf (note, sizeof (note), "[pm] %llu bytes of output dropped\n",
+                                  (unsigned long long)file->dropped);
+
+                buffer_put_bytes (&file->pending, note, n);
+                file->dropped = 0;
+        }
+
+        buffer_put_bytes (&file->pending, data, size);
+        mark_dirty (file);
+}
+
+static void format_timestamp (char *buf, size_t size)
+{
+        struct timespec now;
+        struct tm tm;
+
+        clock_gettime (CLOCK_REALTIME, &now);
+        gmtime_r (&now.tv_sec, &tm);
+
+        size_t n = strftime (buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf (buf + n, size - n, ".%03ldZ ", now.tv_nsec / 1000000);
+}
+
+/**
+ * Moves the first size bytes of the stream buffer to its file, prefixing
+ * every line with a timestamp if the process asked for them.
+ */
+static void stream_emit (capture_stream *stream, size_t size)
+{
+        if (size == 0)
+                return;
+
+        if (!stream->timestamps) {
+                file_append (stream->file, stream->buf, size);
+        } else {
+                char stamp[40];
+                format_timestamp (stamp, sizeof (stamp));
+
+                size_t start = 0;
+                while (start < size) {
+                        char *nl = memchr (stream->buf + start, '\n', size - start);
+                        size_t end = nl ? (size_t)(nl - stream->buf) + 1 : size;
+
+                        if (stream->line_start)
+                                file_append (stream->file, stamp, strlen (stamp));
+
+                        file_append (stream->file, stream->buf + start, end - start);
+                        stream->line_start = nl != NULL;
+                        start = end;
+                }
+        }
+
+        memmove (stream->buf, stream->buf + size, stream->len - size);
+        stream->len -= size;
+}
+
+/**
+ * Keeps the list of streams holding back a partial line in sync with the
+ * stream's buffer.
+ */
+static void stream_update_partial (capture_stream *stream)
+{
+        bool partial = stream->len > 0;
+
+        if (partial == stream->partial)
+                return;
+
+        stream->partial = partial;
+
+        if (partial) {
+                stream->partial_prev = NULL;
+                stream->partial_next = partial_streams;
+
+                if (partial_streams)
+                        partial_streams->partial_prev = stream;
+
+                partial_streams = stream;
+        } else {
+                if (stream->partial_prev)
+                        stream->partial_prev->partial_next = stream->partial_next;
+                else
+                        partial_streams = stream->partial_next;
+
+                if (stream->partial_next)
+                        stream->partial_next->partial_prev = stream->partial_prev;
+        }
+}
+
+/**
+ * Gives a stream a buffer registered with the ring while there are any left,
+ * one of its own after that.
+ */
+static void stream_get_buffer (capture_stream *stream)
+{
+        if (free_buffer_count > 0) {
+                stream->buf_index = free_buffers[--free_buffer_count];
+                stream->buf = ring_buffers + (size_t)stream->buf_index * CAPTURE_STREAM_BUFFER;
+        } else {
+                stream->buf_index = -1;
+                stream->buf = malloc_nofail (CAPTURE_STREAM_BUFFER);
+        }
+}
+
+static void stream_close (capture_stream *stream)
+{
+        stream_emit (stream, stream->len);
+        stream_update_partial (stream);
+
+        epoll_ctl (capture_epoll_fd, EPOLL_CTL_DEL, stream->watch.fd, NULL);
+        uring_remove_file (&ring, stream->slot);
+        close (stream->watch.fd);
+        release_file (stream->file);
+
+        if (stream->buf_index >= 0)
+                free_buffers[free_buffer_count++] = stream->buf_index;
+        else
+                free (stream->buf);
+
+        free (stream);
+}
+
+/**
+ * Takes n bytes read into the free end of the stream buffer.
+ */
+static void stream_consume (capture_stream *stream, size_t n)
+{
+        stream->len += n;
+
+        // hand over every complete line, keep the partial one back
+        char *last = memrchr (stream->buf, '\n', stream->len);
+
+        if (last)
+                stream_emit (stream, last - stream->buf + 1);
+        else if (stream->len == CAPTURE_STREAM_BUFFER)
+                stream_emit (stream, stream->len);
+}
+
+static void stream_read (capture_stream *stream)
+{
+        for (;;) {
+                ssize_t n = read (stream->watch.fd, stream->buf + stream->len, CAPTURE_STREAM_BUFFER - stream->len);
+
+                stats.syscalls++;
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+
+                if (n <= 0) {
+                        stream_close (stream);
+                        return;
+                }
+
+                stream_consume (stream, n);
+        }
+
+        stream_update_partial (stream);
+}
+
+/**
+ * Submits what is queued on the ring and waits for all of it. Returns false
+ * if the ring failed, it is closed and plain calls are used from then on.
+ */
+static bool submit_ring ()
+{
+        uint64_t enters = ring.enters;
+        bool ok = uring_submit_and_wait (&ring);
+
+        stats.syscalls += ring.enters - enters;
+
+        if (!ok) {
+                log_error ("io_uring failed, capturing output with read and write: %s", strerror (errno));
+                uring_close (&ring);
+        }
+
+        return ok;
+}
+
+static void stream_queue_read (capture_stream *stream);
+
+/**
+ * Submits the reads queued by the streams and takes what they read. A pipe
+ * that filled its read is read again in the next submission, up to a pipe's
+ * worth per turn so the files are written before their output piles up.
+ */
+static void complete_reads ()
+{
+        while (ring.queued > 0) {
+                if (!submit_ring ())
+                        return;
+
+                struct io_uring_cqe *cqe;
+
+                while ((cqe = uring_next_cqe (&ring))) {
+                        capture_stream *stream = (capture_stream *)(uintptr_t)cqe->user_data;
+                        int res = cqe->res;
+
+                        uring_seen (&ring);
+
+                        // epoll reports the pipe again if it has data later
+                        if (res == -EAGAIN || res == -EINTR)
+                                continue;
+
+                        if (res <= 0) {
+                                stream_close (stream);
+                                continue;
+                        }
+
+                        stream_consume (stream, res);
+                        stream_update_partial (stream);
+
+                        stream->turn += res;
+
+                        // the submission queue was emptied, there is room
+                        if ((size_t)res == stream->requested && stream->turn < CAPTURE_PIPE_SIZE)
+                                stream_queue_read (stream);
+                }
+        }
+}
+
+/**
+ * Queues a read of the stream's pipe on the ring, submitting the reads queued
+ * before if the ring is full.
+ */
+static void stream_queue_read (capture_stream *stream)
+{
+        struct io_uring_sqe *sqe = uring_get_sqe (&ring);
+
+        if (!sqe) {
+                complete_reads ();
+
+                if (ring.fd < 0) {
+                        stream_read (stream);
+                        return;
+                }
+
+                sqe = uring_get_sqe (&ring);
+        }
+
+        sqe->opcode = stream->buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = stream->slot >= 0 ? stream->slot : stream->watch.fd;
+        sqe->flags = stream->slot >= 0 ? IOSQE_FIXED_FILE : 0;
+        sqe->addr = (uintptr_t)(stream->buf + stream->len);
+        sqe->len = stream->requested = CAPTURE_STREAM_BUFFER - stream->len;
+        sqe->off = (uint64_t)-1;
+        sqe->buf_index = stream->buf_index >= 0 ? stream->buf_index : 0;
+        sqe->user_data = (uintptr_t)stream;
+}
+
+static void handle_stream_event (pm_watch *watch, uint32_t events)
+{
+        capture_stream *stream = (capture_stream *)watch;
+
+        if (ring.fd >= 0) {
+                stream->turn = 0;
+                stream_queue_read (stream);
+        } else {
+                stream_read (stream);
+        }
+}
+
+/*
+ * Followers
+ */
+
+static void link_follower (capture_follower **list, capture_follower *follower)
+{
+        follower->prev = NULL;
+        follower->next = *list;
+
+        if (*list)
+                (*list)->prev = follower;
+
+        *list = follower;
+}
+
+static void unlink_follower (capture_follower *follower)
+{
+        capture_follower **list = follower->file ? &follower->file->followers : &orphans;
+
+        if (follower->prev)
+                follower->prev->next = follower->next;
+        else
+                *list = follower->next;
+
+        if (follower->next)
+                follower->next->prev = follower->prev;
+
+        follower->file = NULL;
+}
+
+static void orphan_follower (capture_follower *follower)
+{
+        unlink_follower (follower);
+        link_follower (&orphans, follower);
+}
+
+/**
+ * Hands the followers waiting for output to path over to the file that was
+ * just opened for it.
+ */
+static void attach_orphans (capture_file *file)
+{
+        for (capture_follower *f = orphans, *next; f != NULL; f = next) {
+                next = f->next;
+
+                if (f->hash != file->hash || strcmp (f->path, file->path) != 0)
+                        continue;
+
+                unlink_follower (f);
+                f->file = file;
+                link_follower (&file->followers, f);
+        }
+}
+
+static void close_follower (capture_follower *follower)
+{
+        unlink_follower (follower);
+
+        epoll_ctl (capture_epoll_fd, EPOLL_CTL_DEL, follower->watch.fd, NULL);
+        close (follower->watch.fd);
+        close (follower->log_fd);
+
+        buffer_free (&follower->unsent);
+        free (follower->path);
+        free (follower);
+}
+
+static void set_blocked (capture_follower *follower, bool blocked)
+{
+        if (follower->blocked == blocked)
+                return;
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | (blocked ? EPOLLOUT : 0), .data.ptr = follower };
+
+        follower->blocked = blocked;
+        epoll_ctl (capture_epoll_fd, EPOLL_CTL_MOD, follower->watch.fd, &ev);
+}
+
+/**
+ * Returns the offset the last lines of a file start at. A newline ending the
+ * file does not start another line.
+ */
+static uint64_t tail_offset (int fd, uint32_t lines)
+{
+        struct stat st;
+        char block[FOLLOW_SCAN_BLOCK];
+
+        if (fstat (fd, &st) < 0)
+                return 0;
+
+        if (lines == 0)
+                return st.st_size;
+
+        uint64_t end = st.st_size;
+        uint64_t pos = end;
+        uint32_t found = 0;
+
+        while (pos > 0) {
+                size_t size = pos < sizeof (block) ? pos : sizeof (block);
+
+                pos -= size;
+
+                if (pread (fd, block, size, pos) != (ssize_t)size)
+                        return 0;
+
+                for (size_t i = size; i > 0; i--)
+                        if (block[i - 1] == '\n' && pos + i != end && ++found == lines)
+                                return pos + i;
+        }
+
+        return 0;
+}
+
+/**
+ * Starts the next frame of log data if the file has grown past what was
+ * sent. Returns false if there is nothing to send.
+ */
+static bool start_frame (capture_follower *follower)
+{
+        struct stat st;
+
+        if (fstat (follower->log_fd, &st) < 0)
+                return false;
+
+        // the file was truncated, it starts over
+        if ((uint64_t)st.st_size < follower->offset)
+                follower->offset = 0;
+
+        if ((uint64_t)st.st_size == follower->offset)
+                return false;
+
+        uint64_t size = st.st_size - follower->offset;
+
+        if (size > FOLLOW_FRAME_SIZE)
+                size = FOLLOW_FRAME_SIZE;
+
+        encode_frame_header (follower->header, size, OK, follower->id);
+        follower->header_sent = 0;
+        follower->frame_left = size;
+
+        return true;
+}
+
+/**
+ * Moves on to the new file at the follower's path after a rotation. Returns
+ * false if there is no new file yet.
+ */
+static bool reopen_log (capture_follower *follower)
+{
+        int fd = open (follower->path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+                return false;
+
+        close (follower->log_fd);
+        follower->log_fd = fd;
+        follower->offset = 0;
+        follower->rotated = false;
+
+        return true;
+}
+
+/**
+ * Sends the follower whatever it has not seen yet, until the socket is full
+ * or the follower had its turn. A follower that is not following is closed
+ * once it has everything.
+ */
+static void pump_follower (capture_follower *follower)
+{
+        int fd = follower->watch.fd;
+        size_t sent = 0;
+
+        while (sent < FOLLOW_TURN_SIZE) {
+                ssize_t n;
+
+                if (follower->unsent_off < follower->unsent.len) {
+                        n = send (fd, follower->unsent.data + follower->unsent_off, follower->unsent.len - follower->unsent_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+                        if (n > 0)
+                                follower->unsent_off += n;
+                } else if (follower->frame_left > 0 && follower->header_sent < PM_FRAME_HEADER_SIZE) {
+                        n = send (fd, follower->header + follower->header_sent, PM_FRAME_HEADER_SIZE - follower->header_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+                        if (n > 0)
+                                follower->header_sent += n;
+                } else if (follower->frame_left > 0) {
+                        off_t offset = follower->offset;
+
+                        n = sendfile (fd, follower->log_fd, &offset, follower->frame_left);
+
+                        // the file shrank under the frame, it cannot be completed
+                        if (n == 0) {
+                                close_follower (follower);
+                                return;
+                        }
+
+                        if (n > 0) {
+                                follower->offset = offset;
+                                follower->frame_left -= n;
+                        }
+                } else if (start_frame (follower) || (follower->rotated && reopen_log (follower))) {
+                        continue;
+                } else {
+                        if (!follower->follow) {
+                                close_follower (follower);
+                                return;
+                        }
+
+                        // caught up, the next write to the file wakes it
+                        set_blocked (follower, false);
+                        return;
+                }
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+
+                if (n < 0) {
+                        close_follower (follower);
+                        return;
+                }
+
+                sent += n;
+        }
+
+        // wait for room, or give the others their turn first
+        set_blocked (follower, true);
+}
+
+static void handle_follower_event (pm_watch *watch, uint32_t events)
+{
+        capture_follower *follower = (capture_follower *)watch;
+
+        if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                close_follower (follower);
+                return;
+        }
+
+        if (events & EPOLLIN) {
+                char discard[256];
+                ssize_t n;
+
+                // the connection only carries log data from now on
+                while ((n = recv (watch->fd, discard, sizeof (discard), MSG_DONTWAIT)) > 0)
+                        ;
+
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                        close_follower (follower);
+                        return;
+                }
+        }
+
+        if (events & EPOLLOUT)
+                pump_follower (follower);
+}
+
+static void start_follower (capture_request *request)
+{
+        capture_follower *follower = calloc_nofail (1, sizeof (capture_follower));
+
+        follower->watch.fd = request->socket_fd;
+        follower->watch.callback = handle_follower_event;
+        follower->path = strdup (request->path);
+        follower->hash = hash_name (request->path);
+        follower->log_fd = request->file_fd;
+        follower->offset = tail_offset (request->file_fd, request->lines);
+        follower->id = request->id;
+        follower->follow = request->follow;
+        follower->unsent = request->unsent;
+        follower->blocked = true;
+
+        capture_file *file = find_file (request->path, follower->hash);
+
+        follower->file = file;
+        link_follower (file ? &file->followers : &orphans, follower);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLOUT, .data.ptr = follower };
+
+        if (epoll_ctl (capture_epoll_fd, EPOLL_CTL_ADD, follower->watch.fd, &ev) < 0) {
+                log_error ("failed to stream %s: %s", request->path, strerror (errno));
+                close_follower (follower);
+        }
+}
+
+static bool rotation_due (capture_file *file)
+{
+        pm_rotation_policy *policy = &file->rotation;
+
+        if (file->size == 0)
+                return false;
+
+        if (policy->max_size > 0 && file->size + file->pending.len > policy->max_size)
+                return true;
+
+        return policy->max_age > 0 && time (NULL) - file->opened_at >= policy->max_age;
+}
+
+/**
+ * Names the segment a log file is rotated to after the current time, a
+ * number is appended if the file was already rotated within this second.
+ */
+static void segment_name (capture_file *file, char *segment, size_t size)
+{
+        char stamp[32];
+        time_t now = time (NULL);
+        struct tm tm;
+
+        gmtime_r (&now, &tm);
+        strftime (stamp, sizeof (stamp), "%Y%m%d-%H%M%S", &tm);
+
+        snprintf (segment, size, "%s.%s", file->path, stamp);
+
+        for (int n = 1;; n++) {
+                char compressed[PATH_MAX];
+                snprintf (compressed, sizeof (compressed), "%s.gz", segment);
+
+                if (access (segment, F_OK) != 0 && access (compressed, F_OK) != 0)
+                        return;
+
+                snprintf (segment, size, "%s.%s-%d", file->path, stamp, n);
+        }
+}
+
+/**
+ * Moves the current log file aside and starts a new one at its path. Only
+ * this thread writes to the file, so nothing is written between the rename
+ * and the switch to the new descriptor. If the new file cannot be created
+ * the old one is put back and kept.
+ */
+static void rotate_file (capture_file *file)
+{
+        char segment[PATH_MAX];
+
+        segment_name (file, segment, sizeof (segment));
+
+        if (rename (file->path, segment) < 0) {
+                log_error ("failed to rotate %s: %s", file->path, strerror (errno));
+                return;
+        }
+
+        int fd = open (file->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+
+        if (fd < 0) {
+                log_error ("failed to start new log file %s: %s", file->path, strerror (errno));
+                rename (segment, file->path);
+                return;
+        }
+
+        close (file->fd);
+        file->fd = fd;
+        file->size = 0;
+
+        if (file->slot >= 0 && !uring_update_file (&ring, file->slot, fd)) {
+                uring_remove_file (&ring, file->slot);
+                file->slot = -1;
+        }
+
+        file->opened_at = time (NULL);
+
+        // followers finish the old file before moving on to the new one
+        for (capture_follower *f = file->followers; f != NULL; f = f->next)
+                f->rotated = true;
+
+        compress_log_segment (segment, file->path, file->rotation.keep);
+        publish_event (EVENT_LOG_ROTATED, NULL, 0, segment);
+}
+
+/**
+ * Takes n bytes of the file's pending output as written, or gives up on the
+ * rest of it if the write failed with err.
+ */
+static void file_written (capture_file *file, ssize_t n, int err)
+{
+        if (n < 0) {
+                log_error ("failed to write output to %s: %s", file->path, strerror (err));
+                file->dropped += file->pending.len - file->written;
+                file->written = file->pending.len;
+                return;
+        }
+
+        file->written += n;
+        file->size += n;
+        stats.bytes += n;
+}
+
+static void write_file (capture_file *file)
+{
+        while (file->written < file->pending.len) {
+                ssize_t n = write (file->fd, file->pending.data + file->written, file->pending.len - file->written);
+
+                stats.syscalls++;
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                file_written (file, n, errno);
+        }
+}
+
+/**
+ * Writes the pending output of a list of files with one submission per
+ * round, short writes are continued in the next round.
+ */
+static void write_files_ring (capture_file *list)
+{
+        for (;;) {
+                bool queued = false;
+
+                for (capture_file *file = list; file != NULL; file = file->dirty_next) {
+                        if (file->written == file->pending.len)
+                                continue;
+
+                        struct io_uring_sqe *sqe = uring_get_sqe (&ring);
+
+                        // the rest go out in the next round
+                        if (!sqe)
+                                break;
+
+                        sqe->opcode = IORING_OP_WRITE;
+                        sqe->fd = file->slot >= 0 ? file->slot : file->fd;
+                        sqe->flags = file->slot >= 0 ? IOSQE_FIXED_FILE : 0;
+                        sqe->addr = (uintptr_t)(file->pending.data + file->written);
+                        sqe->len = file->pending.len - file->written;
+                        sqe->off = (uint64_t)-1;
+                        sqe->user_data = (uintptr_t)file;
+                        queued = true;
+                }
+
+                if (!queued || !submit_ring ())
+                        return;
+
+                struct io_uring_cqe *cqe;
+
+                while ((cqe = uring_next_cqe (&ring))) {
+                        capture_file *file = (capture_file *)(uintptr_t)cqe->user_data;
+                        int res = cqe->res;
+
+                        uring_seen (&ring);
+
+                        if (res == -EINTR)
+                                continue;
+
+                        file_written (file, res > 0 ? res : -1, res < 0 ? -res : EIO);
+                }
+        }
+}
+
+static void flush_dirty_files ()
+{
+        while (dirty_files) {
+                capture_file *list = dirty_files;
+
+                dirty_files = NULL;
+
+                // rotations fall between two writes, before this round's
+                for (capture_file *file = list; file != NULL; file = file->dirty_next) {
+                        file->dirty = false;
+                        file->written = 0;
+
+                        if (file->pending.len > 0 && rotation_due (file))
+                                rotate_file (file);
+                }
+
+                if (ring.fd >= 0)
+                        write_files_ring (list);
+
+                // everything unless the ring failed halfway
+                for (capture_file *file = list; file != NULL; file = file->dirty_next)
+                        write_file (file);
+
+                for (capture_file *file = list, *next; file != NULL; file = next) {
+                        next = file->dirty_next;
+                        buffer_clear (&file->pending);
+
+                        // pumping may close a follower and unlink it
+                        for (capture_follower *f = file->followers, *fnext; f != NULL; f = fnext) {
+                                fnext = f->next;
+
+                                if (!f->blocked)
+                                        pump_follower (f);
+                        }
+
+                        if (file->refs > 0)
+                                continue;
+
+                        capture_file **link = &files[file->hash % CAPTURE_FILE_BUCKETS];
+
+                        while (*link != file)
+                                link = &(*link)->next;
+
+                        *link = file->next;
+
+                        while (file->followers)
+                                orphan_follower (file->followers);
+
+                        uring_remove_file (&ring, file->slot);
+                        close (file->fd);
+                        buffer_free (&file->pending);
+                        free (file->path);
+                        free (file);
+                }
+        }
+}
+
+/**
+ * Writes out partial lines that have been waiting for their newline, such as
+ * prompts or progress output.
+ */
+static void flush_partial_lines ()
+{
+        while (partial_streams) {
+                capture_stream *stream = partial_streams;
+
+                stream_emit (stream, stream->len);
+                stream_update_partial (stream);
+        }
+}
+
+// starts capturing the pipe handed over with request
+static void start_stream (capture_request *request)
+{
+        capture_stream *stream = malloc_nofail (sizeof (capture_stream));
+
+        stream->watch.fd = request->pipe_fd;
+        stream->watch.callback = handle_stream_event;
+        stream->file = acquire_file (request->path, request->file_fd, &request->rotation);
+        stream->timestamps = request->timestamps;
+        stream->partial = false;
+        stream->line_start = true;
+        stream->slot = ring.fd >= 0 ? uring_add_file (&ring, stream->watch.fd) : -1;
+        stream->len = 0;
+        stream_get_buffer (stream);
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = stream };
+
+        if (epoll_ctl (capture_epoll_fd, EPOLL_CTL_ADD, stream->watch.fd, &ev) < 0) {
+                log_error ("failed to capture output for %s: %s", request->path, strerror (errno));
+                stream_close (stream);
+        }
+}
+
+static void handle_control ()
+{
+        uint64_t count;
+
+        while (read (control_fd, &count, sizeof (count)) < 0 && errno == EINTR)
+                ;
+
+        pthread_mutex_lock (&control_lock);
+        capture_request *request = control_head;
+        control_head = control_tail = NULL;
+        // everything handed over before the stop is taken along with it
+        stopping = stop_requested;
+        pthread_mutex_unlock (&control_lock);
+
+        while (request) {
+                capture_request *next = request->next;
+
+                if (request->socket_fd >= 0)
+                        start_follower (request);
+                else
+                        start_stream (request);
+
+                free (request);
+                request = next;
+        }
+}
+
+/**
+ * Closes the ring once the thread is done with it. The descriptors it has
+ * registered hold references to the pipes and files, and its buffers stay
+ * pinned, for as long as it is open.
+ */
+static void release_ring ()
+{
+        stats.io_uring = ring.fd >= 0;
+
+        uring_close (&ring);
+        free (ring_buffers);
+        ring_buffers = NULL;
+        free_buffer_count = 0;
+}
+
+static void *capture_thread_main (void *arg)
+{
+        struct epoll_event events[CAPTURE_EVENT_BATCH];
+        uint64_t partial_flush_at = 0;
+
+        while (!stopping) {
+                int timeout = -1;
+
+                if (partial_streams) {
+                        uint64_t now = monotonic_ms ();
+
+                        if (partial_flush_at == 0)
+                                partial_flush_at = now + CAPTURE_PARTIAL_FLUSH_MS;
+
+                        if (now >= partial_flush_at) {
+                                flush_partial_lines ();
+                                flush_dirty_files ();
+                                partial_flush_at = 0;
+                                continue;
+                        }
+
+                        timeout = partial_flush_at - now;
+                } else {
+                        partial_flush_at = 0;
+                }
+
+                int n = epoll_wait (capture_epoll_fd, events, CAPTURE_EVENT_BATCH, timeout);
+
+                stats.syscalls++;
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        log_error ("output capture failed: %s", strerror (errno));
+                        break;
+                }
+
+                for (int i = 0; i < n; i++) {
+                        pm_watch *watch = events[i].data.ptr;
+
+                        if (watch == NULL)
+                                handle_control ();
+                        else
+                                watch->callback (watch, events[i].events);
+                }
+
+                // the reads the streams queued go out together
+                if (ring.fd >= 0)
+                        complete_reads ();
+
+                flush_dirty_files ();
+        }
+
+        flush_partial_lines ();
+        flush_dirty_files ();
+        release_ring ();
+
+        return NULL;
+}
+
+/**
+ * Sets up the ring unless io_uring is turned off or the kernel lacks what is
+ * needed, output is captured with plain calls then.
+ */
+static void setup_ring ()
+{
+        uint8_t ops[] = { IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITE };
+
+        if (config.no_io_uring)
+                return;
+
+        if (!uring_init (&ring, CAPTURE_RING_ENTRIES)) {
+                log_info ("io_uring is not available, capturing output with read and write: %s", strerror (errno));
+                return;
+        }
+
+        if (!uring_supports (&ring, ops, sizeof (ops)) || !uring_register_files (&ring, CAPTURE_RING_FILES)) {
+                log_info ("io_uring lacks what output capture needs, capturing output with read and write");
+                uring_close (&ring);
+                return;
+        }
+
+        struct iovec buffers[CAPTURE_RING_BUFFERS];
+
+        ring_buffers = malloc_nofail (CAPTURE_RING_BUFFERS * CAPTURE_STREAM_BUFFER);
+
+        for (int i = 0; i < CAPTURE_RING_BUFFERS; i++)
+                buffers[i] = (struct iovec) { ring_buffers + i * CAPTURE_STREAM_BUFFER, CAPTURE_STREAM_BUFFER };
+
+        // streams read into buffers of their own instead
+        if (!uring_register_buffers (&ring, buffers, CAPTURE_RING_BUFFERS)) {
+                log_warn ("failed to register capture buffers with io_uring: %s", strerror (errno));
+                free (ring_buffers);
+                ring_buffers = NULL;
+        } else {
+                for (int i = 0; i < CAPTURE_RING_BUFFERS; i++)
+                        free_buffers[i] = CAPTURE_RING_BUFFERS - 1 - i;
+
+                free_buffer_count = CAPTURE_RING_BUFFERS;
+        }
+
+        log_info ("capturing output with io_uring");
+}
+
+void capture_init ()
+{
+        capture_epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+
+        control_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        if (capture_epoll_fd < 0 || control_fd < 0) {
+                perror ("capture_init");
+                fatal_error ();
+        }
+
+        setup_ring ();
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        epoll_ctl (capture_epoll_fd, EPOLL_CTL_ADD, control_fd, &ev);
+
+        if (pthread_create (&capture_thread, NULL, capture_thread_main, NULL) != 0) {
+                perror ("pthread_create");
+                fatal_error ();
+        }
+}
+
+/**
+ * Stops the capture thread once it has written out everything it has read.
+ */
+void capture_stop ()
+{
+        uint64_t one = 1;
+
+        if (control_fd < 0)
+                return;
+
+        pthread_mutex_lock (&control_lock);
+        stop_requested = true;
+        pthread_mutex_unlock (&control_lock);
+
+        if (write (control_fd, &one, sizeof (one)) < 0)
+                log_error ("failed to stop capture thread: %s", strerror (errno));
+
+        pthread_join (capture_thread, NULL);
+        close (control_fd);
+        control_fd = -1;
+}
+
+/**
+ * Queues a request for the capture thread and wakes it up, neither waits on
+ * the thread. Returns false with errno set if the thread is not running.
+ */
+static bool send_request (capture_request *request)
+{
+        uint64_t one = 1;
+
+        request->next = NULL;
+        pthread_mutex_lock (&control_lock);
+
+        if (control_fd < 0 || stop_requested) {
+                pthread_mutex_unlock (&control_lock);
+                errno = EPIPE;
+                return false;
+        }
+
+        if (control_tail)
+                control_tail->next = request;
+        else
+                control_head = request;
+
+        control_tail = request;
+        pthread_mutex_unlock (&control_lock);
+
+        // the counter only overflows after 2^64 - 2 wakeups, the write cannot
+        // block
+        if (write (control_fd, &one, sizeof (one)) < 0)
+                log_error ("failed to wake capture thread: %s", strerror (errno));
+
+        return true;
+}
+
+/**
+ * Copies what the capture thread has moved so far and the system calls it
+ * took, only exact once capture_stop has returned.
+ */
+void capture_stats (pm_capture_stats *out)
+{
+        *out = stats;
+}
+
+/**
+ * Hands the read end of a pipe to the capture thread, which appends what it
+ * reads to the file open as file_fd. Returns false with errno set if the
+ * thread could not be reached, the descriptors are closed then.
+ */
+static bool hand_over_stream (int pipe_fd, int file_fd, char *path, bool timestamps, pm_rotation_policy *rotation)
+{
+        capture_request *request = malloc_nofail (sizeof (capture_request) + strlen (path) + 1);
+
+        request->pipe_fd = pipe_fd;
+        request->file_fd = file_fd;
+        request->timestamps = timestamps;
+        request->rotation = *rotation;
+        request->socket_fd = -1;
+        strcpy (request->path, path);
+
+        // the holder keeps the pipe readable should the daemon die
+        holder_hold (pipe_fd);
+
+        if (!send_request (request)) {
+                int err = errno;
+
+                log_error ("failed to hand output of %s to capture thread: %s", path, strerror (err));
+                close (pipe_fd);
+                close (file_fd);
+                free (request);
+                errno = err;
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Opens a pipe whose output is appended to the file at path, rotating the
+ * file as the policy says. On success the write end is returned, ready to
+ * become a child's stdout or stderr, and the read end belongs to the capture
+ * thread. Returns -1 with errno set if the file or the pipe could not be
+ * opened.
+ */
+int capture_open (char *path, bool timestamps, pm_rotation_policy *rotation)
+{
+        int file_fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+
+        if (file_fd < 0)
+                return -1;
+
+        int fds[2];
+
+        if (pipe2 (fds, O_CLOEXEC) < 0) {
+                int err = errno;
+                close (file_fd);
+                errno = err;
+                return -1;
+        }
+
+        fcntl (fds[0], F_SETFL, O_NONBLOCK);
+        fcntl (fds[1], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+
+        // a child writing to a pipe nobody reads would die of SIGPIPE
+        if (!hand_over_stream (fds[0], file_fd, path, timestamps, rotation)) {
+                int err = errno;
+                close (fds[1]);
+                errno = err;
+                return -1;
+        }
+
+        return fds[1];
+}
+
+/**
+ * Captures the output of an existing pipe, such as one a process adopted
+ * from an earlier daemon writes to, into the file at path. The capture
+ * thread owns pipe_fd from now on. Returns -1 with errno set if the file
+ * could not be opened.
+ */
+int capture_attach (int pipe_fd, char *path, bool timestamps, pm_rotation_policy *rotation)
+{
+        int file_fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+
+        if (file_fd < 0) {
+                int err = errno;
+                close (pipe_fd);
+                errno = err;
+                return -1;
+        }
+
+        fcntl (pipe_fd, F_SETFL, O_NONBLOCK);
+
+        return hand_over_stream (pipe_fd, file_fd, path, timestamps, rotation) ? 0 : -1;
+}
+
+/**
+ * Hands a client socket to the capture thread, which sends it the last lines
+ * of the log file open as log_fd, then with follow everything appended to the
+ * file at path, as responses to request id. Output queued for the client
+ * before is sent first. The capture thread owns both descriptors and the
+ * queued output from now on.
+ */
+void capture_follow (int socket_fd, int log_fd, uint32_t id, char *path, uint32_t lines, bool follow, pm_buffer *unsent)
+{
+        capture_request *request = malloc_nofail (sizeof (capture_request) + strlen (path) + 1);
+
+        *request = (capture_request) { .pipe_fd = -1,
+                                       .file_fd = log_fd,
+                                       .socket_fd = socket_fd,
+                                       .id = id,
+                                       .lines = lines,
+                                       .follow = follow,
+                                       .unsent = *unsent };
+        strcpy (request->path, path);
+
+        if (!send_request (request)) {
+                log_error ("failed to hand %s to capture thread: %s", path, strerror (errno));
+                close (socket_fd);
+                close (log_fd);
+                buffer_free (&request->unsent);
+                free (request);
+        }
+}
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * cgroup v2 placement
+ *
+ * With a delegated cgroup root configured, every process gets a cgroup of
+ * its own below a cgroup for its group:
+ *
+ *   <root>/<name>/<pid>
+ *
+ * Resource limits are set on the process's cgroup, and writing to its
+ * cgroup.kill takes down the process together with all of its descendants in
+ * a single write.
+ *
+ * posix_spawn cannot start a child inside a cgroup, the child is moved right
+ * after it was started. Anything it forks before that stays in the daemon's
+ * cgroup, in practice the child is still starting its program by then.
+ */
+
+extern pm_configuration config;
+
+static bool write_file (char *path, char *data)
+{
+        int fd = open (path, O_WRONLY | O_CLOEXEC);
+
+        if (fd < 0)
+                return false;
+
+        ssize_t n = write (fd, data, strlen (data));
+        int err = errno;
+
+        close (fd);
+        errno = err;
+
+        return n == (ssize_t)strlen (data);
+}
+
+static void enable_controllers (char *dir, bool warn)
+{
+        char path[PATH_MAX];
+        char *controllers[] = { "+cpu", "+memory", "+pids" };
+
+        snprintf (path, sizeof (path), "%s/cgroup.subtree_control", dir);
+
+        // one at a time, a missing controller must not keep the others off,
+        // only the root reports them, groups below it can't do better
+        for (size_t i = 0; i < sizeof (controllers) / sizeof (controllers[0]); i++)
+                if (!write_file (path, controllers[i]) && warn)
+                        log_warn ("cgroup controller %s is not available in %s: %s", controllers[i] + 1, dir, strerror (errno));
+}
+
+/**
+ * Checks the configured cgroup root and enables the controllers for the
+ * cgroups below it. Placement is turned off if the root is unusable.
+ */
+void cgroup_init ()
+{
+        if (!config.cgroup_root)
+                return;
+
+        char path[PATH_MAX];
+        snprintf (path, sizeof (path), "%s/cgroup.procs", config.cgroup_root);
+
+        if (access (path, W_OK) != 0) {
+                log_error ("%s is not a writable cgroup v2 directory, not using cgroups", config.cgroup_root);
+                config.cgroup_root = NULL;
+                return;
+        }
+
+        enable_controllers (config.cgroup_root, true);
+        log_info ("placing processes in cgroups below %s", config.cgroup_root);
+}
+
+/**
+ * Copies a process name into dst as a valid cgroup name. Slashes would
+ * leave the root and a leading dot could name the parent, both are replaced.
+ */
+static void cgroup_name (char *dst, char *name)
+{
+        size_t i = 0;
+
+        for (; name[i] && i < PM_NAME_MAX - 1; i++)
+                dst[i] = name[i] == '/' || (i == 0 && name[i] == '.') ? '_' : name[i];
+
+        dst[i] = '\0';
+}
+
+static void group_path (char *path, size_t size, char *name)
+{
+        char safe[PM_NAME_MAX];
+        cgroup_name (safe, name);
+
+        snprintf (path, size, "%s/%s", config.cgroup_root, safe);
+}
+
+static void process_path (char *path, size_t size, char *name, pid_t pid)
+{
+        char safe[PM_NAME_MAX];
+        cgroup_name (safe, name);
+
+        snprintf (path, size, "%s/%s/%d", config.cgroup_root, safe, pid);
+}
+
+static void write_limit (char *dir, char *file, char *value)
+{
+        char path[PATH_MAX];
+        snprintf (path, sizeof (path), "%s/%s", dir, file);
+
+        if (!write_file (path, value))
+                log_warn ("failed to set %s to %s: %s", path, value, strerror (errno));
+}
+
+/**
+ * Moves a freshly started process into a cgroup of its own and applies its
+ * resource limits. Failing to do so is logged, the process keeps running
+ * either way.
+ */
+void cgroup_attach (pm_process *process)
+{
+        if (!config.cgroup_root)
+                return;
+
+        char group[PATH_MAX], leaf[PATH_MAX], value[64];
+
+        group_path (group, sizeof (group), process->name);
+
+        if (mkdir (group, 0755) == 0)
+                enable_controllers (group, false);
+        else if (errno != EEXIST) {
+                log_warn ("failed to create cgroup %s: %s", group, strerror (errno));
+                return;
+        }
+
+        process_path (leaf, sizeof (leaf), process->name, process->pid);
+
+        if (mkdir (leaf, 0755) < 0 && errno != EEXIST) {
+                log_warn ("failed to create cgroup %s: %s", leaf, strerror (errno));
+                return;
+        }
+
+        pm_resource_limits *limits = &process->limits;
+
+        if (limits->cpu_percent > 0) {
+                // quota per 100 ms period
+                snprintf (value, sizeof (value), "%u 100000", limits->cpu_percent * 1000);
+                write_limit (leaf, "cpu.max", value);
+        }
+
+        if (limits->memory_max > 0) {
+                snprintf (value, sizeof (value), "%llu", (unsigned long long)limits->memory_max);
+                write_limit (leaf, "memory.max", value);
+        }
+
+        if (limits->pids_max > 0) {
+                snprintf (value, sizeof (value), "%u", limits->pids_max);
+                write_limit (leaf, "pids.max", value);
+        }
+
+        snprintf (value, sizeof (value), "%d", process->pid);
+        write_limit (leaf, "cgroup.procs", value);
+}
+
+/**
+ * Removes the cgroup of a process that has exited, and the cgroup of its
+ * group once that was its last process. A cgroup still holding descendants
+ * of the process is left in place, and so is its group's. The group's cgroup
+ * is made again when the group starts another process.
+ */
+void cgroup_release (pm_process *process)
+{
+        if (!config.cgroup_root || process->pid <= 0)
+                return;
+
+        char group[PATH_MAX], leaf[PATH_MAX];
+        process_path (leaf, sizeof (leaf), process->name, process->pid);
+
+        if (rmdir (leaf) < 0 && errno != ENOENT) {
+                log_warn ("failed to remove cgroup %s: %s", leaf, strerror (errno));
+                return;
+        }
+
+        group_path (group, sizeof (group), process->name);
+
+        // busy while other processes of the group have their cgroups in it
+        if (rmdir (group) < 0 && errno != ENOENT && errno != EBUSY && errno != ENOTEMPTY)
+                log_warn ("failed to remove cgroup %s: %s", group, strerror (errno));
+}
+
+static bool kill_cgroup (char *dir)
+{
+        char path[PATH_MAX];
+        snprintf (path, sizeof (path), "%s/cgroup.kill", dir);
+
+        return write_file (path, "1");
+}
+
+/**
+ * SIGKILLs a process and everything it started, even descendants that left
+ * its process group. Returns false if the process has no cgroup to kill.
+ */
+bool cgroup_kill (pm_process *process)
+{
+        if (!config.cgroup_root || process->pid <= 0)
+                return false;
+
+        char leaf[PATH_MAX];
+        process_path (leaf, sizeof (leaf), process->name, process->pid);
+
+        return kill_cgroup (leaf);
+}
+
+/**
+ * Reads the memory in use and the CPU time consumed by a process and its
+ * descendants. Returns false if the process has no cgroup.
+ */
+bool cgroup_read_usage (pm_process *process, uint64_t *memory_bytes, uint64_t *cpu_usec)
+{
+        if (!config.cgroup_root || process->pid <= 0)
+                return false;
+
+        char leaf[PATH_MAX], path[PATH_MAX + 32], buf[512];
+        process_path (leaf, sizeof (leaf), process->name, process->pid);
+
+        *memory_bytes = 0;
+        *cpu_usec = 0;
+
+        snprintf (path, sizeof (path), "%s/memory.current", leaf);
+        FILE *f = fopen (path, "re");
+
+        if (f) {
+                if (fscanf (f, "%llu", (unsigned long long *)memory_bytes) != 1)
+                        *memory_bytes = 0;
+
+                fclose (f);
+        }
+
+        snprintf (path, sizeof (path), "%s/cpu.stat", leaf);
+        f = fopen (path, "re");
+
+        if (!f)
+                return false;
+
+        while (fgets (buf, sizeof (buf), f))
+                if (sscanf (buf, "usage_usec %llu", (unsigned long long *)cpu_usec) == 1)
+                        break;
+
+        fclose (f);
+
+        return true;
+}
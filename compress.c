@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * Compression of rotated log segments
+ *
+ * The capture thread only renames a full log file out of the way, turning it
+ * into a segment, and queues it here. A background thread running at the
+ * lowest CPU and I/O priority gzips the segment and then prunes old segments
+ * so that at most the configured number of them are kept.
+ */
+
+#define COMPRESS_CHUNK (64 * 1024)
+
+// ioprio_set is not wrapped by glibc
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+typedef struct compress_job compress_job;
+
+typedef struct compress_job {
+        compress_job *next;
+        char *segment;
+        char *log_file;
+        uint32_t keep;
+} compress_job;
+
+static pthread_t compress_thread;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static compress_job *queue_head;
+static compress_job *queue_tail;
+static bool running;
+static bool stopping;
+
+static bool compress_segment (char *segment)
+{
+        char tmp[PATH_MAX], gz[PATH_MAX];
+
+        snprintf (gz, sizeof (gz), "%s.gz", segment);
+        snprintf (tmp, sizeof (tmp), "%s.gz.tmp", segment);
+
+        int in = open (segment, O_RDONLY | O_CLOEXEC);
+
+        if (in < 0) {
+                log_warn ("failed to open log segment %s: %s", segment, strerror (errno));
+                return false;
+        }
+
+        gzFile out = gzopen (tmp, "wbe6");
+
+        if (!out) {
+                log_warn ("failed to create %s: %s", tmp, strerror (errno));
+                close (in);
+                return false;
+        }
+
+        char *chunk = malloc_nofail (COMPRESS_CHUNK);
+        bool ok = true;
+        ssize_t n;
+
+        while ((n = read (in, chunk, COMPRESS_CHUNK)) != 0) {
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0 || gzwrite (out, chunk, n) != n) {
+                        ok = false;
+                        break;
+                }
+        }
+
+        free (chunk);
+        close (in);
+
+        if (gzclose (out) != Z_OK)
+                ok = false;
+
+        // only replace the segment once its compressed copy is complete
+        if (!ok || rename (tmp, gz) < 0) {
+                log_warn ("failed to compress log segment %s", segment);
+                unlink (tmp);
+                return false;
+        }
+
+        unlink (segment);
+
+        return true;
+}
+
+/**
+ * Returns the number a segment rotated more than once within a second got
+ * after its time, 0 for the first one. suffix starts at the segment's dot.
+ */
+static unsigned long segment_number (char *suffix)
+{
+        return suffix[16] == '-' ? strtoul (suffix + 17, NULL, 10) : 0;
+}
+
+// segment names of one log file compared by time, then by their number,
+// which is compared as a number so -10 comes after -9
+static int compare_names (const void *a, const void *b)
+{
+        char *x = strrchr (*(char **)a, '.'), *y = strrchr (*(char **)b, '.');
+
+        // the dot of a .gz suffix, the one before it starts the time
+        if (strcmp (x, ".gz") == 0)
+                x = memrchr (*(char **)a, '.', x - *(char **)a);
+
+        if (strcmp (y, ".gz") == 0)
+                y = memrchr (*(char **)b, '.', y - *(char **)b);
+
+        int cmp = strncmp (x, y, 16);
+
+        if (cmp)
+                return cmp;
+
+        unsigned long x_number = segment_number (x), y_number = segment_number (y);
+
+        return (x_number > y_number) - (x_number < y_number);
+}
+
+/**
+ * Deletes the oldest segments of a log file until at most keep are left.
+ * Segment names carry the time they were rotated, sorting them by name sorts
+ * them by age.
+ */
+static void prune_segments (char *log_file, uint32_t keep)
+{
+        char dir[PATH_MAX];
+        char *slash = strrchr (log_file, '/');
+        char *base = slash ? slash + 1 : log_file;
+
+        if (slash)
+                snprintf (dir, sizeof (dir), "%.*s", (int)(slash - log_file), log_file);
+        else
+                strcpy (dir, ".");
+
+        if (dir[0] == '\0')
+                strcpy (dir, "/");
+
+        DIR *d = opendir (dir);
+
+        if (!d)
+                return;
+
+        size_t base_len = strlen (base);
+        char **names = NULL;
+        size_t count = 0, cap = 0;
+        struct dirent *entry;
+
+        while ((entry = readdir (d)) != NULL) {
+                if (strncmp (entry->d_name, base, base_len) != 0 || !is_log_segment_suffix (entry->d_name + base_len))
+                        continue;
+
+                if (count == cap) {
+                        cap = cap ? cap * 2 : 16;
+                        names = realloc_nofail (names, cap * sizeof (char *));
+                }
+
+                names[count++] = strdup (entry->d_name);
+        }
+
+        closedir (d);
+
+        qsort (names, count, sizeof (char *), compare_names);
+
+        for (size_t i = 0; i < count; i++) {
+                if (i + keep < count) {
+                        char path[PATH_MAX + NAME_MAX + 2];
+                        snprintf (path, sizeof (path), "%s/%s", dir, names[i]);
+
+                        if (unlink (path) < 0 && errno != ENOENT)
+                                log_warn ("failed to remove old log segment %s: %s", path, strerror (errno));
+                }
+
+                free (names[i]);
+        }
+
+        free (names);
+}
+
+static void *compress_thread_main (void *arg)
+{
+        // this thread must never compete with the processes it serves
+        setpriority (PRIO_PROCESS, syscall (SYS_gettid), 19);
+        syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+        for (;;) {
+                pthread_mutex_lock (&queue_lock);
+
+                while (!queue_head && !stopping)
+                        pthread_cond_wait (&queue_ready, &queue_lock);
+
+                compress_job *job = queue_head;
+
+                if (job) {
+                        queue_head = job->next;
+
+                        if (!queue_head)
+                                queue_tail = NULL;
+                }
+
+                pthread_mutex_unlock (&queue_lock);
+
+                if (!job)
+                        return NULL;
+
+                compress_segment (job->segment);
+
+                if (job->keep > 0)
+                        prune_segments (job->log_file, job->keep);
+
+                free (job->segment);
+                free (job->log_file);
+                free (job);
+        }
+}
+
+void compress_init ()
+{
+        if (pthread_create (&compress_thread, NULL, compress_thread_main, NULL) != 0) {
+                perror ("pthread_create");
+                fatal_error ();
+        }
+
+        running = true;
+}
+
+/**
+ * Stops the compression thread once the segments already queued are done.
+ */
+void compress_stop ()
+{
+        if (!running)
+                return;
+
+        pthread_mutex_lock (&queue_lock);
+        stopping = true;
+        pthread_cond_signal (&queue_ready);
+        pthread_mutex_unlock (&queue_lock);
+
+        pthread_join (compress_thread, NULL);
+        running = false;
+}
+
+/**
+ * Queues a rotated segment of log_file for compression. Afterwards only the
+ * newest keep segments are kept, 0 keeps all of them.
+ */
+void compress_log_segment (char *segment, char *log_file, uint32_t keep)
+{
+        compress_job *job = malloc_nofail (sizeof (compress_job));
+
+        job->next = NULL;
+        job->segment = strdup (segment);
+        job->log_file = strdup (log_file);
+        job->keep = keep;
+
+        pthread_mutex_lock (&queue_lock);
+
+        if (queue_tail)
+                queue_tail->next = job;
+        else
+                queue_head = job;
+
+        queue_tail = job;
+
+        pthread_cond_signal (&queue_ready);
+        pthread_mutex_unlock (&queue_lock);
+}
+
+/**
+ * Returns whether suffix, the part of a file name after the log file's name,
+ * is that of a rotated segment: ".YYYYmmdd-HHMMSS", optionally followed by
+ * "-N" and ".gz".
+ */
+bool is_log_segment_suffix (char *suffix)
+{
+        if (*suffix++ != '.')
+                return false;
+
+        for (int i = 0; i < 15; i++, suffix++) {
+                if (i == 8 ? *suffix != '-' : (*suffix < '0' || *suffix > '9'))
+                        return false;
+        }
+
+        if (*suffix == '-') {
+                suffix++;
+
+                if (*suffix < '0' || *suffix > '9')
+                        return false;
+
+                while (*suffix >= '0' && *suffix <= '9')
+                        suffix++;
+        }
+
+        return *suffix == '\0' || strcmp (suffix, ".gz") == 0;
+}
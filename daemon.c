@@ -1,163 +1,590 @@
 #include "pm.h"
 #include <errno.h>
-#include <pthread.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 extern pm_configuration config;
 extern pm_identity process_identity;
 
+/**
+ * Reports a crash and dies of the signal. Only async signal safe calls are
+ * made, the flusher thread and the stdio buffers are left as they are.
+ */
 void handle_error (int sig)
 {
-        printf ("Program recieved signal %d", sig);
-        exit (sig);
+        char message[] = "Program recieved signal   \n";
+
+        message[24] = '0' + sig / 10 % 10;
+        message[25] = '0' + sig % 10;
+        write (STDERR_FILENO, message, sizeof (message) - 1);
+
+        signal (sig, SIG_DFL);
+        raise (sig);
+        _exit (128 + sig);
 }
 
-bool is_dead_child (pid_t pid)
+/**
+ * Returns an argument vector with room for at least count entries. The vector
+ * is shared by all commands and only grows, so parsing a command allocates
+ * nothing once the daemon has seen its largest one.
+ */
+static char **argv_scratch (size_t count)
 {
-        int status;
+        static char **argv = NULL;
+        static size_t capacity = 0;
 
-        if (waitpid (pid, &status, WNOHANG) == -1) {
-                log_error ("Failed to wait on child: %s", strerror (errno));
-                return false;
+        if (count > capacity) {
+                capacity = count < 64 ? 64 : count * 2;
+                argv = realloc_nofail (argv, capacity * sizeof (char *));
         }
 
-        return WIFEXITED (status) || WIFSIGNALED (status);
+        return argv;
 }
 
-void daemon_process (char *socket_file)
+/**
+ * Returns a pid array with room for at least count entries, shared by all
+ * commands like the argument vector.
+ */
+static pid_t *pid_scratch (size_t count)
 {
-        signal (SIGSEGV, handle_error);
+        static pid_t *pids = NULL;
+        static size_t capacity = 0;
 
-        log_info ("pm daemon is starting...");
-        int sock_fd = setup_unix_domain_server_socket (socket_file);
+        if (count > capacity) {
+                capacity = count < 64 ? 64 : count;
+                pids = realloc_nofail (pids, capacity * sizeof (pid_t));
+        }
 
-        log_info ("pm daemon spawning child monitor thread...");
-        pthread_t dead_child_monitor_thread = spawn_daemon_child_monitor_thread ();
+        return pids;
+}
 
-        log_info ("pm daemon initialized successfully!");
-        log_info ("now listening for requests...");
+void daemon_handle_command (pm_connection *conn, pm_cmd *cmd)
+{
+        switch (cmd->instruction) {
+        case NEW_PROCESS: {
+                log_info ("Recieved NEW_PROCESS command...");
+                // the command is parsed in place, the argument strings live in
+                // the connection buffer until the process record copies them
+                char *command = cmd->new_process.command;
+                size_t size = cmd->new_process.size;
+
+                if (size == 0 || command[size - 1] != '\0') {
+                        log_warn ("NEW_PROCESS command was not a null terminated argument list");
+                        send_error (conn, cmd->id, INVALID_COMMAND, "the command must be a null terminated argument list");
+                        break;
+                }
+
+                // count the number of arguments including program name
+                int args = 0;
+                for (size_t i = 0; i < size; i++)
+                        if (!command[i])
+                                args++;
+
+                char **argv = argv_scratch (args + 1);
+
+                int j = 0;
+                for (char *curr = command; j < args; curr += strlen (curr) + 1)
+                        argv[j++] = curr;
 
-        // daemon is entirely command based, it sits and waits for a command to
-        // be written to the socket before doing anything.
-        pm_cmd cmd;
-        for (;;) {
-                int conn_fd = accept (sock_fd, NULL, NULL);
+                argv[j] = NULL;
 
-                read_nofail (conn_fd, &cmd, sizeof (pm_cmd));
+                uint32_t instances = cmd->new_process.instances;
 
-                switch (cmd.instruction) {
-                case NEW_PROCESS: {
-                        log_info ("Recieved NEW_PROCESS command...");
-                        // setup process command line arguments
-                        char *command = malloc_nofail (cmd.new_process.size);
+                if (instances > PM_MAX_INSTANCES) {
+                        log_warn ("NEW_PROCESS asked for %u instances, at most %d are allowed", instances, PM_MAX_INSTANCES);
+                        send_error (conn, cmd->id, INVALID_COMMAND, "at most %d instances are allowed", PM_MAX_INSTANCES);
+                        break;
+                }
+
+                pm_process_options options = { .name = cmd->new_process.name[0] ? cmd->new_process.name : NULL,
+                                               .stdout_file = config.stdout_file,
+                                               .stderr_file = config.stderr_file,
+                                               .max_retries = config.max_retries,
+                                               .instance = -1,
+                                               .timestamps = cmd->new_process.flags & PM_RUN_TIMESTAMPS,
+                                               .rotation = cmd->new_process.flags & PM_RUN_LOG_ROTATION
+                                                                   ? cmd->new_process.rotation
+                                                                   : config.rotation,
+                                               .limits = cmd->new_process.limits,
+                                               .watchdog = cmd->new_process.watchdog };
+
+                memcpy (options.probes, cmd->new_process.probes, sizeof (options.probes));
+
+                if (cmd->new_process.listen[0])
+                        options.listen = cmd->new_process.listen;
+
+                if (cmd->new_process.placement[0] && !parse_placement_spec (cmd->new_process.placement)) {
+                        send_error (conn, cmd->id, INVALID_COMMAND, "invalid placement %s", cmd->new_process.placement);
+                        break;
+                }
 
-                        read_nofail (conn_fd, command, cmd.new_process.size);
+                if (cmd->new_process.placement[0])
+                        options.placement = cmd->new_process.placement;
 
-                        // count the number of arguments including program name
-                        int args = 0;
-                        for (size_t i = 0; i < cmd.new_process.size; i++)
-                                if (!command[i])
-                                        args++;
+                // spawn every instance before answering, the client gets all
+                // of the pids back in one response
+                pid_t *pids = pid_scratch (instances ? instances : 1);
+                uint32_t started = 0;
+                pm_code code = OK;
+                char message[256];
 
-                        char **argv = malloc_nofail ((args + 1) * sizeof (char *));
+                do {
+                        if (instances > 0)
+                                options.instance = started;
 
-                        int j = 0;
-                        char *curr = command;
-                        while (args > 0) {
-                                argv[j] = curr;
-                                while (*curr != '\0')
-                                        curr++;
+                        pid_t pid = new_process (argv, &options);
 
-                                curr++;
-                                args--;
-                                j++;
+                        if (pid < 0) {
+                                code = errno == ENOENT ? NO_SUCH_FILE_OR_DIRECTORY : SPAWN_FAILED;
+                                snprintf (message, sizeof (message), "failed to start %s: %s", argv[0], strerror (errno));
+                                break;
                         }
 
-                        argv[j] = NULL;
+                        pids[started++] = pid;
+                } while (started < instances);
+
+                for (size_t i = 0; i < size - 1; i++)
+                        if (!command[i])
+                                command[i] = ' ';
+
+                if (started == 1)
+                        log_info ("New process with pid %d was added: %s", pids[0], command);
+                else if (started > 1)
+                        log_info ("%u new processes with pids %d-%d were added: %s",
+                                  started,
+                                  pids[0],
+                                  pids[started - 1],
+                                  command);
+
+                // a failure names its cause, followed by the pids of the
+                // instances started before it
+                static pm_buffer response = { 0 };
+
+                buffer_clear (&response);
 
-                        // spawn the new process
-                        pid_t pid = new_process (argv[0], argv, config.stdout_file, config.max_retries);
+                if (code != OK)
+                        buffer_put_string (&response, message);
 
-                        for (int i = 0; i < cmd.new_process.size - 1; i++)
-                                if (!command[i])
-                                        command[i] = ' ';
+                buffer_put_u32 (&response, started);
 
-                        log_info ("New process with pid %d was added: %s", pid, command);
+                for (uint32_t i = 0; i < started; i++)
+                        buffer_put_u32 (&response, pids[i]);
 
-                        free (argv);
-                        free (command);
-                        send_response (conn_fd, OK);
+                send_response_data (conn, cmd->id, code, response.data, response.len);
+                break;
+        }
+        case SIGNAL_PROCESS: {
+                log_info ("Received SIGNAL command");
+
+                pm_process *process = find_process_with_pid (cmd->signal_process.pid);
+
+                if (!process) {
+                        log_warn ("Could not find process with pid %d", cmd->signal_process.pid);
+                        send_error (conn, cmd->id, NO_SUCH_PID, "no process with pid %d", cmd->signal_process.pid);
                         break;
                 }
-                case SIGNAL_PROCESS: {
-                        lock_process_list ();
-                        log_info ("Received SIGNAL command");
 
-                        pm_process *process = find_process_with_pid (cmd.signal_process.pid);
+                // killing the cgroup takes the whole process tree down
+                if (cmd->signal_process.signal == SIGKILL && cgroup_kill (process)) {
+                        send_response (conn, cmd->id, OK);
+                        break;
+                }
 
-                        if (!process) {
-                                log_warn ("Could not find process with pid %d", cmd.signal_process.pid);
-                                unlock_process_list ();
-                                continue;
-                        }
+                if (kill (process->pid, cmd->signal_process.signal) < 0) {
+                        send_error (conn, cmd->id, INVALID_COMMAND, "failed to signal pid %d: %s", process->pid, strerror (errno));
+                        break;
+                }
 
-                        if (kill (process->pid, cmd.signal_process.signal) < 0) {
-                                perror ("kill");
-                                exit (EXIT_FAILURE);
-                        }
+                send_response (conn, cmd->id, OK);
 
-                        unlock_process_list ();
+                break;
+        }
+        case LIST_PROCESS: {
+                pm_buffer *snapshot = snapshot_process_table ();
+
+                send_response_data (conn, cmd->id, OK, snapshot->data, snapshot->len);
+                break;
+        }
+        case STATS: {
+                static pm_buffer stats = { 0 };
+
+                encode_stats (&stats);
+                send_response_data (conn, cmd->id, OK, stats.data, stats.len);
+                break;
+        }
+        case SUBSCRIBE: {
+                log_info ("Client subscribed to events");
 
+                events_subscribe (conn, cmd->id);
+                break;
+        }
+        case LOGS: {
+                char *target = cmd->logs.target;
+                char *end;
+                unsigned long id = strtoul (target, &end, 10);
+
+                // a number is an id from the listing, anything else a name
+                pm_process *process = *target && !*end ? find_process_with_id (id) : find_processes_with_name (target);
+
+                if (!process) {
+                        send_error (conn, cmd->id, NO_SUCH_PID, "no process with name or id %s", target);
                         break;
                 }
-                case LIST_PROCESS: {
-                        lock_process_list ();
 
-                        unlock_process_list ();
+                bool stderr_log = cmd->logs.flags & PM_LOGS_STDERR;
+                char *path = stderr_log ? process->stderr_file : process->stdout_file;
 
+                if (!path) {
+                        send_error (conn, cmd->id, NO_SUCH_FILE_OR_DIRECTORY, "%s of %s goes to the daemon's output, not to a file",
+                                    stderr_log ? "stderr" : "stdout",
+                                    process->name);
                         break;
                 }
-                case SET_AUTORESTART_TRIES: {
-                        config.max_retries = cmd.autorestart.max_retries;
+
+                int log_fd = open (path, O_RDONLY | O_CLOEXEC);
+
+                if (log_fd < 0) {
+                        send_error (conn, cmd->id, NO_SUCH_FILE_OR_DIRECTORY, "failed to open %s: %s", path, strerror (errno));
+                        break;
                 }
-                case SHUTDOWN: {
-                        log_info ("User issued SHUTDOWN command. Shutting down pm daemon...");
 
-                        log_info ("Stopping monitor thread...");
-                        stop_child_monitor_thread (dead_child_monitor_thread);
+                log_info ("Streaming %s to a client...", path);
 
-                        for (pm_process *proc = config.process_list; proc != NULL; proc = proc->next) {
-                                log_info ("Sending SIGTERM (15) to child with pid %d...", proc->pid);
+                // the log data follows this response, sent by the capture
+                // thread which owns the connection from now on
+                send_response (conn, cmd->id, OK);
 
-                                kill (proc->pid, SIGTERM);
-                        }
+                pm_buffer unsent = { 0 };
+                int socket_fd = connection_release_socket (conn, &unsent);
 
-                        signal (SIGCHLD, SIG_IGN);
+                capture_follow (socket_fd, log_fd, cmd->id, path, cmd->logs.lines, cmd->logs.flags & PM_LOGS_FOLLOW, &unsent);
+                break;
+        }
+        case SET_STDOUT:
+        case SET_STDERR: {
+                char *path = cmd->set_file.path;
+                size_t size = cmd->set_file.size;
 
-                        for (pm_process *proc = config.process_list; proc != NULL; proc = proc->next) {
-                                if (!is_dead_child (proc->pid)) {
-                                        log_info (
-                                                "Child (pid: %d) did not exit within 1 second of SIGINT. Sending SIGKILL...",
-                                                proc->pid);
+                if (size > 0 && path[size - 1] != '\0') {
+                        send_response (conn, cmd->id, INVALID_COMMAND);
+                        break;
+                }
 
-                                        kill (proc->pid, SIGKILL);
-                                }
-                        }
+                if (size == 0)
+                        path = NULL;
+
+                if (cmd->instruction == SET_STDOUT)
+                        set_stdout (path);
+                else
+                        set_stderr (path);
+
+                log_info ("%s of new processes now goes to %s",
+                          cmd->instruction == SET_STDOUT ? "stdout" : "stderr",
+                          path && *path ? path : "the daemon's output");
+
+                journal_settings ();
+                send_response (conn, cmd->id, OK);
+                break;
+        }
+        case SET_LOG_ROTATION: {
+                pm_rotation_policy *policy = &cmd->log_rotation.policy;
 
-                        log_info ("Closing connections...");
+                // only processes started from now on follow the new policy
+                config.rotation = *policy;
+
+                log_info ("Log files of new processes now rotate at %llu bytes or %u seconds, keeping %u",
+                          (unsigned long long)policy->max_size,
+                          policy->max_age,
+                          policy->keep);
+
+                journal_settings ();
+                send_response (conn, cmd->id, OK);
+                break;
+        }
+        case SET_AUTORESTART_TRIES: {
+                config.max_retries = cmd->autorestart.max_retries;
+                journal_settings ();
+                send_response (conn, cmd->id, OK);
+                break;
+        }
+        case SHUTDOWN: {
+                log_info ("User issued SHUTDOWN command. Shutting down pm daemon...");
 
-                        close (conn_fd);
-                        close (sock_fd);
+                log_info ("Stopping child monitor...");
+                monitor_stop ();
 
-                        return;
+                stop_all_processes (cmd->shutdown.grace_ms ? cmd->shutdown.grace_ms : PM_SHUTDOWN_GRACE_MS);
+
+                // nothing is left for a later daemon to adopt
+                journal_close (true);
+                holder_stop ();
+
+                // the client learns that every process is gone
+                send_response (conn, cmd->id, OK);
+                config.shutdown = true;
+                break;
+        }
+        case UPGRADE: {
+                char *path = cmd->upgrade.path;
+                size_t size = cmd->upgrade.size;
+
+                if (size == 0 || path[size - 1] != '\0') {
+                        send_response (conn, cmd->id, INVALID_COMMAND);
+                        break;
+                }
+
+                if (access (path, X_OK) < 0) {
+                        send_error (conn, cmd->id, NO_SUCH_FILE_OR_DIRECTORY, "cannot run %s: %s", path, strerror (errno));
+                        break;
+                }
+
+                log_info ("User issued UPGRADE command. Handing over to %s...", path);
+
+                // the event loop exits, daemon_process does the rest
+                free (config.upgrade_path);
+                config.upgrade_path = strdup (path);
+
+                send_response (conn, cmd->id, OK);
+                config.shutdown = true;
+                break;
+        }
+        case ZYGOTE: {
+                char *program = cmd->zygote.program;
+
+                if (!*program) {
+                        static pm_buffer zygotes = { 0 };
+
+                        encode_zygotes (&zygotes);
+                        send_response_data (conn, cmd->id, OK, zygotes.data, zygotes.len);
+                        break;
                 }
-                default: break;
+
+                pm_code code = zygote_register (program, cmd->zygote.pool_size);
+
+                if (code == NO_SUCH_FILE_OR_DIRECTORY) {
+                        send_error (conn, cmd->id, code, "%s was not found on the daemon's PATH", program);
+                        break;
+                } else if (code != OK) {
+                        send_error (conn, cmd->id, code, "no more than %d programs can have a zygote pool", PM_ZYGOTE_PROGRAMS);
+                        break;
                 }
+
+                if (cmd->zygote.pool_size > 0)
+                        log_info ("%s now starts through a pool of %u zygotes", program, cmd->zygote.pool_size);
+                else
+                        log_info ("%s no longer starts through zygotes", program);
+
+                journal_settings ();
+                send_response (conn, cmd->id, OK);
+                break;
+        }
+        case ROLLING_RESTART: {
+                log_info ("Received ROLLING_RESTART command for %s", cmd->rolling_restart.name);
+
+                // answered once the restart is over
+                rollout_start (conn, cmd);
+                break;
+        }
+        case APPLY: {
+                log_info ("Received APPLY command...");
+
+                // answered once every group is up or failed
+                apply_start (conn, cmd);
+                break;
+        }
+        default: send_response (conn, cmd->id, INVALID_COMMAND); break;
+        }
+}
+
+// closes every descriptor of a comma separated list
+static void close_fd_list (char *list)
+{
+        char *end;
+
+        for (char *fd = list; *fd; fd = *end == ',' ? end + 1 : end) {
+                long number = strtol (fd, &end, 10);
+
+                if (end == fd)
+                        break;
+
+                close (number);
+        }
+}
+
+/**
+ * Opens an extra read end of the capture pipe a process has as its
+ * descriptor fd, one that is kept across exec, and adds it to the list.
+ */
+static void hold_output_pipe (pm_process *process, int fd, uint64_t pipe, pm_buffer *list)
+{
+        int pipe_fd = open_output_pipe (process, fd, pipe, 0);
+        char number[16];
+
+        if (pipe_fd < 0)
+                return;
+
+        snprintf (number, sizeof (number), "%s%d", list->len > 0 ? "," : "", pipe_fd);
+        buffer_put_bytes (list, number, strlen (number));
+}
+
+/**
+ * Replaces the daemon with the program at config.upgrade_path. The pid stays
+ * the same, so every child stays a child, and the listening socket is passed
+ * on. The new program adopts the processes from the journal.
+ *
+ * No capture pipe may be left without a reader while the program is
+ * replaced, a child writing to it would see a broken pipe. Every pipe gets
+ * another read end that is kept across exec, the new program closes them
+ * once it reads the pipes itself. Returns only if the program could not be
+ * started, the processes are left running for a later daemon then.
+ */
+static void upgrade_daemon (int sock_fd)
+{
+        pm_buffer held = { 0 };
+        char listen_fd[16];
+
+        log_info ("Writing out captured output...");
+        capture_stop ();
+        compress_stop ();
+        journal_close (false);
+
+        for (pm_process *p = config.processes.head; p != NULL; p = p->next) {
+                if (p->pid <= 0)
+                        continue;
+
+                hold_output_pipe (p, STDOUT_FILENO, p->stdout_pipe, &held);
+
+                if (p->stderr_pipe != p->stdout_pipe)
+                        hold_output_pipe (p, STDERR_FILENO, p->stderr_pipe, &held);
         }
+
+        buffer_put_u8 (&held, '\0');
+        snprintf (listen_fd, sizeof (listen_fd), "%d", sock_fd);
+
+        setenv ("PM_UPGRADE_LISTEN_FD", listen_fd, 1);
+        setenv ("PM_UPGRADE_PIPE_FDS", held.data, 1);
+        fcntl (sock_fd, F_SETFD, 0);
+        holder_pass_on ();
+
+        log_info ("Starting %s...", config.upgrade_path);
+        log_stop ();
+
+        execv (config.upgrade_path, config.argv);
+
+        log_error ("failed to start %s: %s, leaving the processes to the next daemon", config.upgrade_path, strerror (errno));
+
+        unsetenv ("PM_UPGRADE_LISTEN_FD");
+        unsetenv ("PM_UPGRADE_PIPE_FDS");
+        fcntl (sock_fd, F_SETFD, FD_CLOEXEC);
+        holder_take_back ();
+
+        close_fd_list (held.data);
+        buffer_free (&held);
+}
+
+/**
+ * Takes over the listening socket of the daemon that upgraded to this
+ * program, or returns -1 if this daemon was started afresh.
+ */
+static int inherit_listen_socket (char **held_pipes)
+{
+        char *listen_fd = getenv ("PM_UPGRADE_LISTEN_FD");
+        char *pipe_fds = getenv ("PM_UPGRADE_PIPE_FDS");
+
+        *held_pipes = pipe_fds ? strdup (pipe_fds) : NULL;
+
+        if (!listen_fd)
+                return -1;
+
+        int sock_fd = atoi (listen_fd);
+
+        // processes started from now on must not see any of this
+        unsetenv ("PM_UPGRADE_LISTEN_FD");
+        unsetenv ("PM_UPGRADE_PIPE_FDS");
+        fcntl (sock_fd, F_SETFD, FD_CLOEXEC);
+
+        return sock_fd;
+}
+
+void daemon_process (char *socket_file)
+{
+        signal (SIGSEGV, handle_error);
+
+        log_init ();
+        log_info ("pm daemon is starting...");
+
+        // every child costs the daemon a few descriptors, allow as many as
+        // the system lets us have
+        struct rlimit limit;
+
+        if (getrlimit (RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+                limit.rlim_cur = limit.rlim_max;
+                setrlimit (RLIMIT_NOFILE, &limit);
+        }
+        event_loop_init ();
+
+        char *held_pipes;
+        int sock_fd = inherit_listen_socket (&held_pipes);
+
+        if (sock_fd >= 0)
+                log_info ("pm daemon was upgraded, taking over from the previous program...");
+        else
+                sock_fd = setup_unix_domain_server_socket (socket_file);
+
+        cgroup_init ();
+        affinity_init ();
+
+        log_info ("pm daemon setting up child monitor...");
+        monitor_init ();
+        timer_init ();
+        events_init ();
+        sampler_init ();
+
+        log_info ("pm daemon starting output capture...");
+        compress_init ();
+        capture_init ();
+
+        holder_start ();
+        journal_open ();
+        holder_dismiss ();
+
+        // the pipes are read by this program now
+        if (held_pipes)
+                close_fd_list (held_pipes);
+
+        free (held_pipes);
+
+        log_info ("pm daemon initialized successfully!");
+        log_info ("now listening for requests...");
+
+        // daemon is entirely event driven, it sits in the event loop and
+        // serves every client connection as its commands arrive.
+        pm_watch listen_watch;
+        watch_listen_socket (&listen_watch, sock_fd);
+
+        run_event_loop ();
+
+        zygote_stop ();
+
+        if (config.upgrade_path)
+                upgrade_daemon (sock_fd);
+
+        journal_close (false);
+
+        log_info ("Writing out captured output...");
+        capture_stop ();
+        compress_stop ();
+
+        log_info ("Closing connections...");
+
+        close (sock_fd);
+        close (config.epoll_fd);
 }
 
 void spawn_daemon_process ()
@@ -167,12 +594,14 @@ void spawn_daemon_process ()
                 exit (EXIT_FAILURE);
         }
 
-        pid_t pid = fork ();
+        // a daemon that upgraded to this program keeps its pid
+        pid_t pid = getenv ("PM_UPGRADE_LISTEN_FD") ? 0 : fork ();
         if (pid == 0) {
                 process_identity = DAEMON;
                 daemon_process (config.socket_file);
                 unlink (config.socket_file);
                 log_info ("pm daemon shutdown successful!");
+                log_stop ();
                 exit (EXIT_SUCCESS);
         } else if (pid > 0) {
                 return;
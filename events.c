@@ -0,0 +1,317 @@
+#include "pm.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Lifecycle events
+ *
+ * Events are published into a ring of the last PM_EVENT_RING events, from
+ * the event loop and from the capture thread. Publishing never waits on a
+ * subscriber: every subscriber has a cursor into the ring, and one that falls
+ * more than a ring behind skips ahead and is told how many events it missed.
+ *
+ * Subscribers are connections that sent SUBSCRIBE. The event loop pushes new
+ * events to them as responses to that request, but only while a subscriber
+ * has less than EVENT_MAX_BACKLOG bytes waiting to be sent. The rest wait in
+ * the ring until it catches up.
+ */
+
+#define EVENT_MAX_BACKLOG (256 * 1024)
+
+extern pm_configuration config;
+
+// the ring is shared with the capture thread
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pm_event ring[PM_EVENT_RING];
+static uint64_t ring_head;
+
+static pm_watch wake_watch = { .fd = -1 };
+static pm_connection *subscribers;
+
+static uint64_t realtime_ms ()
+{
+        struct timespec now;
+        clock_gettime (CLOCK_REALTIME, &now);
+
+        return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Publishes an event about a process, or about no process in particular if
+ * process is NULL. Safe to call from any thread of the daemon.
+ */
+void publish_event (pm_event_type type, pm_process *process, uint64_t value, char *detail)
+{
+        if (wake_watch.fd < 0)
+                return;
+
+        pm_event event = { .time_ms = realtime_ms (), .type = type, .value = value };
+
+        if (process) {
+                event.handle = process->handle;
+                event.pid = process->pid;
+                event.status = type == EVENT_EXITED ? process->exit_status : 0;
+                event.restarts = process->restarts;
+                snprintf (event.name, sizeof (event.name), "%s", process->name);
+        }
+
+        if (detail)
+                snprintf (event.detail, sizeof (event.detail), "%s", detail);
+
+        pthread_mutex_lock (&ring_lock);
+        event.seq = ring_head;
+        ring[ring_head++ % PM_EVENT_RING] = event;
+        pthread_mutex_unlock (&ring_lock);
+
+        uint64_t one = 1;
+        write (wake_watch.fd, &one, sizeof (one));
+}
+
+static void encode_event (pm_buffer *buf, pm_event *event)
+{
+        buffer_put_u64 (buf, event->seq);
+        buffer_put_u64 (buf, event->time_ms);
+        buffer_put_u8 (buf, event->type);
+        buffer_put_u64 (buf, event->handle);
+        buffer_put_u32 (buf, event->pid);
+        buffer_put_u32 (buf, event->status);
+        buffer_put_u32 (buf, event->restarts);
+        buffer_put_u64 (buf, event->value);
+        buffer_put_string (buf, event->name);
+        buffer_put_string (buf, event->detail);
+}
+
+/**
+ * Copies the subscriber's next event out of the ring. Returns false if it
+ * has seen every event. A subscriber that was overrun gets an EVENT_DROPPED
+ * counting the events it missed instead.
+ */
+static bool next_event (pm_connection *conn, pm_event *event)
+{
+        pthread_mutex_lock (&ring_lock);
+
+        bool found = conn->event_cursor < ring_head;
+
+        if (found && ring_head - conn->event_cursor > PM_EVENT_RING) {
+                uint64_t oldest = ring_head - PM_EVENT_RING;
+
+                *event = (pm_event) { .seq = oldest, .time_ms = realtime_ms (), .type = EVENT_DROPPED, .value = oldest - conn->event_cursor };
+                conn->event_cursor = oldest;
+        } else if (found) {
+                *event = ring[conn->event_cursor++ % PM_EVENT_RING];
+        }
+
+        pthread_mutex_unlock (&ring_lock);
+
+        return found;
+}
+
+/**
+ * Queues the events the subscriber has not seen yet, as far as its backlog
+ * allows. Returns false if the connection was closed.
+ */
+bool events_deliver (pm_connection *conn)
+{
+        static pm_buffer body = { 0 };
+        pm_event event;
+
+        while (conn->out_len - conn->out_off < EVENT_MAX_BACKLOG && next_event (conn, &event)) {
+                buffer_clear (&body);
+                encode_event (&body, &event);
+                send_response_data (conn, conn->subscription_id, OK, body.data, body.len);
+        }
+
+        return connection_flush (conn);
+}
+
+static void handle_wake_event (pm_watch *watch, uint32_t events)
+{
+        uint64_t count;
+
+        if (read (watch->fd, &count, sizeof (count)) != sizeof (count))
+                return;
+
+        // delivering may close a connection and unlink it
+        for (pm_connection *conn = subscribers, *next; conn != NULL; conn = next) {
+                next = conn->subscriber_next;
+                events_deliver (conn);
+        }
+}
+
+void events_init ()
+{
+        wake_watch.fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        wake_watch.callback = handle_wake_event;
+
+        if (wake_watch.fd < 0) {
+                perror ("eventfd");
+                fatal_error ();
+        }
+
+        watch_add (&wake_watch, EPOLLIN);
+}
+
+/**
+ * Turns a connection into a subscriber, it receives every event published
+ * from now on as a response to request id.
+ */
+void events_subscribe (pm_connection *conn, uint32_t id)
+{
+        if (conn->subscribed) {
+                send_error (conn, id, INVALID_COMMAND, "already subscribed with request %u", conn->subscription_id);
+                return;
+        }
+
+        pthread_mutex_lock (&ring_lock);
+        conn->event_cursor = ring_head;
+        pthread_mutex_unlock (&ring_lock);
+
+        conn->subscribed = true;
+        conn->subscription_id = id;
+        conn->subscriber_prev = NULL;
+        conn->subscriber_next = subscribers;
+
+        if (subscribers)
+                subscribers->subscriber_prev = conn;
+
+        subscribers = conn;
+
+        send_response (conn, id, OK);
+}
+
+void events_unsubscribe (pm_connection *conn)
+{
+        if (!conn->subscribed)
+                return;
+
+        if (conn->subscriber_prev)
+                conn->subscriber_prev->subscriber_next = conn->subscriber_next;
+        else
+                subscribers = conn->subscriber_next;
+
+        if (conn->subscriber_next)
+                conn->subscriber_next->subscriber_prev = conn->subscriber_prev;
+
+        conn->subscribed = false;
+}
+
+char *get_event_name (pm_event_type type)
+{
+        switch (type) {
+        case EVENT_STARTED: return "started";
+        case EVENT_EXITED: return "exited";
+        case EVENT_RESTART_SCHEDULED: return "restart_scheduled";
+        case EVENT_RESTARTED: return "restarted";
+        case EVENT_RETIRED: return "retired";
+        case EVENT_RECYCLED: return "recycled";
+        case EVENT_LOG_ROTATED: return "log_rotated";
+        case EVENT_DROPPED: return "dropped";
+        case EVENT_READY: return "ready";
+        case EVENT_UNREADY: return "unready";
+        case EVENT_UNHEALTHY: return "unhealthy";
+        default: return "unknown";
+        }
+}
+
+/**
+ * Prints an event pushed to a subscriber, as a line of text or as a line of
+ * JSON if --json was given.
+ */
+void print_event (char *data, size_t size)
+{
+        pm_reader reader = { .data = data, .len = size };
+        pm_event event;
+
+        event.seq = reader_get_u64 (&reader);
+        event.time_ms = reader_get_u64 (&reader);
+        event.type = reader_get_u8 (&reader);
+        event.handle = reader_get_u64 (&reader);
+        event.pid = reader_get_u32 (&reader);
+        event.status = reader_get_u32 (&reader);
+        event.restarts = reader_get_u32 (&reader);
+        event.value = reader_get_u64 (&reader);
+        reader_get_string (&reader, event.name, sizeof (event.name));
+        reader_get_string (&reader, event.detail, sizeof (event.detail));
+
+        if (reader.error) {
+                log_error ("event from daemon was truncated");
+                return;
+        }
+
+        if (config.json) {
+                printf ("{\"seq\":%llu,\"time\":%llu,\"event\":\"%s\"",
+                        (unsigned long long)event.seq,
+                        (unsigned long long)event.time_ms,
+                        get_event_name (event.type));
+
+                if (event.type != EVENT_LOG_ROTATED && event.type != EVENT_DROPPED) {
+                        printf (",\"id\":%u,\"name\":", (uint32_t)event.handle);
+                        print_json_string (event.name);
+                        printf (",\"pid\":%d,\"restarts\":%u", event.pid, event.restarts);
+                }
+
+                if (event.type == EVENT_EXITED && event.status == -1)
+                        printf (",\"exit_code\":null,\"exit_signal\":null");
+                else if (event.type == EVENT_EXITED && WIFSIGNALED (event.status))
+                        printf (",\"exit_code\":null,\"exit_signal\":%d", WTERMSIG (event.status));
+                else if (event.type == EVENT_EXITED)
+                        printf (",\"exit_code\":%d,\"exit_signal\":null", WEXITSTATUS (event.status));
+                else if (event.type == EVENT_RESTART_SCHEDULED)
+                        printf (",\"delay_ms\":%llu", (unsigned long long)event.value);
+                else if (event.type == EVENT_DROPPED)
+                        printf (",\"dropped\":%llu", (unsigned long long)event.value);
+
+                if (event.detail[0]) {
+                        printf (",\"detail\":");
+                        print_json_string (event.detail);
+                }
+
+                printf ("}\n");
+                fflush (stdout);
+                return;
+        }
+
+        char stamp[32];
+        time_t seconds = event.time_ms / 1000;
+        struct tm tm;
+
+        gmtime_r (&seconds, &tm);
+        strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        printf ("%s.%03uZ %-17s ", stamp, (unsigned)(event.time_ms % 1000), get_event_name (event.type));
+
+        switch (event.type) {
+        case EVENT_EXITED:
+                if (event.status == -1)
+                        printf ("%s (id %u, pid %d) exited, status unknown\n", event.name, (uint32_t)event.handle, event.pid);
+                else if (WIFSIGNALED (event.status))
+                        printf ("%s (id %u, pid %d) killed by signal %d\n", event.name, (uint32_t)event.handle, event.pid, WTERMSIG (event.status));
+                else
+                        printf ("%s (id %u, pid %d) exited with status %d\n", event.name, (uint32_t)event.handle, event.pid, WEXITSTATUS (event.status));
+                break;
+        case EVENT_RESTART_SCHEDULED:
+                printf ("%s (id %u) restarts in %llu ms\n", event.name, (uint32_t)event.handle, (unsigned long long)event.value);
+                break;
+        case EVENT_RECYCLED:
+                printf ("%s (id %u, pid %d) is over its %s limit\n", event.name, (uint32_t)event.handle, event.pid, event.detail);
+                break;
+        case EVENT_READY: printf ("%s (id %u, pid %d) is ready\n", event.name, (uint32_t)event.handle, event.pid); break;
+        case EVENT_UNREADY:
+                printf ("%s (id %u, pid %d) is not ready: %s\n", event.name, (uint32_t)event.handle, event.pid, event.detail);
+                break;
+        case EVENT_UNHEALTHY:
+                printf ("%s (id %u, pid %d) failed its liveness probe: %s\n", event.name, (uint32_t)event.handle, event.pid, event.detail);
+                break;
+        case EVENT_LOG_ROTATED: printf ("%s\n", event.detail); break;
+        case EVENT_DROPPED: printf ("%llu events were missed\n", (unsigned long long)event.value); break;
+        default:
+                printf ("%s (id %u, pid %d) restarts %u\n", event.name, (uint32_t)event.handle, event.pid, event.restarts);
+                break;
+        }
+
+        fflush (stdout);
+}
@@ -0,0 +1,508 @@
+#include "pm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Health checks
+ *
+ * A process may have a liveness and a readiness probe. Probes are driven by
+ * the daemon's timer wheel and run on its event loop, none of them ever
+ * blocks: sockets connect without blocking and are watched until they are
+ * connected and, for http, until the status line has arrived. Exec probes
+ * are children of the daemon whose exit the child monitor hands back here.
+ * Every probe has one timer, it fires for the next attempt while the probe
+ * is idle and as the deadline while an attempt is in flight.
+ *
+ * A probe that failed threshold times in a row is failing. A failing
+ * liveness probe stops the process, its exit goes through the restart policy
+ * like any crash. A failing readiness probe marks the process unready until
+ * it succeeds again.
+ *
+ * The first attempt of a probe is spread over its interval, so processes
+ * started together are not all probed at the same moment.
+ */
+
+// slots of the exec probe index once the first probe runs
+#define EXEC_INDEX_INITIAL_CAPACITY 64
+
+extern pm_configuration config;
+extern char **environ;
+
+typedef struct pm_probe {
+        pm_process *process;
+        pm_probe_kind kind;
+        pm_timer timer;
+        // socket of an attempt in flight, -1 otherwise
+        pm_watch watch;
+        // exec probe in flight, 0 otherwise
+        pid_t exec_pid;
+        bool in_flight;
+        // an http request was sent, the status line is awaited
+        bool request_sent;
+        char status_line[16];
+        uint32_t status_len;
+        uint32_t failures;
+} pm_probe;
+
+static pm_slab probe_slab = PM_SLAB_INIT (pm_probe, 256);
+
+// an exec probe by its pid, probe is NULL once it timed out or lost its
+// process and was killed, until it is reaped
+typedef struct exec_entry {
+        pid_t pid;
+        pm_probe *probe;
+} exec_entry;
+
+// exec probes that have not been reaped, indexed by pid like the process
+// table: open addressing with linear probing, deletions shift the cluster
+// back
+static exec_entry *execs;
+static size_t exec_count;
+static size_t exec_cap;
+
+static void exec_insert_slot (exec_entry *index, size_t cap, exec_entry entry)
+{
+        size_t mask = cap - 1;
+        size_t i = hash_pid (entry.pid) & mask;
+
+        while (index[i].pid)
+                i = (i + 1) & mask;
+
+        index[i] = entry;
+}
+
+static void exec_insert (pid_t pid, pm_probe *probe)
+{
+        if ((exec_count + 1) * 2 > exec_cap) {
+                size_t cap = exec_cap ? exec_cap * 2 : EXEC_INDEX_INITIAL_CAPACITY;
+                exec_entry *index = calloc_nofail (cap, sizeof (exec_entry));
+
+                for (size_t i = 0; i < exec_cap; i++)
+                        if (execs[i].pid)
+                                exec_insert_slot (index, cap, execs[i]);
+
+                free (execs);
+                execs = index;
+                exec_cap = cap;
+        }
+
+        exec_insert_slot (execs, exec_cap, (exec_entry) { .pid = pid, .probe = probe });
+        exec_count++;
+}
+
+static exec_entry *exec_find (pid_t pid)
+{
+        if (!exec_cap)
+                return NULL;
+
+        size_t mask = exec_cap - 1;
+
+        for (size_t i = hash_pid (pid) & mask; execs[i].pid; i = (i + 1) & mask)
+                if (execs[i].pid == pid)
+                        return &execs[i];
+
+        return NULL;
+}
+
+static void exec_remove (exec_entry *entry)
+{
+        size_t mask = exec_cap - 1;
+        size_t i = entry - execs;
+
+        execs[i] = (exec_entry) { 0 };
+        exec_count--;
+
+        // shift back entries that were displaced past the freed slot
+        for (size_t j = (i + 1) & mask; execs[j].pid; j = (j + 1) & mask) {
+                size_t home = hash_pid (execs[j].pid) & mask;
+
+                // entry stays if its home lies cyclically in (i, j]
+                if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                        continue;
+
+                execs[i] = execs[j];
+                execs[j] = (exec_entry) { 0 };
+                i = j;
+        }
+}
+
+/**
+ * Ends the attempt in flight, if any. A socket is closed with a reset
+ * rather than the usual handshake: a closing socket would otherwise linger
+ * in TIME_WAIT, and thousands of probes a second would exhaust the
+ * loopback's ports.
+ */
+static void abort_attempt (pm_probe *probe)
+{
+        if (probe->watch.fd >= 0) {
+                struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+
+                setsockopt (probe->watch.fd, SOL_SOCKET, SO_LINGER, &reset, sizeof (reset));
+                watch_remove (&probe->watch);
+                close (probe->watch.fd);
+                probe->watch.fd = -1;
+        }
+
+        if (probe->exec_pid > 0) {
+                signal_group (probe->exec_pid, SIGKILL);
+
+                // reaped later, without a probe to report to
+                exec_find (probe->exec_pid)->probe = NULL;
+                probe->exec_pid = 0;
+        }
+
+        probe->in_flight = false;
+        probe->request_sent = false;
+        probe->status_len = 0;
+}
+
+/**
+ * Records the outcome of an attempt and schedules the next one, unless the
+ * process is being stopped for failing its liveness probe.
+ */
+static void finish_attempt (pm_probe *probe, bool success, char *reason)
+{
+        pm_process *process = probe->process;
+        pm_probe_spec *spec = &process->probes[probe->kind];
+
+        abort_attempt (probe);
+
+        if (success) {
+                probe->failures = 0;
+
+                if (probe->kind == PROBE_READINESS && process->readiness != READINESS_READY) {
+                        set_process_readiness (process, READINESS_READY);
+                        publish_event (EVENT_READY, process, 0, NULL);
+                }
+        } else if (++probe->failures >= spec->threshold) {
+                char detail[PM_EVENT_DETAIL];
+
+                snprintf (detail, sizeof (detail), "%s, %u times in a row", reason, probe->failures);
+
+                if (probe->kind == PROBE_LIVENESS) {
+                        timer_cancel (&probe->timer);
+                        liveness_failed (process, detail);
+                        return;
+                }
+
+                if (process->readiness != READINESS_UNREADY) {
+                        log_warn ("%s (pid %d) is not ready: %s", process->name, process->pid, detail);
+                        set_process_readiness (process, READINESS_UNREADY);
+                        publish_event (EVENT_UNREADY, process, 0, detail);
+                }
+        }
+
+        timer_schedule (&probe->timer, spec->interval_ms);
+}
+
+static void handle_probe_event (pm_watch *watch, uint32_t events)
+{
+        pm_probe *probe = (pm_probe *)((char *)watch - offsetof (pm_probe, watch));
+        pm_probe_spec *spec = &probe->process->probes[probe->kind];
+
+        // the event may be left over from an attempt that already ended
+        if (watch->fd < 0)
+                return;
+
+        if (!probe->request_sent) {
+                int err = 0;
+                socklen_t len = sizeof (err);
+
+                if (getsockopt (watch->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                        err = errno;
+
+                if (err != 0) {
+                        finish_attempt (probe, false, strerror (err));
+                        return;
+                }
+
+                if (spec->type != PROBE_HTTP) {
+                        finish_attempt (probe, true, NULL);
+                        return;
+                }
+
+                char request[PM_PROBE_TARGET_MAX + 64];
+                char *path = strchr (spec->target, '/');
+                int size = snprintf (request, sizeof (request), "GET %s HTTP/1.0\r\nHost: 127.0.0.1\r\nUser-Agent: pm\r\n\r\n", path ? path : "/");
+
+                // a request this small fits a fresh socket's buffer
+                if (send (watch->fd, request, size, MSG_NOSIGNAL) != size) {
+                        finish_attempt (probe, false, "failed to send the request");
+                        return;
+                }
+
+                probe->request_sent = true;
+                watch_modify (watch, EPOLLIN);
+                return;
+        }
+
+        // only the status line matters, "HTTP/1.1 200"
+        ssize_t n = recv (watch->fd, probe->status_line + probe->status_len, 12 - probe->status_len, 0);
+
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                return;
+
+        if (n <= 0) {
+                finish_attempt (probe, false, n == 0 ? "connection closed before a response" : strerror (errno));
+                return;
+        }
+
+        probe->status_len += n;
+
+        if (probe->status_len < 12)
+                return;
+
+        probe->status_line[12] = '\0';
+
+        int status = atoi (probe->status_line + 9);
+
+        if (strncmp (probe->status_line, "HTTP/", 5) != 0) {
+                finish_attempt (probe, false, "not an http response");
+        } else if (status < 200 || status >= 400) {
+                char reason[32];
+
+                snprintf (reason, sizeof (reason), "http status %d", status);
+                finish_attempt (probe, false, reason);
+        } else {
+                finish_attempt (probe, true, NULL);
+        }
+}
+
+/**
+ * Starts connecting a socket to the probe's target. Returns false with
+ * errno set if it could not even get started.
+ */
+static bool start_connect (pm_probe *probe, pm_probe_spec *spec)
+{
+        struct sockaddr_un unix_addr = { .sun_family = AF_UNIX };
+        struct sockaddr_in inet_addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl (INADDR_LOOPBACK) };
+        struct sockaddr *addr;
+        socklen_t addr_len;
+
+        if (spec->type == PROBE_UNIX) {
+                snprintf (unix_addr.sun_path, sizeof (unix_addr.sun_path), "%s", spec->target);
+                addr = (struct sockaddr *)&unix_addr;
+                addr_len = sizeof (unix_addr);
+        } else {
+                inet_addr.sin_port = htons (atoi (spec->target));
+                addr = (struct sockaddr *)&inet_addr;
+                addr_len = sizeof (inet_addr);
+        }
+
+        int fd = socket (addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (fd < 0)
+                return false;
+
+        probe->watch.fd = fd;
+        probe->watch.callback = handle_probe_event;
+
+        // a unix socket whose backlog is full does not wait, it refuses
+        if (connect (fd, addr, addr_len) < 0 && errno != EINPROGRESS) {
+                int err = errno == EAGAIN ? ECONNREFUSED : errno;
+
+                close (fd);
+                probe->watch.fd = -1;
+                errno = err;
+                return false;
+        }
+
+        // connected or not, the result is picked up from the event loop
+        watch_add (&probe->watch, EPOLLOUT);
+
+        return true;
+}
+
+/**
+ * Returns the daemon's environment with PM_PID set to the pid of the probed
+ * process, instances sharing their sockets can only be told apart by it.
+ * The vector is only valid until the next call.
+ */
+static char **probe_environment (pm_process *process)
+{
+        static char **envp = NULL;
+        static size_t capacity = 0;
+        static char variable[32];
+
+        size_t count = 0;
+        while (environ[count])
+                count++;
+
+        if (count + 2 > capacity) {
+                capacity = count + 2;
+                envp = realloc_nofail (envp, capacity * sizeof (char *));
+        }
+
+        size_t j = 0;
+        for (size_t i = 0; i < count; i++)
+                if (strncmp (environ[i], "PM_PID=", 7) != 0)
+                        envp[j++] = environ[i];
+
+        snprintf (variable, sizeof (variable), "PM_PID=%d", process->pid);
+        envp[j++] = variable;
+        envp[j] = NULL;
+
+        return envp;
+}
+
+static bool start_exec (pm_probe *probe, pm_probe_spec *spec)
+{
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t mask, defaults;
+        pid_t pid;
+
+        posix_spawn_file_actions_init (&actions);
+        posix_spawnattr_init (&attr);
+
+        sigemptyset (&mask);
+        sigfillset (&defaults);
+        posix_spawnattr_setsigmask (&attr, &mask);
+        posix_spawnattr_setsigdefault (&attr, &defaults);
+        posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+        // a probe that times out is killed along with whatever it started
+        posix_spawnattr_setpgroup (&attr, 0);
+
+        posix_spawn_file_actions_addopen (&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_addopen (&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+        posix_spawn_file_actions_addopen (&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+        char *argv[] = { "sh", "-c", spec->target, NULL };
+        int err = posix_spawn (&pid, "/bin/sh", &actions, &attr, argv, probe_environment (probe->process));
+
+        posix_spawnattr_destroy (&attr);
+        posix_spawn_file_actions_destroy (&actions);
+
+        if (err != 0) {
+                errno = err;
+                return false;
+        }
+
+        probe->exec_pid = pid;
+        exec_insert (pid, probe);
+
+        return true;
+}
+
+static void start_attempt (pm_probe *probe)
+{
+        pm_probe_spec *spec = &probe->process->probes[probe->kind];
+        bool started = spec->type == PROBE_EXEC ? start_exec (probe, spec) : start_connect (probe, spec);
+
+        if (!started) {
+                finish_attempt (probe, false, strerror (errno));
+                return;
+        }
+
+        probe->in_flight = true;
+        timer_schedule (&probe->timer, spec->timeout_ms);
+}
+
+static void handle_probe_timer (pm_timer *timer)
+{
+        pm_probe *probe = timer->data;
+
+        if (probe->in_flight)
+                finish_attempt (probe, false, "timed out");
+        else
+                start_attempt (probe);
+}
+
+/**
+ * Starts probing a process that was just started or adopted.
+ */
+void health_start (pm_process *process)
+{
+        for (int kind = 0; kind < PM_PROBE_KINDS; kind++) {
+                pm_probe_spec *spec = &process->probes[kind];
+
+                if (spec->type == PROBE_NONE)
+                        continue;
+
+                pm_probe *probe = process->probe_state[kind];
+
+                if (!probe) {
+                        probe = slab_alloc (&probe_slab);
+                        *probe = (pm_probe) { .process = process, .kind = kind, .watch = { .fd = -1 } };
+                        probe->timer = (pm_timer) { .callback = handle_probe_timer, .data = probe };
+                        process->probe_state[kind] = probe;
+                }
+
+                probe->failures = 0;
+
+                // at least a tick away, never on the turn of the wheel that
+                // is running now
+                timer_schedule (&probe->timer, PM_TIMER_TICK_MS + random () % spec->interval_ms);
+        }
+
+        if (process->probes[PROBE_READINESS].type != PROBE_NONE)
+                set_process_readiness (process, READINESS_STARTING);
+}
+
+/**
+ * Stops probing a process, it exited or is removed.
+ */
+void health_stop (pm_process *process)
+{
+        for (int kind = 0; kind < PM_PROBE_KINDS; kind++) {
+                pm_probe *probe = process->probe_state[kind];
+
+                if (!probe)
+                        continue;
+
+                abort_attempt (probe);
+                timer_cancel (&probe->timer);
+                slab_free (&probe_slab, probe);
+                process->probe_state[kind] = NULL;
+        }
+
+        if (process->readiness != READINESS_NONE)
+                set_process_readiness (process, READINESS_NONE);
+}
+
+/**
+ * Called for every child the monitor reaps that is not a managed process.
+ * Returns true if it was an exec probe.
+ */
+bool health_reaped (pid_t pid, int status)
+{
+        exec_entry *entry = exec_find (pid);
+
+        if (!entry)
+                return false;
+
+        pm_probe *probe = entry->probe;
+
+        exec_remove (entry);
+
+        if (!probe)
+                return true;
+
+        probe->exec_pid = 0;
+
+        if (WIFEXITED (status) && WEXITSTATUS (status) == 0) {
+                finish_attempt (probe, true, NULL);
+        } else {
+                char reason[64];
+
+                if (WIFSIGNALED (status))
+                        snprintf (reason, sizeof (reason), "probe killed by signal %d", WTERMSIG (status));
+                else
+                        snprintf (reason, sizeof (reason), "probe exited with status %d", WEXITSTATUS (status));
+
+                finish_attempt (probe, false, reason);
+        }
+
+        return true;
+}
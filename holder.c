@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Pipe holder
+ *
+ * A child writing to a capture pipe nobody reads dies of SIGPIPE. Were the
+ * daemon the only reader, every process would die with it the moment it
+ * writes, and a daemon started after the crash would find nothing left to
+ * adopt. So the daemon keeps a helper, this program run as PM_HOLDER_NAME,
+ * and hands it another read end of every capture pipe. The helper never
+ * reads them, it only keeps them open.
+ *
+ * Should the daemon go away without telling the helper to quit, the helper
+ * keeps holding the pipes and listens on a socket next to the daemon's. A
+ * child whose pipe fills up waits for it instead of dying. The next daemon
+ * reopens the pipes through /proc once it has adopted the processes, then
+ * connects to that socket, and the helper lets go and exits. It also exits
+ * once the writers of every pipe it holds are gone.
+ *
+ * Requests are SOCK_SEQPACKET messages of a single byte, a pipe comes along
+ * as SCM_RIGHTS.
+ */
+
+// descriptor the helper finds its socket at
+#define HOLDER_FD 3
+
+#define HOLDER_EVENT_BATCH 64
+
+// holder requests
+#define HOLDER_PIPE 'p'
+#define HOLDER_QUIT 'q'
+
+extern pm_configuration config;
+extern char **environ;
+
+static int holder_fd = -1;
+static pid_t holder_pid;
+
+// where a holder left behind by a daemon that is gone listens
+static bool holder_path (char *path, size_t size)
+{
+        return (size_t)snprintf (path, size, "%s.holder", config.socket_file) < size;
+}
+
+/**
+ * Tells a holder left behind listening on path to let go of its pipes, and
+ * waits until it did. Returns the holder's pid, or 0 if there was none.
+ */
+static pid_t dismiss (char *path)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        struct ucred peer = { 0 };
+        socklen_t len = sizeof (peer);
+        struct timeval timeout = { .tv_sec = 1 };
+        char byte;
+
+        snprintf (addr.sun_path, sizeof (addr.sun_path), "%s", path);
+
+        int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd < 0)
+                return 0;
+
+        if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+            getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) < 0) {
+                close (fd);
+                return 0;
+        }
+
+        // the connection ends once the holder has exited
+        setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+
+        ssize_t n;
+
+        while ((n = read (fd, &byte, 1)) > 0 || (n < 0 && errno == EINTR))
+                ;
+
+        close (fd);
+
+        return n == 0 ? peer.pid : 0;
+}
+
+/**
+ * Starts the holder of this daemon, or takes over the one of the daemon that
+ * upgraded to this program. Without one, a crash of the daemon takes every
+ * process down with it once it writes output.
+ */
+void holder_start ()
+{
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t mask, defaults;
+        char path[sizeof (((struct sockaddr_un *)0)->sun_path)];
+        char *passed = getenv ("PM_UPGRADE_HOLDER");
+        int fds[2];
+
+        if (passed) {
+                sscanf (passed, "%d,%d", &holder_fd, &holder_pid);
+                unsetenv ("PM_UPGRADE_HOLDER");
+                fcntl (holder_fd, F_SETFD, FD_CLOEXEC);
+                return;
+        }
+
+        if (!holder_path (path, sizeof (path))) {
+                log_warn ("socket path %s is too long, processes do not survive a crash of the daemon", config.socket_file);
+                return;
+        }
+
+        if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+                log_error ("failed to create a pipe holder socket: %s", strerror (errno));
+                return;
+        }
+
+        posix_spawn_file_actions_init (&actions);
+        posix_spawnattr_init (&attr);
+
+        // in a group of its own, out of reach of signals meant for the daemon
+        sigemptyset (&mask);
+        sigfillset (&defaults);
+        posix_spawnattr_setsigmask (&attr, &mask);
+        posix_spawnattr_setsigdefault (&attr, &defaults);
+        posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup (&attr, 0);
+
+        posix_spawn_file_actions_adddup2 (&actions, fds[1], HOLDER_FD);
+
+        char *argv[] = { PM_HOLDER_NAME, path, NULL };
+        int err = posix_spawn (&holder_pid, "/proc/self/exe", &actions, &attr, argv, environ);
+
+        posix_spawnattr_destroy (&attr);
+        posix_spawn_file_actions_destroy (&actions);
+        close (fds[1]);
+
+        if (err != 0) {
+                log_error ("failed to start the pipe holder: %s", strerror (err));
+                close (fds[0]);
+                holder_pid = 0;
+                return;
+        }
+
+        holder_fd = fds[0];
+}
+
+/**
+ * Lets the holder of a daemon that is gone exit, once this daemon reads the
+ * pipes of the processes it adopted itself.
+ */
+void holder_dismiss ()
+{
+        char path[sizeof (((struct sockaddr_un *)0)->sun_path)];
+
+        if (!holder_path (path, sizeof (path)))
+                return;
+
+        pid_t pid = dismiss (path);
+
+        if (pid == 0)
+                return;
+
+        log_info ("took over the output pipes held since the last daemon stopped");
+
+        // the holder of a daemon that died before an upgrade finished may
+        // be a child of this one, it keeps the pid
+        waitpid (pid, NULL, 0);
+}
+
+/**
+ * Keeps the holder's socket across the exec of an upgrade, the program the
+ * daemon is replaced with takes it over.
+ */
+void holder_pass_on ()
+{
+        char passed[32];
+
+        if (holder_fd < 0)
+                return;
+
+        snprintf (passed, sizeof (passed), "%d,%d", holder_fd, holder_pid);
+        setenv ("PM_UPGRADE_HOLDER", passed, 1);
+        fcntl (holder_fd, F_SETFD, 0);
+}
+
+/**
+ * Takes the holder back from an upgrade that failed.
+ */
+void holder_take_back ()
+{
+        if (holder_fd < 0)
+                return;
+
+        unsetenv ("PM_UPGRADE_HOLDER");
+        fcntl (holder_fd, F_SETFD, FD_CLOEXEC);
+}
+
+/**
+ * Hands the holder another read end of a capture pipe, pipe_fd stays with
+ * the caller.
+ */
+void holder_hold (int pipe_fd)
+{
+        char control[CMSG_SPACE (sizeof (int))] = { 0 };
+        char type = HOLDER_PIPE;
+        struct iovec iov = { .iov_base = &type, .iov_len = 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof (control) };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+
+        if (holder_fd < 0)
+                return;
+
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+        memcpy (CMSG_DATA (cmsg), &pipe_fd, sizeof (int));
+
+        if (sendmsg (holder_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+                log_warn ("failed to hand a capture pipe to the pipe holder: %s", strerror (errno));
+}
+
+/**
+ * Lets the holder exit along with the daemon, nothing is left to adopt.
+ */
+void holder_stop ()
+{
+        char type = HOLDER_QUIT;
+
+        if (holder_fd < 0)
+                return;
+
+        if (send (holder_fd, &type, 1, MSG_NOSIGNAL) == 1)
+                waitpid (holder_pid, NULL, 0);
+
+        close (holder_fd);
+        holder_fd = -1;
+        holder_pid = 0;
+}
+
+/**
+ * Returns whether pid was the holder, which is not replaced. Processes stop
+ * surviving a crash of the daemon then.
+ */
+bool holder_reaped (pid_t pid)
+{
+        if (holder_pid == 0 || pid != holder_pid)
+                return false;
+
+        log_warn ("pipe holder %d exited, processes no longer survive a crash of the daemon", pid);
+
+        close (holder_fd);
+        holder_fd = -1;
+        holder_pid = 0;
+
+        return true;
+}
+
+/**
+ * Listens on path for the next daemon, once the daemon that started the
+ * holder is gone. Returns -1 if it cannot.
+ */
+static int listen_for_daemon (char *path)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        snprintf (addr.sun_path, sizeof (addr.sun_path), "%s", path);
+
+        // a holder left by an earlier crash only holds pipes this one has
+        // been handed again since
+        dismiss (path);
+        unlink (path);
+
+        if (fd >= 0 && (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 || listen (fd, 1) < 0)) {
+                close (fd);
+                fd = -1;
+        }
+
+        return fd;
+}
+
+/**
+ * Runs as the pipe holder of a daemon, path is where it listens for the
+ * next daemon once that one is gone. Never returns.
+ */
+void holder_main (char *path)
+{
+        char control[CMSG_SPACE (sizeof (int))];
+        struct epoll_event events[HOLDER_EVENT_BATCH];
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = HOLDER_FD };
+        int epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+        int listen_fd = -1;
+        size_t held = 0;
+        bool orphaned = false;
+
+        fcntl (HOLDER_FD, F_SETFD, FD_CLOEXEC);
+        prctl (PR_SET_NAME, PM_HOLDER_NAME);
+
+        if (epoll_fd < 0 || epoll_ctl (epoll_fd, EPOLL_CTL_ADD, HOLDER_FD, &ev) < 0)
+                _exit (EXIT_FAILURE);
+
+        for (;;) {
+                int n = epoll_wait (epoll_fd, events, HOLDER_EVENT_BATCH, -1);
+
+                if (n < 0 && errno != EINTR)
+                        _exit (EXIT_FAILURE);
+
+                for (int i = 0; i < n; i++) {
+                        int fd = events[i].data.fd;
+
+                        // the next daemon reads the pipes itself now, it
+                        // sees the connection end once the holder is gone
+                        if (fd == listen_fd) {
+                                if (accept (listen_fd, NULL, NULL) < 0)
+                                        continue;
+
+                                unlink (path);
+                                _exit (EXIT_SUCCESS);
+                        }
+
+                        // every writer of the pipe is gone
+                        if (fd != HOLDER_FD) {
+                                close (fd);
+                                held--;
+                                continue;
+                        }
+
+                        char type = 0;
+                        struct iovec iov = { .iov_base = &type, .iov_len = 1 };
+                        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof (control) };
+                        ssize_t size = recvmsg (HOLDER_FD, &msg, MSG_CMSG_CLOEXEC);
+
+                        if (size < 0)
+                                continue;
+
+                        if (type == HOLDER_QUIT)
+                                _exit (EXIT_SUCCESS);
+
+                        // the daemon is gone without letting the holder go
+                        if (size == 0) {
+                                close (HOLDER_FD);
+                                listen_fd = listen_for_daemon (path);
+                                orphaned = true;
+
+                                ev = (struct epoll_event) { .events = EPOLLIN, .data.fd = listen_fd };
+
+                                if (listen_fd >= 0)
+                                        epoll_ctl (epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+                                continue;
+                        }
+
+                        struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+                        int pipe_fd;
+
+                        if (type != HOLDER_PIPE || !cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+                                continue;
+
+                        memcpy (&pipe_fd, CMSG_DATA (cmsg), sizeof (int));
+
+                        // no events asked for, a pipe only reports that its
+                        // writers are gone and is never read
+                        ev = (struct epoll_event) { .events = 0, .data.fd = pipe_fd };
+
+                        if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, pipe_fd, &ev) < 0)
+                                close (pipe_fd);
+                        else
+                                held++;
+                }
+
+                if (orphaned && held == 0) {
+                        if (listen_fd >= 0)
+                                unlink (path);
+
+                        _exit (EXIT_SUCCESS);
+                }
+        }
+}
@@ -0,0 +1,774 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define EVENT_BATCH_SIZE 64
+#define CONNECTION_READ_SIZE 4096
+
+// responses a connection may have waiting before its requests are held back
+#define CONNECTION_MAX_BACKLOG (1024 * 1024)
+
+// submissions queued at once on the event loop's ring, and client sockets
+// registered with it, the ones beyond are used as they are
+#define IO_RING_ENTRIES 256
+#define IO_RING_FILES 1024
+
+// what a connection waits for the ring to do, and the low bits of the
+// user_data of an entry saying what it did
+#define RING_RECV 1
+#define RING_SEND 2
+#define RING_ACCEPT 3
+
+/*
+ * io_uring
+ *
+ * Where the kernel has io_uring, client connections are accepted, read and
+ * written through a ring instead of one system call at a time. Epoll still
+ * says which sockets are ready, their callbacks only note what is to be done
+ * and once the events are dispatched the accepts, reads and sends of all of
+ * them go out with a single call. The requests read are handled as the reads
+ * complete, and their responses go out together with the next call. The
+ * entries are only filled in when they are submitted, until then a callback
+ * may still grow the buffers of a connection, hand its socket over or close
+ * it.
+ *
+ * Client sockets are registered with the ring as they are accepted, so the
+ * kernel does not look them up for every read and send. Their buffers are
+ * not: they grow with the requests and responses of a connection and would
+ * have to be registered again every time, the reads and sends use the plain
+ * opcodes.
+ */
+
+extern pm_configuration config;
+
+// the ring, its fd is -1 if connections are served with plain calls
+static pm_uring ring = { .fd = -1 };
+// connections waiting for the next submission, and the ones submitted whose
+// results are still to be handled
+static pm_connection *queued_connections;
+static pm_connection *submitted_connections;
+// listening sockets epoll reported ready, accepted from once each
+static pm_watch *accepting[EVENT_BATCH_SIZE];
+static int accepting_count;
+// set while the callbacks of the event loop run, connections are only read
+// and written through the ring from there
+static bool dispatching;
+static pm_io_stats stats;
+
+/**
+ * Sets up the ring unless io_uring is turned off or the kernel lacks what is
+ * needed, connections are served with plain calls then.
+ */
+static void setup_ring ()
+{
+        uint8_t ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND };
+
+        if (config.no_io_uring)
+                return;
+
+        if (!uring_init (&ring, IO_RING_ENTRIES)) {
+                log_info ("io_uring is not available, serving clients with plain system calls: %s", strerror (errno));
+                return;
+        }
+
+        if (!uring_supports (&ring, ops, sizeof (ops)) || !uring_register_files (&ring, IO_RING_FILES)) {
+                log_info ("io_uring lacks what serving clients needs, serving them with plain system calls");
+                uring_close (&ring);
+                return;
+        }
+
+        log_info ("serving clients with io_uring");
+}
+
+void event_loop_init ()
+{
+        config.epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+
+        if (config.epoll_fd < 0) {
+                perror ("epoll_create1");
+                fatal_error ();
+        }
+
+        setup_ring ();
+}
+
+void watch_add (pm_watch *watch, uint32_t events)
+{
+        struct epoll_event ev = { .events = events, .data.ptr = watch };
+
+        stats.syscalls++;
+
+        if (epoll_ctl (config.epoll_fd, EPOLL_CTL_ADD, watch->fd, &ev) < 0) {
+                perror ("epoll_ctl");
+                fatal_error ();
+        }
+}
+
+void watch_modify (pm_watch *watch, uint32_t events)
+{
+        struct epoll_event ev = { .events = events, .data.ptr = watch };
+
+        stats.syscalls++;
+
+        if (epoll_ctl (config.epoll_fd, EPOLL_CTL_MOD, watch->fd, &ev) < 0) {
+                perror ("epoll_ctl");
+                fatal_error ();
+        }
+}
+
+void watch_remove (pm_watch *watch)
+{
+        stats.syscalls++;
+        epoll_ctl (config.epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+static void complete_ring ();
+
+/**
+ * Runs the daemon's event loop until a command requests shutdown. Every file
+ * descriptor the daemon cares about is registered with a pm_watch whose
+ * callback is invoked when the descriptor becomes ready.
+ */
+void run_event_loop ()
+{
+        struct epoll_event events[EVENT_BATCH_SIZE];
+
+        while (!config.shutdown) {
+                int n = epoll_wait (config.epoll_fd, events, EVENT_BATCH_SIZE, -1);
+
+                stats.syscalls++;
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        perror ("epoll_wait");
+                        fatal_error ();
+                }
+
+                dispatching = true;
+
+                for (int i = 0; i < n; i++) {
+                        pm_watch *watch = events[i].data.ptr;
+                        watch->callback (watch, events[i].events);
+                }
+
+                // the accepts, reads and sends the callbacks queued go out
+                // together
+                complete_ring ();
+                dispatching = false;
+        }
+}
+
+/**
+ * Copies the system calls the event loop has taken so far and whether it
+ * uses the ring.
+ */
+void io_stats (pm_io_stats *out)
+{
+        *out = stats;
+        out->io_uring = ring.fd >= 0;
+}
+
+static void connection_update_events (pm_connection *conn)
+{
+        uint32_t events = conn->eof || conn->stalled ? 0 : EPOLLIN | EPOLLRDHUP;
+
+        if (conn->out_len > conn->out_off)
+                events |= EPOLLOUT;
+
+        // most flushes leave them as they were
+        if (events != conn->events) {
+                watch_modify (&conn->watch, events);
+                conn->events = events;
+        }
+}
+
+static void ring_link (pm_connection *conn, pm_connection **list)
+{
+        conn->ring_list = list;
+        conn->ring_prev = NULL;
+        conn->ring_next = *list;
+
+        if (*list)
+                (*list)->ring_prev = conn;
+
+        *list = conn;
+}
+
+/**
+ * Takes the socket of a connection out of the ring's table, before it is
+ * closed or handed elsewhere.
+ */
+static void ring_remove_socket (pm_connection *conn)
+{
+        if (conn->slot < 0)
+                return;
+
+        if (ring.fd >= 0)
+                stats.syscalls++;
+
+        uring_remove_file (&ring, conn->slot);
+        conn->slot = -1;
+}
+
+static void ring_unlink (pm_connection *conn)
+{
+        if (!conn->ring_list)
+                return;
+
+        if (conn->ring_prev)
+                conn->ring_prev->ring_next = conn->ring_next;
+        else
+                *conn->ring_list = conn->ring_next;
+
+        if (conn->ring_next)
+                conn->ring_next->ring_prev = conn->ring_prev;
+
+        conn->ring_list = NULL;
+}
+
+/**
+ * Notes that the connection waits for the ring to read or send, op is
+ * RING_RECV or RING_SEND. A connection whose last submission is still to be
+ * handled is queued once it was.
+ */
+static void ring_queue (pm_connection *conn, uint8_t op)
+{
+        conn->ring_queued |= op;
+
+        if (!conn->ring_list)
+                ring_link (conn, &queued_connections);
+}
+
+void close_connection (pm_connection *conn)
+{
+        ring_unlink (conn);
+        events_unsubscribe (conn);
+        rollout_detach (conn);
+        apply_detach (conn);
+
+        // the socket may have been handed elsewhere
+        if (conn->watch.fd >= 0) {
+                ring_remove_socket (conn);
+                watch_remove (&conn->watch);
+                close (conn->watch.fd);
+        }
+
+        free (conn->in);
+        free (conn->out);
+        free (conn);
+}
+
+/**
+ * Takes note of what was sent. A connection that has nothing left to send
+ * and is done is closed, returns false then.
+ */
+static bool connection_flushed (pm_connection *conn)
+{
+        if (conn->out_off == conn->out_len)
+                conn->out_off = conn->out_len = 0;
+
+        // a stalled connection still has requests to answer
+        if (conn->out_len == 0 && (conn->closing || (conn->eof && !conn->stalled))) {
+                close_connection (conn);
+                return false;
+        }
+
+        connection_update_events (conn);
+
+        return true;
+}
+
+/**
+ * Writes as much of the pending output buffer as the socket accepts without
+ * blocking. Returns false if the connection failed and was closed. From the
+ * event loop's callbacks the output is sent through the ring once they ran,
+ * a failure closes the connection then.
+ */
+bool connection_flush (pm_connection *conn)
+{
+        if (dispatching && ring.fd >= 0 && conn->out_off < conn->out_len) {
+                ring_queue (conn, RING_SEND);
+                return true;
+        }
+
+        while (conn->out_off < conn->out_len) {
+                ssize_t n = send (conn->watch.fd,
+                                  conn->out + conn->out_off,
+                                  conn->out_len - conn->out_off,
+                                  MSG_NOSIGNAL | MSG_DONTWAIT);
+
+                stats.syscalls++;
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                break;
+
+                        log_warn ("error occurred when sending response back to client: %s", strerror (errno));
+                        close_connection (conn);
+                        return false;
+                }
+
+                conn->out_off += n;
+        }
+
+        return connection_flushed (conn);
+}
+
+/**
+ * Queues data to be sent to the client. The data is written out as soon as the
+ * socket is writable, a slow client only ever delays itself.
+ */
+void connection_write (pm_connection *conn, void *data, size_t size)
+{
+        if (conn->out_len + size > conn->out_cap) {
+                // compact before growing the buffer
+                if (conn->out_off > 0) {
+                        memmove (conn->out, conn->out + conn->out_off, conn->out_len - conn->out_off);
+                        conn->out_len -= conn->out_off;
+                        conn->out_off = 0;
+                }
+
+                size_t cap = conn->out_cap ? conn->out_cap : CONNECTION_READ_SIZE;
+                while (cap < conn->out_len + size)
+                        cap *= 2;
+
+                if (cap != conn->out_cap) {
+                        conn->out = realloc_nofail (conn->out, cap);
+                        conn->out_cap = cap;
+                }
+        }
+
+        memcpy (conn->out + conn->out_len, data, size);
+        conn->out_len += size;
+}
+
+/**
+ * Takes the socket of a connection out of the event loop and hands it to the
+ * caller, together with the output not sent yet. The connection is closed
+ * once the current request was handled, requests the client sent after it
+ * are dropped.
+ */
+int connection_release_socket (pm_connection *conn, pm_buffer *unsent)
+{
+        int fd = conn->watch.fd;
+
+        ring_remove_socket (conn);
+        watch_remove (&conn->watch);
+        buffer_put_bytes (unsent, conn->out + conn->out_off, conn->out_len - conn->out_off);
+
+        conn->out_len = conn->out_off = 0;
+        conn->watch.fd = -1;
+        conn->closing = true;
+
+        return fd;
+}
+
+/**
+ * Dispatches every complete request sitting in the input buffer, until too
+ * many responses are waiting for the client. Returns false if the connection
+ * was closed.
+ */
+static bool connection_process_commands (pm_connection *conn)
+{
+        size_t consumed = 0;
+
+        conn->stalled = false;
+
+        while (!conn->closing && !config.shutdown) {
+                if (conn->out_len - conn->out_off >= CONNECTION_MAX_BACKLOG) {
+                        conn->stalled = true;
+                        break;
+                }
+
+                char *frame = conn->in + consumed;
+                size_t size = frame_size (frame, conn->in_len - consumed);
+
+                if (size == 0)
+                        break;
+
+                if (size == SIZE_MAX) {
+                        log_warn ("client sent a request larger than %d bytes, dropping connection", PM_MAX_COMMAND_SIZE);
+                        send_error (conn, 0, INVALID_COMMAND, "requests may be at most %d bytes", PM_MAX_COMMAND_SIZE);
+                        conn->closing = true;
+                        break;
+                }
+
+                // the request is handled in place, the buffer is only
+                // compacted once every complete request was handled
+                consumed += size;
+
+                pm_cmd cmd;
+                pm_code code = decode_request (frame, size, &cmd);
+
+                if (code == UNSUPPORTED_VERSION) {
+                        pm_frame_header header;
+                        decode_frame_header (frame, &header);
+
+                        log_warn ("client speaks protocol version %u, dropping connection", header.version);
+                        send_error (conn, cmd.id, code, "protocol version %u is not supported, the daemon speaks version %d",
+                                    header.version,
+                                    PM_PROTOCOL_VERSION);
+                        conn->closing = true;
+                        break;
+                }
+
+                if (code != OK) {
+                        send_error (conn, cmd.id, code, "malformed or unknown request %u", cmd.instruction);
+                        continue;
+                }
+
+                daemon_handle_command (conn, &cmd);
+        }
+
+        if (consumed > 0) {
+                memmove (conn->in, conn->in + consumed, conn->in_len - consumed);
+                conn->in_len -= consumed;
+        }
+
+        return connection_flush (conn);
+}
+
+static void connection_reserve (pm_connection *conn)
+{
+        if (conn->in_cap - conn->in_len < CONNECTION_READ_SIZE) {
+                conn->in_cap = conn->in_cap ? conn->in_cap * 2 : CONNECTION_READ_SIZE;
+                conn->in = realloc_nofail (conn->in, conn->in_cap);
+        }
+}
+
+static void connection_read (pm_connection *conn)
+{
+        // read with the others once the callbacks ran
+        if (ring.fd >= 0) {
+                ring_queue (conn, RING_RECV);
+                return;
+        }
+
+        for (;;) {
+                connection_reserve (conn);
+
+                ssize_t n = recv (conn->watch.fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, MSG_DONTWAIT);
+
+                stats.syscalls++;
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                break;
+
+                        log_warn ("error occurred when reading from client: %s", strerror (errno));
+                        close_connection (conn);
+                        return;
+                }
+
+                if (n == 0) {
+                        // client is done sending, answer what we have and
+                        // close once the responses are written out.
+                        conn->eof = true;
+                        break;
+                }
+
+                conn->in_len += n;
+
+                if (conn->in_len > PM_FRAME_HEADER_SIZE + PM_MAX_COMMAND_SIZE)
+                        break;
+        }
+
+        connection_process_commands (conn);
+}
+
+static void handle_connection_event (pm_watch *watch, uint32_t events)
+{
+        pm_connection *conn = (pm_connection *)watch;
+
+        if (events & EPOLLERR) {
+                close_connection (conn);
+                return;
+        }
+
+        if (events & EPOLLOUT) {
+                if (!connection_flush (conn))
+                        return;
+
+                // a subscriber may have events waiting for room
+                if (conn->subscribed && !events_deliver (conn))
+                        return;
+
+                // the client caught up, go on with the requests held back
+                if (conn->stalled && conn->out_len - conn->out_off < CONNECTION_MAX_BACKLOG) {
+                        if (!connection_process_commands (conn))
+                                return;
+                }
+        }
+
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP) && !conn->eof)
+                connection_read (conn);
+}
+
+static void add_connection (int conn_fd)
+{
+        pm_connection *conn = malloc_nofail (sizeof (pm_connection));
+        *conn = (pm_connection) { .watch = { .fd = conn_fd, .callback = handle_connection_event }, .events = EPOLLIN | EPOLLRDHUP, .slot = -1 };
+
+        watch_add (&conn->watch, conn->events);
+
+        if (ring.fd >= 0) {
+                conn->slot = uring_add_file (&ring, conn_fd);
+                stats.syscalls++;
+        }
+}
+
+static void handle_listen_event (pm_watch *watch, uint32_t events)
+{
+        // a socket epoll reports ready has a connection waiting, one accept
+        // on the ring never waits. More waiting ones are reported again.
+        if (ring.fd >= 0 && accepting_count < EVENT_BATCH_SIZE) {
+                accepting[accepting_count++] = watch;
+                return;
+        }
+
+        for (;;) {
+                int conn_fd = accept4 (watch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+                stats.syscalls++;
+
+                if (conn_fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                log_warn ("failed to accept connection: %s", strerror (errno));
+
+                        return;
+                }
+
+                add_connection (conn_fd);
+        }
+}
+
+/**
+ * Fills in the entries of the accepts and of the connections queued, as
+ * many as the ring has room for. The rest wait for the next submission.
+ */
+static void ring_fill ()
+{
+        for (int i = 0; i < accepting_count; i++) {
+                struct io_uring_sqe *sqe = uring_get_sqe (&ring);
+
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->fd = accepting[i]->fd;
+                sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+                sqe->user_data = (uintptr_t)accepting[i] | RING_ACCEPT;
+        }
+
+        accepting_count = 0;
+
+        // a connection takes up to two entries
+        while (queued_connections && ring.sq_entries - ring.queued >= 2) {
+                pm_connection *conn = queued_connections;
+
+                ring_unlink (conn);
+                ring_link (conn, &submitted_connections);
+
+                conn->ring_submitted = conn->ring_queued;
+                conn->ring_queued = 0;
+                conn->sent = conn->received = 0;
+
+                // the socket was handed elsewhere
+                if (conn->watch.fd < 0) {
+                        conn->ring_submitted &= ~RING_RECV;
+                        continue;
+                }
+
+                if ((conn->ring_submitted & RING_SEND) && conn->out_off < conn->out_len) {
+                        struct io_uring_sqe *sqe = uring_get_sqe (&ring);
+
+                        sqe->opcode = IORING_OP_SEND;
+                        sqe->fd = conn->slot >= 0 ? conn->slot : conn->watch.fd;
+                        sqe->flags = conn->slot >= 0 ? IOSQE_FIXED_FILE : 0;
+                        sqe->addr = (uintptr_t)(conn->out + conn->out_off);
+                        sqe->len = conn->out_len - conn->out_off;
+                        sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+                        sqe->user_data = (uintptr_t)conn | RING_SEND;
+                }
+
+                if (conn->ring_submitted & RING_RECV) {
+                        struct io_uring_sqe *sqe = uring_get_sqe (&ring);
+
+                        connection_reserve (conn);
+
+                        // a socket without data answers right away
+                        sqe->opcode = IORING_OP_RECV;
+                        sqe->fd = conn->slot >= 0 ? conn->slot : conn->watch.fd;
+                        sqe->flags = conn->slot >= 0 ? IOSQE_FIXED_FILE : 0;
+                        sqe->addr = (uintptr_t)(conn->in + conn->in_len);
+                        sqe->len = conn->requested = conn->in_cap - conn->in_len;
+                        sqe->msg_flags = MSG_DONTWAIT;
+                        sqe->user_data = (uintptr_t)conn | RING_RECV;
+                }
+        }
+}
+
+/**
+ * Handles what the ring sent and read for a connection, like the plain
+ * calls do. Returns false if the connection was closed.
+ */
+static bool connection_completed (pm_connection *conn)
+{
+        if (conn->ring_submitted & RING_SEND) {
+                if (conn->sent < 0 && conn->sent != -EAGAIN && conn->sent != -EINTR) {
+                        log_warn ("error occurred when sending response back to client: %s", strerror (-conn->sent));
+                        close_connection (conn);
+                        return false;
+                }
+
+                if (conn->sent > 0)
+                        conn->out_off += conn->sent;
+
+                if (!connection_flushed (conn))
+                        return false;
+
+                // the room a send made is not reported by epoll like it is
+                // to plain calls, subscribers and stalled requests go on here
+                if (conn->sent > 0) {
+                        if (conn->subscribed && !events_deliver (conn))
+                                return false;
+
+                        if (conn->stalled && conn->out_len - conn->out_off < CONNECTION_MAX_BACKLOG) {
+                                if (!connection_process_commands (conn))
+                                        return false;
+                        }
+                }
+        }
+
+        if (conn->ring_submitted & RING_RECV) {
+                int n = conn->received;
+
+                if (n < 0 && n != -EAGAIN && n != -EINTR) {
+                        log_warn ("error occurred when reading from client: %s", strerror (-n));
+                        close_connection (conn);
+                        return false;
+                }
+
+                if (n == 0)
+                        conn->eof = true;
+
+                if (n > 0)
+                        conn->in_len += n;
+
+                // there may be more, the requests are handled once all of it
+                // was read like connection_read does
+                if (n > 0 && (size_t)n == conn->requested && conn->in_len <= PM_FRAME_HEADER_SIZE + PM_MAX_COMMAND_SIZE) {
+                        ring_queue (conn, RING_RECV);
+                        return true;
+                }
+
+                return connection_process_commands (conn);
+        }
+
+        return true;
+}
+
+/**
+ * Gives up on the ring after it failed. The entries of the failed
+ * submission are taken as not done: epoll reports the sockets to accept
+ * from and read again, the output is sent with plain calls.
+ */
+static void ring_failed ()
+{
+        log_error ("io_uring failed, serving clients with plain system calls: %s", strerror (errno));
+        uring_close (&ring);
+        accepting_count = 0;
+
+        pm_connection **lists[] = { &submitted_connections, &queued_connections };
+
+        for (int i = 0; i < 2; i++) {
+                while (*lists[i]) {
+                        pm_connection *conn = *lists[i];
+                        uint8_t ops = conn->ring_submitted | conn->ring_queued;
+
+                        ring_unlink (conn);
+                        conn->ring_submitted = conn->ring_queued = 0;
+
+                        if (ops & RING_SEND)
+                                connection_flush (conn);
+                }
+        }
+}
+
+/**
+ * Submits the accepts, reads and sends the callbacks queued and handles
+ * what they did, until the requests read were answered and the answers
+ * sent. A send the socket took only part of is continued once epoll reports
+ * room for the rest.
+ */
+static void complete_ring ()
+{
+        while (ring.fd >= 0 && (accepting_count > 0 || queued_connections)) {
+                ring_fill ();
+
+                uint64_t enters = ring.enters;
+                bool ok = uring_submit_and_wait (&ring);
+
+                stats.syscalls += ring.enters - enters;
+
+                if (!ok) {
+                        ring_failed ();
+                        return;
+                }
+
+                // only the results are taken first, handling them may close
+                // a connection whose entries completed too
+                struct io_uring_cqe *cqe;
+
+                while ((cqe = uring_next_cqe (&ring))) {
+                        void *target = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+                        int op = cqe->user_data & 3;
+                        int res = cqe->res;
+
+                        uring_seen (&ring);
+
+                        if (op == RING_ACCEPT) {
+                                if (res >= 0)
+                                        add_connection (res);
+                                else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED)
+                                        log_warn ("failed to accept connection: %s", strerror (-res));
+                        } else if (op == RING_SEND) {
+                                ((pm_connection *)target)->sent = res;
+                        } else {
+                                ((pm_connection *)target)->received = res;
+                        }
+                }
+
+                while (submitted_connections) {
+                        pm_connection *conn = submitted_connections;
+
+                        ring_unlink (conn);
+
+                        // queued again while it waited to be handled
+                        if (connection_completed (conn) && conn->ring_queued && !conn->ring_list)
+                                ring_link (conn, &queued_connections);
+                }
+        }
+}
+
+void watch_listen_socket (pm_watch *watch, int sock_fd)
+{
+        watch->fd = sock_fd;
+        watch->callback = handle_listen_event;
+        watch_add (watch, EPOLLIN);
+}
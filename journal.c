@@ -0,0 +1,608 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Process journal
+ *
+ * The process table is journaled to a file next to the daemon's socket. A
+ * daemon started after the previous one died, or the program a daemon was
+ * upgraded to, reads it back and adopts the processes that are still running
+ * instead of starting them all over.
+ *
+ * Every change to the table appends a record: the settings of a process when
+ * it is inserted, its pid, state and counters whenever they change, and its
+ * removal. Once the journal has grown to several times the size of the
+ * table, it is rewritten from the table.
+ *
+ * A record is appended with a single write and never synced. The journal has
+ * to outlive the daemon, not the machine: after a reboot none of the
+ * processes it describes exist any more, and a journal written before the
+ * last boot is discarded.
+ *
+ * The file starts with a magic number, the version of its encoding and the
+ * boot id. Every record is a u32 body size, a u8 record type and the body.
+ */
+
+#define JOURNAL_MAGIC 0x314a4d50 // "PMJ1"
+#define JOURNAL_VERSION 1
+
+// the journal is rewritten once it is this large and several times the size
+// it had after the last rewrite
+#define JOURNAL_COMPACT_MIN (256 * 1024)
+#define JOURNAL_COMPACT_RATIO 4
+
+#define JOURNAL_BOOT_ID_SIZE 36
+
+// records naming a higher slot are taken to be corrupt
+#define JOURNAL_MAX_SLOTS (1 << 24)
+
+typedef enum journal_record_type {
+        // daemon wide settings for new processes
+        JOURNAL_SETTINGS,
+        // a process was inserted, followed by its first JOURNAL_STATE
+        JOURNAL_PROCESS,
+        JOURNAL_STATE,
+        JOURNAL_REMOVE,
+} journal_record_type;
+
+/**
+ * A process as read back from the journal: the bodies of its JOURNAL_PROCESS
+ * record and of its latest JOURNAL_STATE record.
+ */
+typedef struct journal_entry {
+        pm_handle handle;
+        // position of the JOURNAL_PROCESS record, processes are restored in
+        // the order they were inserted
+        size_t order;
+        char *process;
+        size_t process_size;
+        char *state;
+        size_t state_size;
+} journal_entry;
+
+extern pm_configuration config;
+
+static int journal_fd = -1;
+static char *journal_path;
+static uint64_t journal_size;
+static uint64_t compacted_size;
+static pm_buffer record;
+
+static void read_boot_id (char *boot_id)
+{
+        memset (boot_id, 0, JOURNAL_BOOT_ID_SIZE);
+
+        int fd = open ("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+                return;
+
+        if (read (fd, boot_id, JOURNAL_BOOT_ID_SIZE) < 0)
+                memset (boot_id, 0, JOURNAL_BOOT_ID_SIZE);
+
+        close (fd);
+}
+
+/**
+ * Returns when the process pid started, in clock ticks after boot, or 0 if
+ * there is no such process. Together with the pid it names one process, a
+ * reused pid comes with a later start time.
+ */
+uint64_t read_start_ticks (pid_t pid)
+{
+        char path[64], buf[1024];
+
+        snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+
+        int fd = open (path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+                return 0;
+
+        ssize_t n = read (fd, buf, sizeof (buf) - 1);
+        close (fd);
+
+        if (n <= 0)
+                return 0;
+
+        buf[n] = '\0';
+
+        // the command name may contain anything, fields start after its ')'
+        char *p = strrchr (buf, ')');
+        unsigned long long ticks;
+
+        if (!p || sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &ticks) != 1)
+                return 0;
+
+        return ticks;
+}
+
+static void begin_record (journal_record_type type)
+{
+        buffer_put_u32 (&record, 0);
+        buffer_put_u8 (&record, type);
+}
+
+// the size of the record started at offset start
+static void end_record (size_t start)
+{
+        uint32_t size = record.len - start - 5;
+
+        for (int i = 0; i < 4; i++)
+                record.data[start + i] = (char)(size >> (8 * i));
+}
+
+static void put_settings ()
+{
+        size_t start = record.len;
+
+        begin_record (JOURNAL_SETTINGS);
+        buffer_put_string (&record, config.stdout_file);
+        buffer_put_string (&record, config.stderr_file);
+        buffer_put_u32 (&record, config.max_retries);
+        buffer_put_u64 (&record, config.rotation.max_size);
+        buffer_put_u32 (&record, config.rotation.max_age);
+        buffer_put_u32 (&record, config.rotation.keep);
+        put_zygote_pools (&record);
+        end_record (start);
+}
+
+static void put_state (pm_process *process)
+{
+        size_t start = record.len;
+
+        begin_record (JOURNAL_STATE);
+        buffer_put_u64 (&record, process->handle);
+        buffer_put_u32 (&record, process->pid);
+        buffer_put_u64 (&record, process->start_ticks);
+        buffer_put_u64 (&record, process->start_time);
+        buffer_put_u64 (&record, process->stdout_pipe);
+        buffer_put_u64 (&record, process->stderr_pipe);
+        buffer_put_u8 (&record, process->state);
+        buffer_put_u32 (&record, process->restarts);
+        buffer_put_u32 (&record, process->max_retries);
+        buffer_put_u32 (&record, process->backoff);
+        buffer_put_u32 (&record, process->exit_status);
+        buffer_put_u32 (&record, process->cpu_slot);
+        end_record (start);
+}
+
+static void put_process (pm_process *process)
+{
+        size_t start = record.len;
+
+        begin_record (JOURNAL_PROCESS);
+        buffer_put_u64 (&record, process->handle);
+        buffer_put_string (&record, process->name);
+        buffer_put_string (&record, process->stdout_file);
+        buffer_put_string (&record, process->stderr_file);
+        buffer_put_u32 (&record, process->instance);
+        buffer_put_u8 (&record, process->timestamps);
+        buffer_put_u64 (&record, process->rotation.max_size);
+        buffer_put_u32 (&record, process->rotation.max_age);
+        buffer_put_u32 (&record, process->rotation.keep);
+        buffer_put_u32 (&record, process->limits.cpu_percent);
+        buffer_put_u32 (&record, process->limits.pids_max);
+        buffer_put_u64 (&record, process->limits.memory_max);
+        buffer_put_u64 (&record, process->watchdog.max_memory);
+        buffer_put_u32 (&record, process->watchdog.max_cpu_percent);
+        buffer_put_u32 (&record, process->watchdog.window);
+
+        // the arguments one after the other, each null terminated
+        size_t size_at = record.len;
+        buffer_put_u32 (&record, 0);
+
+        for (int i = 0; process->argv[i]; i++)
+                buffer_put_bytes (&record, process->argv[i], strlen (process->argv[i]) + 1);
+
+        uint32_t size = record.len - size_at - 4;
+
+        for (int i = 0; i < 4; i++)
+                record.data[size_at + i] = (char)(size >> (8 * i));
+
+        for (int kind = 0; kind < PM_PROBE_KINDS; kind++)
+                put_probe (&record, &process->probes[kind]);
+
+        buffer_put_string (&record, process->listen);
+        buffer_put_string (&record, process->placement);
+        end_record (start);
+
+        put_state (process);
+}
+
+/**
+ * Writes the whole journal anew from the process table, into a new file
+ * that replaces the old one once it is complete.
+ */
+static void compact_journal ()
+{
+        char path[PATH_MAX], boot_id[JOURNAL_BOOT_ID_SIZE];
+
+        snprintf (path, sizeof (path), "%s.new", journal_path);
+
+        int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+
+        if (fd < 0) {
+                log_warn ("failed to write journal %s: %s", path, strerror (errno));
+                return;
+        }
+
+        read_boot_id (boot_id);
+        buffer_clear (&record);
+        buffer_put_u32 (&record, JOURNAL_MAGIC);
+        buffer_put_u32 (&record, JOURNAL_VERSION);
+        buffer_put_bytes (&record, boot_id, JOURNAL_BOOT_ID_SIZE);
+
+        put_settings ();
+
+        for (pm_process *p = config.processes.head; p != NULL; p = p->next)
+                put_process (p);
+
+        if (write (fd, record.data, record.len) != (ssize_t)record.len || rename (path, journal_path) < 0) {
+                log_warn ("failed to write journal %s: %s", path, strerror (errno));
+                close (fd);
+                unlink (path);
+                return;
+        }
+
+        if (journal_fd >= 0)
+                close (journal_fd);
+
+        journal_fd = fd;
+        journal_size = compacted_size = record.len;
+}
+
+static void append_record ()
+{
+        if (write (journal_fd, record.data, record.len) != (ssize_t)record.len) {
+                log_warn ("failed to append to journal %s: %s", journal_path, strerror (errno));
+                return;
+        }
+
+        journal_size += record.len;
+
+        if (journal_size > JOURNAL_COMPACT_MIN && journal_size > compacted_size * JOURNAL_COMPACT_RATIO)
+                compact_journal ();
+}
+
+void journal_insert (pm_process *process)
+{
+        if (journal_fd < 0)
+                return;
+
+        buffer_clear (&record);
+        put_process (process);
+        append_record ();
+}
+
+void journal_update (pm_process *process)
+{
+        if (journal_fd < 0)
+                return;
+
+        buffer_clear (&record);
+        put_state (process);
+        append_record ();
+}
+
+void journal_remove (pm_process *process)
+{
+        if (journal_fd < 0)
+                return;
+
+        buffer_clear (&record);
+
+        size_t start = record.len;
+
+        begin_record (JOURNAL_REMOVE);
+        buffer_put_u64 (&record, process->handle);
+        end_record (start);
+        append_record ();
+}
+
+void journal_settings ()
+{
+        if (journal_fd < 0)
+                return;
+
+        buffer_clear (&record);
+        put_settings ();
+        append_record ();
+}
+
+static void get_path (pm_reader *reader, char *path)
+{
+        reader_get_string (reader, path, PATH_MAX);
+}
+
+static void restore_settings (char *data, size_t size)
+{
+        pm_reader reader = { .data = data, .len = size };
+        char stdout_file[PATH_MAX], stderr_file[PATH_MAX];
+
+        get_path (&reader, stdout_file);
+        get_path (&reader, stderr_file);
+        config.max_retries = reader_get_u32 (&reader);
+        config.rotation.max_size = reader_get_u64 (&reader);
+        config.rotation.max_age = reader_get_u32 (&reader);
+        config.rotation.keep = reader_get_u32 (&reader);
+
+        set_stdout (stdout_file);
+        set_stderr (stderr_file);
+
+        uint8_t pools = reader_get_u8 (&reader);
+
+        for (uint8_t i = 0; i < pools && !reader.error; i++) {
+                char program[PM_NAME_MAX];
+
+                reader_get_string (&reader, program, sizeof (program));
+                uint32_t size = reader_get_u32 (&reader);
+
+                if (!reader.error && zygote_register (program, size) != OK)
+                        log_warn ("zygote pool of %s could not be restored", program);
+        }
+}
+
+/**
+ * Recreates the process of a journal entry and adopts it. Returns false if
+ * the entry is malformed.
+ */
+static bool restore_entry (journal_entry *entry)
+{
+        pm_reader reader = { .data = entry->process, .len = entry->process_size };
+        char name[PATH_MAX], stdout_file[PATH_MAX], stderr_file[PATH_MAX];
+        pm_process_options options = { 0 };
+
+        reader_get_u64 (&reader);
+        get_path (&reader, name);
+        get_path (&reader, stdout_file);
+        get_path (&reader, stderr_file);
+        options.instance = (int32_t)reader_get_u32 (&reader);
+        options.timestamps = reader_get_u8 (&reader);
+        options.rotation.max_size = reader_get_u64 (&reader);
+        options.rotation.max_age = reader_get_u32 (&reader);
+        options.rotation.keep = reader_get_u32 (&reader);
+        options.limits.cpu_percent = reader_get_u32 (&reader);
+        options.limits.pids_max = reader_get_u32 (&reader);
+        options.limits.memory_max = reader_get_u64 (&reader);
+        options.watchdog.max_memory = reader_get_u64 (&reader);
+        options.watchdog.max_cpu_percent = reader_get_u32 (&reader);
+        options.watchdog.window = reader_get_u32 (&reader);
+
+        uint32_t size = reader_get_u32 (&reader);
+        char *command = reader_get_bytes (&reader, size);
+        char probe_targets[PM_PROBE_KINDS][PM_PROBE_TARGET_MAX];
+        char listen[PM_LISTEN_SPEC_MAX] = "";
+        char placement[PM_PLACEMENT_SPEC_MAX] = "";
+
+        // records of a daemon from before probes have none
+        for (int kind = 0; kind < PM_PROBE_KINDS && reader.off < reader.len; kind++)
+                get_probe (&reader, &options.probes[kind], probe_targets[kind]);
+
+        if (reader.off < reader.len)
+                reader_get_string (&reader, listen, sizeof (listen));
+
+        if (reader.off < reader.len)
+                reader_get_string (&reader, placement, sizeof (placement));
+
+        if (reader.error || size == 0 || command[size - 1] != '\0' || !entry->state)
+                return false;
+
+        options.name = name;
+        options.stdout_file = *stdout_file ? stdout_file : NULL;
+        options.stderr_file = *stderr_file ? stderr_file : NULL;
+        options.listen = *listen ? listen : NULL;
+        options.placement = *placement ? placement : NULL;
+
+        int args = 0;
+        for (uint32_t i = 0; i < size; i++)
+                if (!command[i])
+                        args++;
+
+        char **argv = malloc_nofail ((args + 1) * sizeof (char *));
+        char *arg = command;
+
+        for (int i = 0; i < args; arg += strlen (arg) + 1)
+                argv[i++] = arg;
+
+        argv[args] = NULL;
+
+        pm_process *process = create_process_entry (argv, &options);
+        free (argv);
+
+        reader = (pm_reader) { .data = entry->state, .len = entry->state_size };
+
+        reader_get_u64 (&reader);
+        process->pid = reader_get_u32 (&reader);
+        process->start_ticks = reader_get_u64 (&reader);
+        process->start_time = reader_get_u64 (&reader);
+        process->stdout_pipe = reader_get_u64 (&reader);
+        process->stderr_pipe = reader_get_u64 (&reader);
+        process->state = reader_get_u8 (&reader);
+        process->restarts = reader_get_u32 (&reader);
+        process->max_retries = (int32_t)reader_get_u32 (&reader);
+        process->backoff = reader_get_u32 (&reader);
+        process->exit_status = (int32_t)reader_get_u32 (&reader);
+
+        int cpu_slot = reader.off < reader.len ? (int32_t)reader_get_u32 (&reader) : -1;
+
+        if (reader.error) {
+                free_process_entry (process);
+                return false;
+        }
+
+        // the sockets did not survive the daemon, a running process still
+        // has them
+        if (process->listen && process->state == PROCESS_RUNNING && process->pid > 0)
+                process->listener = listener_acquire (process->name, process->listen, process->pid);
+
+        // a running process stays on its CPUs, the others take a slot again
+        // when they start
+        if (process->placement && process->state == PROCESS_RUNNING && process->pid > 0)
+                affinity_adopt (process, cpu_slot);
+
+        restore_process (process, entry->handle);
+        adopt_process (process);
+
+        return true;
+}
+
+static int compare_entries (const void *a, const void *b)
+{
+        const journal_entry *x = a, *y = b;
+
+        return (x->order > y->order) - (x->order < y->order);
+}
+
+/**
+ * Reads back the journal in data and restores the processes it describes.
+ * Entries are kept by the slot of their handle, a later record for the same
+ * slot but another generation belongs to a process that replaced the one
+ * before.
+ */
+static void replay_journal (char *data, size_t size)
+{
+        char boot_id[JOURNAL_BOOT_ID_SIZE];
+        pm_reader reader = { .data = data, .len = size };
+
+        uint32_t magic = reader_get_u32 (&reader);
+        uint32_t version = reader_get_u32 (&reader);
+        char *journal_boot_id = reader_get_bytes (&reader, JOURNAL_BOOT_ID_SIZE);
+
+        if (reader.error || magic != JOURNAL_MAGIC || version != JOURNAL_VERSION) {
+                log_warn ("ignoring journal %s, it is not a journal this daemon can read", journal_path);
+                return;
+        }
+
+        read_boot_id (boot_id);
+
+        if (memcmp (boot_id, journal_boot_id, JOURNAL_BOOT_ID_SIZE) != 0) {
+                log_info ("ignoring journal %s, it was written before the system was restarted", journal_path);
+                return;
+        }
+
+        journal_entry *entries = NULL;
+        uint32_t entry_count = 0;
+        size_t order = 0;
+        char *settings = NULL;
+        size_t settings_size = 0;
+
+        while (reader.off < reader.len) {
+                uint32_t record_size = reader_get_u32 (&reader);
+                uint8_t type = reader_get_u8 (&reader);
+                char *body = reader_get_bytes (&reader, record_size);
+
+                // a record cut short by the end of the daemon is dropped
+                if (reader.error)
+                        break;
+
+                // only the latest settings count
+                if (type == JOURNAL_SETTINGS) {
+                        settings = body;
+                        settings_size = record_size;
+                        continue;
+                }
+
+                pm_reader record_reader = { .data = body, .len = record_size };
+                pm_handle handle = reader_get_u64 (&record_reader);
+                uint32_t slot = (uint32_t)handle;
+
+                // slots are reused, a table never has this many
+                if (record_reader.error || slot >= JOURNAL_MAX_SLOTS)
+                        continue;
+
+                if (slot >= entry_count) {
+                        uint32_t count = slot + 1 > entry_count * 2 ? slot + 1 : entry_count * 2;
+
+                        entries = realloc_nofail (entries, count * sizeof (journal_entry));
+                        memset (entries + entry_count, 0, (count - entry_count) * sizeof (journal_entry));
+                        entry_count = count;
+                }
+
+                journal_entry *entry = &entries[slot];
+
+                if (type == JOURNAL_PROCESS) {
+                        *entry = (journal_entry) { .handle = handle, .order = order++, .process = body, .process_size = record_size };
+                } else if (entry->handle == handle && type == JOURNAL_STATE) {
+                        entry->state = body;
+                        entry->state_size = record_size;
+                } else if (entry->handle == handle && type == JOURNAL_REMOVE) {
+                        *entry = (journal_entry) { 0 };
+                }
+        }
+
+        if (settings)
+                restore_settings (settings, settings_size);
+
+        size_t live = 0;
+
+        for (uint32_t i = 0; i < entry_count; i++)
+                if (entries[i].process)
+                        entries[live++] = entries[i];
+
+        qsort (entries, live, sizeof (journal_entry), compare_entries);
+
+        for (size_t i = 0; i < live; i++)
+                if (!restore_entry (&entries[i]))
+                        log_warn ("dropping a malformed entry of journal %s", journal_path);
+
+        if (live > 0)
+                log_info ("restored %zu processes from journal %s", live, journal_path);
+
+        free (entries);
+}
+
+/**
+ * Restores the process table from the journal of an earlier daemon, if
+ * there is one, and starts journaling this daemon's process table.
+ */
+void journal_open ()
+{
+        char path[PATH_MAX];
+
+        snprintf (path, sizeof (path), "%s.journal", config.socket_file);
+        journal_path = strdup (path);
+
+        int fd = open (journal_path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+
+        if (fd >= 0 && fstat (fd, &st) == 0 && st.st_size > 0) {
+                char *data = malloc_nofail (st.st_size);
+                size_t len = 0;
+                ssize_t n;
+
+                while (len < (size_t)st.st_size && (n = read (fd, data + len, st.st_size - len)) > 0)
+                        len += n;
+
+                replay_journal (data, len);
+                free (data);
+        }
+
+        if (fd >= 0)
+                close (fd);
+
+        compact_journal ();
+}
+
+/**
+ * Stops journaling. A discarded journal is removed, the next daemon starts
+ * out with an empty process table.
+ */
+void journal_close (bool discard)
+{
+        if (journal_fd < 0)
+                return;
+
+        close (journal_fd);
+        journal_fd = -1;
+
+        if (discard)
+                unlink (journal_path);
+}
@@ -0,0 +1,405 @@
+#include "pm.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Listening sockets
+ *
+ * A group may have the daemon own its listening sockets. They are opened
+ * when the first process of the group starts and stay open until the last
+ * one is removed or retired, so they outlive every restart of the processes
+ * accepting from them: a connection that arrives while no process is
+ * accepting waits in the backlog rather than being refused.
+ *
+ * Processes get the sockets the way systemd's socket activation passes
+ * them: as descriptors 3 and up, with LISTEN_FDS set to their number and
+ * LISTEN_PID to the pid of the process. posix_spawn cannot know the pid
+ * before the child exists, so these processes are started through this
+ * program as PM_LISTEN_NAME, which sets LISTEN_PID and execs the program.
+ * Whether that exec failed comes back over a pipe, as with a zygote.
+ *
+ * Sockets do not survive the daemon, a daemon that takes over takes them
+ * back from a running process of the group with pidfd_getfd. If it cannot,
+ * tcp sockets are opened again next to the old ones with SO_REUSEPORT.
+ */
+
+extern pm_configuration config;
+
+// sockets are kept above the descriptors they are passed as, so setting up
+// a child's descriptors never overwrites a socket still to be passed
+#define LISTEN_FD_FLOOR (3 + PM_LISTEN_MAX)
+
+static pm_listener *listeners;
+
+/**
+ * Copies the address of a spec that starts at spec to item, which holds
+ * PM_LISTEN_SPEC_MAX bytes, and returns where the next one starts, or NULL
+ * if there are no more.
+ */
+static char *next_address (char *spec, char *item)
+{
+        if (!spec || !*spec)
+                return NULL;
+
+        size_t len = strcspn (spec, ",");
+
+        if (len >= PM_LISTEN_SPEC_MAX)
+                len = PM_LISTEN_SPEC_MAX - 1;
+
+        memcpy (item, spec, len);
+        item[len] = '\0';
+
+        return spec[len] ? spec + len + 1 : spec + len;
+}
+
+/**
+ * Parses an address given as tcp:[host:]port or unix:path. A tcp address
+ * without a host listens on every IPv4 address. Returns false if it is
+ * malformed.
+ */
+static bool parse_address (char *item, struct sockaddr_storage *addr, socklen_t *len)
+{
+        memset (addr, 0, sizeof (*addr));
+
+        if (strncmp (item, "unix:", 5) == 0) {
+                struct sockaddr_un *un = (struct sockaddr_un *)addr;
+
+                if (!item[5] || strlen (item + 5) >= sizeof (un->sun_path))
+                        return false;
+
+                un->sun_family = AF_UNIX;
+                strcpy (un->sun_path, item + 5);
+                *len = sizeof (*un);
+                return true;
+        }
+
+        if (strncmp (item, "tcp:", 4) != 0)
+                return false;
+
+        struct sockaddr_in *in = (struct sockaddr_in *)addr;
+        char host[INET_ADDRSTRLEN] = "0.0.0.0";
+        char *port = strrchr (item + 4, ':');
+
+        if (port) {
+                size_t host_len = port - (item + 4);
+
+                if (host_len >= sizeof (host))
+                        return false;
+
+                memcpy (host, item + 4, host_len);
+                host[host_len] = '\0';
+                port++;
+        } else {
+                port = item + 4;
+        }
+
+        char *end;
+        unsigned long number = strtoul (port, &end, 10);
+
+        if (end == port || *end || number == 0 || number > 65535 || inet_pton (AF_INET, host, &in->sin_addr) != 1)
+                return false;
+
+        in->sin_family = AF_INET;
+        in->sin_port = htons (number);
+        *len = sizeof (*in);
+        return true;
+}
+
+/**
+ * Checks that the spec is a list of at most PM_LISTEN_MAX addresses and
+ * returns a copy with the paths of unix sockets made absolute, the daemon
+ * runs elsewhere. Returns NULL if the spec is malformed.
+ */
+char *parse_listen_spec (char *spec)
+{
+        char item[PM_LISTEN_SPEC_MAX];
+        struct sockaddr_storage addr;
+        socklen_t len;
+        pm_buffer parsed = { 0 };
+        int count = 0;
+
+        for (char *next = spec; (next = next_address (next, item)); count++) {
+                if (count == PM_LISTEN_MAX || !parse_address (item, &addr, &len)) {
+                        buffer_free (&parsed);
+                        return NULL;
+                }
+
+                if (count > 0)
+                        buffer_put_bytes (&parsed, ",", 1);
+
+                if (addr.ss_family == AF_UNIX) {
+                        char *path = absolute_path (item + 5);
+
+                        buffer_put_bytes (&parsed, "unix:", 5);
+                        buffer_put_bytes (&parsed, path, strlen (path));
+                        free (path);
+                } else {
+                        buffer_put_bytes (&parsed, item, strlen (item));
+                }
+        }
+
+        buffer_put_u8 (&parsed, '\0');
+
+        if (count == 0 || parsed.len > PM_LISTEN_SPEC_MAX) {
+                buffer_free (&parsed);
+                return NULL;
+        }
+
+        return parsed.data;
+}
+
+static uint64_t path_inode (struct sockaddr_storage *addr)
+{
+        struct stat st;
+
+        if (addr->ss_family != AF_UNIX || stat (((struct sockaddr_un *)addr)->sun_path, &st) < 0 || !S_ISSOCK (st.st_mode))
+                return 0;
+
+        return st.st_ino;
+}
+
+/**
+ * Moves a socket above LISTEN_FD_FLOOR, closing the descriptor it had.
+ * Returns the new descriptor, or -1 with errno set.
+ */
+static int raise_fd (int fd)
+{
+        if (fd < 0 || fd >= LISTEN_FD_FLOOR)
+                return fd;
+
+        int raised = fcntl (fd, F_DUPFD_CLOEXEC, LISTEN_FD_FLOOR);
+        int err = errno;
+
+        close (fd);
+        errno = err;
+
+        return raised;
+}
+
+static int open_socket (struct sockaddr_storage *addr, socklen_t len)
+{
+        int fd = socket (addr->ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int on = 1;
+
+        if (fd < 0)
+                return -1;
+
+        if (addr->ss_family == AF_INET) {
+                setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+                setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on));
+        } else if (path_inode (addr)) {
+                // a socket file left behind by an earlier daemon
+                unlink (((struct sockaddr_un *)addr)->sun_path);
+        }
+
+        if (bind (fd, (struct sockaddr *)addr, len) < 0 || listen (fd, SOMAXCONN) < 0) {
+                int err = errno;
+                close (fd);
+                errno = err;
+                return -1;
+        }
+
+        return raise_fd (fd);
+}
+
+/**
+ * Returns whether fd is a socket listening on addr.
+ */
+static bool is_listening_on (int fd, struct sockaddr_storage *addr)
+{
+        struct sockaddr_storage bound = { 0 };
+        socklen_t bound_len = sizeof (bound);
+        int listening = 0;
+        socklen_t size = sizeof (listening);
+
+        if (getsockopt (fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) < 0 || !listening)
+                return false;
+
+        if (getsockname (fd, (struct sockaddr *)&bound, &bound_len) < 0 || bound.ss_family != addr->ss_family)
+                return false;
+
+        if (addr->ss_family == AF_UNIX)
+                return strcmp (((struct sockaddr_un *)&bound)->sun_path, ((struct sockaddr_un *)addr)->sun_path) == 0;
+
+        struct sockaddr_in *a = (struct sockaddr_in *)&bound, *b = (struct sockaddr_in *)addr;
+
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+static void close_sockets (pm_listener *listener)
+{
+        for (int i = 0; i < listener->count; i++)
+                close (listener->fds[i]);
+
+        listener->count = 0;
+}
+
+/**
+ * Takes the sockets from the process pid, which got them as descriptors 3
+ * and up. Returns false unless every one of them is still listening on its
+ * address.
+ */
+static bool take_sockets (pm_listener *listener, pid_t pid)
+{
+        char item[PM_LISTEN_SPEC_MAX];
+        struct sockaddr_storage addr;
+        socklen_t len;
+        int pidfd = open_pidfd (pid);
+
+        if (pidfd < 0)
+                return false;
+
+        for (char *next = listener->spec; (next = next_address (next, item));) {
+                int fd = parse_address (item, &addr, &len) ? syscall (SYS_pidfd_getfd, pidfd, 3 + listener->count, 0) : -1;
+
+                if (fd >= 0 && !is_listening_on (fd, &addr)) {
+                        close (fd);
+                        fd = -1;
+                }
+
+                if ((fd = raise_fd (fd)) < 0) {
+                        close (pidfd);
+                        close_sockets (listener);
+                        return false;
+                }
+
+                listener->fds[listener->count] = fd;
+                listener->paths[listener->count++] = path_inode (&addr);
+        }
+
+        close (pidfd);
+        return true;
+}
+
+static bool open_sockets (pm_listener *listener)
+{
+        char item[PM_LISTEN_SPEC_MAX];
+        struct sockaddr_storage addr;
+        socklen_t len;
+
+        for (char *next = listener->spec; (next = next_address (next, item));) {
+                int fd = -1;
+
+                if (!parse_address (item, &addr, &len))
+                        errno = EINVAL;
+                else
+                        fd = open_socket (&addr, len);
+
+                if (fd < 0) {
+                        int err = errno;
+                        log_error ("failed to listen on %s for %s: %s", item, listener->name, strerror (err));
+                        close_sockets (listener);
+                        errno = err;
+                        return false;
+                }
+
+                listener->fds[listener->count] = fd;
+                listener->paths[listener->count++] = path_inode (&addr);
+        }
+
+        return true;
+}
+
+/**
+ * Returns the listening sockets of the group name on the addresses in spec,
+ * opening them unless the group already has them. The sockets of a process
+ * pid started by an earlier daemon are taken over if they still listen.
+ * Every call has to be matched by a listener_release. Returns NULL with
+ * errno set if the sockets could not be opened.
+ */
+pm_listener *listener_acquire (char *name, char *spec, pid_t pid)
+{
+        for (pm_listener *listener = listeners; listener != NULL; listener = listener->next) {
+                if (strcmp (listener->name, name) == 0 && strcmp (listener->spec, spec) == 0) {
+                        listener->refs++;
+                        return listener;
+                }
+        }
+
+        pm_listener *listener = calloc_nofail (1, sizeof (pm_listener));
+
+        snprintf (listener->name, sizeof (listener->name), "%s", name);
+        listener->spec = strdup (spec);
+
+        if (pid > 0 && take_sockets (listener, pid)) {
+                log_info ("took over the sockets of %s listening on %s from pid %d", name, spec, pid);
+        } else if (open_sockets (listener)) {
+                log_info ("%s now listens on %s", name, spec);
+        } else {
+                int err = errno;
+                free (listener->spec);
+                free (listener);
+                errno = err;
+                return NULL;
+        }
+
+        listener->refs = 1;
+        listener->next = listeners;
+        listeners = listener;
+
+        return listener;
+}
+
+/**
+ * Drops a reference to listening sockets, the last one closes them and
+ * removes their socket files.
+ */
+void listener_release (pm_listener *listener)
+{
+        if (!listener || --listener->refs > 0)
+                return;
+
+        char item[PM_LISTEN_SPEC_MAX];
+        struct sockaddr_storage addr;
+        socklen_t len;
+        int i = 0;
+
+        for (char *next = listener->spec; (next = next_address (next, item)) && i < listener->count; i++)
+                if (listener->paths[i] && parse_address (item, &addr, &len) && path_inode (&addr) == listener->paths[i])
+                        unlink (((struct sockaddr_un *)&addr)->sun_path);
+
+        log_info ("%s no longer listens on %s", listener->name, listener->spec);
+        close_sockets (listener);
+
+        pm_listener **link = &listeners;
+
+        while (*link != listener)
+                link = &(*link)->next;
+
+        *link = listener->next;
+        free (listener->spec);
+        free (listener);
+}
+
+/**
+ * Runs as PM_LISTEN_NAME in a process that was given listening sockets:
+ * argv holds the program and its arguments. Sets LISTEN_PID now that the
+ * pid is known and execs the program, which keeps the pid. The daemon sees
+ * end of file on PM_LISTEN_STATUS_FD once the program runs, or the errno of
+ * the failed exec.
+ */
+void listen_exec (char **argv)
+{
+        char pid[16];
+
+        fcntl (PM_LISTEN_STATUS_FD, F_SETFD, FD_CLOEXEC);
+
+        snprintf (pid, sizeof (pid), "%d", getpid ());
+        setenv ("LISTEN_PID", pid, 1);
+
+        execvp (argv[0], argv);
+
+        int err = errno;
+
+        write (PM_LISTEN_STATUS_FD, &err, sizeof (err));
+        _exit (127);
+}
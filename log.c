@@ -1,10 +1,65 @@
+#define _GNU_SOURCE
 #include "pm.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Logging
+ *
+ * In the daemon a message is formatted straight into a slot of a bounded
+ * ring shared by every thread, and a single flusher thread turns the slots
+ * into lines and writes them out in batches. Claiming a slot is one compare
+ * and swap, so logging from the event loop, the monitor or the capture
+ * thread never waits on stderr, and since only the flusher writes, lines of
+ * different threads never tear. When the ring is full messages are dropped
+ * and counted rather than blocking the caller.
+ *
+ * Outside the daemon, or before the flusher runs, every message is written
+ * synchronously with a single write.
+ */
+
+#define LOG_RING_SIZE 1024
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+
+// longest message kept, longer ones are truncated
+#define LOG_MESSAGE_MAX 480
+
+#define LOG_LINE_MAX (LOG_MESSAGE_MAX * 2 + 128)
+#define LOG_BATCH_SIZE (64 * 1024)
+
+extern pm_configuration config;
 
 pm_identity process_identity;
 
+typedef struct log_slot {
+        // equals the position the slot is free for, one past it once filled
+        _Atomic size_t sequence;
+        uint8_t level;
+        uint8_t identity;
+        uint16_t len;
+        struct timespec time;
+        char text[LOG_MESSAGE_MAX];
+} log_slot;
+
+static log_slot ring[LOG_RING_SIZE];
+static _Atomic size_t enqueue_pos;
+static size_t dequeue_pos;
+static _Atomic uint64_t dropped;
+
+static atomic_bool async;
+static atomic_bool flusher_sleeping;
+static atomic_bool stopping;
+static int wake_fd = -1;
+static pthread_t flusher_thread;
+
 char *get_identity_name (pm_identity id)
 {
         switch (id) {
@@ -15,26 +70,358 @@ char *get_identity_name (pm_identity id)
         }
 }
 
+static char *level_name (pm_log_level level)
+{
+        switch (level) {
+        case LOG_LEVEL_INFO: return "INFO";
+        case LOG_LEVEL_WARN: return "WARN";
+        case LOG_LEVEL_ERROR: return "ERR";
+        default: return "?";
+        }
+}
+
+/**
+ * Returns the level named by name, or -1 if there is no such level.
+ */
+int parse_log_level (char *name)
+{
+        if (strcasecmp (name, "info") == 0)
+                return LOG_LEVEL_INFO;
+
+        if (strcasecmp (name, "warn") == 0)
+                return LOG_LEVEL_WARN;
+
+        if (strcasecmp (name, "error") == 0)
+                return LOG_LEVEL_ERROR;
+
+        return -1;
+}
+
+static size_t format_json_string (char *out, size_t size, char *str, size_t len)
+{
+        size_t n = 0;
+
+        for (size_t i = 0; i < len && n + 7 < size; i++) {
+                unsigned char c = str[i];
+
+                if (c == '"' || c == '\\') {
+                        out[n++] = '\\';
+                        out[n++] = c;
+                } else if (c < 0x20) {
+                        n += snprintf (out + n, size - n, "\\u%04x", c);
+                } else {
+                        out[n++] = c;
+                }
+        }
+
+        return n;
+}
+
+/**
+ * Formats a message as one line of output, as text or as a JSON object if
+ * structured output was asked for. Returns the length of the line.
+ */
+static size_t format_line (char *line,
+                           pm_log_level level,
+                           pm_identity identity,
+                           struct timespec *when,
+                           char *text,
+                           size_t len)
+{
+        char stamp[40] = "";
+
+        if (config.log_timestamps) {
+                struct tm tm;
+                gmtime_r (&when->tv_sec, &tm);
+
+                size_t n = strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+                snprintf (stamp + n, sizeof (stamp) - n, ".%03ldZ", when->tv_nsec / 1000000);
+        }
+
+        size_t n;
+
+        if (config.log_format == LOG_FORMAT_JSON) {
+                n = snprintf (line, LOG_LINE_MAX, "{");
+
+                if (config.log_timestamps)
+                        n += snprintf (line + n, LOG_LINE_MAX - n, "\"time\":\"%s\",", stamp);
+
+                n += snprintf (line + n,
+                               LOG_LINE_MAX - n,
+                               "\"level\":\"%s\",\"source\":\"%s\",\"message\":\"",
+                               level_name (level),
+                               get_identity_name (identity));
+                n += format_json_string (line + n, LOG_LINE_MAX - n - 3, text, len);
+                n += snprintf (line + n, LOG_LINE_MAX - n, "\"}\n");
+        } else {
+                n = snprintf (line,
+                              LOG_LINE_MAX,
+                              "%s%s[%s: %s] ",
+                              stamp,
+                              *stamp ? " " : "",
+                              level_name (level),
+                              get_identity_name (identity));
+
+                memcpy (line + n, text, len);
+                n += len;
+                line[n++] = '\n';
+        }
+
+        return n;
+}
+
+static void write_all (char *data, size_t size)
+{
+        while (size > 0) {
+                ssize_t n = write (STDERR_FILENO, data, size);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n <= 0)
+                        return;
+
+                data += n;
+                size -= n;
+        }
+}
+
+static void log_sync (pm_log_level level, char *message, va_list args)
+{
+        char text[LOG_MESSAGE_MAX], line[LOG_LINE_MAX];
+        struct timespec now = { 0 };
+
+        if (config.log_timestamps)
+                clock_gettime (CLOCK_REALTIME, &now);
+
+        int len = vsnprintf (text, sizeof (text), message, args);
+
+        if (len < 0)
+                return;
+
+        if (len >= sizeof (text))
+                len = sizeof (text) - 1;
+
+        write_all (line, format_line (line, level, process_identity, &now, text, len));
+}
+
+static void wake_flusher ()
+{
+        uint64_t one = 1;
+
+        // can only fail if the counter is full, the flusher is awake then
+        write (wake_fd, &one, sizeof (one));
+}
+
+static void log_async (pm_log_level level, char *message, va_list args)
+{
+        size_t pos = atomic_load_explicit (&enqueue_pos, memory_order_relaxed);
+        log_slot *slot;
+
+        for (;;) {
+                slot = &ring[pos & LOG_RING_MASK];
+
+                size_t sequence = atomic_load_explicit (&slot->sequence, memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+                if (diff == 0) {
+                        if (atomic_compare_exchange_weak_explicit (&enqueue_pos,
+                                                                   &pos,
+                                                                   pos + 1,
+                                                                   memory_order_relaxed,
+                                                                   memory_order_relaxed))
+                                break;
+                } else if (diff < 0) {
+                        // the flusher has fallen a whole ring behind
+                        atomic_fetch_add_explicit (&dropped, 1, memory_order_relaxed);
+                        return;
+                } else {
+                        pos = atomic_load_explicit (&enqueue_pos, memory_order_relaxed);
+                }
+        }
+
+        int len = vsnprintf (slot->text, LOG_MESSAGE_MAX, message, args);
+
+        slot->len = len < 0 ? 0 : len >= LOG_MESSAGE_MAX ? LOG_MESSAGE_MAX - 1 : len;
+        slot->level = level;
+        slot->identity = process_identity;
+
+        if (config.log_timestamps)
+                clock_gettime (CLOCK_REALTIME_COARSE, &slot->time);
+
+        atomic_store_explicit (&slot->sequence, pos + 1, memory_order_release);
+
+        // pairs with the fence in the flusher before it goes to sleep
+        atomic_thread_fence (memory_order_seq_cst);
+
+        if (atomic_load_explicit (&flusher_sleeping, memory_order_relaxed)
+            && atomic_exchange (&flusher_sleeping, false))
+                wake_flusher ();
+}
+
+static void log_message (pm_log_level level, char *message, va_list args)
+{
+        if (atomic_load_explicit (&async, memory_order_acquire))
+                log_async (level, message, args);
+        else
+                log_sync (level, message, args);
+}
+
+static bool ring_empty ()
+{
+        log_slot *slot = &ring[dequeue_pos & LOG_RING_MASK];
+
+        return atomic_load_explicit (&slot->sequence, memory_order_acquire) != dequeue_pos + 1;
+}
+
+/**
+ * Moves every filled slot into the batch buffer and writes it out. Returns
+ * false if the ring was empty.
+ */
+static bool drain_ring (char *batch)
+{
+        size_t len = 0;
+        bool drained = false;
+        uint64_t lost = atomic_exchange (&dropped, 0);
+
+        if (lost > 0) {
+                char text[64];
+                struct timespec now;
+
+                clock_gettime (CLOCK_REALTIME, &now);
+                int n = snprintf (text, sizeof (text), "%llu log messages dropped", (unsigned long long)lost);
+
+                len += format_line (batch + len, LOG_LEVEL_WARN, process_identity, &now, text, n);
+        }
+
+        while (!ring_empty ()) {
+                log_slot *slot = &ring[dequeue_pos & LOG_RING_MASK];
+
+                if (len + LOG_LINE_MAX > LOG_BATCH_SIZE) {
+                        write_all (batch, len);
+                        len = 0;
+                }
+
+                len += format_line (batch + len, slot->level, slot->identity, &slot->time, slot->text, slot->len);
+
+                atomic_store_explicit (&slot->sequence, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+                dequeue_pos++;
+                drained = true;
+        }
+
+        write_all (batch, len);
+
+        return drained || lost > 0;
+}
+
+static void *flusher_thread_main (void *arg)
+{
+        char *batch = malloc_nofail (LOG_BATCH_SIZE);
+
+        for (;;) {
+                if (drain_ring (batch))
+                        continue;
+
+                if (atomic_load (&stopping))
+                        break;
+
+                atomic_store (&flusher_sleeping, true);
+                atomic_thread_fence (memory_order_seq_cst);
+
+                // a message published before the flag was seen must not be
+                // left waiting for the next one
+                if (!ring_empty () || atomic_load (&stopping)) {
+                        atomic_store (&flusher_sleeping, false);
+                        continue;
+                }
+
+                uint64_t count;
+
+                if (read (wake_fd, &count, sizeof (count)) < 0 && errno != EINTR)
+                        break;
+        }
+
+        free (batch);
+
+        return NULL;
+}
+
+/**
+ * Starts the flusher thread, from then on logging only queues messages.
+ */
+void log_init ()
+{
+        for (size_t i = 0; i < LOG_RING_SIZE; i++)
+                atomic_init (&ring[i].sequence, i);
+
+        wake_fd = eventfd (0, EFD_CLOEXEC);
+
+        // the flusher starts before the daemon blocks SIGCHLD for its
+        // signalfd, it must not take signals meant for the event loop
+        sigset_t all, old;
+        sigfillset (&all);
+        pthread_sigmask (SIG_SETMASK, &all, &old);
+
+        int err = wake_fd < 0 ? errno : pthread_create (&flusher_thread, NULL, flusher_thread_main, NULL);
+
+        pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+        if (err != 0) {
+                errno = err;
+                perror ("log_init");
+                fatal_error ();
+        }
+
+        atomic_store (&async, true);
+}
+
+/**
+ * Writes out every queued message and stops the flusher thread, logging is
+ * synchronous again afterwards. Called on the way out rather than from
+ * atexit, exit is not safe to join a thread from everywhere.
+ */
+void log_stop ()
+{
+        // the flusher cannot wait for itself, its own messages are lost
+        if (atomic_load (&async) && pthread_equal (pthread_self (), flusher_thread))
+                return;
+
+        if (!atomic_exchange (&async, false))
+                return;
+
+        atomic_store (&stopping, true);
+        atomic_store (&flusher_sleeping, false);
+        wake_flusher ();
+
+        pthread_join (flusher_thread, NULL);
+        close (wake_fd);
+        wake_fd = -1;
+
+        // pick up messages published while the flusher was finishing
+        char *batch = malloc_nofail (LOG_BATCH_SIZE);
+        drain_ring (batch);
+        free (batch);
+}
+
 void log_info (char *message, ...)
 {
+        if (config.log_level > LOG_LEVEL_INFO)
+                return;
+
         va_list args;
         va_start (args, message);
-
-        fprintf (stderr, "[INFO: %s] ", get_identity_name (process_identity));
-        vfprintf (stderr, message, args);
-        putchar ('\n');
+        log_message (LOG_LEVEL_INFO, message, args);
         va_end (args);
 }
 
 void log_warn (char *message, ...)
 {
+        if (config.log_level > LOG_LEVEL_WARN)
+                return;
+
         va_list args;
         va_start (args, message);
-
-        fprintf (stderr, "[WARN: %s] ", get_identity_name (process_identity));
-        vfprintf (stderr, message, args);
-        putchar ('\n');
-
+        log_message (LOG_LEVEL_WARN, message, args);
         va_end (args);
 }
 
@@ -42,10 +429,6 @@ void log_error (char *message, ...)
 {
         va_list args;
         va_start (args, message);
-
-        fprintf (stderr, "[ERR: %s] ", get_identity_name (process_identity));
-        vfprintf (stderr, message, args);
-        putchar ('\n');
-
+        log_message (LOG_LEVEL_ERROR, message, args);
         va_end (args);
 }
@@ -0,0 +1,34 @@
+#include "pm.h"
+#include <string.h>
+
+/*
+ * Entry point
+ *
+ * The same binary is the client, the daemon, and the zygotes, listeners and
+ * pipe holder the daemon starts, which one it is comes from argv[0] and the arguments.
+ * main lives apart from the rest so the tests can link everything else.
+ */
+
+extern pm_identity process_identity;
+extern pm_configuration config;
+
+int main (int argc, char **argv)
+{
+        // started by the daemon to wait for a process to exec
+        if (argc == 2 && strcmp (argv[0], PM_ZYGOTE_NAME) == 0)
+                zygote_main (argv[1]);
+
+        // started by the daemon to hand listening sockets to a process
+        if (argc >= 2 && strcmp (argv[0], PM_LISTEN_NAME) == 0)
+                listen_exec (argv + 1);
+
+        // started by the daemon to keep its capture pipes open
+        if (argc == 2 && strcmp (argv[0], PM_HOLDER_NAME) == 0)
+                holder_main (argv[1]);
+
+        process_identity = MAIN;
+        config.argv = argv;
+        parse_cmd_args (argc, argv);
+
+        return 0;
+}
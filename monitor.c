@@ -1,86 +1,401 @@
 #include "pm.h"
-#include <fcntl.h>
+#include <errno.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 extern pm_configuration config;
 
-void daemon_child_monitor_thread (void *arg)
+static pm_watch child_watch;
+
+static void schedule_restart (pm_process *child);
+
+/**
+ * Gives up on a process, it stays listed as exited.
+ */
+static void retire (pm_process *child)
 {
-        // block this thread from handling SIGCHLD
-        sigset_t set;
-        sigemptyset (&set);
-        sigaddset (&set, SIGCHLD);
-        pthread_sigmask (SIG_BLOCK, &set, NULL);
-        while (1) {
-                // we spend most of our time sleeping on the sem wait.
-                sem_wait (config.dead_child);
-                if (config.shutdown) {
-                        log_info ("monitor thread has exit per request");
-                        pthread_exit (NULL);
-                }
-                int status;
-                pid_t pid;
-                while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
-                        // determine how child died
-                        if (WIFEXITED (status)) {
-                                log_info ("child with pid %d exited with status code %d", pid, WEXITSTATUS (status));
-                        } else if (WIFSIGNALED (status)) {
-                                log_info ("child with pid %d was killed by signal %d", pid, WTERMSIG (status));
-                        }
-
-                        lock_process_list ();
-
-                        pm_process *child = find_process_with_pid (pid);
-
-                        if (!child) {
-                                log_warn ("erroneous SIGCHLD received. did not recognize child pid %d", pid);
-                                unlock_process_list ();
-                                continue;
-                        }
-
-                        // try to restart child if process was configured to
-                        // auto restart
-                        if (child->max_retries > 0) {
-                                child->max_retries--;
-
-                                log_info (
-                                        "autorestart enabled (retries left: %d). attempting to restart child with old pid %d...",
-                                        child->max_retries,
-                                        pid);
-
-                                new_process (child->program_name, child->argv, child->stdout_file, child->max_retries);
-                        }
-
-                        remove_process_from_list (child);
-                        unlock_process_list ();
-                }
+        publish_event (EVENT_RETIRED, child, 0, NULL);
+        retire_process (child);
+}
+
+/**
+ * Records an exit of the process and returns whether it is crash looping,
+ * having exited PM_CRASH_LOOP_EXITS times within PM_CRASH_LOOP_WINDOW
+ * seconds.
+ */
+static bool record_exit (pm_process *child, time_t now)
+{
+        child->exits[child->exit_count++ % PM_CRASH_LOOP_EXITS] = now;
+
+        if (child->exit_count < PM_CRASH_LOOP_EXITS)
+                return false;
+
+        // the slot about to be overwritten next holds the oldest exit
+        time_t oldest = child->exits[child->exit_count % PM_CRASH_LOOP_EXITS];
+
+        return now - oldest < PM_CRASH_LOOP_WINDOW;
+}
+
+static void handle_restart_timer (pm_timer *timer)
+{
+        pm_process *child = timer->data;
+
+        child->restarts++;
+        set_process_state (child, PROCESS_RUNNING);
+
+        log_info ("restarting %s (restart %u)...", child->name, child->restarts);
+
+        if (restart_process (child) > 0)
+                return;
+
+        // failing to start counts as another crash
+        if (child->max_retries > 0 && !record_exit (child, time (NULL))) {
+                child->max_retries--;
+                schedule_restart (child);
+                return;
+        }
+
+        retire (child);
+}
+
+/**
+ * Restarts a crashed process after a delay that doubles with every crash in
+ * a row, with jitter so that processes crashing together do not all come
+ * back at the same moment.
+ */
+static void schedule_restart (pm_process *child)
+{
+        uint64_t delay = PM_BACKOFF_MAX_MS;
+
+        if (child->backoff < 32 && (uint64_t)PM_BACKOFF_INITIAL_MS << child->backoff < PM_BACKOFF_MAX_MS)
+                delay = (uint64_t)PM_BACKOFF_INITIAL_MS << child->backoff;
+
+        // wait between half and all of the delay
+        delay = delay / 2 + random () % (delay / 2 + 1);
+        child->backoff++;
+
+        log_info ("restarting %s in %llu ms (retries left: %d)", child->name, (unsigned long long)delay, child->max_retries);
+
+        child->restart_timer.callback = handle_restart_timer;
+        child->restart_timer.data = child;
+
+        set_process_state (child, PROCESS_WAITING);
+        timer_schedule (&child->restart_timer, delay);
+
+        publish_event (EVENT_RESTART_SCHEDULED, child, delay, NULL);
+}
+
+static void handle_kill_timer (pm_timer *timer)
+{
+        pm_process *child = timer->data;
+
+        if (child->pid <= 0)
+                return;
+
+        log_warn ("%s (pid %d) did not exit after SIGTERM, sending SIGKILL...", child->name, child->pid);
+
+        if (!cgroup_kill (child))
+                signal_group (child->pid, SIGKILL);
+}
+
+/**
+ * Stops a running process: it gets SIGTERM, and SIGKILL if it is still
+ * around after grace_ms.
+ */
+static void terminate (pm_process *child, uint32_t grace_ms)
+{
+        signal_group (child->pid, SIGTERM);
+
+        child->kill_timer.callback = handle_kill_timer;
+        child->kill_timer.data = child;
+        timer_schedule (&child->kill_timer, grace_ms);
+}
+
+/**
+ * Recycles a process that has been over one of its watchdog limits for the
+ * whole window: it gets SIGTERM, SIGKILL if it is still around after the
+ * shutdown grace period, and is started again once it has exited.
+ */
+void watchdog_check (pm_process *process)
+{
+        pm_watchdog_policy *policy = &process->watchdog;
+        pm_sample *sample = get_sample (process, 0);
+
+        if (!sample || process->recycling || process->replaced || (policy->max_memory == 0 && policy->max_cpu_percent == 0))
+                return;
+
+        bool memory = policy->max_memory > 0 && sample->rss > policy->max_memory;
+        bool cpu = policy->max_cpu_percent > 0 && get_cpu_permille (process, 0) > policy->max_cpu_percent * 10;
+
+        if (!memory && !cpu) {
+                process->exceeded_since = 0;
+                return;
         }
+
+        if (process->exceeded_since == 0)
+                process->exceeded_since = sample->time_ms;
+
+        uint32_t window = policy->window ? policy->window : PM_WATCHDOG_WINDOW;
+
+        if (sample->time_ms - process->exceeded_since < window * 1000ULL)
+                return;
+
+        log_warn ("%s (pid %d) exceeded its %s limit for %u seconds, restarting it",
+                  process->name,
+                  process->pid,
+                  memory ? "memory" : "CPU",
+                  window);
+
+        publish_event (EVENT_RECYCLED, process, 0, memory ? "memory" : "CPU");
+
+        process->recycling = true;
+        process->exceeded_since = 0;
+        terminate (process, PM_SHUTDOWN_GRACE_MS);
 }
 
-pthread_t spawn_daemon_child_monitor_thread ()
+/**
+ * Stops a process that failed its liveness probe. Unlike a recycled process
+ * it counts as crashed, whether and when it comes back is up to the restart
+ * policy.
+ */
+void liveness_failed (pm_process *process, char *reason)
 {
-        config.dead_child = sem_open ("dead_child", O_CREAT, 0600, 0);
-        pthread_mutex_init (&config.process_list_lock, NULL);
+        if (process->recycling || process->replaced)
+                return;
 
-        pthread_t dead_child_thread;
+        log_warn ("%s (pid %d) failed its liveness probe: %s, stopping it", process->name, process->pid, reason);
+        publish_event (EVENT_UNHEALTHY, process, 0, reason);
+
+        terminate (process, PM_SHUTDOWN_GRACE_MS);
+}
+
+/**
+ * Stops a process that was replaced by another one, it gets grace_ms to
+ * exit after SIGTERM and is removed from the table once it has. A process
+ * that is not running is removed right away.
+ */
+void drain_process (pm_process *process, uint32_t grace_ms)
+{
+        if (process->pid <= 0) {
+                remove_process (process);
+                return;
+        }
+
+        process->replaced = true;
+        terminate (process, grace_ms);
+}
+
+/**
+ * Handles the exit of a managed process: it is restarted or retired as its
+ * settings say. A status of -1 means the status is unknown.
+ */
+static void process_exited (pm_process *child, int status)
+{
+        child->exit_status = status;
+        publish_event (EVENT_EXITED, child, 0, NULL);
+        cgroup_release (child);
+        health_stop (child);
+        timer_cancel (&child->kill_timer);
 
-        if (pthread_create (&dead_child_thread, NULL, &daemon_child_monitor_thread, NULL) != 0) {
-                perror ("pthread_create");
-                exit (EXIT_FAILURE);
+        if (child->replaced) {
+                log_info ("%s (pid %d) was replaced and has exited", child->name, child->pid);
+                remove_process (child);
+                return;
         }
 
-        signal (SIGCHLD, handle_child_signal);
+        // a recycled process did not crash, it comes back right away
+        if (child->recycling) {
+                child->recycling = false;
+                child->restarts++;
+
+                if (restart_process (child) <= 0)
+                        retire (child);
+
+                return;
+        }
+
+        if (child->max_retries <= 0) {
+                retire (child);
+                return;
+        }
+
+        time_t now = time (NULL);
+
+        // a process that stayed up for a while was healthy, start over
+        if (now - child->start_time >= PM_MIN_UPTIME)
+                child->backoff = 0;
+
+        if (record_exit (child, now)) {
+                log_error ("%s exited %d times within %d seconds, no longer restarting it",
+                           child->name,
+                           PM_CRASH_LOOP_EXITS,
+                           PM_CRASH_LOOP_WINDOW);
+                retire (child);
+                return;
+        }
+
+        // try to restart child if process was configured to auto restart
+        child->max_retries--;
+        update_process_pid (child, 0);
+        schedule_restart (child);
+}
+
+static void reap_child (pid_t pid, int status)
+{
+        pm_process *child = find_process_with_pid (pid);
+
+        // as a subreaper the daemon also inherits whatever managed processes
+        // leave behind when they exit
+        if (!child && !zygote_reaped (pid) && !health_reaped (pid, status) && !holder_reaped (pid)) {
+                log_info ("reaped pid %d, an orphaned descendant of a managed process", pid);
+                return;
+        }
+
+        if (!child)
+                return;
+
+        // determine how child died
+        if (WIFEXITED (status)) {
+                log_info ("child with pid %d exited with status code %d", pid, WEXITSTATUS (status));
+        } else if (WIFSIGNALED (status)) {
+                log_info ("child with pid %d was killed by signal %d", pid, WTERMSIG (status));
+        }
+
+        process_exited (child, status);
+}
+
+void release_pidfd (pm_process *process)
+{
+        if (process->pidfd_watch.fd < 0)
+                return;
+
+        watch_remove (&process->pidfd_watch);
+        close (process->pidfd_watch.fd);
+        process->pidfd_watch.fd = -1;
+}
+
+/**
+ * Called when an adopted process that is not the daemon's child exits. Its
+ * parent is gone and only its new parent learns its exit status.
+ */
+static void handle_adopted_exit (pm_watch *watch, uint32_t events)
+{
+        pm_process *child = (pm_process *)((char *)watch - offsetof (pm_process, pidfd_watch));
+
+        release_pidfd (child);
+        log_info ("%s (pid %d) exited, its status is unknown as it was started by an earlier daemon", child->name, child->pid);
+
+        process_exited (child, -1);
+}
+
+/**
+ * Takes over a process read back from the journal. A process still running
+ * is watched again, through its pidfd unless it is still the daemon's child
+ * after an upgrade. One that exited while no daemon was watching it is
+ * handled as if it had just exited, and one that was waiting for a restart
+ * gets a new restart timer.
+ */
+void adopt_process (pm_process *process)
+{
+        if (process->state == PROCESS_EXITED) {
+                retire_process (process);
+                return;
+        }
+
+        if (process->state == PROCESS_WAITING) {
+                schedule_restart (process);
+                return;
+        }
+
+        // the pidfd is opened first, if the pid still names the process it
+        // is supposed to then the pidfd refers to that process
+        int pidfd = process->pid > 0 ? open_pidfd (process->pid) : -1;
+
+        if (pidfd < 0 || read_start_ticks (process->pid) != process->start_ticks) {
+                if (pidfd >= 0)
+                        close (pidfd);
+
+                log_info ("%s (pid %d) exited while no daemon was watching it", process->name, process->pid);
+                process_exited (process, -1);
+                return;
+        }
+
+        siginfo_t info;
+
+        if (waitid (P_PID, process->pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0) {
+                close (pidfd);
+        } else {
+                process->pidfd_watch.fd = pidfd;
+                process->pidfd_watch.callback = handle_adopted_exit;
+                watch_add (&process->pidfd_watch, EPOLLIN);
+        }
+
+        reattach_output (process);
+        health_start (process);
+        log_info ("adopted %s (pid %d)", process->name, process->pid);
+}
+
+/**
+ * Called from the event loop when SIGCHLD is pending on the signalfd. Signals
+ * coalesce, so every exited child is collected with waitpid rather than
+ * trusting the number of siginfo records read.
+ */
+static void handle_child_event (pm_watch *watch, uint32_t events)
+{
+        struct signalfd_siginfo info[16];
+
+        while (read (watch->fd, info, sizeof (info)) > 0)
+                ;
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+                reap_child (pid, status);
+}
+
+/**
+ * Routes SIGCHLD into the daemon's event loop. The signal is blocked so it is
+ * only ever delivered through the signalfd, children have their signal mask
+ * reset before exec.
+ */
+void monitor_init ()
+{
+        // descendants of managed processes whose parent exits are handed to
+        // the daemon rather than to init, so they are reaped and stay in
+        // the daemon's tree. Processes adopted from an earlier daemon already
+        // belong to init, they are watched through their pidfd instead.
+        if (prctl (PR_SET_CHILD_SUBREAPER, 1) < 0)
+                log_warn ("failed to become a subreaper: %s", strerror (errno));
+
+        sigset_t set;
+        sigemptyset (&set);
+        sigaddset (&set, SIGCHLD);
+
+        if (sigprocmask (SIG_BLOCK, &set, NULL) < 0) {
+                perror ("sigprocmask");
+                fatal_error ();
+        }
+
+        child_watch.fd = signalfd (-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+        child_watch.callback = handle_child_event;
+
+        if (child_watch.fd < 0) {
+                perror ("signalfd");
+                fatal_error ();
+        }
 
-        return dead_child_thread;
+        watch_add (&child_watch, EPOLLIN);
 }
 
-pthread_t stop_child_monitor_thread (pthread_t thread)
+void monitor_stop ()
 {
-        config.shutdown = true;
-        sem_post (config.dead_child);
-        pthread_join (thread, NULL);
-        config.shutdown = false;
+        watch_remove (&child_watch);
+        close (child_watch.fd);
 }
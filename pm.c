@@ -8,8 +8,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <pthread.h>
-#include <semaphore.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -17,41 +16,54 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #define DAEMON_SOCKET_FILENAME "daemon.sock"
 
-extern pm_identity process_identity;
-
 pm_configuration config = { .socket_file = NULL,
                             .stdout_file = NULL,
                             .shutdown = false,
-                            .process_list = NULL,
-                            .process_list_end = NULL };
+                            .log_lines = 10,
+                            .zygote_pool = PM_ZYGOTE_POOL,
+                            .processes = { 0 } };
 
 void fatal_error ()
 {
         if (config.socket_file)
                 unlink (config.socket_file);
 
+        // the reason was likely just logged
+        log_stop ();
         exit (EXIT_FAILURE);
 }
 
-int get_write_file_fd (char *filename)
+/**
+ * Removes the socket file a daemon that died left behind. Returns false if
+ * a daemon still answers on it.
+ */
+static bool remove_stale_socket (struct sockaddr_un *addr)
 {
-        int fd = open (filename, O_CREAT | O_WRONLY, 0666);
+        int probe_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
-        if (fd < 0) {
-                perror ("open");
-                exit (EXIT_FAILURE);
+        if (probe_fd < 0)
+                return false;
+
+        bool stale = connect (probe_fd, (struct sockaddr *)addr, sizeof (struct sockaddr_un)) < 0 && errno == ECONNREFUSED;
+
+        close (probe_fd);
+
+        if (stale) {
+                log_info ("Removing the socket file %s of a daemon that is gone", addr->sun_path);
+                unlink (addr->sun_path);
         }
 
-        return fd;
+        return stale;
 }
 
 int setup_unix_domain_server_socket (char *socket_file)
 {
-        int sock_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+        int sock_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
         if (sock_fd < 0) {
                 perror ("socket");
@@ -63,14 +75,19 @@ int setup_unix_domain_server_socket (char *socket_file)
         addr.sun_family = AF_UNIX;
         strncpy (addr.sun_path, socket_file, 104);
 
-        if (bind (sock_fd, (struct sockaddr *)&addr, sizeof (struct sockaddr_un)) < 0) {
+        int bound = bind (sock_fd, (struct sockaddr *)&addr, sizeof (struct sockaddr_un));
+
+        if (bound < 0 && errno == EADDRINUSE && remove_stale_socket (&addr))
+                bound = bind (sock_fd, (struct sockaddr *)&addr, sizeof (struct sockaddr_un));
+
+        if (bound < 0) {
                 log_error ("Error binding to socket: %s", strerror (errno));
                 log_error ("Make sure the socket file you specify does not already exist. Use --sockfile=... to specify socket file name");
 
                 fatal_error ();
         }
 
-        if (listen (sock_fd, 1) < 0) {
+        if (listen (sock_fd, SOMAXCONN) < 0) {
                 perror ("listen");
                 fatal_error ();
         }
@@ -103,17 +120,154 @@ void set_stdout (char *stdout_file)
 {
         if (config.stdout_file != NULL) {
                 free (config.stdout_file);
+                config.stdout_file = NULL;
         }
 
+        if (!stdout_file || !*stdout_file)
+                return;
+
         config.stdout_file = malloc_nofail (strlen (stdout_file) + 1);
         strcpy (config.stdout_file, stdout_file);
 }
 
-void handle_child_signal (int signal)
+void set_stderr (char *stderr_file)
+{
+        if (config.stderr_file != NULL) {
+                free (config.stderr_file);
+                config.stderr_file = NULL;
+        }
+
+        if (!stderr_file || !*stderr_file)
+                return;
+
+        config.stderr_file = malloc_nofail (strlen (stderr_file) + 1);
+        strcpy (config.stderr_file, stderr_file);
+}
+
+static uint32_t next_request_id = 1;
+
+/**
+ * Sends a request to the daemon without waiting for its response. Returns the
+ * id the response will carry.
+ */
+uint32_t send_request (int sock_fd, pm_cmd *command)
 {
-        sem_post (config.dead_child);
+        static pm_buffer frame = { 0 };
+
+        command->id = next_request_id++;
+
+        buffer_clear (&frame);
+        encode_request (&frame, command);
+
+        for (size_t off = 0; off < frame.len;) {
+                ssize_t n = send (sock_fd, frame.data + off, frame.len - off, MSG_NOSIGNAL);
 
-        return;
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0) {
+                        perror ("send");
+                        exit (EXIT_FAILURE);
+                }
+
+                off += n;
+        }
+
+        return command->id;
+}
+
+/**
+ * Waits for the next response from the daemon, whichever request it answers.
+ * The response is allocated and has to be freed by the caller. Returns NULL
+ * if the daemon closed the connection between two responses.
+ */
+pm_response *receive_response (int sock_fd)
+{
+        char data[PM_FRAME_HEADER_SIZE];
+        pm_frame_header header;
+        ssize_t n;
+
+        while ((n = recv (sock_fd, data, 1, 0)) < 0 && errno == EINTR)
+                ;
+
+        if (n == 0)
+                return NULL;
+
+        if (n < 0) {
+                perror ("recv");
+                exit (EXIT_FAILURE);
+        }
+
+        read_nofail (sock_fd, data + 1, sizeof (data) - 1);
+        decode_frame_header (data, &header);
+
+        if (header.version != PM_PROTOCOL_VERSION) {
+                log_error ("daemon speaks protocol version %u, this client speaks version %d", header.version, PM_PROTOCOL_VERSION);
+                exit (EXIT_FAILURE);
+        }
+
+        pm_response *response = malloc_nofail (sizeof (pm_response) + header.size);
+        *response = (pm_response) { .id = header.id, .code = header.type, .size = header.size };
+        read_nofail (sock_fd, response->data, header.size);
+
+        return response;
+}
+
+/**
+ * Sends a request to the daemon and waits for its response. The response is
+ * allocated and has to be freed by the caller.
+ */
+pm_response *send_client_command (int sock_fd, pm_cmd *command)
+{
+        uint32_t id = send_request (sock_fd, command);
+        pm_response *response = receive_response (sock_fd);
+
+        if (!response) {
+                log_error ("daemon closed the connection without answering");
+                exit (EXIT_FAILURE);
+        }
+
+        // nothing else is in flight, the response has to be this one's
+        if (response->id != id) {
+                log_error ("daemon answered request %u while request %u was pending", response->id, id);
+                exit (EXIT_FAILURE);
+        }
+
+        return response;
+}
+
+/**
+ * Returns a reader over the body of a response. The message a failed
+ * response starts with is read into message first.
+ */
+static pm_reader response_reader (pm_response *response, char *message, size_t size)
+{
+        pm_reader reader = { .data = response->data, .len = response->size };
+
+        *message = '\0';
+
+        if (response->code != OK)
+                reader_get_string (&reader, message, size);
+
+        if (!*message)
+                snprintf (message, size, "%s", get_code_description (response->code));
+
+        return reader;
+}
+
+/**
+ * Exits with the daemon's error message if the request failed.
+ */
+static void check_response (pm_response *response, char *action)
+{
+        char message[512];
+
+        if (response->code == OK)
+                return;
+
+        response_reader (response, message, sizeof (message));
+        log_error ("daemon could not %s: %s", action, message);
+        exit (EXIT_FAILURE);
 }
 
 void process_daemon_command (char *command)
@@ -124,25 +278,42 @@ void process_daemon_command (char *command)
         } else if (strcmp (command, "shutdown") == 0) {
                 int sock_fd = setup_unix_domain_client_socket (config.socket_file);
 
-                pm_cmd cmd;
-                cmd.instruction = SHUTDOWN;
-                send (sock_fd, &cmd, sizeof (pm_cmd), MSG_NOSIGNAL);
+                // answered once every process has been stopped
+                pm_cmd cmd = { .instruction = SHUTDOWN, .shutdown = { .grace_ms = config.shutdown_grace_ms } };
+                pm_response *response = send_client_command (sock_fd, &cmd);
+
+                check_response (response, "shut down");
+                free (response);
                 close (sock_fd);
-        }
-}
+        } else if (strcmp (command, "upgrade") == 0) {
+                // the daemon is replaced by the program this client runs
+                char path[PATH_MAX];
+                ssize_t len = readlink ("/proc/self/exe", path, sizeof (path) - 1);
 
-pm_code send_client_command (int sock_fd, pm_cmd *command)
-{
-        pm_code response;
+                if (len < 0) {
+                        perror ("readlink");
+                        exit (EXIT_FAILURE);
+                }
 
-        switch (command->instruction) {
-        case NEW_PROCESS: send (sock_fd, command, sizeof (pm_cmd) + command->new_process.size, MSG_NOSIGNAL); break;
+                path[len] = '\0';
 
-        default: break;
-        }
+                int sock_fd = setup_unix_domain_client_socket (config.socket_file);
+                pm_cmd cmd = { .instruction = UPGRADE, .upgrade = { .size = len + 1, .path = path } };
+                pm_response *response = send_client_command (sock_fd, &cmd);
+
+                check_response (response, "upgrade");
+                free (response);
+                close (sock_fd);
+
+                // the listening socket is kept, the upgraded daemon answers
+                // once it has taken over every process
+                sock_fd = setup_unix_domain_client_socket (config.socket_file);
+                cmd = (pm_cmd) { .instruction = LIST_PROCESS };
+                response = send_client_command (sock_fd, &cmd);
 
-        if (recv (sock_fd, &response, sizeof (pm_code), 0) != sizeof (pm_code)) {
-                log_error ("");
+                check_response (response, "reach the upgraded daemon");
+                free (response);
+                close (sock_fd);
         }
 }
 
@@ -162,6 +333,881 @@ void join_string_list_with_null_term (char **list, char *joined)
         }
 }
 
+void print_json_string (char *str)
+{
+        putchar ('"');
+
+        for (unsigned char *c = (unsigned char *)str; *c; c++) {
+                if (*c == '"' || *c == '\\')
+                        printf ("\\%c", *c);
+                else if (*c < 0x20)
+                        printf ("\\u%04x", *c);
+                else
+                        putchar (*c);
+        }
+
+        putchar ('"');
+}
+
+static void format_exit_status (int status, char *buf, size_t size)
+{
+        if (status == -1)
+                snprintf (buf, size, "-");
+        else if (WIFSIGNALED (status))
+                snprintf (buf, size, "signal %d", WTERMSIG (status));
+        else
+                snprintf (buf, size, "%d", WEXITSTATUS (status));
+}
+
+/**
+ * Prints the LIST_PROCESS encoding produced by snapshot_process_table, as a
+ * table or as JSON if --json was given.
+ */
+void print_process_list (char *data, size_t size)
+{
+        pm_reader reader = { .data = data, .len = size };
+        time_t now = time (NULL);
+
+        uint32_t count = reader_get_u32 (&reader);
+
+        if (config.json)
+                printf ("[");
+        else
+                printf ("%-6s %-20s %-8s %-8s %-9s %-10s %-8s %-10s %s\n",
+                        "id", "name", "pid", "state", "ready", "uptime", "restarts", "exit", "command");
+
+        for (uint32_t i = 0; i < count && !reader.error; i++) {
+                char name[PM_NAME_MAX], command[4096], exit_status[32];
+
+                pm_handle handle = reader_get_u64 (&reader);
+                pid_t pid = reader_get_u32 (&reader);
+                pm_process_state state = reader_get_u8 (&reader);
+                uint32_t restarts = reader_get_u32 (&reader);
+                int status = reader_get_u32 (&reader);
+                time_t start_time = reader_get_u64 (&reader);
+                reader_get_string (&reader, name, sizeof (name));
+                reader_get_string (&reader, command, sizeof (command));
+                pm_readiness readiness = reader_get_u8 (&reader);
+                char cpus[256];
+                reader_get_string (&reader, cpus, sizeof (cpus));
+
+                long uptime = state == PROCESS_RUNNING ? (long)(now - start_time) : 0;
+
+                if (config.json) {
+                        printf ("%s{\"id\":%u,\"handle\":%llu,\"name\":", i ? "," : "", (uint32_t)handle, (unsigned long long)handle);
+                        print_json_string (name);
+                        printf (",\"pid\":%d,\"state\":\"%s\",\"readiness\":",
+                                pid,
+                                get_state_name (state));
+
+                        if (readiness == READINESS_NONE)
+                                printf ("null");
+                        else
+                                printf ("\"%s\"", get_readiness_name (readiness));
+
+                        printf (",\"uptime\":%ld,\"restarts\":%u,", uptime, restarts);
+
+                        if (status == -1)
+                                printf ("\"exit_code\":null,\"exit_signal\":null,\"command\":");
+                        else if (WIFSIGNALED (status))
+                                printf ("\"exit_code\":null,\"exit_signal\":%d,\"command\":", WTERMSIG (status));
+                        else
+                                printf ("\"exit_code\":%d,\"exit_signal\":null,\"command\":", WEXITSTATUS (status));
+
+                        print_json_string (command);
+                        printf (",\"cpus\":");
+
+                        if (*cpus)
+                                print_json_string (cpus);
+                        else
+                                printf ("null");
+
+                        printf ("}");
+                } else {
+                        format_exit_status (status, exit_status, sizeof (exit_status));
+                        printf ("%-6u %-20s %-8d %-8s %-9s %-10ld %-8u %-10s %s\n",
+                                (uint32_t)handle,
+                                name,
+                                pid,
+                                get_state_name (state),
+                                get_readiness_name (readiness),
+                                uptime,
+                                restarts,
+                                exit_status,
+                                command);
+                }
+        }
+
+        if (config.json)
+                printf ("]\n");
+
+        if (reader.error)
+                log_error ("process list from daemon was truncated");
+}
+
+static void format_bytes (uint64_t bytes, char *buf, size_t size)
+{
+        char *units = "BKMGT";
+        double value = bytes;
+        int unit = 0;
+
+        while (value >= 1024 && units[unit + 1]) {
+                value /= 1024;
+                unit++;
+        }
+
+        snprintf (buf, size, unit ? "%.1f%c" : "%.0f%c", value, units[unit]);
+}
+
+/**
+ * Prints the STATS encoding produced by encode_stats, as a table or as JSON
+ * if --json was given. Only JSON includes the sample history.
+ */
+void print_stats (char *data, size_t size)
+{
+        pm_reader reader = { .data = data, .len = size };
+        uint32_t count = reader_get_u32 (&reader);
+
+        if (config.json)
+                printf ("[");
+        else
+                printf ("%-6s %-20s %-8s %-7s %-9s %-8s %-6s %-9s %s\n",
+                        "id", "name", "pid", "cpu", "memory", "threads", "fds", "read", "written");
+
+        for (uint32_t i = 0; i < count && !reader.error; i++) {
+                char name[PM_NAME_MAX], rss[16], read[16], written[16];
+
+                pm_handle handle = reader_get_u64 (&reader);
+                pid_t pid = reader_get_u32 (&reader);
+                reader_get_string (&reader, name, sizeof (name));
+                uint32_t cpu = reader_get_u32 (&reader);
+                uint64_t memory = reader_get_u64 (&reader);
+                uint32_t threads = reader_get_u32 (&reader);
+                uint32_t fds = reader_get_u32 (&reader);
+                uint64_t read_bytes = reader_get_u64 (&reader);
+                uint64_t write_bytes = reader_get_u64 (&reader);
+                uint8_t history = reader_get_u8 (&reader);
+
+                if (config.json) {
+                        printf ("%s{\"id\":%u,\"name\":", i ? "," : "", (uint32_t)handle);
+                        print_json_string (name);
+                        printf (",\"pid\":%d,\"cpu\":%.1f,\"memory\":%llu,\"threads\":%u,\"fds\":%u,"
+                                "\"read_bytes\":%llu,\"write_bytes\":%llu,\"history\":[",
+                                pid,
+                                cpu / 10.0,
+                                (unsigned long long)memory,
+                                threads,
+                                fds,
+                                (unsigned long long)read_bytes,
+                                (unsigned long long)write_bytes);
+                }
+
+                for (uint8_t j = 0; j < history; j++) {
+                        uint32_t past_cpu = reader_get_u32 (&reader);
+                        uint64_t past_memory = reader_get_u64 (&reader);
+
+                        if (config.json)
+                                printf ("%s{\"cpu\":%.1f,\"memory\":%llu}", j ? "," : "", past_cpu / 10.0, (unsigned long long)past_memory);
+                }
+
+                if (config.json) {
+                        printf ("]}");
+                        continue;
+                }
+
+                format_bytes (memory, rss, sizeof (rss));
+                format_bytes (read_bytes, read, sizeof (read));
+                format_bytes (write_bytes, written, sizeof (written));
+
+                printf ("%-6u %-20s %-8d %5.1f%%  %-9s %-8u %-6u %-9s %s\n",
+                        (uint32_t)handle,
+                        name,
+                        pid,
+                        cpu / 10.0,
+                        rss,
+                        threads,
+                        fds,
+                        read,
+                        written);
+        }
+
+        if (config.json)
+                printf ("]\n");
+
+        if (reader.error)
+                log_error ("stats from daemon were truncated");
+}
+
+static void format_usec (uint64_t usec, char *buf, size_t size)
+{
+        if (usec < 1000)
+                snprintf (buf, size, "%lluus", (unsigned long long)usec);
+        else if (usec < 1000000)
+                snprintf (buf, size, "%.1fms", usec / 1000.0);
+        else
+                snprintf (buf, size, "%.2fs", usec / 1000000.0);
+}
+
+/**
+ * Returns the latency at or below which the given per mille of a histogram
+ * fall, as the upper bound of their bucket but no more than the maximum.
+ */
+static uint64_t histogram_percentile (pm_histogram *histogram, uint32_t permille)
+{
+        uint64_t rank = (histogram->count * permille + 999) / 1000, seen = 0;
+
+        for (int i = 0; i < PM_HISTOGRAM_BUCKETS; i++) {
+                seen += histogram->buckets[i];
+
+                if (seen >= rank && seen > 0) {
+                        uint64_t bound = (uint64_t)2 << i;
+                        return bound < histogram->max ? bound : histogram->max;
+                }
+        }
+
+        return histogram->max;
+}
+
+/**
+ * Prints the ZYGOTE listing produced by encode_zygotes: the pools, then the
+ * spawn latencies as a summary and a histogram each, or all of it as JSON if
+ * --json was given.
+ */
+void print_zygotes (char *data, size_t size)
+{
+        pm_reader reader = { .data = data, .len = size };
+        uint8_t count = reader_get_u8 (&reader);
+
+        if (config.json)
+                printf ("{\"pools\":[");
+        else
+                printf ("%-20s %-6s %-6s %s\n", "program", "pool", "ready", "path");
+
+        for (uint8_t i = 0; i < count && !reader.error; i++) {
+                char program[PM_NAME_MAX], path[PATH_MAX];
+
+                reader_get_string (&reader, program, sizeof (program));
+                reader_get_string (&reader, path, sizeof (path));
+                uint32_t pool = reader_get_u32 (&reader);
+                uint32_t ready = reader_get_u32 (&reader);
+
+                if (config.json) {
+                        printf ("%s{\"program\":", i ? "," : "");
+                        print_json_string (program);
+                        printf (",\"path\":");
+                        print_json_string (path);
+                        printf (",\"pool\":%u,\"ready\":%u}", pool, ready);
+                } else {
+                        printf ("%-20s %-6u %-6u %s\n", program, pool, ready, path);
+                }
+        }
+
+        uint8_t histograms = reader_get_u8 (&reader);
+
+        if (config.json)
+                printf ("],\"spawn_latency\":{");
+        else
+                printf ("\n%-8s %-8s %-9s %-9s %-9s %-9s %s\n", "spawn", "count", "mean", "p50", "p90", "p99", "max");
+
+        pm_histogram *all = calloc_nofail (histograms ? histograms : 1, sizeof (pm_histogram));
+        char (*names)[PM_NAME_MAX] = calloc_nofail (histograms ? histograms : 1, PM_NAME_MAX);
+
+        for (uint8_t i = 0; i < histograms && !reader.error; i++) {
+                pm_histogram *histogram = &all[i];
+                char mean[16], p50[16], p90[16], p99[16], max[16];
+
+                reader_get_string (&reader, names[i], PM_NAME_MAX);
+                histogram->count = reader_get_u64 (&reader);
+                histogram->sum = reader_get_u64 (&reader);
+                histogram->max = reader_get_u64 (&reader);
+
+                uint8_t buckets = reader_get_u8 (&reader);
+
+                for (uint8_t j = 0; j < buckets; j++) {
+                        uint64_t value = reader_get_u64 (&reader);
+
+                        // a daemon with more buckets counts the rest in the last
+                        histogram->buckets[j < PM_HISTOGRAM_BUCKETS ? j : PM_HISTOGRAM_BUCKETS - 1] += value;
+                }
+
+                uint64_t average = histogram->count ? histogram->sum / histogram->count : 0;
+
+                if (config.json) {
+                        printf ("%s", i ? "," : "");
+                        print_json_string (names[i]);
+                        printf (":{\"count\":%llu,\"mean_us\":%llu,\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu,\"buckets\":[",
+                                (unsigned long long)histogram->count,
+                                (unsigned long long)average,
+                                (unsigned long long)histogram_percentile (histogram, 500),
+                                (unsigned long long)histogram_percentile (histogram, 900),
+                                (unsigned long long)histogram_percentile (histogram, 990),
+                                (unsigned long long)histogram->max);
+
+                        for (int j = 0; j < PM_HISTOGRAM_BUCKETS; j++)
+                                printf ("%s%llu", j ? "," : "", (unsigned long long)histogram->buckets[j]);
+
+                        printf ("]}");
+                        continue;
+                }
+
+                format_usec (average, mean, sizeof (mean));
+                format_usec (histogram_percentile (histogram, 500), p50, sizeof (p50));
+                format_usec (histogram_percentile (histogram, 900), p90, sizeof (p90));
+                format_usec (histogram_percentile (histogram, 990), p99, sizeof (p99));
+                format_usec (histogram->max, max, sizeof (max));
+
+                printf ("%-8s %-8llu %-9s %-9s %-9s %-9s %s\n", names[i], (unsigned long long)histogram->count, mean, p50, p90, p99, max);
+        }
+
+        if (config.json) {
+                printf ("}}\n");
+        } else {
+                // one bar per bucket that has latencies in it
+                for (uint8_t i = 0; i < histograms; i++) {
+                        uint64_t peak = 0;
+
+                        for (int j = 0; j < PM_HISTOGRAM_BUCKETS; j++)
+                                if (all[i].buckets[j] > peak)
+                                        peak = all[i].buckets[j];
+
+                        if (peak == 0)
+                                continue;
+
+                        printf ("\n%s\n", names[i]);
+
+                        for (int j = 0; j < PM_HISTOGRAM_BUCKETS; j++) {
+                                char bound[16], bar[41];
+                                int width = all[i].buckets[j] * 40 / peak;
+
+                                if (all[i].buckets[j] == 0)
+                                        continue;
+
+                                // the last bucket has no upper bound
+                                bool last = j == PM_HISTOGRAM_BUCKETS - 1;
+
+                                format_usec (last ? (uint64_t)1 << j : (uint64_t)2 << j, bound, sizeof (bound));
+                                memset (bar, '#', width);
+                                bar[width] = '\0';
+
+                                printf ("  %s%-8s %-40s %llu\n", last ? ">=" : "< ", bound, bar, (unsigned long long)all[i].buckets[j]);
+                        }
+                }
+        }
+
+        free (all);
+        free (names);
+
+        if (reader.error)
+                log_error ("zygote listing from daemon was truncated");
+}
+
+/**
+ * Returns a newly allocated absolute version of path, relative paths are
+ * taken relative to the current directory.
+ */
+char *absolute_path (char *path)
+{
+        if (path[0] == '/')
+                return strdup (path);
+
+        char cwd[4096];
+
+        if (!getcwd (cwd, sizeof (cwd))) {
+                perror ("getcwd");
+                exit (EXIT_FAILURE);
+        }
+
+        char *absolute = malloc_nofail (strlen (cwd) + strlen (path) + 2);
+        sprintf (absolute, "%s/%s", cwd, path);
+
+        return absolute;
+}
+
+/**
+ * Parses a probe given as type:target, see pm_probe_spec. A unix socket is
+ * made absolute, the daemon runs elsewhere. Returns false with the error
+ * logged if the probe is malformed, what names it in the message.
+ */
+static bool parse_probe (char *what, char *value, pm_probe_spec *spec)
+{
+        char *types[] = { [PROBE_EXEC] = "exec", [PROBE_UNIX] = "unix", [PROBE_TCP] = "tcp", [PROBE_HTTP] = "http" };
+        char *target = strchr (value, ':');
+
+        spec->type = PROBE_NONE;
+
+        for (int type = PROBE_EXEC; target && type <= PROBE_HTTP; type++)
+                if ((size_t)(target - value) == strlen (types[type]) && strncmp (value, types[type], target - value) == 0)
+                        spec->type = type;
+
+        if (spec->type == PROBE_NONE || !*++target) {
+                log_error ("%s must be exec:command, unix:path, tcp:port or http:port[/path]", what);
+                return false;
+        }
+
+        if (spec->type == PROBE_TCP || spec->type == PROBE_HTTP) {
+                char *end;
+                unsigned long port = strtoul (target, &end, 10);
+
+                if (end == target || port == 0 || port > 65535 || (*end && (*end != '/' || spec->type == PROBE_TCP))) {
+                        log_error ("invalid port for %s: %s", what, target);
+                        return false;
+                }
+        }
+
+        spec->target = spec->type == PROBE_UNIX ? absolute_path (target) : target;
+
+        if (strlen (spec->target) >= PM_PROBE_TARGET_MAX) {
+                log_error ("%s must be shorter than %d characters", what, PM_PROBE_TARGET_MAX);
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Fills in a NEW_PROCESS request for a null terminated argument list, with
+ * the options the client was given.
+ */
+static void init_run_command (pm_cmd *cmd, char *command, uint32_t size)
+{
+        if (config.process_name && strlen (config.process_name) >= PM_NAME_MAX) {
+                log_error ("process name must be shorter than %d characters", PM_NAME_MAX);
+                exit (EXIT_FAILURE);
+        }
+
+        *cmd = (pm_cmd) { .instruction = NEW_PROCESS,
+                          .new_process = { .instances = config.instances,
+                                           .flags = config.timestamps ? PM_RUN_TIMESTAMPS : 0,
+                                           .limits = config.limits,
+                                           .watchdog = config.watchdog,
+                                           .size = size,
+                                           .command = command } };
+
+        memcpy (cmd->new_process.probes, config.probes, sizeof (config.probes));
+
+        if (config.listen)
+                strcpy (cmd->new_process.listen, config.listen);
+
+        if (config.placement)
+                strcpy (cmd->new_process.placement, config.placement);
+
+        if (config.has_rotation) {
+                cmd->new_process.flags |= PM_RUN_LOG_ROTATION;
+                cmd->new_process.rotation = config.rotation;
+        }
+
+        if (config.process_name)
+                strcpy (cmd->new_process.name, config.process_name);
+}
+
+/**
+ * Prints the pids a NEW_PROCESS response carries, one per line. Returns false
+ * if the request failed, with the daemon's message in message.
+ */
+static bool print_started (pm_response *response, char *message, size_t size)
+{
+        pm_reader reader = response_reader (response, message, size);
+        uint32_t count = reader_get_u32 (&reader);
+
+        for (uint32_t i = 0; i < count && !reader.error; i++)
+                printf ("%d\n", (pid_t)reader_get_u32 (&reader));
+
+        return response->code == OK;
+}
+
+/**
+ * Turns the whitespace separated words of a line into a null terminated
+ * argument list in place. Returns its size, 0 for a blank line.
+ */
+static size_t split_arguments (char *line)
+{
+        size_t size = 0;
+        bool in_word = false;
+
+        for (char *c = line; *c; c++) {
+                if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') {
+                        if (in_word)
+                                line[size++] = '\0';
+
+                        in_word = false;
+                        continue;
+                }
+
+                line[size++] = *c;
+                in_word = true;
+        }
+
+        if (in_word)
+                line[size++] = '\0';
+
+        return size;
+}
+
+/**
+ * Starts one process per line of standard input over a single connection.
+ * Up to PM_PIPELINE_DEPTH requests are in flight at a time, their responses
+ * are matched by id and printed in the order of the lines.
+ */
+static void run_batch (int sock_fd)
+{
+        char **lines = NULL;
+        size_t *sizes = NULL;
+        size_t count = 0, cap = 0;
+        char *line = NULL;
+        size_t line_cap = 0;
+
+        while (getline (&line, &line_cap, stdin) > 0) {
+                size_t size = split_arguments (line);
+
+                if (size == 0)
+                        continue;
+
+                if (count == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        lines = realloc_nofail (lines, cap * sizeof (char *));
+                        sizes = realloc_nofail (sizes, cap * sizeof (size_t));
+                }
+
+                lines[count] = malloc_nofail (size);
+                memcpy (lines[count], line, size);
+                sizes[count++] = size;
+        }
+
+        free (line);
+
+        pm_response **responses = calloc_nofail (count ? count : 1, sizeof (pm_response *));
+        uint32_t first_id = next_request_id;
+        size_t sent = 0, received = 0;
+
+        while (received < count) {
+                for (; sent < count && sent - received < PM_PIPELINE_DEPTH; sent++) {
+                        pm_cmd cmd;
+
+                        init_run_command (&cmd, lines[sent], sizes[sent]);
+                        send_request (sock_fd, &cmd);
+                }
+
+                pm_response *response = receive_response (sock_fd);
+
+                if (!response) {
+                        log_error ("daemon closed the connection with %zu requests unanswered", sent - received);
+                        exit (EXIT_FAILURE);
+                }
+
+                size_t index = response->id - first_id;
+
+                if (index >= sent || responses[index]) {
+                        log_error ("daemon sent a response to unknown request %u", response->id);
+                        exit (EXIT_FAILURE);
+                }
+
+                responses[index] = response;
+                received++;
+        }
+
+        bool failed = false;
+
+        for (size_t i = 0; i < count; i++) {
+                char message[512];
+
+                if (!print_started (responses[i], message, sizeof (message))) {
+                        log_error ("daemon could not start %s: %s", lines[i], message);
+                        failed = true;
+                }
+
+                free (responses[i]);
+                free (lines[i]);
+        }
+
+        free (responses);
+        free (lines);
+        free (sizes);
+
+        if (failed)
+                exit (EXIT_FAILURE);
+}
+
+/**
+ * A group as a process file describes it.
+ */
+typedef struct apply_entry {
+        char name[PM_NAME_MAX];
+        uint32_t instances;
+        int max_retries;
+        char *stdout_file;
+        char *stderr_file;
+        char *command;
+        size_t size;
+        pm_probe_spec probes[PM_PROBE_KINDS];
+        char *listen;
+        char *placement;
+        char *depends_on;
+} apply_entry;
+
+// strips the whitespace around s in place
+static char *trim (char *s)
+{
+        while (*s == ' ' || *s == '\t')
+                s++;
+
+        char *end = s + strlen (s);
+
+        while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+                end--;
+
+        *end = '\0';
+        return s;
+}
+
+/**
+ * Sets a key of the group a process file describes. Returns false with the
+ * error logged if its value is malformed, where names the line.
+ */
+static bool set_entry_key (apply_entry *entry, char *key, char *value, char *where)
+{
+        char what[PATH_MAX + 64];
+        char *end;
+
+        snprintf (what, sizeof (what), "%s: %s", where, key);
+
+        if (strcmp (key, "command") == 0) {
+                char *command = strdup (value);
+
+                free (entry->command);
+                entry->command = command;
+                entry->size = split_arguments (command);
+        } else if (strcmp (key, "instances") == 0) {
+                unsigned long instances = strtoul (value, &end, 10);
+
+                if (end == value || *end || instances < 1 || instances > PM_MAX_INSTANCES) {
+                        log_error ("%s must be between 1 and %d", what, PM_MAX_INSTANCES);
+                        return false;
+                }
+
+                entry->instances = instances;
+        } else if (strcmp (key, "retries") == 0) {
+                unsigned long retries = strtoul (value, &end, 10);
+
+                if (end == value || *end || retries > INT32_MAX) {
+                        log_error ("%s must be a number", what);
+                        return false;
+                }
+
+                entry->max_retries = retries;
+        } else if (strcmp (key, "stdout") == 0 || strcmp (key, "stderr") == 0) {
+                // the daemon runs elsewhere, hand it an absolute path
+                char **file = strcmp (key, "stdout") == 0 ? &entry->stdout_file : &entry->stderr_file;
+
+                free (*file);
+                *file = *value ? absolute_path (value) : NULL;
+        } else if (strcmp (key, "liveness") == 0 || strcmp (key, "readiness") == 0) {
+                pm_probe_kind kind = strcmp (key, "liveness") == 0 ? PROBE_LIVENESS : PROBE_READINESS;
+
+                // the timing comes from the --probe-* options
+                entry->probes[kind] = config.probes[kind];
+
+                if (!parse_probe (what, strdup (value), &entry->probes[kind]))
+                        return false;
+        } else if (strcmp (key, "listen") == 0) {
+                free (entry->listen);
+
+                if (!(entry->listen = parse_listen_spec (value))) {
+                        log_error ("%s must be up to %d comma separated tcp:[host:]port or unix:path", what, PM_LISTEN_MAX);
+                        return false;
+                }
+        } else if (strcmp (key, "placement") == 0) {
+                if (!parse_placement_spec (value)) {
+                        log_error ("%s must be core, spread, pack, node:N or cpus:list", what);
+                        return false;
+                }
+
+                free (entry->placement);
+                entry->placement = strdup (value);
+        } else if (strcmp (key, "depends_on") == 0) {
+                free (entry->depends_on);
+                entry->depends_on = strdup (value);
+        } else {
+                log_error ("%s is not a known key", what);
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Reads a process file and appends the entries of an APPLY request for it
+ * to entries, see apply.c. Exits if the file is malformed.
+ *
+ * A process file lists groups as sections: a [name] line followed by
+ * key = value lines, lines starting with # are comments. The keys are
+ * command, instances, retries, stdout, stderr, liveness, readiness, listen,
+ * placement and depends_on, the names of other groups separated by commas or spaces.
+ */
+static void encode_process_file (char *path, pm_buffer *entries)
+{
+        FILE *file = fopen (path, "r");
+
+        if (!file) {
+                log_error ("failed to open %s: %s", path, strerror (errno));
+                exit (EXIT_FAILURE);
+        }
+
+        apply_entry *list = NULL;
+        uint32_t count = 0;
+        char *line = NULL, where[PATH_MAX + 16];
+        size_t line_cap = 0;
+        bool failed = false;
+
+        for (int number = 1; !failed && getline (&line, &line_cap, file) > 0; number++) {
+                char *text = trim (line);
+
+                snprintf (where, sizeof (where), "%s:%d", path, number);
+
+                if (!*text || *text == '#')
+                        continue;
+
+                if (*text == '[') {
+                        char *name = text + 1;
+                        char *close = strchr (name, ']');
+
+                        if (!close || close[1] || close == name || (size_t)(close - name) >= PM_NAME_MAX) {
+                                log_error ("%s: a group starts with [name], shorter than %d characters", where, PM_NAME_MAX);
+                                failed = true;
+                                continue;
+                        }
+
+                        *close = '\0';
+
+                        if (count == PM_APPLY_MAX) {
+                                log_error ("%s: a file describes at most %d groups", where, PM_APPLY_MAX);
+                                failed = true;
+                                continue;
+                        }
+
+                        list = realloc_nofail (list, (count + 1) * sizeof (apply_entry));
+                        list[count] = (apply_entry) { .max_retries = -1 };
+                        strcpy (list[count++].name, name);
+                        continue;
+                }
+
+                char *equals = strchr (text, '=');
+
+                if (!equals || count == 0) {
+                        log_error ("%s: expected key = value inside a [name] group", where);
+                        failed = true;
+                        continue;
+                }
+
+                *equals = '\0';
+                failed = !set_entry_key (&list[count - 1], trim (text), trim (equals + 1), where);
+        }
+
+        free (line);
+        fclose (file);
+
+        for (uint32_t i = 0; !failed && i < count; i++) {
+                if (!list[i].size) {
+                        log_error ("%s: group %s has no command", path, list[i].name);
+                        failed = true;
+                }
+        }
+
+        if (failed)
+                exit (EXIT_FAILURE);
+
+        buffer_put_u32 (entries, count);
+
+        for (uint32_t i = 0; i < count; i++) {
+                apply_entry *entry = &list[i];
+
+                buffer_put_string (entries, entry->name);
+                buffer_put_u32 (entries, entry->instances);
+                buffer_put_u32 (entries, entry->max_retries);
+                buffer_put_string (entries, entry->stdout_file ? entry->stdout_file : "");
+                buffer_put_string (entries, entry->stderr_file ? entry->stderr_file : "");
+                buffer_put_u32 (entries, entry->size);
+                buffer_put_bytes (entries, entry->command, entry->size);
+
+                for (int kind = 0; kind < PM_PROBE_KINDS; kind++)
+                        put_probe (entries, &entry->probes[kind]);
+
+                buffer_put_string (entries, entry->listen ? entry->listen : "");
+
+                // the names are counted first, then written
+                char *names = entry->depends_on ? entry->depends_on : "";
+                uint16_t dependencies = 0;
+
+                for (char *name = names; *(name += strspn (name, ", \t")); name += strcspn (name, ", \t"))
+                        dependencies++;
+
+                buffer_put_u16 (entries, dependencies);
+
+                for (char *name = names; *(name += strspn (name, ", \t"));) {
+                        size_t len = strcspn (name, ", \t");
+                        char dependency[PM_NAME_MAX];
+
+                        snprintf (dependency, sizeof (dependency), "%.*s", (int)len, name);
+                        buffer_put_string (entries, dependency);
+                        name += len;
+                }
+
+                buffer_put_string (entries, entry->placement ? entry->placement : "");
+
+                free (entry->stdout_file);
+                free (entry->stderr_file);
+                free (entry->command);
+                free (entry->listen);
+                free (entry->placement);
+                free (entry->depends_on);
+        }
+
+        free (list);
+
+        if (entries->len > PM_MAX_COMMAND_SIZE - 16) {
+                log_error ("%s describes more than fits in a request of %d bytes", path, PM_MAX_COMMAND_SIZE);
+                exit (EXIT_FAILURE);
+        }
+}
+
+/**
+ * Prints what an APPLY request did to each group, one per line, or as JSON
+ * if --json was given.
+ */
+void print_applied (char *data, size_t size)
+{
+        pm_reader reader = { .data = data, .len = size };
+        uint32_t count = reader_get_u32 (&reader);
+
+        if (config.json)
+                printf ("[");
+        else
+                printf ("%-20s %-10s %s\n", "name", "action", "detail");
+
+        for (uint32_t i = 0; i < count && !reader.error; i++) {
+                char name[PM_NAME_MAX], detail[256];
+
+                reader_get_string (&reader, name, sizeof (name));
+                char *action = get_apply_action_name (reader_get_u8 (&reader));
+                reader_get_string (&reader, detail, sizeof (detail));
+
+                if (config.json) {
+                        printf ("%s{\"name\":", i ? "," : "");
+                        print_json_string (name);
+                        printf (",\"action\":\"%s\",\"detail\":", action);
+                        print_json_string (detail);
+                        printf ("}");
+                } else {
+                        printf ("%-20s %-10s %s\n", name, action, detail);
+                }
+        }
+
+        if (config.json)
+                printf ("]\n");
+
+        if (reader.error)
+                log_error ("apply result from daemon was truncated");
+}
+
 void process_client_command (char *command, char **remaining_argv)
 {
         int sock_fd = setup_unix_domain_client_socket (config.socket_file);
@@ -172,14 +1218,103 @@ void process_client_command (char *command, char **remaining_argv)
                         buffer_size += strlen (remaining_argv[i]) + 1;
                 }
 
-                pm_cmd *cmd = malloc_nofail (sizeof (pm_cmd) + buffer_size);
+                if (buffer_size == 0) {
+                        log_error ("run requires a program to start");
+                        exit (EXIT_FAILURE);
+                }
+
+                char *arguments = malloc_nofail (buffer_size);
+                join_string_list_with_null_term (remaining_argv, arguments);
+
+                pm_cmd cmd;
+                init_run_command (&cmd, arguments, buffer_size);
+
+                pm_response *response = send_client_command (sock_fd, &cmd);
+                char message[512];
+
+                // print the pid of every process that was started, one per line
+                if (!print_started (response, message, sizeof (message))) {
+                        log_error ("daemon could not start %s: %s", remaining_argv[0], message);
+                        exit (EXIT_FAILURE);
+                }
+
+                free (response);
+                free (arguments);
+
+        } else if (strcmp (command, "batch") == 0) {
+                run_batch (sock_fd);
+
+        } else if (strcmp (command, "list") == 0) {
+                pm_cmd cmd = { .instruction = LIST_PROCESS };
+
+                pm_response *response = send_client_command (sock_fd, &cmd);
+
+                check_response (response, "list processes");
+                print_process_list (response->data, response->size);
+                free (response);
+
+        } else if (strcmp (command, "stats") == 0) {
+                pm_cmd cmd = { .instruction = STATS };
+
+                pm_response *response = send_client_command (sock_fd, &cmd);
+
+                check_response (response, "collect stats");
+                print_stats (response->data, response->size);
+                free (response);
+
+        } else if (strcmp (command, "events") == 0) {
+                pm_cmd cmd = { .instruction = SUBSCRIBE };
+
+                pm_response *response = send_client_command (sock_fd, &cmd);
+
+                check_response (response, "subscribe to events");
+                free (response);
+
+                // every event comes as another response to the request,
+                // until the daemon goes away
+                while ((response = receive_response (sock_fd))) {
+                        if (response->id == cmd.id)
+                                print_event (response->data, response->size);
+
+                        free (response);
+                }
+
+        } else if (strcmp (command, "logs") == 0) {
+                if (!remaining_argv[0] || strlen (remaining_argv[0]) >= PM_NAME_MAX) {
+                        log_error ("logs requires the name or id of a process");
+                        exit (EXIT_FAILURE);
+                }
+
+                pm_cmd cmd = { .instruction = LOGS, .logs = { .lines = config.log_lines, .flags = config.logs_flags } };
+                strcpy (cmd.logs.target, remaining_argv[0]);
+
+                pm_response *response = send_client_command (sock_fd, &cmd);
+
+                check_response (response, "stream logs");
+                free (response);
+
+                // the log data follows in responses to the same request, the
+                // daemon closes the connection once it has sent everything
+                while ((response = receive_response (sock_fd))) {
+                        if (response->id == cmd.id && response->code == OK)
+                                fwrite (response->data, 1, response->size, stdout);
+
+                        fflush (stdout);
+                        free (response);
+                }
+
+        } else if (strcmp (command, "stdout") == 0 || strcmp (command, "stderr") == 0) {
+                // the daemon runs elsewhere, hand it an absolute path
+                char *path = remaining_argv[0] ? absolute_path (remaining_argv[0]) : strdup ("");
 
-                cmd->instruction = NEW_PROCESS;
-                cmd->new_process.size = buffer_size;
+                pm_cmd cmd = { .instruction = strcmp (command, "stdout") == 0 ? SET_STDOUT : SET_STDERR,
+                               .set_file = { .size = *path ? strlen (path) + 1 : 0, .path = path } };
 
-                join_string_list_with_null_term (remaining_argv, cmd->new_process.command);
+                pm_response *response = send_client_command (sock_fd, &cmd);
 
-                send_client_command (sock_fd, cmd);
+                check_response (response, strcmp (command, "stdout") == 0 ? "set stdout" : "set stderr");
+                free (response);
+                free (path);
 
         } else if (strcmp (command, "autorestart") == 0) {
                 pm_cmd cmd = (pm_cmd) {
@@ -189,7 +1324,90 @@ void process_client_command (char *command, char **remaining_argv)
                         }
                 };
 
-                send_client_command (sock_fd, &cmd);
+                free (send_client_command (sock_fd, &cmd));
+
+        } else if (strcmp (command, "zygote") == 0) {
+                pm_cmd cmd = { .instruction = ZYGOTE, .zygote = { .pool_size = config.zygote_pool } };
+
+                if (remaining_argv[0] && strlen (remaining_argv[0]) >= PM_NAME_MAX) {
+                        log_error ("program name %s is too long", remaining_argv[0]);
+                        exit (EXIT_FAILURE);
+                }
+
+                // without a program the pools are listed
+                if (remaining_argv[0])
+                        strcpy (cmd.zygote.program, remaining_argv[0]);
+
+                pm_response *response = send_client_command (sock_fd, &cmd);
+
+                check_response (response, remaining_argv[0] ? "set up the zygote pool" : "list zygote pools");
+
+                if (!remaining_argv[0])
+                        print_zygotes (response->data, response->size);
+
+                free (response);
+
+        } else if (strcmp (command, "restart") == 0) {
+                if (!remaining_argv[0] || strlen (remaining_argv[0]) >= PM_NAME_MAX) {
+                        log_error ("restart requires the name of a group");
+                        exit (EXIT_FAILURE);
+                }
+
+                pm_cmd cmd = { .instruction = ROLLING_RESTART,
+                               .rolling_restart = { .batch = config.rollout_batch,
+                                                    .timeout_ms = config.rollout_timeout_ms,
+                                                    .grace_ms = config.shutdown_grace_ms } };
+                strcpy (cmd.rolling_restart.name, remaining_argv[0]);
+
+                // answered once every instance has been replaced
+                pm_response *response = send_client_command (sock_fd, &cmd);
+
+                check_response (response, "restart the group");
+
+                pm_reader reader = { .data = response->data, .len = response->size };
+                printf ("replaced %u instances of %s\n", reader_get_u32 (&reader), remaining_argv[0]);
+                free (response);
+
+        } else if (strcmp (command, "apply") == 0) {
+                if (!remaining_argv[0]) {
+                        log_error ("apply requires a process file");
+                        exit (EXIT_FAILURE);
+                }
+
+                pm_buffer entries = { 0 };
+                encode_process_file (remaining_argv[0], &entries);
+
+                pm_cmd cmd = { .instruction = APPLY,
+                               .apply = { .flags = config.apply_flags,
+                                          .timeout_ms = config.rollout_timeout_ms,
+                                          .grace_ms = config.shutdown_grace_ms,
+                                          .size = entries.len,
+                                          .entries = entries.data } };
+
+                // answered once every group is up or failed
+                pm_response *response = send_client_command (sock_fd, &cmd);
+                char message[512];
+                pm_reader reader = response_reader (response, message, sizeof (message));
+
+                // a failed apply lists the groups too, unless it was rejected
+                if (response->code == OK || reader.off < reader.len)
+                        print_applied (reader.data + reader.off, reader.len - reader.off);
+
+                if (response->code != OK) {
+                        log_error ("daemon could not apply %s: %s", remaining_argv[0], message);
+                        exit (EXIT_FAILURE);
+                }
+
+                free (response);
+                buffer_free (&entries);
+
+        } else if (strcmp (command, "logrotate") == 0) {
+                pm_cmd cmd = { .instruction = SET_LOG_ROTATION, .log_rotation = { .policy = config.rotation } };
+
+                pm_response *response = send_client_command (sock_fd, &cmd);
+
+                check_response (response, "set log rotation");
+                free (response);
 
         } else {
                 print_usage_statement ();
@@ -205,12 +1423,115 @@ void print_usage_statement ()
                 "target:\n"
                 "  daemon\n"
                 "  client\n"
+                "  bench\n"
                 "subcommand:\n"
                 "  daemon\n"
-                "    start - starts the pm daemon\n"
-                "    shutdown - shutdown the pm daemon\n"
+                "    start [--log-level=level] [--log-format=format] [--log-timestamps] - starts the\n"
+                "      pm daemon, logging messages of level (info, warn or error) and above as\n"
+                "      format (text or json)\n"
+                "    start [--cgroup-root=dir] ... - place every process in a cgroup of its own\n"
+                "      below the delegated cgroup v2 directory dir\n"
+                "    start [--no-io-uring] ... - serve clients and capture output with plain\n"
+                "      system calls even where io_uring is available\n"
+                "    shutdown [--grace=age] - shutdown the pm daemon, processes get age to exit\n"
+                "      after SIGTERM before they are killed (default 5s)\n"
+                "    upgrade - replace the running daemon with this pm binary, processes keep\n"
+                "      running\n"
+                "  client\n"
+                "    run [--name=name] [--instances=n] [--] program [args...] - starts a process\n"
+                "    run [--timestamps] ... - prefix captured output lines with the time\n"
+                "    batch [run options] - starts one process per line of standard input, words\n"
+                "      separated by whitespace, over a single pipelined connection\n"
+                "    list [--json] - lists managed processes\n"
+                "    stats [--json] - shows CPU, memory, threads, descriptors and I/O per process\n"
+                "    events [--json] - prints process starts, exits, restarts and log rotations as\n"
+                "      they happen\n"
+                "    logs target [--lines=n] [--follow] [--stderr] - prints the last n lines (default\n"
+                "      10) of the stdout log file of target, a process name or id, then with\n"
+                "      --follow whatever it writes from then on\n"
+                "    stdout [file] - send stdout of new processes to file, or back to the daemon's\n"
+                "    stderr [file] - send stderr of new processes to file, or back to the daemon's\n"
+                "    autorestart - restart processes that exit, up to 3 times\n"
+                "    run [--cpu-max=percent] [--memory-max=size] [--pids-max=n] ... - limit the\n"
+                "      resources of each process, needs --cgroup-root on the daemon\n"
+                "    run [--max-memory-restart=size] [--max-cpu-restart=percent] [--watchdog-window=age]\n"
+                "      ... - restart a process that stays over a limit for age (default 30s)\n"
+                "    run [--liveness=probe] [--readiness=probe] ... - probe the process, it is\n"
+                "      stopped and restarted as a crash once its liveness probe fails, and listed\n"
+                "      as unready while its readiness probe fails\n"
+                "    run [--probe-interval=age] [--probe-timeout=age] [--probe-failures=n] ... -\n"
+                "      probe every age (default 1s), fail probes taking longer than age (default\n"
+                "      1s), and count a probe as failing after n failures in a row (default 3)\n"
+                "    run [--listen=addresses] ... - the daemon owns listening sockets for the group\n"
+                "      and passes them to each process as descriptors 3 and up, with LISTEN_FDS\n"
+                "      and LISTEN_PID set like systemd does\n"
+                "    run [--placement=placement] ... - pin each process to CPUs of its own, it keeps\n"
+                "      them across restarts\n"
+                "    run [--log-max-size=size] [--log-max-age=age] [--log-keep=n] ... - rotate the\n"
+                "      process's log files with this policy\n"
+                "    zygote [--pool=n] program - keep n (default 4) zygotes ready to start program\n"
+                "      with, for runs whose program is given exactly like this, --pool=0 stops\n"
+                "    zygote [--json] - lists zygote pools and spawn latencies with and without them\n"
+                "    restart name [--batch=n] [--ready-timeout=age] [--grace=age] - replaces the\n"
+                "      processes of the group n (default 1) at a time: starts new ones, waits up\n"
+                "      to age (default 60s) for them to be ready, then stops the old ones\n"
+                "    apply file [--prune] [--ready-timeout=age] [--grace=age] - brings the groups\n"
+                "      described in file to that state: starts, scales or replaces only what\n"
+                "      differs, starting each group once the groups it depends on are ready and\n"
+                "      groups that do not depend on each other together, --prune stops the\n"
+                "      groups file does not describe\n"
+                "    logrotate [--log-max-size=size] [--log-max-age=age] [--log-keep=n] - rotate log\n"
+                "      files of new processes with this policy, no options turns rotation off\n"
+                "  bench\n"
+                "    capture [--writers=n] [--lines=n] - n (default 16) writers write n (default\n"
+                "      100000) lines each through output capture, with io_uring and with read\n"
+                "      and write, and the throughput and system calls of each are compared\n"
+                "    requests [--clients=n] [--requests=n] - n (default 16) clients send n (default\n"
+                "      20000) requests each, one after another, to an event loop serving them\n"
+                "      with io_uring and with plain system calls, which are compared the same way\n"
                 "\n"
-                "sockfilename: name of the UNIX socket file\n");
+                "sockfilename: name of the UNIX socket file\n"
+                "name: name of the process, processes started together share it\n"
+                "n: number of instances to start, each one gets PM_INSTANCE_ID=0..n-1\n"
+                "probe: exec:command, unix:path, tcp:port or http:port[/path], ports are on\n"
+                "  127.0.0.1, http expects a 2xx or 3xx status, commands get PM_PID\n"
+                "file: [name] sections of key = value lines, keys are command, instances,\n"
+                "  retries, stdout, stderr, liveness, readiness, listen, placement and\n"
+                "  depends_on, a list of group names\n"
+                "addresses: comma separated tcp:[host:]port or unix:path, up to 8\n"
+                "placement: core (a physical core each), spread (cores of every NUMA node in\n"
+                "  turn), pack (a CPU each, hyperthreads of a core first), node:N (the CPUs and\n"
+                "  memory of NUMA node N) or cpus:list (like 0-3,8)\n"
+                "size: bytes, or with a K, M or G suffix\n"
+                "age: seconds, or with an s, m, h or d suffix\n");
+}
+
+/**
+ * Parses a number followed by an optional unit suffix, each suffix in units
+ * stands for the matching multiplier. Exits if the value is malformed.
+ */
+static uint64_t parse_with_unit (char *option, char *value, char *units, uint64_t *multipliers)
+{
+        char *end;
+        errno = 0;
+        unsigned long long number = strtoull (value, &end, 10);
+
+        if (end == value || errno != 0 || *value == '-') {
+                log_error ("invalid value for --%s: %s", option, value);
+                exit (EXIT_FAILURE);
+        }
+
+        if (*end == '\0')
+                return number;
+
+        char *unit = strchr (units, *end);
+
+        if (!unit || end[1] != '\0') {
+                log_error ("invalid unit for --%s: %s", option, value);
+                exit (EXIT_FAILURE);
+        }
+
+        return number * multipliers[unit - units];
 }
 
 bool consume_argv (int argc, char **argv, int *opt_index, char *expected)
@@ -230,12 +1551,221 @@ bool consume_argv (int argc, char **argv, int *opt_index, char *expected)
 void parse_cmd_args (int argc, char **argv)
 {
         struct option long_options[] = {
-                {.name = "sockfile", .has_arg = required_argument, .flag = NULL, .val = 's'}
+                {.name = "sockfile", .has_arg = required_argument, .flag = NULL, .val = 's'},
+                {.name = "name", .has_arg = required_argument, .flag = NULL, .val = 'n'},
+                {.name = "instances", .has_arg = required_argument, .flag = NULL, .val = 'i'},
+                {.name = "json", .has_arg = no_argument, .flag = NULL, .val = 'j'},
+                {.name = "timestamps", .has_arg = no_argument, .flag = NULL, .val = 't'},
+                {.name = "log-max-size", .has_arg = required_argument, .flag = NULL, .val = 'S'},
+                {.name = "log-max-age", .has_arg = required_argument, .flag = NULL, .val = 'A'},
+                {.name = "log-keep", .has_arg = required_argument, .flag = NULL, .val = 'K'},
+                {.name = "cgroup-root", .has_arg = required_argument, .flag = NULL, .val = 'C'},
+                {.name = "cpu-max", .has_arg = required_argument, .flag = NULL, .val = 'c'},
+                {.name = "memory-max", .has_arg = required_argument, .flag = NULL, .val = 'm'},
+                {.name = "pids-max", .has_arg = required_argument, .flag = NULL, .val = 'p'},
+                {.name = "max-memory-restart", .has_arg = required_argument, .flag = NULL, .val = 'M'},
+                {.name = "max-cpu-restart", .has_arg = required_argument, .flag = NULL, .val = 'U'},
+                {.name = "watchdog-window", .has_arg = required_argument, .flag = NULL, .val = 'W'},
+                {.name = "grace", .has_arg = required_argument, .flag = NULL, .val = 'G'},
+                {.name = "log-level", .has_arg = required_argument, .flag = NULL, .val = 'L'},
+                {.name = "log-format", .has_arg = required_argument, .flag = NULL, .val = 'F'},
+                {.name = "log-timestamps", .has_arg = no_argument, .flag = NULL, .val = 'T'},
+                {.name = "lines", .has_arg = required_argument, .flag = NULL, .val = 'l'},
+                {.name = "follow", .has_arg = no_argument, .flag = NULL, .val = 'f'},
+                {.name = "stderr", .has_arg = no_argument, .flag = NULL, .val = 'e'},
+                {.name = "pool", .has_arg = required_argument, .flag = NULL, .val = 'P'},
+                {.name = "liveness", .has_arg = required_argument, .flag = NULL, .val = 'v'},
+                {.name = "readiness", .has_arg = required_argument, .flag = NULL, .val = 'r'},
+                {.name = "probe-interval", .has_arg = required_argument, .flag = NULL, .val = 'I'},
+                {.name = "probe-timeout", .has_arg = required_argument, .flag = NULL, .val = 'O'},
+                {.name = "probe-failures", .has_arg = required_argument, .flag = NULL, .val = 'X'},
+                {.name = "listen", .has_arg = required_argument, .flag = NULL, .val = 'H'},
+                {.name = "placement", .has_arg = required_argument, .flag = NULL, .val = 'Y'},
+                {.name = "batch", .has_arg = required_argument, .flag = NULL, .val = 'B'},
+                {.name = "ready-timeout", .has_arg = required_argument, .flag = NULL, .val = 'R'},
+                {.name = "prune", .has_arg = no_argument, .flag = NULL, .val = 'D'},
+                {.name = "no-io-uring", .has_arg = no_argument, .flag = NULL, .val = 'u'},
+                {.name = "writers", .has_arg = required_argument, .flag = NULL, .val = 'w'},
+                {.name = "clients", .has_arg = required_argument, .flag = NULL, .val = 'k'},
+                {.name = "requests", .has_arg = required_argument, .flag = NULL, .val = 'q'},
+                { 0 }
         };
         int option_index = 0, c;
         while ((c = getopt_long (argc, argv, "s:", long_options, &option_index)) != -1) {
                 switch (c) {
                 case 's': config.socket_file = optarg; break;
+                case 'n': config.process_name = optarg; break;
+                case 'j': config.json = true; break;
+                case 't': config.timestamps = true; break;
+                case 'S':
+                        config.rotation.max_size = parse_with_unit ("log-max-size", optarg, "kKmMgG",
+                                                                    (uint64_t[]) { 1 << 10, 1 << 10, 1 << 20, 1 << 20, 1 << 30, 1 << 30 });
+                        config.has_rotation = true;
+                        break;
+                case 'A':
+                        config.rotation.max_age = parse_with_unit ("log-max-age", optarg, "smhd",
+                                                                   (uint64_t[]) { 1, 60, 60 * 60, 24 * 60 * 60 });
+                        config.has_rotation = true;
+                        break;
+                case 'L': {
+                        int level = parse_log_level (optarg);
+
+                        if (level < 0) {
+                                log_error ("--log-level must be one of info, warn or error");
+                                exit (EXIT_FAILURE);
+                        }
+
+                        config.log_level = level;
+                        break;
+                }
+                case 'F':
+                        if (strcmp (optarg, "text") == 0) {
+                                config.log_format = LOG_FORMAT_TEXT;
+                        } else if (strcmp (optarg, "json") == 0) {
+                                config.log_format = LOG_FORMAT_JSON;
+                        } else {
+                                log_error ("--log-format must be text or json");
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                case 'T': config.log_timestamps = true; break;
+                case 'l':
+                        config.log_lines = parse_with_unit ("lines", optarg, "", NULL);
+                        config.has_log_lines = true;
+                        break;
+                case 'f': config.logs_flags |= PM_LOGS_FOLLOW; break;
+                case 'e': config.logs_flags |= PM_LOGS_STDERR; break;
+                case 'v':
+                        if (!parse_probe ("--liveness", optarg, &config.probes[PROBE_LIVENESS]))
+                                exit (EXIT_FAILURE);
+                        break;
+                case 'r':
+                        if (!parse_probe ("--readiness", optarg, &config.probes[PROBE_READINESS]))
+                                exit (EXIT_FAILURE);
+                        break;
+                case 'I':
+                case 'O':
+                case 'X': {
+                        char *option = c == 'I' ? "probe-interval" : c == 'O' ? "probe-timeout" : "probe-failures";
+                        uint64_t value = c == 'X' ? parse_with_unit (option, optarg, "", NULL)
+                                                  : parse_with_unit (option, optarg, "smh", (uint64_t[]) { 1, 60, 60 * 60 }) * 1000;
+
+                        if (value == 0 || value > UINT32_MAX) {
+                                log_error ("--%s must be above 0", option);
+                                exit (EXIT_FAILURE);
+                        }
+
+                        // the settings apply to both probes
+                        for (int kind = 0; kind < PM_PROBE_KINDS; kind++) {
+                                if (c == 'I')
+                                        config.probes[kind].interval_ms = value;
+                                else if (c == 'O')
+                                        config.probes[kind].timeout_ms = value;
+                                else
+                                        config.probes[kind].threshold = value;
+                        }
+                        break;
+                }
+                case 'P':
+                        config.zygote_pool = parse_with_unit ("pool", optarg, "", NULL);
+
+                        if (config.zygote_pool > PM_ZYGOTE_POOL_MAX) {
+                                log_error ("--pool must be at most %d", PM_ZYGOTE_POOL_MAX);
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                case 'H':
+                        config.listen = parse_listen_spec (optarg);
+
+                        if (!config.listen) {
+                                log_error ("--listen must be up to %d comma separated tcp:[host:]port or unix:path", PM_LISTEN_MAX);
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                case 'Y':
+                        if (!parse_placement_spec (optarg)) {
+                                log_error ("--placement must be core, spread, pack, node:N or cpus:list");
+                                exit (EXIT_FAILURE);
+                        }
+
+                        config.placement = optarg;
+                        break;
+                case 'B':
+                        config.rollout_batch = parse_with_unit ("batch", optarg, "", NULL);
+
+                        if (config.rollout_batch == 0) {
+                                log_error ("--batch must be above 0");
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                case 'R':
+                        config.rollout_timeout_ms = parse_with_unit ("ready-timeout", optarg, "smh", (uint64_t[]) { 1, 60, 60 * 60 }) * 1000;
+
+                        if (config.rollout_timeout_ms == 0) {
+                                log_error ("--ready-timeout must be above 0");
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                case 'D': config.apply_flags |= PM_APPLY_PRUNE; break;
+                case 'u': config.no_io_uring = true; break;
+                case 'w':
+                        config.bench_writers = parse_with_unit ("writers", optarg, "", NULL);
+
+                        if (config.bench_writers == 0 || config.bench_writers > PM_MAX_INSTANCES) {
+                                log_error ("--writers must be between 1 and %d", PM_MAX_INSTANCES);
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                case 'k':
+                        config.bench_clients = parse_with_unit ("clients", optarg, "", NULL);
+
+                        if (config.bench_clients == 0 || config.bench_clients > PM_MAX_INSTANCES) {
+                                log_error ("--clients must be between 1 and %d", PM_MAX_INSTANCES);
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                case 'q':
+                        config.bench_requests = parse_with_unit ("requests", optarg, "", NULL);
+
+                        if (config.bench_requests == 0) {
+                                log_error ("--requests must be above 0");
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                case 'C': config.cgroup_root = absolute_path (optarg); break;
+                case 'c': config.limits.cpu_percent = parse_with_unit ("cpu-max", optarg, "%", (uint64_t[]) { 1 }); break;
+                case 'm':
+                        config.limits.memory_max = parse_with_unit ("memory-max", optarg, "kKmMgG",
+                                                                    (uint64_t[]) { 1 << 10, 1 << 10, 1 << 20, 1 << 20, 1 << 30, 1 << 30 });
+                        break;
+                case 'p': config.limits.pids_max = parse_with_unit ("pids-max", optarg, "", NULL); break;
+                case 'M':
+                        config.watchdog.max_memory = parse_with_unit ("max-memory-restart", optarg, "kKmMgG",
+                                                                      (uint64_t[]) { 1 << 10, 1 << 10, 1 << 20, 1 << 20, 1 << 30, 1 << 30 });
+                        break;
+                case 'U': config.watchdog.max_cpu_percent = parse_with_unit ("max-cpu-restart", optarg, "%", (uint64_t[]) { 1 }); break;
+                case 'W':
+                        config.watchdog.window = parse_with_unit ("watchdog-window", optarg, "smh", (uint64_t[]) { 1, 60, 60 * 60 });
+                        break;
+                case 'G':
+                        config.shutdown_grace_ms = parse_with_unit ("grace", optarg, "smh", (uint64_t[]) { 1, 60, 60 * 60 }) * 1000;
+
+                        // 0 would mean the daemon's default, kill right away instead
+                        if (config.shutdown_grace_ms == 0)
+                                config.shutdown_grace_ms = 1;
+                        break;
+                case 'K':
+                        config.rotation.keep = parse_with_unit ("log-keep", optarg, "", NULL);
+                        config.has_rotation = true;
+                        break;
+                case 'i':
+                        config.instances = atoi (optarg);
+
+                        if (config.instances < 1 || config.instances > PM_MAX_INSTANCES) {
+                                log_error ("--instances must be between 1 and %d", PM_MAX_INSTANCES);
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
                 default: break;
                 }
         }
@@ -255,13 +1785,15 @@ void parse_cmd_args (int argc, char **argv)
                 }
 
                 process_client_command (argv[optind], &argv[optind + 1]);
+        } else if (consume_argv (argc, argv, &optind, "bench")) {
+                if (!argv[optind]) {
+                        log_error ("bench target requires subcommand");
+                        print_usage_statement ();
+                        return;
+                }
+
+                process_bench_command (argv[optind]);
         } else {
                 print_usage_statement ();
         }
 }
-
-int main (int argc, char **argv)
-{
-        process_identity = MAIN;
-        parse_cmd_args (argc, argv);
-}
@@ -1,12 +1,114 @@
 #ifndef pm_h
 #define pm_h
 
-#include <pthread.h>
-#include <semaphore.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+
+// largest request body the daemon is willing to buffer for a client
+#define PM_MAX_COMMAND_SIZE (256 * 1024)
+
+// version of the framing and encoding of requests and responses
+#define PM_PROTOCOL_VERSION 1
+
+// u32 body size, u16 version, u16 type, u32 request id
+#define PM_FRAME_HEADER_SIZE 12
+
+// requests the client keeps in flight on one connection before it waits for
+// responses
+#define PM_PIPELINE_DEPTH 128
+
+// longest process or group name, including the terminating null byte
+#define PM_NAME_MAX 64
+
+// most instances a single NEW_PROCESS command may start
+#define PM_MAX_INSTANCES 4096
+
+// exited processes kept around for listing before the oldest is dropped
+#define PM_MAX_EXITED 128
+
+// resolution of the daemon's timers
+#define PM_TIMER_TICK_MS 100
+
+// delay before the first restart of a crashed process, doubled for every
+// further crash up to the maximum
+#define PM_BACKOFF_INITIAL_MS 500
+#define PM_BACKOFF_MAX_MS (60 * 1000)
+
+// a process that ran for this many seconds starts over with the initial delay
+#define PM_MIN_UPTIME 10
+
+// a process exiting this many times within the window is crash looping and
+// is no longer restarted
+#define PM_CRASH_LOOP_EXITS 5
+#define PM_CRASH_LOOP_WINDOW 60
+
+// how often running processes are sampled and how many samples are kept
+#define PM_SAMPLE_INTERVAL_MS 1000
+#define PM_SAMPLE_HISTORY 32
+
+// lifecycle events kept for subscribers, one that falls further behind
+// loses the oldest ones
+#define PM_EVENT_RING 1024
+#define PM_EVENT_DETAIL 256
+
+// time processes get to exit after SIGTERM when the daemon shuts down
+#define PM_SHUTDOWN_GRACE_MS 5000
+
+// programs that may have a zygote pool, helpers kept ready per program and
+// the pool size used when none is given
+#define PM_ZYGOTE_PROGRAMS 16
+#define PM_ZYGOTE_POOL_MAX 64
+#define PM_ZYGOTE_POOL 4
+
+// argv[0] this program is started with to run as a zygote
+#define PM_ZYGOTE_NAME "pm-zygote"
+
+// buckets of a latency histogram, powers of two of microseconds
+#define PM_HISTOGRAM_BUCKETS 24
+
+// longest probe target, including the terminating null byte
+#define PM_PROBE_TARGET_MAX 256
+
+// how often a process is probed, how long a probe may take and how many
+// probes in a row have to fail, unless the probe says otherwise
+#define PM_PROBE_INTERVAL_MS 1000
+#define PM_PROBE_TIMEOUT_MS 1000
+#define PM_PROBE_THRESHOLD 3
+
+// listening sockets a group may have the daemon own, and the longest list
+// of their addresses, including the terminating null byte
+#define PM_LISTEN_MAX 8
+#define PM_LISTEN_SPEC_MAX 1024
+
+// argv[0] this program is started with to hand listening sockets to a
+// process, see listen.c
+#define PM_LISTEN_NAME "pm-listen"
+
+// descriptor PM_LISTEN_NAME reports a failed exec on, right above the
+// sockets
+#define PM_LISTEN_STATUS_FD (3 + PM_LISTEN_MAX)
+
+// argv[0] this program is started with to keep the capture pipes open for
+// a daemon, see holder.c
+#define PM_HOLDER_NAME "pm-holder"
+
+// longest CPU placement, including the terminating null byte, and the most
+// NUMA nodes placements know of
+#define PM_PLACEMENT_SPEC_MAX 256
+#define PM_NUMA_NODES_MAX 64
+
+// how long a rolling restart waits for a new instance to become ready
+#define PM_ROLLOUT_TIMEOUT_MS (60 * 1000)
+
+// most groups and dependencies of a group an APPLY request may have
+#define PM_APPLY_MAX 4096
+#define PM_APPLY_DEPENDENCIES 64
+
 typedef enum pm_instruction {
         NEW_PROCESS,
         SIGNAL_PROCESS,
@@ -14,26 +116,213 @@ typedef enum pm_instruction {
         SET_AUTORESTART_TRIES,
         SET_STDOUT,
         SET_STDERR,
-        SHUTDOWN
+        SHUTDOWN,
+        SET_LOG_ROTATION,
+        STATS,
+        SUBSCRIBE,
+        LOGS,
+        UPGRADE,
+        ZYGOTE,
+        ROLLING_RESTART,
+        APPLY
 } pm_instruction;
 
 typedef enum pm_code {
         OK,
         NO_SUCH_PID,
         NO_SUCH_FILE_OR_DIRECTORY,
+        INVALID_COMMAND,
+        SPAWN_FAILED,
+        UNSUPPORTED_VERSION,
 } pm_code;
 
+// NEW_PROCESS flags
+#define PM_RUN_TIMESTAMPS (1 << 0)
+// the command carries its own log rotation policy
+#define PM_RUN_LOG_ROTATION (1 << 1)
+
+// APPLY flags
+// groups that are not in the request are stopped and removed
+#define PM_APPLY_PRUNE (1 << 0)
+
+// LOGS flags
+#define PM_LOGS_FOLLOW (1 << 0)
+#define PM_LOGS_STDERR (1 << 1)
+
+/**
+ * When the log files of a process are rotated. A file is rotated once it
+ * would grow past max_size bytes or once it is older than max_age seconds,
+ * and only the newest keep rotated segments are kept. Zero disables a limit.
+ */
+typedef struct pm_rotation_policy {
+        uint64_t max_size;
+        uint32_t max_age;
+        uint32_t keep;
+} pm_rotation_policy;
+
+/**
+ * Resources a process may use, enforced through its cgroup. Zero leaves a
+ * resource unlimited.
+ */
+typedef struct pm_resource_limits {
+        // percent of one CPU, 250 allows two and a half
+        uint32_t cpu_percent;
+        uint32_t pids_max;
+        uint64_t memory_max;
+} pm_resource_limits;
+
+/**
+ * Limits a running process is recycled at. A process using more memory or
+ * CPU than allowed for window seconds in a row is stopped and started again.
+ * Zero disables a limit.
+ */
+typedef struct pm_watchdog_policy {
+        uint64_t max_memory;
+        // percent of one CPU
+        uint32_t max_cpu_percent;
+        uint32_t window;
+} pm_watchdog_policy;
+
+// window used when a watchdog limit is given without one
+#define PM_WATCHDOG_WINDOW 30
+
+typedef enum pm_probe_type { PROBE_NONE, PROBE_EXEC, PROBE_UNIX, PROBE_TCP, PROBE_HTTP } pm_probe_type;
+
+// a failing liveness probe restarts the process, a readiness probe only
+// decides whether it is listed as ready
+typedef enum pm_probe_kind { PROBE_LIVENESS, PROBE_READINESS, PM_PROBE_KINDS } pm_probe_kind;
+
+/**
+ * How a process is probed. An exec probe runs target with /bin/sh -c, with
+ * PM_PID set to the pid of the process, and succeeds if it exits with
+ * status 0. A unix probe connects to the socket at
+ * target, a tcp probe to the port target on 127.0.0.1. An http probe sends
+ * GET to target, a port followed by an optional path, on 127.0.0.1 and
+ * succeeds on a 2xx or 3xx status.
+ */
+typedef struct pm_probe_spec {
+        pm_probe_type type;
+        char *target;
+        uint32_t interval_ms;
+        uint32_t timeout_ms;
+        // failures in a row after which the probe counts as failing
+        uint32_t threshold;
+} pm_probe_spec;
+
+typedef enum pm_readiness {
+        // the process has no readiness probe
+        READINESS_NONE,
+        // not probed successfully yet
+        READINESS_STARTING,
+        READINESS_READY,
+        READINESS_UNREADY,
+} pm_readiness;
+
+// slot index in the low 32 bits, slot generation in the high 32 bits
+typedef uint64_t pm_handle;
+
+typedef enum pm_event_type {
+        EVENT_STARTED,
+        EVENT_EXITED,
+        EVENT_RESTART_SCHEDULED,
+        EVENT_RESTARTED,
+        // exited for good, it is not restarted again
+        EVENT_RETIRED,
+        // stopped by the watchdog to be started again
+        EVENT_RECYCLED,
+        EVENT_LOG_ROTATED,
+        // the subscriber fell behind and missed events
+        EVENT_DROPPED,
+        EVENT_READY,
+        EVENT_UNREADY,
+        // failed its liveness probe, it is stopped to be restarted
+        EVENT_UNHEALTHY,
+} pm_event_type;
+
+/**
+ * A lifecycle event as kept in the event ring. Fields that do not apply to
+ * an event are 0.
+ */
+typedef struct pm_event {
+        uint64_t seq;
+        // wall clock time in milliseconds
+        uint64_t time_ms;
+        pm_event_type type;
+        pm_handle handle;
+        pid_t pid;
+        // wait status of EVENT_EXITED, -1 if unknown
+        int status;
+        uint32_t restarts;
+        // delay of EVENT_RESTART_SCHEDULED, missed events of EVENT_DROPPED
+        uint64_t value;
+        char name[PM_NAME_MAX];
+        // cause of EVENT_RECYCLED, EVENT_UNREADY and EVENT_UNHEALTHY,
+        // segment of EVENT_LOG_ROTATED
+        char detail[PM_EVENT_DETAIL];
+} pm_event;
+
+// what an APPLY request did to a group
+typedef enum pm_apply_action {
+        APPLY_UNCHANGED,
+        APPLY_STARTED,
+        // instances were added or stopped, the others were kept
+        APPLY_SCALED,
+        // the settings changed, every instance was replaced
+        APPLY_REPLACED,
+        // not in the request, stopped with PM_APPLY_PRUNE
+        APPLY_REMOVED,
+        APPLY_FAILED,
+        // one of its dependencies failed, it was left alone
+        APPLY_SKIPPED,
+} pm_apply_action;
+
 typedef enum pm_identity { MAIN, DAEMON, MONITOR } pm_identity;
 
-typedef struct __attribute__ ((packed)) pm_cmd {
+typedef enum pm_log_level { LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR } pm_log_level;
+
+typedef enum pm_log_format { LOG_FORMAT_TEXT, LOG_FORMAT_JSON } pm_log_format;
+
+/**
+ * A decoded request. Variable length data points into the frame the request
+ * was decoded from and only lives as long as it does.
+ */
+typedef struct pm_cmd {
+        uint32_t id;
         pm_instruction instruction;
 
         union {
                 struct {
-                        size_t size;
-                        char command[];
+                        // 0 starts a single process, otherwise the number of
+                        // instances to start, each one gets PM_INSTANCE_ID
+                        uint32_t instances;
+                        // group name, the program name is used if empty
+                        char name[PM_NAME_MAX];
+                        uint32_t flags;
+                        // only used with PM_RUN_LOG_ROTATION
+                        pm_rotation_policy rotation;
+                        pm_resource_limits limits;
+                        pm_watchdog_policy watchdog;
+                        // null terminated arguments, one after the other
+                        uint32_t size;
+                        char *command;
+                        // the targets point into probe_targets
+                        pm_probe_spec probes[PM_PROBE_KINDS];
+                        char probe_targets[PM_PROBE_KINDS][PM_PROBE_TARGET_MAX];
+                        // comma separated addresses of the listening sockets
+                        // the daemon owns for the group, empty for none
+                        char listen[PM_LISTEN_SPEC_MAX];
+                        // CPUs every instance is pinned to, see affinity.c,
+                        // empty for none
+                        char placement[PM_PLACEMENT_SPEC_MAX];
                 } new_process;
 
+                // SET_STDOUT and SET_STDERR, an empty path resets to the
+                // daemon's own output
+                struct {
+                        uint32_t size;
+                        char *path;
+                } set_file;
+
                 struct {
                         int signal;
                         pid_t pid;
@@ -42,73 +331,733 @@ typedef struct __attribute__ ((packed)) pm_cmd {
                 struct {
                         int max_retries;
                 } autorestart;
+
+                struct {
+                        // 0 uses PM_SHUTDOWN_GRACE_MS
+                        uint32_t grace_ms;
+                } shutdown;
+
+                // policy for processes started without one of their own
+                struct {
+                        pm_rotation_policy policy;
+                } log_rotation;
+
+                // the last lines of a process's log file, then whatever is
+                // appended to it with PM_LOGS_FOLLOW
+                struct {
+                        // process name or id
+                        char target[PM_NAME_MAX];
+                        uint32_t lines;
+                        uint32_t flags;
+                } logs;
+
+                // the program the daemon replaces itself with
+                struct {
+                        uint32_t size;
+                        char *path;
+                } upgrade;
+
+                // keeps pool_size zygotes ready for program, 0 removes its
+                // pool, an empty program lists the pools
+                struct {
+                        uint32_t pool_size;
+                        char program[PM_NAME_MAX];
+                } zygote;
+
+                // replaces the instances of a group batch at a time, 0
+                // timeout and grace use the defaults
+                struct {
+                        char name[PM_NAME_MAX];
+                        uint32_t batch;
+                        uint32_t timeout_ms;
+                        uint32_t grace_ms;
+                } rolling_restart;
+
+                // brings the groups described by entries to that state, see
+                // apply.c for their encoding. 0 timeout and grace use the
+                // defaults of a rolling restart
+                struct {
+                        uint32_t flags;
+                        uint32_t timeout_ms;
+                        uint32_t grace_ms;
+                        uint32_t size;
+                        char *entries;
+                } apply;
         };
 
 } pm_cmd;
 
-typedef struct __attribute__ ((packed)) pm_response {
-        pm_code code;
+typedef struct pm_frame_header {
+        uint32_t size;
+        uint16_t version;
+        // pm_instruction of a request, pm_code of a response
+        uint16_t type;
+        uint32_t id;
+} pm_frame_header;
 
+/**
+ * A response as received by the client, data holds size bytes of body.
+ */
+typedef struct pm_response {
+        uint32_t id;
+        pm_code code;
+        uint32_t size;
+        char data[];
 } pm_response;
 
+/**
+ * Latencies in microseconds. Bucket i counts latencies below 2^(i+1) that
+ * did not fit the bucket before, the last bucket everything above.
+ */
+typedef struct pm_histogram {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[PM_HISTOGRAM_BUCKETS];
+} pm_histogram;
+
+typedef struct pm_buffer {
+        char *data;
+        size_t len;
+        size_t cap;
+} pm_buffer;
+
+typedef struct pm_reader {
+        char *data;
+        size_t len;
+        size_t off;
+        bool error;
+} pm_reader;
+
+typedef struct pm_watch pm_watch;
+
+/**
+ * A file descriptor registered with the daemon's event loop. The callback is
+ * invoked with the ready epoll events whenever the descriptor becomes ready.
+ */
+typedef struct pm_watch {
+        int fd;
+        void (*callback) (pm_watch *watch, uint32_t events);
+} pm_watch;
+
+typedef struct pm_timer pm_timer;
+
+/**
+ * A timer of the daemon's timer wheel. The callback runs on the event loop
+ * once the timer expires, data is left to the owner of the timer.
+ */
+typedef struct pm_timer {
+        pm_timer *next;
+        pm_timer *prev;
+        // wheel slot the timer is linked into, NULL when not pending
+        pm_timer **slot;
+        uint64_t expires;
+        void (*callback) (pm_timer *timer);
+        void *data;
+} pm_timer;
+
+/**
+ * A client connection. Input is buffered until a full command has arrived
+ * and output is buffered until the client is ready to receive it.
+ */
+typedef struct pm_connection pm_connection;
+
+typedef struct pm_connection {
+        pm_watch watch;
+        char *in;
+        size_t in_len;
+        size_t in_cap;
+        char *out;
+        size_t out_len;
+        size_t out_off;
+        size_t out_cap;
+        bool eof;
+        bool closing;
+        // too many responses are waiting to be sent, requests are left in
+        // the input buffer until the client has caught up
+        bool stalled;
+        // events are pushed to the connection as responses to its
+        // SUBSCRIBE request, starting at event_cursor
+        bool subscribed;
+        uint32_t subscription_id;
+        uint64_t event_cursor;
+        pm_connection *subscriber_next;
+        pm_connection *subscriber_prev;
+        // the epoll events the socket is watched for
+        uint32_t events;
+        // the socket's slot in the event loop's ring, -1 if it has none
+        int slot;
+        // what the connection waits for the event loop's ring to do, what
+        // the last submission was asked to do and did, and the list of
+        // connections it is on for it, see io.c
+        uint8_t ring_queued;
+        uint8_t ring_submitted;
+        int sent;
+        int received;
+        size_t requested;
+        pm_connection **ring_list;
+        pm_connection *ring_next;
+        pm_connection *ring_prev;
+} pm_connection;
+
+/**
+ * Fixed size object allocator. Objects are carved out of large chunks and
+ * recycled through a free list threaded through their first word, chunks are
+ * never returned to the system.
+ */
+typedef struct pm_slab {
+        size_t object_size;
+        size_t objects_per_chunk;
+        void *free_list;
+} pm_slab;
+
+#define PM_SLAB_INIT(type, count) { .object_size = sizeof (type), .objects_per_chunk = (count), .free_list = NULL }
+
+/**
+ * Resource usage of a process at one point in time. CPU time and I/O are
+ * totals since the process started.
+ */
+typedef struct pm_sample {
+        uint64_t time_ms;
+        uint64_t cpu_usec;
+        uint64_t rss;
+        uint64_t read_bytes;
+        uint64_t write_bytes;
+        uint32_t threads;
+        uint32_t fds;
+} pm_sample;
+
+/**
+ * Sampling state of a process: its open /proc files and a ring of its last
+ * samples, indexed by the number of samples taken.
+ */
+typedef struct pm_sampler {
+        pid_t pid;
+        int stat_fd;
+        int io_fd;
+        int fd_dir_fd;
+        uint32_t count;
+        pm_sample ring[PM_SAMPLE_HISTORY];
+} pm_sampler;
+
+typedef enum pm_process_state {
+        PROCESS_RUNNING,
+        PROCESS_EXITED,
+        // crashed, a restart is scheduled
+        PROCESS_WAITING,
+} pm_process_state;
+
+/**
+ * An io_uring instance, see uring.c. The pointers lead into the queues
+ * shared with the kernel.
+ */
+typedef struct pm_uring {
+        int fd;
+        void *sq_ring;
+        void *cq_ring;
+        size_t sq_size;
+        size_t cq_size;
+        size_t sqes_size;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_array;
+        unsigned sq_mask;
+        unsigned sq_entries;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        // entries filled in but not submitted yet, and submitted ones whose
+        // completion was not seen yet
+        unsigned queued;
+        unsigned inflight;
+        // io_uring_enter calls made
+        uint64_t enters;
+        // free slots of the registered descriptor table
+        int *free_files;
+        unsigned free_file_count;
+} pm_uring;
+
+// what the capture thread moved and the system calls it took to do so,
+// reading pipes, writing files and waiting for both
+typedef struct pm_capture_stats {
+        uint64_t bytes;
+        uint64_t syscalls;
+        // whether the ring was still in use when the thread stopped
+        bool io_uring;
+} pm_capture_stats;
+
+// the system calls the event loop took to wait for connections, accept,
+// read and write them
+typedef struct pm_io_stats {
+        uint64_t syscalls;
+        // whether the ring was used
+        bool io_uring;
+} pm_io_stats;
+
 typedef struct pm_process pm_process;
 
+// probing state of a process, kept by the health checks
+typedef struct pm_probe pm_probe;
+
+typedef struct pm_listener pm_listener;
+
+/**
+ * Listening sockets the daemon owns for a group, shared by every process of
+ * the group with the same addresses. A process gets fds[i] as descriptor
+ * 3 + i.
+ */
+typedef struct pm_listener {
+        pm_listener *next;
+        char name[PM_NAME_MAX];
+        char *spec;
+        uint32_t refs;
+        int count;
+        int fds[PM_LISTEN_MAX];
+        // inodes of the unix socket files, removed with the sockets if
+        // they are still the same files
+        uint64_t paths[PM_LISTEN_MAX];
+} pm_listener;
+
+/**
+ * Settings a process is started with. The strings are copied into the process
+ * record, they only need to live for the duration of the call.
+ */
+typedef struct pm_process_options {
+        char *name;
+        char *stdout_file;
+        char *stderr_file;
+        int max_retries;
+        int instance;
+        bool timestamps;
+        pm_rotation_policy rotation;
+        pm_resource_limits limits;
+        pm_watchdog_policy watchdog;
+        pm_probe_spec probes[PM_PROBE_KINDS];
+        // addresses of the group's listening sockets, NULL for none
+        char *listen;
+        // CPU placement of the process, NULL for none
+        char *placement;
+} pm_process_options;
+
 typedef struct pm_process {
+        // must stay first, it holds the slab free list link while unused
         pm_process *next;
+        pm_process *prev;
+        pm_process *name_next;
+        pm_process *name_prev;
+        pm_handle handle;
+        uint32_t name_hash;
+        char *name;
         char *program_name;
         char *stdout_file;
+        char *stderr_file;
         char **argv;
+        char *arena;
+        size_t arena_size;
         int max_retries;
+        int instance;
+        bool timestamps;
+        pm_rotation_policy rotation;
+        pm_resource_limits limits;
+        pm_process_state state;
+        uint32_t restarts;
+        // crashes since the process last stayed up for PM_MIN_UPTIME
+        uint32_t backoff;
+        pm_timer restart_timer;
+        // times of the last exits, a ring indexed by the number of exits
+        time_t exits[PM_CRASH_LOOP_EXITS];
+        uint32_t exit_count;
+        pm_sampler *sampler;
+        pm_watchdog_policy watchdog;
+        // monotonic time a watchdog limit was first seen exceeded, 0 if not
+        uint64_t exceeded_since;
+        // stopped by the watchdog, restart as soon as it exits
+        bool recycling;
+        // replaced by a rolling restart, removed once it exits
+        bool replaced;
+        pm_timer kill_timer;
+        // wait status of the last exit, -1 if the process never exited or
+        // its status is unknown
+        int exit_status;
         time_t start_time;
+        // start time in clock ticks after boot, with the pid it identifies
+        // the process across daemons
+        uint64_t start_ticks;
+        // inodes of the pipes capturing stdout and stderr, 0 if not captured
+        uint64_t stdout_pipe;
+        uint64_t stderr_pipe;
+        // pidfd of a process adopted from an earlier daemon which is not
+        // the daemon's child, its exit is seen through the pidfd, -1 if unused
+        pm_watch pidfd_watch;
+        // targets live in the arena
+        pm_probe_spec probes[PM_PROBE_KINDS];
+        // NULL while the process is not probed
+        pm_probe *probe_state[PM_PROBE_KINDS];
+        pm_readiness readiness;
+        // addresses of the group's listening sockets in the arena, NULL for
+        // none, and the sockets, NULL until they could be opened
+        char *listen;
+        pm_listener *listener;
+        // CPU placement in the arena, NULL for none, and the slot of the
+        // placement the process holds, -1 until it was given one
+        char *placement;
+        int cpu_slot;
         pid_t pid;
 } pm_process;
 
+/**
+ * Every managed process, reachable in O(1) by handle, by pid and by name.
+ * Iteration follows insertion order through the head/next links.
+ */
+typedef struct pm_process_table {
+        pm_process *head;
+        pm_process *tail;
+        size_t count;
+
+        pm_process **slots;
+        uint32_t *generations;
+        uint32_t *free_slots;
+        uint32_t slot_count;
+        uint32_t slot_cap;
+        uint32_t free_count;
+
+        pm_process **pid_index;
+        size_t pid_count;
+        size_t pid_cap;
+
+        pm_process **name_index;
+        size_t name_count;
+        size_t name_cap;
+
+        // ring of exited processes, oldest first
+        pm_handle exited[PM_MAX_EXITED];
+        size_t exited_head;
+        size_t exited_count;
+
+        // bumped on every change visible in a listing
+        uint64_t generation;
+} pm_process_table;
+
 typedef struct pm_configuration {
         char *socket_file;
         char *stdout_file;
-        sem_t *dead_child;
-        pm_process *process_list;
-        pm_process *process_list_end;
-        pthread_mutex_t process_list_lock;
+        char *stderr_file;
+        pm_process_table processes;
         int max_retries;
+        int instances;
+        char *process_name;
+        bool json;
+        bool timestamps;
+        // daemon wide log rotation policy, in the client the one given with
+        // the --log-* options, has_rotation is set if any of them was used
+        pm_rotation_policy rotation;
+        bool has_rotation;
+        // messages below log_level are discarded before being formatted
+        pm_log_level log_level;
+        uint32_t shutdown_grace_ms;
+        // delegated cgroup v2 directory processes are placed below, if any
+        char *cgroup_root;
+        // limits given to the client for the processes it starts
+        pm_resource_limits limits;
+        pm_watchdog_policy watchdog;
+        pm_log_format log_format;
+        bool log_timestamps;
+        // lines and flags the client asks LOGS for, has_log_lines is set if
+        // --lines was used
+        uint32_t log_lines;
+        bool has_log_lines;
+        uint32_t logs_flags;
+        // writers pm bench capture runs
+        uint32_t bench_writers;
+        // clients pm bench requests runs, and the requests each one sends
+        uint32_t bench_clients;
+        uint32_t bench_requests;
+        // zygotes the client asks ZYGOTE for
+        uint32_t zygote_pool;
+        // probes given to the client for the processes it starts
+        pm_probe_spec probes[PM_PROBE_KINDS];
+        // listening sockets given to the client for the processes it starts
+        char *listen;
+        // CPU placement given to the client for the processes it starts
+        char *placement;
+        // batch size and timeout the client asks ROLLING_RESTART for
+        uint32_t rollout_batch;
+        uint32_t rollout_timeout_ms;
+        // flags the client asks APPLY for
+        uint32_t apply_flags;
+        // the event loop and the capture thread read and write with plain
+        // system calls even where io_uring is available
+        bool no_io_uring;
+        // command line the daemon was started with, used again by an upgrade
+        char **argv;
+        // program the daemon replaces itself with once the event loop exits
+        char *upgrade_path;
+        int epoll_fd;
         bool shutdown;
 } pm_configuration;
 
+// an APPLY request and its groups as apply.c works through them
+typedef enum node_state {
+        // waiting for the groups it depends on
+        NODE_BLOCKED,
+        // started, waiting for its instances to be ready
+        NODE_STARTING,
+        // ready, failed or skipped
+        NODE_SETTLED,
+} node_state;
+
+typedef struct apply_node {
+        char name[PM_NAME_MAX];
+        uint32_t instances;
+        int max_retries;
+        char *stdout_file;
+        char *stderr_file;
+        char *command;
+        char **argv;
+        pm_probe_spec probes[PM_PROBE_KINDS];
+        char probe_targets[PM_PROBE_KINDS][PM_PROBE_TARGET_MAX];
+        char *listen;
+        char *placement;
+        char (*depends_on)[PM_NAME_MAX];
+        uint16_t depends_count;
+        // groups depending on this one by index, and the number of groups
+        // this one depends on that are not ready yet
+        uint32_t *dependents;
+        uint32_t dependent_count;
+        uint32_t pending;
+        node_state state;
+        pm_apply_action action;
+        char detail[256];
+        // instance numbers to start, and the instances that have to be
+        // ready: the ones started and the running ones kept
+        int *missing;
+        uint32_t missing_count;
+        pm_handle *started;
+        uint32_t started_count;
+        pm_handle *kept;
+        uint32_t kept_count;
+        // instances to stop, right away when scaling down and once the new
+        // instances are ready when replacing them
+        pm_handle *retiring;
+        uint32_t retiring_count;
+        uint64_t launched;
+        uint64_t deadline;
+} apply_node;
+
+typedef struct pm_apply {
+        // the client that sent the request, NULL once it is gone
+        pm_connection *conn;
+        uint32_t id;
+        uint32_t flags;
+        uint32_t timeout_ms;
+        uint32_t grace_ms;
+        apply_node *nodes;
+        uint32_t count;
+        // groups stopped with PM_APPLY_PRUNE
+        char (*removed)[PM_NAME_MAX];
+        uint32_t removed_count;
+        bool begun;
+        pm_timer timer;
+} pm_apply;
+
 void *malloc_nofail (size_t size);
+void *realloc_nofail (void *ptr, size_t size);
+void *calloc_nofail (size_t count, size_t size);
+void *slab_alloc (pm_slab *slab);
+void slab_free (pm_slab *slab, void *object);
 void read_nofail (int fd, void *buf, size_t size);
-int get_write_file_fd (char *filename);
-void lock_process_list ();
-
-void unlock_process_list ();
+int open_pidfd (pid_t pid);
+uint64_t monotonic_ms ();
+uint64_t monotonic_usec ();
 int setup_unix_domain_server_socket (char *socket_file);
 int setup_unix_domain_client_socket (char *socket_file);
-pid_t new_process (char *program,
-                   char **argv,
-                   char *stdout_file,
-                   int max_retries);
+pid_t new_process (char **argv, pm_process_options *options);
 void set_stdout (char *stdout_file);
-void handle_child_signal (int signal);
-void send_response (int conn_fd, pm_code err);
-void free_process_list_entry (pm_process *process);
+void set_stderr (char *stderr_file);
+char *get_code_description (pm_code code);
+pid_t restart_process (pm_process *process);
+pm_process *clone_process (pm_process *process);
+pm_process *create_process_entry (char **argv, pm_process_options *options);
+void free_process_entry (pm_process *process);
+uint32_t hash_name (char *name);
+uint32_t hash_pid (pid_t pid);
 pm_process *find_process_with_pid (pid_t pid);
-bool remove_process_from_list (pm_process *process);
-void daemon_child_monitor_thread (void *arg);
-pthread_t spawn_daemon_child_monitor_thread ();
-pthread_t stop_child_monitor_thread (pthread_t thread);
+pm_process *find_process_with_handle (pm_handle handle);
+pm_process *find_process_with_id (uint32_t id);
+pm_process *find_processes_with_name (char *name);
+void insert_process (pm_process *process);
+void restore_process (pm_process *process, pm_handle handle);
+void update_process_pid (pm_process *process, pid_t pid);
+void set_process_state (pm_process *process, pm_process_state state);
+void set_process_readiness (pm_process *process, pm_readiness readiness);
+void retire_process (pm_process *process);
+void remove_process (pm_process *process);
+pm_buffer *snapshot_process_table ();
+char *get_state_name (pm_process_state state);
+char *get_readiness_name (pm_readiness readiness);
+void monitor_init ();
+void monitor_stop ();
+void adopt_process (pm_process *process);
+void liveness_failed (pm_process *process, char *reason);
+void drain_process (pm_process *process, uint32_t grace_ms);
+void release_pidfd (pm_process *process);
+int open_output_pipe (pm_process *process, int fd, uint64_t pipe, int flags);
+void reattach_output (pm_process *process);
+void journal_open ();
+void journal_close (bool discard);
+void journal_insert (pm_process *process);
+void journal_update (pm_process *process);
+void journal_remove (pm_process *process);
+void journal_settings ();
+uint64_t read_start_ticks (pid_t pid);
+void stop_all_processes (uint32_t grace_ms);
+void signal_group (pid_t pid, int sig);
+void watchdog_check (pm_process *process);
+void health_start (pm_process *process);
+void health_stop (pm_process *process);
+bool health_reaped (pid_t pid, int status);
+pm_code zygote_register (char *program, uint32_t size);
+pid_t zygote_spawn (char **argv, char **envp, int out_fd, int err_fd);
+bool zygote_reaped (pid_t pid);
+void zygote_stop ();
+void zygote_main (char *program);
+void record_spawn_latency (bool zygote, uint64_t usec);
+void put_zygote_pools (pm_buffer *buf);
+void encode_zygotes (pm_buffer *buf);
+void print_zygotes (char *data, size_t size);
+pm_listener *listener_acquire (char *name, char *spec, pid_t pid);
+void listener_release (pm_listener *listener);
+char *parse_listen_spec (char *spec);
+void listen_exec (char **argv);
+void holder_start ();
+void holder_dismiss ();
+void holder_pass_on ();
+void holder_take_back ();
+void holder_hold (int pipe_fd);
+void holder_stop ();
+bool holder_reaped (pid_t pid);
+void holder_main (char *path);
+void rollout_start (pm_connection *conn, pm_cmd *cmd);
+void rollout_detach (pm_connection *conn);
+void apply_start (pm_connection *conn, pm_cmd *cmd);
+void apply_detach (pm_connection *conn);
+char *get_apply_action_name (pm_apply_action action);
+bool link_nodes (pm_apply *apply, char *error, size_t size);
+void free_apply (pm_apply *apply);
+void print_applied (char *data, size_t size);
+bool parse_placement_spec (char *spec);
+void affinity_init ();
+bool affinity_assign (pm_process *process);
+void affinity_adopt (pm_process *process, int slot);
+void affinity_release (pm_process *process);
+void affinity_enter (pm_process *process);
+void affinity_leave (pm_process *process);
+void affinity_format (pm_process *process, char *buf, size_t size);
+void cgroup_init ();
+void cgroup_attach (pm_process *process);
+void cgroup_release (pm_process *process);
+bool cgroup_kill (pm_process *process);
+bool cgroup_read_usage (pm_process *process, uint64_t *memory_bytes, uint64_t *cpu_usec);
+void sampler_init ();
+void sampler_free (pm_process *process);
+pm_sample *get_sample (pm_process *process, uint32_t age);
+uint32_t get_cpu_permille (pm_process *process, uint32_t age);
+void encode_stats (pm_buffer *buf);
+void print_stats (char *data, size_t size);
+void events_init ();
+void publish_event (pm_event_type type, pm_process *process, uint64_t value, char *detail);
+void events_subscribe (pm_connection *conn, uint32_t id);
+void events_unsubscribe (pm_connection *conn);
+bool events_deliver (pm_connection *conn);
+char *get_event_name (pm_event_type type);
+void print_event (char *data, size_t size);
+void timer_init ();
+void timer_schedule (pm_timer *timer, uint64_t delay_ms);
+void timer_cancel (pm_timer *timer);
 void daemon_process (char *socket_file);
+void daemon_handle_command (pm_connection *conn, pm_cmd *cmd);
 void spawn_daemon_process ();
 void process_daemon_command (char *command);
 
-void add_process_to_list (pid_t pid,
-                  char *program,
-                  char **argv,
-                  char *stdout_file,
-                  int max_retries);
+void buffer_reserve (pm_buffer *buf, size_t size);
+void buffer_put_bytes (pm_buffer *buf, void *data, size_t size);
+void buffer_put_u8 (pm_buffer *buf, uint8_t value);
+void buffer_put_u16 (pm_buffer *buf, uint16_t value);
+void buffer_put_u32 (pm_buffer *buf, uint32_t value);
+void buffer_put_u64 (pm_buffer *buf, uint64_t value);
+void buffer_put_string (pm_buffer *buf, char *str);
+void buffer_clear (pm_buffer *buf);
+void buffer_free (pm_buffer *buf);
+uint8_t reader_get_u8 (pm_reader *reader);
+uint16_t reader_get_u16 (pm_reader *reader);
+uint32_t reader_get_u32 (pm_reader *reader);
+uint64_t reader_get_u64 (pm_reader *reader);
+void reader_get_string (pm_reader *reader, char *dst, size_t size);
+char *reader_get_bytes (pm_reader *reader, size_t size);
+
+void encode_frame_header (char *dst, uint32_t size, uint16_t type, uint32_t id);
+void decode_frame_header (char *data, pm_frame_header *header);
+size_t frame_size (char *data, size_t len);
+void put_probe (pm_buffer *buf, pm_probe_spec *spec);
+void get_probe (pm_reader *reader, pm_probe_spec *spec, char *target);
+void encode_request (pm_buffer *buf, pm_cmd *cmd);
+pm_code decode_request (char *frame, size_t size, pm_cmd *cmd);
+void send_response (pm_connection *conn, uint32_t id, pm_code code);
+void send_response_data (pm_connection *conn, uint32_t id, pm_code code, void *data, uint32_t size);
+void send_error (pm_connection *conn, uint32_t id, pm_code code, char *message, ...);
+
+void capture_init ();
+void capture_stop ();
+int capture_open (char *path, bool timestamps, pm_rotation_policy *rotation);
+int capture_attach (int pipe_fd, char *path, bool timestamps, pm_rotation_policy *rotation);
+void capture_follow (int socket_fd, int log_fd, uint32_t id, char *path, uint32_t lines, bool follow, pm_buffer *unsent);
+void capture_stats (pm_capture_stats *stats);
+
+bool uring_init (pm_uring *ring, unsigned entries);
+void uring_close (pm_uring *ring);
+bool uring_supports (pm_uring *ring, uint8_t *ops, int count);
+bool uring_register_buffers (pm_uring *ring, struct iovec *buffers, unsigned count);
+bool uring_register_files (pm_uring *ring, unsigned count);
+bool uring_update_file (pm_uring *ring, int slot, int fd);
+int uring_add_file (pm_uring *ring, int fd);
+void uring_remove_file (pm_uring *ring, int slot);
+struct io_uring_sqe *uring_get_sqe (pm_uring *ring);
+bool uring_submit_and_wait (pm_uring *ring);
+struct io_uring_cqe *uring_next_cqe (pm_uring *ring);
+void uring_seen (pm_uring *ring);
+
+void process_bench_command (char *command);
+
+void compress_init ();
+void compress_stop ();
+void compress_log_segment (char *segment, char *log_file, uint32_t keep);
+bool is_log_segment_suffix (char *suffix);
+
+void event_loop_init ();
+void run_event_loop ();
+void io_stats (pm_io_stats *stats);
+void watch_add (pm_watch *watch, uint32_t events);
+void watch_modify (pm_watch *watch, uint32_t events);
+void watch_remove (pm_watch *watch);
+void watch_listen_socket (pm_watch *watch, int sock_fd);
+void connection_write (pm_connection *conn, void *data, size_t size);
+bool connection_flush (pm_connection *conn);
+int connection_release_socket (pm_connection *conn, pm_buffer *unsent);
+void close_connection (pm_connection *conn);
 
 char *get_identity_name (pm_identity id);
+int parse_log_level (char *name);
+void log_init ();
+void log_stop ();
 void log_info (char *message, ...);
 void log_warn (char *message, ...);
 void log_error (char *message, ...);
 void print_usage_statement ();
+void parse_cmd_args (int argc, char **argv);
+void print_process_list (char *data, size_t size);
+void print_json_string (char *str);
+char *absolute_path (char *path);
 void fatal_error ();
 #endif
\ No newline at end of file
@@ -1,136 +1,565 @@
+#define _GNU_SOURCE
 #include "pm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 extern pm_configuration config;
+extern char **environ;
 
-void lock_process_list ()
+static pm_slab process_slab = PM_SLAB_INIT (pm_process, 256);
+
+/**
+ * Returns the daemon's environment with PM_INSTANCE_ID set to the instance
+ * number of the process, and LISTEN_FDS to the number of listening sockets
+ * it gets. The vector is reused by every call, it is only valid until the
+ * next one.
+ */
+static char **process_environment (pm_process *process)
 {
-        pthread_mutex_lock (&config.process_list_lock);
+        static char **envp = NULL;
+        static size_t capacity = 0;
+        static char instance[32], listen_fds[32];
+
+        if (process->instance < 0 && !process->listener)
+                return environ;
+
+        size_t count = 0;
+        while (environ[count])
+                count++;
+
+        if (count + 3 > capacity) {
+                capacity = count + 3;
+                envp = realloc_nofail (envp, capacity * sizeof (char *));
+        }
+
+        // whatever the daemon itself was started with is not passed on
+        size_t j = 0;
+        for (size_t i = 0; i < count; i++)
+                if (strncmp (environ[i], "PM_INSTANCE_ID=", 15) != 0 && strncmp (environ[i], "LISTEN_", 7) != 0)
+                        envp[j++] = environ[i];
+
+        if (process->instance >= 0) {
+                snprintf (instance, sizeof (instance), "PM_INSTANCE_ID=%d", process->instance);
+                envp[j++] = instance;
+        }
+
+        if (process->listener) {
+                snprintf (listen_fds, sizeof (listen_fds), "LISTEN_FDS=%d", process->listener->count);
+                envp[j++] = listen_fds;
+        }
+
+        envp[j] = NULL;
+
+        return envp;
 }
 
-void unlock_process_list ()
+static uint64_t pipe_inode (int fd)
 {
-        pthread_mutex_unlock (&config.process_list_lock);
+        struct stat st;
+
+        return fd >= 0 && fstat (fd, &st) == 0 ? st.st_ino : 0;
 }
 
-pid_t new_process (char *program, char **argv, char *stdout_file, int max_retries)
+/**
+ * Starts the program of a process with posix_spawn. posix_spawn runs the
+ * child on the daemon's address space until it has exec'd, so the cost of a
+ * spawn does not grow with the daemon's memory, and failing to exec the
+ * program is reported here rather than from inside the child. A process
+ * with a CPU placement is started on its CPUs. Returns 0 or the error
+ * number.
+ *
+ * A process with listening sockets gets them as descriptors 3 and up and is
+ * started through PM_LISTEN_NAME. It reports failing to exec the program
+ * over a pipe, which is waited for here.
+ */
+static int spawn_direct (pm_process *process, char **envp, int out_fd, int err_fd, pid_t *pid)
 {
-        pid_t pid = fork ();
-
-        if (pid == 0) {
-                // redirect stdout if user specified another location.
-                if (stdout_file) {
-                        int fd = get_write_file_fd (stdout_file);
-                        dup2 (fd, STDOUT_FILENO);
-                        close (fd);
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t mask, defaults;
+
+        posix_spawn_file_actions_init (&actions);
+        posix_spawnattr_init (&attr);
+
+        // the daemon blocks SIGCHLD for its signalfd, don't pass that on, and
+        // don't leave the child with any of the daemon's dispositions
+        sigemptyset (&mask);
+        sigfillset (&defaults);
+        posix_spawnattr_setsigmask (&attr, &mask);
+        posix_spawnattr_setsigdefault (&attr, &defaults);
+        posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+        // every child leads its own process group, stopping the group stops
+        // everything the child started too
+        posix_spawnattr_setpgroup (&attr, 0);
+
+        // redirect stdout and stderr if user specified another location.
+        if (out_fd >= 0)
+                posix_spawn_file_actions_adddup2 (&actions, out_fd, STDOUT_FILENO);
+
+        if (err_fd >= 0)
+                posix_spawn_file_actions_adddup2 (&actions, err_fd, STDERR_FILENO);
+
+        int err;
+
+        if (process->listener) {
+                static char **argv = NULL;
+                static size_t capacity = 0;
+                size_t argc = 0;
+
+                while (process->argv[argc])
+                        argc++;
+
+                if (argc + 2 > capacity) {
+                        capacity = argc + 2;
+                        argv = realloc_nofail (argv, capacity * sizeof (char *));
+                }
+
+                argv[0] = PM_LISTEN_NAME;
+                memcpy (argv + 1, process->argv, (argc + 1) * sizeof (char *));
+
+                for (int i = 0; i < process->listener->count; i++)
+                        posix_spawn_file_actions_adddup2 (&actions, process->listener->fds[i], 3 + i);
+
+                // the write end is kept above every descriptor the child is
+                // set up with, and passed last
+                int status[2];
+
+                if (pipe2 (status, O_CLOEXEC) < 0) {
+                        err = errno;
+                        posix_spawnattr_destroy (&attr);
+                        posix_spawn_file_actions_destroy (&actions);
+                        return err;
                 }
 
-                execvp (program, argv);
+                int status_fd = fcntl (status[1], F_DUPFD_CLOEXEC, PM_LISTEN_STATUS_FD + 1);
+
+                close (status[1]);
+                posix_spawn_file_actions_adddup2 (&actions, status_fd, PM_LISTEN_STATUS_FD);
+
+                affinity_enter (process);
+                err = status_fd < 0 ? errno : posix_spawn (pid, "/proc/self/exe", &actions, &attr, argv, envp);
+
+                if (status_fd >= 0)
+                        close (status_fd);
+
+                // end of file once the program runs, an errno if it could
+                // not be started
+                if (err == 0) {
+                        int exec_err;
+                        ssize_t n;
+
+                        while ((n = read (status[0], &exec_err, sizeof (exec_err))) < 0 && errno == EINTR)
+                                ;
 
-                perror ("execvp");
-                fatal_error ();
-        } else if (pid > 0) {
-                add_process_to_list (pid, program, argv, stdout_file, max_retries);
-                return pid;
+                        if (n == sizeof (exec_err)) {
+                                // it exits right after, don't leave it to the
+                                // child monitor
+                                waitpid (*pid, NULL, 0);
+                                err = exec_err;
+                        }
+                }
+
+                close (status[0]);
         } else {
-                perror ("fork");
-                fatal_error ();
+                affinity_enter (process);
+                err = posix_spawnp (pid, process->program_name, &actions, &attr, process->argv, envp);
         }
+
+        affinity_leave (process);
+
+        posix_spawnattr_destroy (&attr);
+        posix_spawn_file_actions_destroy (&actions);
+
+        return err;
 }
 
-void free_process_list_entry (pm_process *process)
+/**
+ * Starts the program of a process record, through a zygote if its program
+ * has a pool with one ready and with posix_spawn otherwise. Either way it is
+ * timed for the spawn latency histograms.
+ *
+ * Output that goes to a file is captured through a pipe, the capture thread
+ * writes it to the file on the child's behalf.
+ *
+ * Returns the pid of the new child, or -1 with errno set if it could not be
+ * started.
+ */
+static pid_t spawn_process (pm_process *process)
 {
-        if (process->program_name)
-                free (process->program_name);
+        uint64_t begin = monotonic_usec ();
+        int out_fd = -1, err_fd = -1;
+
+        // the group's sockets are opened by its first process, or again once
+        // they could not be taken over from an earlier daemon
+        if (process->listen && !process->listener) {
+                process->listener = listener_acquire (process->name, process->listen, 0);
+
+                if (!process->listener)
+                        return -1;
+        }
+
+        // a restarted process keeps the slot it was given first
+        if (!affinity_assign (process))
+                return -1;
+
+        if (process->stdout_file) {
+                out_fd = capture_open (process->stdout_file, process->timestamps, &process->rotation);
+
+                if (out_fd < 0) {
+                        log_error ("failed to open %s: %s", process->stdout_file, strerror (errno));
+                        return -1;
+                }
+        }
+
+        // stdout and stderr going to the same file share one pipe, which
+        // keeps their relative order
+        if (process->stderr_file && out_fd >= 0 && strcmp (process->stderr_file, process->stdout_file) == 0) {
+                err_fd = out_fd;
+        } else if (process->stderr_file) {
+                err_fd = capture_open (process->stderr_file, process->timestamps, &process->rotation);
+
+                if (err_fd < 0) {
+                        int err = errno;
+                        log_error ("failed to open %s: %s", process->stderr_file, strerror (err));
+
+                        if (out_fd >= 0)
+                                close (out_fd);
 
-        if (process->argv) {
-                for (int i = 0; process->argv[i] != NULL; i++) {
-                        free (process->argv[i]);
+                        errno = err;
+                        return -1;
                 }
-                free (process->argv);
         }
 
-        if (process->stdout_file)
-                free (process->stdout_file);
+        char **envp = process_environment (process);
 
-        free (process);
+        // a later daemon recognizes the pipes by their inode
+        process->stdout_pipe = pipe_inode (out_fd);
+        process->stderr_pipe = pipe_inode (err_fd);
+
+        // zygotes have no way to hand over the listening sockets, and were
+        // forked before the CPUs of the process were known
+        pid_t pid = process->listener || process->placement ? 0 : zygote_spawn (process->argv, envp, out_fd, err_fd);
+        bool zygote = pid != 0;
+        int err = pid < 0 ? errno : 0;
+
+        if (!zygote)
+                err = spawn_direct (process, envp, out_fd, err_fd, &pid);
+
+        // the child has its own copies now, the capture thread sees end of
+        // file once the child and everything it started are gone
+        if (out_fd >= 0)
+                close (out_fd);
+
+        if (err_fd >= 0 && err_fd != out_fd)
+                close (err_fd);
+
+        if (err != 0) {
+                log_error ("failed to start %s: %s", process->program_name, strerror (err));
+                errno = err;
+                return -1;
+        }
+
+        record_spawn_latency (zygote, monotonic_usec () - begin);
+
+        process->start_time = time (NULL);
+        process->start_ticks = read_start_ticks (pid);
+
+        return pid;
 }
 
-pm_process *find_process_with_pid (pid_t pid)
+/**
+ * Creates a record for the program in argv[0] and starts it. Returns the pid of the new
+ * process, or -1 with errno set if it could not be started, in which case no
+ * record is kept.
+ */
+pid_t new_process (char **argv, pm_process_options *options)
 {
-        for (pm_process *curr = config.process_list; curr != NULL; curr = curr->next)
-                if (curr->pid == pid) {
-                        return curr;
-                }
-        return NULL;
+        pm_process *process = create_process_entry (argv, options);
+
+        process->pid = spawn_process (process);
+
+        if (process->pid < 0) {
+                free_process_entry (process);
+                return -1;
+        }
+
+        cgroup_attach (process);
+
+        insert_process (process);
+        health_start (process);
+        publish_event (EVENT_STARTED, process, 0, NULL);
+
+        return process->pid;
 }
 
-bool remove_process_from_list (pm_process *process)
+/**
+ * Starts another process with the command and settings of an existing one,
+ * like one more instance of its group, with the daemon's current number of
+ * retries. Returns the new record, or NULL with errno set if the process
+ * could not be started.
+ */
+pm_process *clone_process (pm_process *process)
 {
-        pm_process *prev = NULL;
-        pm_process *curr = config.process_list;
+        pm_process_options options = { .name = process->name,
+                                       .stdout_file = process->stdout_file,
+                                       .stderr_file = process->stderr_file,
+                                       .max_retries = config.max_retries,
+                                       .instance = process->instance,
+                                       .timestamps = process->timestamps,
+                                       .rotation = process->rotation,
+                                       .limits = process->limits,
+                                       .watchdog = process->watchdog,
+                                       .listen = process->listen,
+                                       .placement = process->placement };
 
-        for (; curr != NULL || curr != process; prev = curr, curr = curr->next)
-                ;
+        memcpy (options.probes, process->probes, sizeof (options.probes));
 
-        if (!curr)
-                return false;
+        pid_t pid = new_process (process->argv, &options);
 
-        if (config.process_list == curr)
-                config.process_list = curr->next;
+        return pid < 0 ? NULL : find_process_with_pid (pid);
+}
 
-        if (config.process_list_end == curr)
-                config.process_list_end = prev;
+/**
+ * Starts the process described by an existing record again. The record keeps
+ * its handle, only its pid changes. Returns -1 with errno set if the process
+ * could not be started, the record is left without a pid.
+ */
+pid_t restart_process (pm_process *process)
+{
+        pid_t pid = spawn_process (process);
 
-        if (prev)
-                prev->next = curr->next;
+        update_process_pid (process, pid < 0 ? 0 : pid);
 
-        free_process_list_entry (curr);
+        if (pid > 0) {
+                cgroup_attach (process);
+                health_start (process);
+                publish_event (EVENT_RESTARTED, process, 0, NULL);
+        }
 
-        return false;
+        return pid;
 }
 
-void add_process_to_list (pid_t pid, char *program, char **argv, char *stdout_file, int max_retries)
+/**
+ * Opens a new read end of the pipe a process has as its descriptor fd, if
+ * that still is the capture pipe with the given inode. Opening a pipe
+ * through /proc does not create a new pipe, it adds a reader to the one the
+ * process writes to. Returns -1 if the pipe is gone or was replaced.
+ */
+int open_output_pipe (pm_process *process, int fd, uint64_t pipe, int flags)
 {
-        pm_process *p = malloc_nofail (sizeof (pm_process));
-        p->next = NULL;
+        char path[64];
+        struct stat st;
 
-        p->pid = pid;
-        p->max_retries = max_retries;
+        if (pipe == 0)
+                return -1;
 
-        p->program_name = malloc_nofail (strlen (program) + 1);
-        strcpy (p->program_name, program);
+        snprintf (path, sizeof (path), "/proc/%d/fd/%d", process->pid, fd);
 
-        if (stdout_file) {
-                p->stdout_file = malloc_nofail (strlen (stdout_file) + 1);
-                strcpy (p->stdout_file, stdout_file);
-        } else {
-                p->stdout_file = NULL;
+        int pipe_fd = open (path, O_RDONLY | O_NONBLOCK | flags);
+
+        if (pipe_fd >= 0 && (fstat (pipe_fd, &st) < 0 || !S_ISFIFO (st.st_mode) || st.st_ino != pipe)) {
+                close (pipe_fd);
+                return -1;
         }
 
+        return pipe_fd;
+}
+
+static void reattach_stream (pm_process *process, int fd, char *path, uint64_t pipe)
+{
+        if (!path || pipe == 0)
+                return;
+
+        int pipe_fd = open_output_pipe (process, fd, pipe, O_CLOEXEC);
+
+        if (pipe_fd >= 0 && capture_attach (pipe_fd, path, process->timestamps, &process->rotation) == 0)
+                return;
+
+        log_warn ("output of %s (pid %d) to %s can no longer be captured", process->name, process->pid, path);
+}
+
+/**
+ * Captures the output of a process adopted from an earlier daemon again. Its
+ * stdout and stderr still are the pipes that daemon read from, output that
+ * piled up in them in the meantime goes to the log files now.
+ */
+void reattach_output (pm_process *process)
+{
+        reattach_stream (process, STDOUT_FILENO, process->stdout_file, process->stdout_pipe);
+
+        // a pipe shared with stdout is read once
+        if (process->stderr_pipe != process->stdout_pipe)
+                reattach_stream (process, STDERR_FILENO, process->stderr_file, process->stderr_pipe);
+}
+
+void free_process_entry (pm_process *process)
+{
+        release_pidfd (process);
+        health_stop (process);
+        timer_cancel (&process->restart_timer);
+        timer_cancel (&process->kill_timer);
+        sampler_free (process);
+        listener_release (process->listener);
+        affinity_release (process);
+
+        // the arena stays attached to the record so the next process
+        // allocated from this slot can reuse it
+        slab_free (&process_slab, process);
+}
+
+/**
+ * Lays out the argument vector, name and output paths of a process in its
+ * arena. The arena is a single block, it is only reallocated when the new
+ * command does not fit the space left behind by a previous one.
+ */
+static void set_process_command (pm_process *p, char **argv, pm_process_options *options)
+{
         int argc = 0;
+        size_t size = 0;
+
+        for (; argv[argc] != NULL; argc++)
+                size += strlen (argv[argc]) + 1;
 
-        while (argv[argc] != NULL)
-                argc++;
+        size += (argc + 1) * sizeof (char *);
+
+        if (options->name)
+                size += strlen (options->name) + 1;
+
+        if (options->stdout_file)
+                size += strlen (options->stdout_file) + 1;
+
+        if (options->stderr_file)
+                size += strlen (options->stderr_file) + 1;
+
+        for (int kind = 0; kind < PM_PROBE_KINDS; kind++)
+                if (options->probes[kind].type != PROBE_NONE)
+                        size += strlen (options->probes[kind].target) + 1;
+
+        if (options->listen)
+                size += strlen (options->listen) + 1;
+
+        if (options->placement)
+                size += strlen (options->placement) + 1;
+
+        if (size > p->arena_size) {
+                free (p->arena);
+                p->arena = malloc_nofail (size);
+                p->arena_size = size;
+        }
 
-        p->argv = malloc_nofail ((argc + 1) * sizeof (char *));
+        p->argv = (char **)p->arena;
+        char *strings = p->arena + (argc + 1) * sizeof (char *);
 
         for (int i = 0; i < argc; i++) {
-                p->argv[i] = malloc_nofail (strlen (argv[i]) + 1);
-                strcpy (p->argv[i], argv[i]);
+                p->argv[i] = strings;
+                strings = stpcpy (strings, argv[i]) + 1;
         }
 
         p->argv[argc] = NULL;
+        p->program_name = p->argv[0];
 
-        lock_process_list ();
+        if (options->name) {
+                p->name = strings;
+                strings = stpcpy (strings, options->name) + 1;
+        } else {
+                // processes are named after their program, without the directory
+                char *base = strrchr (p->program_name, '/');
+                p->name = base ? base + 1 : p->program_name;
+        }
+
+        if (options->stdout_file) {
+                p->stdout_file = strings;
+                strings = stpcpy (strings, options->stdout_file) + 1;
+        } else {
+                p->stdout_file = NULL;
+        }
+
+        if (options->stderr_file) {
+                p->stderr_file = strings;
+                strings = stpcpy (strings, options->stderr_file) + 1;
+        } else {
+                p->stderr_file = NULL;
+        }
+
+        for (int kind = 0; kind < PM_PROBE_KINDS; kind++) {
+                pm_probe_spec *spec = &p->probes[kind];
+
+                if (spec->type == PROBE_NONE) {
+                        spec->target = NULL;
+                        continue;
+                }
+
+                spec->target = strings;
+                strings = stpcpy (strings, options->probes[kind].target) + 1;
+        }
+
+        if (options->listen) {
+                p->listen = strings;
+                strings = stpcpy (strings, options->listen) + 1;
+        } else {
+                p->listen = NULL;
+        }
 
-        if (!config.process_list_end) {
-                config.process_list = p;
-                config.process_list_end = p;
+        if (options->placement) {
+                p->placement = strings;
+                strings = stpcpy (strings, options->placement) + 1;
         } else {
-                config.process_list_end->next = p;
-                config.process_list_end = p;
+                p->placement = NULL;
+        }
+}
+
+/**
+ * Copies the probes of a process, filling in the defaults for whatever they
+ * leave at 0.
+ */
+static void set_process_probes (pm_process *p, pm_probe_spec *probes)
+{
+        for (int kind = 0; kind < PM_PROBE_KINDS; kind++) {
+                pm_probe_spec *spec = &p->probes[kind];
+
+                *spec = probes[kind];
+
+                if (spec->interval_ms == 0)
+                        spec->interval_ms = PM_PROBE_INTERVAL_MS;
+
+                if (spec->timeout_ms == 0)
+                        spec->timeout_ms = PM_PROBE_TIMEOUT_MS;
+
+                if (spec->threshold == 0)
+                        spec->threshold = PM_PROBE_THRESHOLD;
         }
-        unlock_process_list ();
+}
+
+pm_process *create_process_entry (char **argv, pm_process_options *options)
+{
+        pm_process *p = slab_alloc (&process_slab);
+
+        // keep the arena of whichever process used this record last
+        char *arena = p->arena;
+        size_t arena_size = p->arena_size;
+
+        *p = (pm_process) { .arena = arena,
+                            .arena_size = arena_size,
+                            .max_retries = options->max_retries,
+                            .instance = options->instance,
+                            .timestamps = options->timestamps,
+                            .rotation = options->rotation,
+                            .limits = options->limits,
+                            .watchdog = options->watchdog,
+                            .state = PROCESS_RUNNING,
+                            .exit_status = -1,
+                            .cpu_slot = -1,
+                            .pidfd_watch = { .fd = -1 } };
+
+        set_process_probes (p, options->probes);
+        set_process_command (p, argv, options);
+
+        return p;
 }
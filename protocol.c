@@ -0,0 +1,320 @@
+#include "pm.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Wire protocol
+ *
+ * Client and daemon exchange frames. Every frame starts with a header, all
+ * integers are little endian:
+ *
+ *   u32 size      bytes of body following the header
+ *   u16 version   PM_PROTOCOL_VERSION
+ *   u16 type      pm_instruction of a request, pm_code of a response
+ *   u32 id        picked by the client, echoed in the response
+ *
+ * A connection stays open for as long as the client likes, and the client
+ * may send further requests before earlier ones were answered. Responses are
+ * matched to requests by id, not by their order.
+ *
+ * The body of a failed request's response starts with an error message,
+ * followed by whatever part of the result there is. Fields are only ever
+ * appended to a body, the daemon ignores trailing bytes it does not know.
+ */
+
+static void put_le (char *dst, uint64_t value, int size)
+{
+        for (int i = 0; i < size; i++)
+                dst[i] = (char)(value >> (8 * i));
+}
+
+static uint64_t get_le (char *src, int size)
+{
+        uint64_t value = 0;
+
+        for (int i = 0; i < size; i++)
+                value |= (uint64_t)(unsigned char)src[i] << (8 * i);
+
+        return value;
+}
+
+void encode_frame_header (char *dst, uint32_t size, uint16_t type, uint32_t id)
+{
+        put_le (dst, size, 4);
+        put_le (dst + 4, PM_PROTOCOL_VERSION, 2);
+        put_le (dst + 6, type, 2);
+        put_le (dst + 8, id, 4);
+}
+
+void decode_frame_header (char *data, pm_frame_header *header)
+{
+        header->size = get_le (data, 4);
+        header->version = get_le (data + 4, 2);
+        header->type = get_le (data + 6, 2);
+        header->id = get_le (data + 8, 4);
+}
+
+/**
+ * Returns the number of bytes the frame at the head of data occupies, 0 if
+ * more data is required before it is complete, or SIZE_MAX if its body is
+ * larger than PM_MAX_COMMAND_SIZE.
+ */
+size_t frame_size (char *data, size_t len)
+{
+        if (len < PM_FRAME_HEADER_SIZE)
+                return 0;
+
+        size_t size = get_le (data, 4);
+
+        if (size > PM_MAX_COMMAND_SIZE)
+                return SIZE_MAX;
+
+        if (len < PM_FRAME_HEADER_SIZE + size)
+                return 0;
+
+        return PM_FRAME_HEADER_SIZE + size;
+}
+
+static void put_rotation (pm_buffer *buf, pm_rotation_policy *policy)
+{
+        buffer_put_u64 (buf, policy->max_size);
+        buffer_put_u32 (buf, policy->max_age);
+        buffer_put_u32 (buf, policy->keep);
+}
+
+static void get_rotation (pm_reader *reader, pm_rotation_policy *policy)
+{
+        policy->max_size = reader_get_u64 (reader);
+        policy->max_age = reader_get_u32 (reader);
+        policy->keep = reader_get_u32 (reader);
+}
+
+void put_probe (pm_buffer *buf, pm_probe_spec *spec)
+{
+        buffer_put_u8 (buf, spec->type);
+        buffer_put_string (buf, spec->type != PROBE_NONE ? spec->target : "");
+        buffer_put_u32 (buf, spec->interval_ms);
+        buffer_put_u32 (buf, spec->timeout_ms);
+        buffer_put_u32 (buf, spec->threshold);
+}
+
+/**
+ * Reads a probe written by put_probe, its target is copied to target, which
+ * holds PM_PROBE_TARGET_MAX bytes. An unknown type reads as PROBE_NONE.
+ */
+void get_probe (pm_reader *reader, pm_probe_spec *spec, char *target)
+{
+        spec->type = reader_get_u8 (reader);
+        reader_get_string (reader, target, PM_PROBE_TARGET_MAX);
+        spec->target = target;
+        spec->interval_ms = reader_get_u32 (reader);
+        spec->timeout_ms = reader_get_u32 (reader);
+        spec->threshold = reader_get_u32 (reader);
+
+        if (spec->type > PROBE_HTTP)
+                spec->type = PROBE_NONE;
+}
+
+/**
+ * Appends the frame of a request to buf.
+ */
+void encode_request (pm_buffer *buf, pm_cmd *cmd)
+{
+        size_t start = buf->len;
+
+        // the header is written once the size of the body is known
+        buffer_reserve (buf, PM_FRAME_HEADER_SIZE);
+        buf->len += PM_FRAME_HEADER_SIZE;
+
+        switch (cmd->instruction) {
+        case NEW_PROCESS:
+                buffer_put_u32 (buf, cmd->new_process.instances);
+                buffer_put_string (buf, cmd->new_process.name);
+                buffer_put_u32 (buf, cmd->new_process.flags);
+                put_rotation (buf, &cmd->new_process.rotation);
+                buffer_put_u32 (buf, cmd->new_process.limits.cpu_percent);
+                buffer_put_u32 (buf, cmd->new_process.limits.pids_max);
+                buffer_put_u64 (buf, cmd->new_process.limits.memory_max);
+                buffer_put_u64 (buf, cmd->new_process.watchdog.max_memory);
+                buffer_put_u32 (buf, cmd->new_process.watchdog.max_cpu_percent);
+                buffer_put_u32 (buf, cmd->new_process.watchdog.window);
+                buffer_put_u32 (buf, cmd->new_process.size);
+                buffer_put_bytes (buf, cmd->new_process.command, cmd->new_process.size);
+
+                for (int kind = 0; kind < PM_PROBE_KINDS; kind++)
+                        put_probe (buf, &cmd->new_process.probes[kind]);
+
+                buffer_put_string (buf, cmd->new_process.listen);
+                buffer_put_string (buf, cmd->new_process.placement);
+                break;
+        case SET_STDOUT:
+        case SET_STDERR:
+                buffer_put_u32 (buf, cmd->set_file.size);
+                buffer_put_bytes (buf, cmd->set_file.path, cmd->set_file.size);
+                break;
+        case SIGNAL_PROCESS:
+                buffer_put_u32 (buf, cmd->signal_process.signal);
+                buffer_put_u32 (buf, cmd->signal_process.pid);
+                break;
+        case SET_AUTORESTART_TRIES: buffer_put_u32 (buf, cmd->autorestart.max_retries); break;
+        case SHUTDOWN: buffer_put_u32 (buf, cmd->shutdown.grace_ms); break;
+        case SET_LOG_ROTATION: put_rotation (buf, &cmd->log_rotation.policy); break;
+        case UPGRADE:
+                buffer_put_u32 (buf, cmd->upgrade.size);
+                buffer_put_bytes (buf, cmd->upgrade.path, cmd->upgrade.size);
+                break;
+        case ZYGOTE:
+                buffer_put_u32 (buf, cmd->zygote.pool_size);
+                buffer_put_string (buf, cmd->zygote.program);
+                break;
+        case ROLLING_RESTART:
+                buffer_put_string (buf, cmd->rolling_restart.name);
+                buffer_put_u32 (buf, cmd->rolling_restart.batch);
+                buffer_put_u32 (buf, cmd->rolling_restart.timeout_ms);
+                buffer_put_u32 (buf, cmd->rolling_restart.grace_ms);
+                break;
+        case APPLY:
+                buffer_put_u32 (buf, cmd->apply.flags);
+                buffer_put_u32 (buf, cmd->apply.timeout_ms);
+                buffer_put_u32 (buf, cmd->apply.grace_ms);
+                buffer_put_u32 (buf, cmd->apply.size);
+                buffer_put_bytes (buf, cmd->apply.entries, cmd->apply.size);
+                break;
+        case LOGS:
+                buffer_put_string (buf, cmd->logs.target);
+                buffer_put_u32 (buf, cmd->logs.lines);
+                buffer_put_u32 (buf, cmd->logs.flags);
+                break;
+        default: break;
+        }
+
+        encode_frame_header (buf->data + start, buf->len - start - PM_FRAME_HEADER_SIZE, cmd->instruction, cmd->id);
+}
+
+/**
+ * Decodes the request in a complete frame. The id is filled in as soon as
+ * the header could be read, so even a request that failed to decode can be
+ * answered.
+ */
+pm_code decode_request (char *frame, size_t size, pm_cmd *cmd)
+{
+        pm_frame_header header;
+        decode_frame_header (frame, &header);
+
+        *cmd = (pm_cmd) { .id = header.id, .instruction = header.type };
+
+        if (header.version != PM_PROTOCOL_VERSION)
+                return UNSUPPORTED_VERSION;
+
+        pm_reader reader = { .data = frame + PM_FRAME_HEADER_SIZE, .len = size - PM_FRAME_HEADER_SIZE };
+
+        switch (cmd->instruction) {
+        case NEW_PROCESS:
+                cmd->new_process.instances = reader_get_u32 (&reader);
+                reader_get_string (&reader, cmd->new_process.name, PM_NAME_MAX);
+                cmd->new_process.flags = reader_get_u32 (&reader);
+                get_rotation (&reader, &cmd->new_process.rotation);
+                cmd->new_process.limits.cpu_percent = reader_get_u32 (&reader);
+                cmd->new_process.limits.pids_max = reader_get_u32 (&reader);
+                cmd->new_process.limits.memory_max = reader_get_u64 (&reader);
+                cmd->new_process.watchdog.max_memory = reader_get_u64 (&reader);
+                cmd->new_process.watchdog.max_cpu_percent = reader_get_u32 (&reader);
+                cmd->new_process.watchdog.window = reader_get_u32 (&reader);
+                cmd->new_process.size = reader_get_u32 (&reader);
+                cmd->new_process.command = reader_get_bytes (&reader, cmd->new_process.size);
+
+                // probes came later, a request without them has none
+                for (int kind = 0; kind < PM_PROBE_KINDS && reader.off < reader.len; kind++)
+                        get_probe (&reader, &cmd->new_process.probes[kind], cmd->new_process.probe_targets[kind]);
+
+                if (reader.off < reader.len)
+                        reader_get_string (&reader, cmd->new_process.listen, PM_LISTEN_SPEC_MAX);
+
+                if (reader.off < reader.len)
+                        reader_get_string (&reader, cmd->new_process.placement, PM_PLACEMENT_SPEC_MAX);
+                break;
+        case SET_STDOUT:
+        case SET_STDERR:
+                cmd->set_file.size = reader_get_u32 (&reader);
+                cmd->set_file.path = reader_get_bytes (&reader, cmd->set_file.size);
+                break;
+        case SIGNAL_PROCESS:
+                cmd->signal_process.signal = reader_get_u32 (&reader);
+                cmd->signal_process.pid = reader_get_u32 (&reader);
+                break;
+        case SET_AUTORESTART_TRIES: cmd->autorestart.max_retries = reader_get_u32 (&reader); break;
+        case SHUTDOWN: cmd->shutdown.grace_ms = reader_get_u32 (&reader); break;
+        case SET_LOG_ROTATION: get_rotation (&reader, &cmd->log_rotation.policy); break;
+        case UPGRADE:
+                cmd->upgrade.size = reader_get_u32 (&reader);
+                cmd->upgrade.path = reader_get_bytes (&reader, cmd->upgrade.size);
+                break;
+        case ZYGOTE:
+                cmd->zygote.pool_size = reader_get_u32 (&reader);
+                reader_get_string (&reader, cmd->zygote.program, PM_NAME_MAX);
+                break;
+        case ROLLING_RESTART:
+                reader_get_string (&reader, cmd->rolling_restart.name, PM_NAME_MAX);
+                cmd->rolling_restart.batch = reader_get_u32 (&reader);
+                cmd->rolling_restart.timeout_ms = reader_get_u32 (&reader);
+                cmd->rolling_restart.grace_ms = reader_get_u32 (&reader);
+                break;
+        case APPLY:
+                cmd->apply.flags = reader_get_u32 (&reader);
+                cmd->apply.timeout_ms = reader_get_u32 (&reader);
+                cmd->apply.grace_ms = reader_get_u32 (&reader);
+                cmd->apply.size = reader_get_u32 (&reader);
+                cmd->apply.entries = reader_get_bytes (&reader, cmd->apply.size);
+                break;
+        case LOGS:
+                reader_get_string (&reader, cmd->logs.target, PM_NAME_MAX);
+                cmd->logs.lines = reader_get_u32 (&reader);
+                cmd->logs.flags = reader_get_u32 (&reader);
+                break;
+        case LIST_PROCESS:
+        case STATS:
+        case SUBSCRIBE: break;
+        default: return INVALID_COMMAND;
+        }
+
+        return reader.error ? INVALID_COMMAND : OK;
+}
+
+void send_response_data (pm_connection *conn, uint32_t id, pm_code code, void *data, uint32_t size)
+{
+        char header[PM_FRAME_HEADER_SIZE];
+
+        encode_frame_header (header, size, code, id);
+        connection_write (conn, header, sizeof (header));
+
+        if (size > 0)
+                connection_write (conn, data, size);
+}
+
+/**
+ * Answers a request with a bare code, a failure gets the code's description
+ * as its message.
+ */
+void send_response (pm_connection *conn, uint32_t id, pm_code code)
+{
+        if (code == OK)
+                send_response_data (conn, id, code, NULL, 0);
+        else
+                send_error (conn, id, code, "%s", get_code_description (code));
+}
+
+void send_error (pm_connection *conn, uint32_t id, pm_code code, char *message, ...)
+{
+        static pm_buffer body = { 0 };
+        char text[512];
+        va_list args;
+
+        va_start (args, message);
+        vsnprintf (text, sizeof (text), message, args);
+        va_end (args);
+
+        buffer_clear (&body);
+        buffer_put_string (&body, text);
+        send_response_data (conn, id, code, body.data, body.len);
+}
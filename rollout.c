@@ -0,0 +1,294 @@
+#include "pm.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Rolling restarts
+ *
+ * A rolling restart replaces the instances of a group a batch at a time.
+ * For every instance of a batch another one is started with the same
+ * command and settings, and once all of them are ready the instances they
+ * replace are drained: they get SIGTERM, SIGKILL after the grace period, and
+ * are removed once they have exited. The next batch starts after that. The
+ * new instances of a group whose listening sockets the daemon owns accept
+ * from the very sockets the old ones did, so no connection is refused along
+ * the way.
+ *
+ * An instance is ready once its readiness probe succeeded, or as soon as it
+ * runs if it has none. A new instance that exits or is not ready within the
+ * timeout fails the restart: the instances started for the batch are
+ * drained and the ones they were to replace keep running.
+ *
+ * The client is answered once the restart is over. A restart in progress is
+ * checked on every timer tick, there are never many of them.
+ */
+
+extern pm_configuration config;
+
+typedef enum rollout_phase {
+        // nothing started yet, the restart begins on the next tick so that
+        // it is answered from the timer even if it fails right away
+        ROLLOUT_QUEUED,
+        // the new instances of the batch are started, waiting for them to
+        // become ready
+        ROLLOUT_STARTING,
+        // the old instances of the batch are drained, waiting for them to
+        // exit
+        ROLLOUT_STOPPING,
+} rollout_phase;
+
+typedef struct pm_rollout pm_rollout;
+
+typedef struct pm_rollout {
+        pm_rollout *next;
+        char name[PM_NAME_MAX];
+        // the client that asked for the restart, NULL once it is gone
+        pm_connection *conn;
+        uint32_t id;
+        uint32_t batch;
+        uint32_t timeout_ms;
+        uint32_t grace_ms;
+        // the instances to replace and, at the same index, their
+        // replacements
+        pm_handle *old;
+        pm_handle *new;
+        uint32_t count;
+        // index of the first instance of the current batch
+        uint32_t done;
+        rollout_phase phase;
+        uint64_t deadline;
+        pm_timer timer;
+} pm_rollout;
+
+static pm_rollout *rollouts;
+
+static uint32_t batch_end (pm_rollout *rollout)
+{
+        return rollout->count - rollout->done < rollout->batch ? rollout->count : rollout->done + rollout->batch;
+}
+
+/**
+ * Ends a rolling restart and answers the client with code, and with a
+ * message unless it succeeded.
+ */
+static void finish (pm_rollout *rollout, pm_code code, char *message)
+{
+        if (code == OK)
+                log_info ("rolling restart of %s replaced %u instances", rollout->name, rollout->count);
+        else
+                log_error ("rolling restart of %s failed: %s", rollout->name, message);
+
+        if (rollout->conn && code == OK) {
+                pm_buffer response = { 0 };
+
+                buffer_put_u32 (&response, rollout->count);
+                send_response_data (rollout->conn, rollout->id, OK, response.data, response.len);
+                buffer_free (&response);
+        } else if (rollout->conn) {
+                send_error (rollout->conn, rollout->id, code, "%s", message);
+        }
+
+        // not answered from a request, nothing else sends it
+        if (rollout->conn)
+                connection_flush (rollout->conn);
+
+        pm_rollout **link = &rollouts;
+
+        while (*link != rollout)
+                link = &(*link)->next;
+
+        *link = rollout->next;
+        timer_cancel (&rollout->timer);
+        free (rollout->old);
+        free (rollout->new);
+        free (rollout);
+}
+
+/**
+ * Drains the new instances of the current batch after it failed, the old
+ * ones stay.
+ */
+static void abort_batch (pm_rollout *rollout, char *message)
+{
+        for (uint32_t i = rollout->done; i < batch_end (rollout); i++) {
+                pm_process *process = find_process_with_handle (rollout->new[i]);
+
+                if (process)
+                        drain_process (process, rollout->grace_ms);
+        }
+
+        finish (rollout, SPAWN_FAILED, message);
+}
+
+/**
+ * Starts the replacements of the next batch. Returns false if the restart
+ * is over.
+ */
+static bool start_batch (pm_rollout *rollout)
+{
+        char message[512];
+
+        if (rollout->done == rollout->count) {
+                finish (rollout, OK, NULL);
+                return false;
+        }
+
+        rollout->phase = ROLLOUT_STARTING;
+        rollout->deadline = monotonic_ms () + rollout->timeout_ms;
+
+        for (uint32_t i = rollout->done; i < batch_end (rollout); i++) {
+                pm_process *old = find_process_with_handle (rollout->old[i]);
+
+                // removed in the meantime, there is nothing to replace
+                if (!old)
+                        continue;
+
+                pm_process *process = clone_process (old);
+
+                if (!process) {
+                        snprintf (message, sizeof (message), "failed to start another %s: %s", old->name, strerror (errno));
+                        abort_batch (rollout, message);
+                        return false;
+                }
+
+                rollout->new[i] = process->handle;
+        }
+
+        return true;
+}
+
+/**
+ * Checks on the current batch and moves the restart along.
+ */
+static void step (pm_rollout *rollout)
+{
+        char message[512];
+        uint32_t end = batch_end (rollout);
+
+        if (rollout->phase == ROLLOUT_QUEUED) {
+                start_batch (rollout);
+                return;
+        }
+
+        if (rollout->phase == ROLLOUT_STOPPING) {
+                for (uint32_t i = rollout->done; i < end; i++)
+                        if (find_process_with_handle (rollout->old[i]))
+                                return;
+
+                rollout->done = end;
+                start_batch (rollout);
+                return;
+        }
+
+        bool ready = true;
+
+        for (uint32_t i = rollout->done; i < end; i++) {
+                pm_process *process = find_process_with_handle (rollout->new[i]);
+
+                if (rollout->new[i] && (!process || process->state != PROCESS_RUNNING)) {
+                        snprintf (message, sizeof (message), "a new instance of %s exited before it was ready", rollout->name);
+                        abort_batch (rollout, message);
+                        return;
+                }
+
+                if (process && process->readiness != READINESS_NONE && process->readiness != READINESS_READY)
+                        ready = false;
+        }
+
+        if (!ready && monotonic_ms () >= rollout->deadline) {
+                snprintf (message, sizeof (message), "a new instance of %s was not ready within %u ms", rollout->name, rollout->timeout_ms);
+                abort_batch (rollout, message);
+                return;
+        }
+
+        if (!ready)
+                return;
+
+        rollout->phase = ROLLOUT_STOPPING;
+
+        for (uint32_t i = rollout->done; i < end; i++) {
+                pm_process *old = find_process_with_handle (rollout->old[i]);
+
+                if (old) {
+                        log_info ("draining %s (pid %d), its replacement is ready", old->name, old->pid);
+                        drain_process (old, rollout->grace_ms);
+                }
+        }
+
+        step (rollout);
+}
+
+static void handle_rollout_timer (pm_timer *timer)
+{
+        pm_rollout *rollout = timer->data;
+
+        // the timer is rescheduled first, step may end the restart
+        timer_schedule (timer, PM_TIMER_TICK_MS);
+        step (rollout);
+}
+
+/**
+ * Starts a rolling restart of the group a ROLLING_RESTART request names. The
+ * instances that are running or waiting for a restart are replaced, the
+ * request is answered once they all are.
+ */
+void rollout_start (pm_connection *conn, pm_cmd *cmd)
+{
+        char *name = cmd->rolling_restart.name;
+
+        for (pm_rollout *rollout = rollouts; rollout != NULL; rollout = rollout->next) {
+                if (strcmp (rollout->name, name) == 0) {
+                        send_error (conn, cmd->id, INVALID_COMMAND, "a rolling restart of %s is already in progress", name);
+                        return;
+                }
+        }
+
+        uint32_t count = 0;
+
+        for (pm_process *p = find_processes_with_name (name); p != NULL; p = p->name_next)
+                if (p->state != PROCESS_EXITED && !p->replaced)
+                        count++;
+
+        if (count == 0) {
+                send_error (conn, cmd->id, NO_SUCH_PID, "no running process with name %s", name);
+                return;
+        }
+
+        pm_rollout *rollout = calloc_nofail (1, sizeof (pm_rollout));
+
+        snprintf (rollout->name, sizeof (rollout->name), "%s", name);
+        rollout->conn = conn;
+        rollout->id = cmd->id;
+        rollout->batch = cmd->rolling_restart.batch ? cmd->rolling_restart.batch : 1;
+        rollout->timeout_ms = cmd->rolling_restart.timeout_ms ? cmd->rolling_restart.timeout_ms : PM_ROLLOUT_TIMEOUT_MS;
+        rollout->grace_ms = cmd->rolling_restart.grace_ms ? cmd->rolling_restart.grace_ms : PM_SHUTDOWN_GRACE_MS;
+        rollout->old = calloc_nofail (count, sizeof (pm_handle));
+        rollout->new = calloc_nofail (count, sizeof (pm_handle));
+
+        // the name index lists the newest instance first, replace the
+        // oldest first
+        for (pm_process *p = find_processes_with_name (name); p != NULL; p = p->name_next)
+                if (p->state != PROCESS_EXITED && !p->replaced)
+                        rollout->old[count - ++rollout->count] = p->handle;
+
+        rollout->next = rollouts;
+        rollouts = rollout;
+
+        log_info ("rolling restart of %u instances of %s, %u at a time...", rollout->count, name, rollout->batch);
+
+        rollout->timer.callback = handle_rollout_timer;
+        rollout->timer.data = rollout;
+        timer_schedule (&rollout->timer, PM_TIMER_TICK_MS);
+}
+
+/**
+ * Forgets a client that is going away, the rolling restarts it asked for
+ * carry on without answering it.
+ */
+void rollout_detach (pm_connection *conn)
+{
+        for (pm_rollout *rollout = rollouts; rollout != NULL; rollout = rollout->next)
+                if (rollout->conn == conn)
+                        rollout->conn = NULL;
+}
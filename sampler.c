@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Resource sampling
+ *
+ * Once per PM_SAMPLE_INTERVAL_MS the event loop samples every running
+ * process: CPU time, resident memory, threads, open descriptors and bytes
+ * read and written. The /proc files of a process are opened once and read
+ * again with pread on every sample, which keeps a sample down to a few
+ * system calls. Processes placed in a cgroup take CPU time and memory from
+ * the cgroup instead, which also covers their descendants.
+ *
+ * The last PM_SAMPLE_HISTORY samples of every process are kept in a ring.
+ */
+
+extern pm_configuration config;
+
+static pm_slab sampler_slab = PM_SLAB_INIT (pm_sampler, 256);
+static pm_timer sample_timer;
+static long clock_ticks;
+static long page_size;
+
+static void close_proc_files (pm_sampler *sampler)
+{
+        if (sampler->stat_fd >= 0)
+                close (sampler->stat_fd);
+
+        if (sampler->io_fd >= 0)
+                close (sampler->io_fd);
+
+        if (sampler->fd_dir_fd >= 0)
+                close (sampler->fd_dir_fd);
+
+        sampler->stat_fd = sampler->io_fd = sampler->fd_dir_fd = -1;
+}
+
+/**
+ * Opens the /proc files of the sampler's process. The descriptors stay tied
+ * to the process they were opened for, reads fail once it is gone even if its
+ * pid was reused.
+ */
+static void open_proc_files (pm_sampler *sampler, pid_t pid)
+{
+        char path[64];
+
+        close_proc_files (sampler);
+
+        snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+        sampler->stat_fd = open (path, O_RDONLY | O_CLOEXEC);
+
+        snprintf (path, sizeof (path), "/proc/%d/io", pid);
+        sampler->io_fd = open (path, O_RDONLY | O_CLOEXEC);
+
+        snprintf (path, sizeof (path), "/proc/%d/fd", pid);
+        sampler->fd_dir_fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        sampler->pid = pid;
+        // a new process starts a new history
+        sampler->count = 0;
+}
+
+static ssize_t pread_text (int fd, char *buf, size_t size)
+{
+        if (fd < 0)
+                return -1;
+
+        ssize_t n = pread (fd, buf, size - 1, 0);
+
+        if (n >= 0)
+                buf[n] = '\0';
+
+        return n;
+}
+
+static bool read_stat (pm_sampler *sampler, pm_sample *sample)
+{
+        char buf[1024];
+
+        if (pread_text (sampler->stat_fd, buf, sizeof (buf)) <= 0)
+                return false;
+
+        // the command name may contain anything, fields start after its ')'
+        char *p = strrchr (buf, ')');
+
+        if (!p)
+                return false;
+
+        unsigned long long utime, stime, rss;
+        long threads;
+
+        if (sscanf (p + 2,
+                    "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %ld %*d %*u %*u %llu",
+                    &utime,
+                    &stime,
+                    &threads,
+                    &rss)
+            != 4)
+                return false;
+
+        sample->cpu_usec = (utime + stime) * 1000000ULL / clock_ticks;
+        sample->rss = rss * page_size;
+        sample->threads = threads;
+
+        return true;
+}
+
+static void read_io (pm_sampler *sampler, pm_sample *sample)
+{
+        char buf[512];
+
+        // only readable by the process's owner, missing I/O counts are 0
+        if (pread_text (sampler->io_fd, buf, sizeof (buf)) <= 0)
+                return;
+
+        char *read_bytes = strstr (buf, "\nread_bytes: ");
+        char *write_bytes = strstr (buf, "\nwrite_bytes: ");
+
+        if (read_bytes)
+                sample->read_bytes = strtoull (read_bytes + 13, NULL, 10);
+
+        if (write_bytes)
+                sample->write_bytes = strtoull (write_bytes + 14, NULL, 10);
+}
+
+/**
+ * Returns the number of descriptors in the /proc/<pid>/fd directory open as
+ * dir_fd. Since Linux 6.2 it is the directory's size, before that the size
+ * is 0 and the entries are counted.
+ */
+static uint32_t count_fds (int dir_fd)
+{
+        struct stat st;
+
+        if (dir_fd < 0 || fstat (dir_fd, &st) < 0)
+                return 0;
+
+        if (st.st_size > 0)
+                return st.st_size;
+
+        char buf[4096];
+        uint32_t count = 0;
+        long n;
+
+        lseek (dir_fd, 0, SEEK_SET);
+
+        while ((n = syscall (SYS_getdents64, dir_fd, buf, sizeof (buf))) > 0) {
+                for (long off = 0; off < n;) {
+                        struct dirent64 *entry = (struct dirent64 *)(buf + off);
+
+                        if (entry->d_name[0] != '.')
+                                count++;
+
+                        off += entry->d_reclen;
+                }
+        }
+
+        return count;
+}
+
+static void sample_process (pm_process *process, uint64_t now)
+{
+        if (!process->sampler) {
+                process->sampler = slab_alloc (&sampler_slab);
+                *process->sampler = (pm_sampler) { .stat_fd = -1, .io_fd = -1, .fd_dir_fd = -1 };
+        }
+
+        pm_sampler *sampler = process->sampler;
+
+        if (sampler->pid != process->pid)
+                open_proc_files (sampler, process->pid);
+
+        pm_sample sample = { .time_ms = now };
+
+        if (!read_stat (sampler, &sample))
+                return;
+
+        read_io (sampler, &sample);
+
+        sample.fds = count_fds (sampler->fd_dir_fd);
+
+        uint64_t memory, cpu;
+
+        if (cgroup_read_usage (process, &memory, &cpu)) {
+                sample.rss = memory;
+                sample.cpu_usec = cpu;
+        }
+
+        sampler->ring[sampler->count++ % PM_SAMPLE_HISTORY] = sample;
+}
+
+static void handle_sample_timer (pm_timer *timer)
+{
+        uint64_t now = monotonic_ms ();
+
+        for (pm_process *p = config.processes.head; p != NULL; p = p->next) {
+                if (p->pid > 0) {
+                        sample_process (p, now);
+                        watchdog_check (p);
+                } else if (p->sampler) {
+                        close_proc_files (p->sampler);
+                }
+        }
+
+        timer_schedule (timer, PM_SAMPLE_INTERVAL_MS);
+}
+
+void sampler_init ()
+{
+        clock_ticks = sysconf (_SC_CLK_TCK);
+        page_size = sysconf (_SC_PAGESIZE);
+
+        sample_timer.callback = handle_sample_timer;
+        timer_schedule (&sample_timer, PM_SAMPLE_INTERVAL_MS);
+}
+
+void sampler_free (pm_process *process)
+{
+        if (!process->sampler)
+                return;
+
+        close_proc_files (process->sampler);
+        slab_free (&sampler_slab, process->sampler);
+        process->sampler = NULL;
+}
+
+/**
+ * Returns the sample taken age samples ago, 0 being the latest, or NULL if
+ * there is no such sample.
+ */
+pm_sample *get_sample (pm_process *process, uint32_t age)
+{
+        pm_sampler *sampler = process->sampler;
+
+        if (!sampler || age >= sampler->count || age >= PM_SAMPLE_HISTORY)
+                return NULL;
+
+        return &sampler->ring[(sampler->count - 1 - age) % PM_SAMPLE_HISTORY];
+}
+
+/**
+ * Returns the CPU used between a sample and the one before it, in tenths of a
+ * percent of one CPU.
+ */
+uint32_t get_cpu_permille (pm_process *process, uint32_t age)
+{
+        pm_sample *sample = get_sample (process, age);
+        pm_sample *previous = get_sample (process, age + 1);
+
+        if (!sample || !previous || sample->time_ms <= previous->time_ms || sample->cpu_usec < previous->cpu_usec)
+                return 0;
+
+        // microseconds of CPU per millisecond of wall time is per mille
+        return (sample->cpu_usec - previous->cpu_usec) / (sample->time_ms - previous->time_ms);
+}
+
+/**
+ * Returns the STATS encoding of every running process.
+ *
+ * Encoding: u32 count, then for every process u64 handle, u32 pid, name as a
+ * length prefixed string, the latest sample as u32 CPU per mille, u64 RSS,
+ * u32 threads, u32 descriptors, u64 bytes read, u64 bytes written, then u8
+ * history length followed by that many u32 CPU per mille and u64 RSS pairs,
+ * newest first.
+ */
+void encode_stats (pm_buffer *buf)
+{
+        uint32_t count = 0;
+
+        buffer_clear (buf);
+        buffer_put_u32 (buf, 0);
+
+        for (pm_process *p = config.processes.head; p != NULL; p = p->next) {
+                pm_sample *latest = p->pid > 0 ? get_sample (p, 0) : NULL;
+
+                if (!latest || p->sampler->pid != p->pid)
+                        continue;
+
+                buffer_put_u64 (buf, p->handle);
+                buffer_put_u32 (buf, p->pid);
+                buffer_put_string (buf, p->name);
+                buffer_put_u32 (buf, get_cpu_permille (p, 0));
+                buffer_put_u64 (buf, latest->rss);
+                buffer_put_u32 (buf, latest->threads);
+                buffer_put_u32 (buf, latest->fds);
+                buffer_put_u64 (buf, latest->read_bytes);
+                buffer_put_u64 (buf, latest->write_bytes);
+
+                uint32_t history = p->sampler->count < PM_SAMPLE_HISTORY ? p->sampler->count : PM_SAMPLE_HISTORY;
+
+                buffer_put_u8 (buf, history);
+
+                for (uint32_t age = 0; age < history; age++) {
+                        buffer_put_u32 (buf, get_cpu_permille (p, age));
+                        buffer_put_u64 (buf, get_sample (p, age)->rss);
+                }
+
+                count++;
+        }
+
+        // patch the count in now that it is known
+        for (int i = 0; i < 4; i++)
+                buf->data[i] = (char)(count >> (8 * i));
+}
@@ -0,0 +1,164 @@
+#include "pm.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Stopping every managed process
+ *
+ * Every child leads its own process group, so a signal sent to the group
+ * also reaches whatever the child started. All groups get SIGTERM at once,
+ * then a single poll over the pidfds of the children waits for them until
+ * the grace period is over, and only the ones still alive then get SIGKILL.
+ * Stopping thousands of processes takes about one grace period.
+ */
+
+// children without a pidfd are checked this often
+#define SHUTDOWN_POLL_MS 50
+
+extern pm_configuration config;
+
+/**
+ * Sends a signal to the process group a child leads.
+ */
+void signal_group (pid_t pid, int sig)
+{
+        // fall back to the child alone if it never got its own group
+        if (kill (-pid, sig) < 0)
+                kill (pid, sig);
+}
+
+/**
+ * Reaps the child if it has exited. Returns whether it is gone, exited tells
+ * that its pidfd reported it gone.
+ */
+static bool try_reap (pm_process *process, bool exited)
+{
+        int status;
+        pid_t pid = waitpid (process->pid, &status, WNOHANG);
+
+        if (pid > 0) {
+                process->exit_status = status;
+                return true;
+        }
+
+        if (pid == 0 || errno != ECHILD)
+                return false;
+
+        // a process adopted from an earlier daemon is not our child, only
+        // its pidfd or kill tells that it is gone and its status is unknown
+        return exited || (kill (process->pid, 0) < 0 && errno == ESRCH);
+}
+
+/**
+ * Stops every running process, giving them grace_ms milliseconds to exit
+ * after SIGTERM before they are killed, and reaps all of them.
+ */
+void stop_all_processes (uint32_t grace_ms)
+{
+        size_t count = 0;
+
+        for (pm_process *p = config.processes.head; p != NULL; p = p->next)
+                if (p->pid > 0)
+                        count++;
+
+        if (count == 0)
+                return;
+
+        pm_process **children = malloc_nofail (count * sizeof (pm_process *));
+        struct pollfd *fds = malloc_nofail (count * sizeof (struct pollfd));
+        size_t n = 0;
+        bool without_pidfd = false;
+
+        for (pm_process *p = config.processes.head; p != NULL; p = p->next) {
+                if (p->pid <= 0)
+                        continue;
+
+                // the pidfd is opened first, it stays valid until the child
+                // is reaped even if it exits right after the signal
+                fds[n] = (struct pollfd) { .fd = open_pidfd (p->pid), .events = POLLIN };
+                without_pidfd |= fds[n].fd < 0;
+                children[n++] = p;
+
+                signal_group (p->pid, SIGTERM);
+        }
+
+        log_info ("Sent SIGTERM to %zu processes, waiting up to %u ms for them to exit...", n, grace_ms);
+
+        uint64_t deadline = monotonic_ms () + grace_ms;
+        size_t remaining = n;
+
+        while (remaining > 0) {
+                uint64_t now = monotonic_ms ();
+
+                if (now >= deadline)
+                        break;
+
+                int timeout = deadline - now;
+
+                if (without_pidfd && timeout > SHUTDOWN_POLL_MS)
+                        timeout = SHUTDOWN_POLL_MS;
+
+                if (poll (fds, n, timeout) < 0 && errno != EINTR) {
+                        log_error ("failed to wait for processes to exit: %s", strerror (errno));
+                        break;
+                }
+
+                for (size_t i = 0; i < n; i++) {
+                        if (!children[i])
+                                continue;
+
+                        bool exited = fds[i].fd >= 0 && (fds[i].revents & (POLLIN | POLLHUP));
+
+                        if (fds[i].fd >= 0 && !exited)
+                                continue;
+
+                        if (!try_reap (children[i], exited))
+                                continue;
+
+                        // a negative descriptor is skipped by poll
+                        if (fds[i].fd >= 0)
+                                close (fds[i].fd);
+
+                        fds[i].fd = -1;
+                        children[i] = NULL;
+                        remaining--;
+                }
+        }
+
+        if (remaining > 0)
+                log_info ("%zu processes did not exit within %u ms, sending SIGKILL...", remaining, grace_ms);
+
+        // a cgroup also catches descendants that left the process group
+        for (size_t i = 0; i < n; i++)
+                if (children[i] && !cgroup_kill (children[i]))
+                        signal_group (children[i]->pid, SIGKILL);
+
+        for (size_t i = 0; i < n; i++) {
+                if (!children[i])
+                        continue;
+
+                int status;
+                if (waitpid (children[i]->pid, &status, 0) > 0)
+                        children[i]->exit_status = status;
+
+                if (fds[i].fd >= 0)
+                        close (fds[i].fd);
+        }
+
+        for (pm_process *p = config.processes.head; p != NULL; p = p->next) {
+                if (p->pid > 0) {
+                        release_pidfd (p);
+                        cgroup_release (p);
+                        update_process_pid (p, 0);
+                        set_process_state (p, PROCESS_EXITED);
+                }
+        }
+
+        free (children);
+        free (fds);
+}
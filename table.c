@@ -0,0 +1,566 @@
+#include "pm.h"
+#include <string.h>
+
+#define TABLE_INITIAL_CAPACITY 64
+
+extern pm_configuration config;
+
+uint32_t hash_pid (pid_t pid)
+{
+        uint32_t h = (uint32_t)pid;
+
+        h ^= h >> 16;
+        h *= 0x7feb352d;
+        h ^= h >> 15;
+        h *= 0x846ca68b;
+        h ^= h >> 16;
+
+        return h;
+}
+
+uint32_t hash_name (char *name)
+{
+        uint32_t h = 2166136261u;
+
+        for (; *name; name++) {
+                h ^= (unsigned char)*name;
+                h *= 16777619u;
+        }
+
+        return h;
+}
+
+static uint32_t handle_index (pm_handle handle)
+{
+        return (uint32_t)handle;
+}
+
+static uint32_t handle_generation (pm_handle handle)
+{
+        return (uint32_t)(handle >> 32);
+}
+
+/*
+ * pid index
+ *
+ * Open addressing with linear probing. Deletions shift the following entries
+ * of the cluster back instead of leaving tombstones, so lookups never probe
+ * further than the longest live cluster.
+ */
+
+static void pid_index_insert_slot (pm_process **index, size_t cap, pm_process *process)
+{
+        size_t mask = cap - 1;
+        size_t i = hash_pid (process->pid) & mask;
+
+        while (index[i])
+                i = (i + 1) & mask;
+
+        index[i] = process;
+}
+
+static void pid_index_grow (pm_process_table *table)
+{
+        size_t cap = table->pid_cap ? table->pid_cap * 2 : TABLE_INITIAL_CAPACITY;
+        pm_process **index = calloc_nofail (cap, sizeof (pm_process *));
+
+        for (size_t i = 0; i < table->pid_cap; i++)
+                if (table->pid_index[i])
+                        pid_index_insert_slot (index, cap, table->pid_index[i]);
+
+        free (table->pid_index);
+        table->pid_index = index;
+        table->pid_cap = cap;
+}
+
+static void pid_index_insert (pm_process_table *table, pm_process *process)
+{
+        if ((table->pid_count + 1) * 2 > table->pid_cap)
+                pid_index_grow (table);
+
+        pid_index_insert_slot (table->pid_index, table->pid_cap, process);
+        table->pid_count++;
+}
+
+static void pid_index_remove (pm_process_table *table, pm_process *process)
+{
+        if (!table->pid_cap)
+                return;
+
+        size_t mask = table->pid_cap - 1;
+        size_t i = hash_pid (process->pid) & mask;
+
+        while (table->pid_index[i] != process) {
+                if (!table->pid_index[i])
+                        return;
+
+                i = (i + 1) & mask;
+        }
+
+        table->pid_index[i] = NULL;
+        table->pid_count--;
+
+        // shift back entries that were displaced past the freed slot
+        for (size_t j = (i + 1) & mask; table->pid_index[j]; j = (j + 1) & mask) {
+                size_t home = hash_pid (table->pid_index[j]->pid) & mask;
+
+                // entry stays if its home lies cyclically in (i, j]
+                if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                        continue;
+
+                table->pid_index[i] = table->pid_index[j];
+                table->pid_index[j] = NULL;
+                i = j;
+        }
+}
+
+pm_process *find_process_with_pid (pid_t pid)
+{
+        pm_process_table *table = &config.processes;
+
+        if (!table->pid_cap)
+                return NULL;
+
+        size_t mask = table->pid_cap - 1;
+
+        for (size_t i = hash_pid (pid) & mask; table->pid_index[i]; i = (i + 1) & mask)
+                if (table->pid_index[i]->pid == pid)
+                        return table->pid_index[i];
+
+        return NULL;
+}
+
+/*
+ * name index
+ *
+ * Maps a name to the first process carrying it, the remaining processes with
+ * the same name hang off that one through name_next/name_prev.
+ */
+
+static size_t name_index_find_slot (pm_process **index, size_t cap, char *name, uint32_t hash)
+{
+        size_t mask = cap - 1;
+        size_t i = hash & mask;
+
+        while (index[i] && (index[i]->name_hash != hash || strcmp (index[i]->name, name) != 0))
+                i = (i + 1) & mask;
+
+        return i;
+}
+
+static void name_index_grow (pm_process_table *table)
+{
+        size_t cap = table->name_cap ? table->name_cap * 2 : TABLE_INITIAL_CAPACITY;
+        pm_process **index = calloc_nofail (cap, sizeof (pm_process *));
+
+        for (size_t i = 0; i < table->name_cap; i++) {
+                pm_process *head = table->name_index[i];
+
+                if (head)
+                        index[name_index_find_slot (index, cap, head->name, head->name_hash)] = head;
+        }
+
+        free (table->name_index);
+        table->name_index = index;
+        table->name_cap = cap;
+}
+
+static void name_index_insert (pm_process_table *table, pm_process *process)
+{
+        if ((table->name_count + 1) * 2 > table->name_cap)
+                name_index_grow (table);
+
+        size_t i = name_index_find_slot (table->name_index, table->name_cap, process->name, process->name_hash);
+        pm_process *head = table->name_index[i];
+
+        process->name_prev = NULL;
+        process->name_next = head;
+
+        if (head)
+                head->name_prev = process;
+        else
+                table->name_count++;
+
+        table->name_index[i] = process;
+}
+
+static void name_index_remove (pm_process_table *table, pm_process *process)
+{
+        if (process->name_prev) {
+                process->name_prev->name_next = process->name_next;
+
+                if (process->name_next)
+                        process->name_next->name_prev = process->name_prev;
+
+                return;
+        }
+
+        size_t mask = table->name_cap - 1;
+        size_t i = name_index_find_slot (table->name_index, table->name_cap, process->name, process->name_hash);
+
+        if (process->name_next) {
+                process->name_next->name_prev = NULL;
+                table->name_index[i] = process->name_next;
+                return;
+        }
+
+        // last process with this name, drop the slot and close the gap
+        table->name_index[i] = NULL;
+        table->name_count--;
+
+        for (size_t j = (i + 1) & mask; table->name_index[j]; j = (j + 1) & mask) {
+                size_t home = table->name_index[j]->name_hash & mask;
+
+                if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                        continue;
+
+                table->name_index[i] = table->name_index[j];
+                table->name_index[j] = NULL;
+                i = j;
+        }
+}
+
+pm_process *find_processes_with_name (char *name)
+{
+        pm_process_table *table = &config.processes;
+
+        if (!table->name_cap)
+                return NULL;
+
+        return table->name_index[name_index_find_slot (table->name_index, table->name_cap, name, hash_name (name))];
+}
+
+/*
+ * handles
+ *
+ * A handle names a slot of the table together with the generation the slot
+ * had when the process was inserted. The record keeps its slot across
+ * restarts, so the handle stays valid until the process is removed.
+ */
+
+static uint32_t add_slot (pm_process_table *table)
+{
+        if (table->slot_count == table->slot_cap) {
+                table->slot_cap = table->slot_cap ? table->slot_cap * 2 : TABLE_INITIAL_CAPACITY;
+                table->slots = realloc_nofail (table->slots, table->slot_cap * sizeof (pm_process *));
+                table->generations = realloc_nofail (table->generations, table->slot_cap * sizeof (uint32_t));
+                table->free_slots = realloc_nofail (table->free_slots, table->slot_cap * sizeof (uint32_t));
+        }
+
+        table->slots[table->slot_count] = NULL;
+        table->generations[table->slot_count] = 0;
+
+        return table->slot_count++;
+}
+
+static pm_handle allocate_handle (pm_process_table *table, pm_process *process)
+{
+        uint32_t index;
+
+        if (table->free_count > 0)
+                index = table->free_slots[--table->free_count];
+        else
+                index = add_slot (table);
+
+        // generation 0 is never handed out so that a zero handle is invalid
+        if (++table->generations[index] == 0)
+                table->generations[index] = 1;
+
+        table->slots[index] = process;
+
+        return ((pm_handle)table->generations[index] << 32) | index;
+}
+
+pm_process *find_process_with_handle (pm_handle handle)
+{
+        pm_process_table *table = &config.processes;
+        uint32_t index = handle_index (handle);
+
+        if (index >= table->slot_count || table->generations[index] != handle_generation (handle))
+                return NULL;
+
+        return table->slots[index];
+}
+
+/**
+ * Finds a process by the id listings show for it, the slot of its handle.
+ */
+pm_process *find_process_with_id (uint32_t id)
+{
+        pm_process_table *table = &config.processes;
+
+        return id < table->slot_count ? table->slots[id] : NULL;
+}
+
+/**
+ * Claims the slot of a handle handed out by an earlier daemon, so a process
+ * read back from the journal keeps its id. Slots skipped on the way become
+ * free. Returns 0 if the slot is taken.
+ */
+static pm_handle claim_handle (pm_process_table *table, pm_process *process, pm_handle handle)
+{
+        uint32_t index = handle_index (handle);
+
+        if (handle_generation (handle) == 0 || (index < table->slot_count && table->slots[index]))
+                return 0;
+
+        while (table->slot_count <= index) {
+                uint32_t skipped = add_slot (table);
+                table->free_slots[table->free_count++] = skipped;
+        }
+
+        for (uint32_t i = 0; i < table->free_count; i++) {
+                if (table->free_slots[i] == index) {
+                        table->free_slots[i] = table->free_slots[--table->free_count];
+                        break;
+                }
+        }
+
+        table->generations[index] = handle_generation (handle);
+        table->slots[index] = process;
+
+        return handle;
+}
+
+static void link_process (pm_process_table *table, pm_process *process)
+{
+        process->name_hash = hash_name (process->name);
+
+        process->next = NULL;
+        process->prev = table->tail;
+
+        if (table->tail)
+                table->tail->next = process;
+        else
+                table->head = process;
+
+        table->tail = process;
+        table->count++;
+        table->generation++;
+
+        if (process->pid > 0)
+                pid_index_insert (table, process);
+
+        name_index_insert (table, process);
+}
+
+/**
+ * Inserts a process into the table and its indexes. The process must already
+ * have its pid and name set.
+ */
+void insert_process (pm_process *process)
+{
+        pm_process_table *table = &config.processes;
+
+        process->handle = allocate_handle (table, process);
+        link_process (table, process);
+        journal_insert (process);
+}
+
+/**
+ * Inserts a process read back from the journal under the handle it had
+ * before, or under a new one if that is taken.
+ */
+void restore_process (pm_process *process, pm_handle handle)
+{
+        pm_process_table *table = &config.processes;
+
+        process->handle = claim_handle (table, process, handle);
+
+        if (!process->handle)
+                process->handle = allocate_handle (table, process);
+
+        link_process (table, process);
+}
+
+/**
+ * Points the record at a new pid, as happens when a process is restarted. A
+ * pid of 0 leaves the process out of the pid index.
+ */
+void update_process_pid (pm_process *process, pid_t pid)
+{
+        pm_process_table *table = &config.processes;
+
+        if (process->pid > 0)
+                pid_index_remove (table, process);
+
+        process->pid = pid;
+        table->generation++;
+
+        if (pid > 0)
+                pid_index_insert (table, process);
+
+        journal_update (process);
+}
+
+void set_process_state (pm_process *process, pm_process_state state)
+{
+        process->state = state;
+        config.processes.generation++;
+
+        journal_update (process);
+}
+
+/**
+ * Readiness only shows in listings, it is probed afresh after a restart and
+ * not journaled.
+ */
+void set_process_readiness (pm_process *process, pm_readiness readiness)
+{
+        process->readiness = readiness;
+        config.processes.generation++;
+}
+
+/**
+ * Keeps a process that exited for good in the table so it still shows up in
+ * listings. Only the last PM_MAX_EXITED of them are kept, older ones are
+ * removed as new ones retire.
+ */
+void retire_process (pm_process *process)
+{
+        pm_process_table *table = &config.processes;
+
+        update_process_pid (process, 0);
+        set_process_state (process, PROCESS_EXITED);
+
+        // the group's sockets are closed once no process is left to accept,
+        // and its CPUs go to whoever is placed next
+        listener_release (process->listener);
+        process->listener = NULL;
+        affinity_release (process);
+
+        if (table->exited_count == PM_MAX_EXITED) {
+                pm_process *oldest = find_process_with_handle (table->exited[table->exited_head]);
+
+                if (oldest && oldest->state == PROCESS_EXITED)
+                        remove_process (oldest);
+
+                table->exited_head = (table->exited_head + 1) % PM_MAX_EXITED;
+                table->exited_count--;
+        }
+
+        table->exited[(table->exited_head + table->exited_count) % PM_MAX_EXITED] = process->handle;
+        table->exited_count++;
+}
+
+void remove_process (pm_process *process)
+{
+        pm_process_table *table = &config.processes;
+        uint32_t index = handle_index (process->handle);
+
+        if (process->pid > 0)
+                pid_index_remove (table, process);
+
+        name_index_remove (table, process);
+
+        if (process->prev)
+                process->prev->next = process->next;
+        else
+                table->head = process->next;
+
+        if (process->next)
+                process->next->prev = process->prev;
+        else
+                table->tail = process->prev;
+
+        table->slots[index] = NULL;
+        table->free_slots[table->free_count++] = index;
+        table->count--;
+        table->generation++;
+
+        journal_remove (process);
+        free_process_entry (process);
+}
+
+char *get_state_name (pm_process_state state)
+{
+        switch (state) {
+        case PROCESS_RUNNING: return "running";
+        case PROCESS_EXITED: return "exited";
+        case PROCESS_WAITING: return "waiting";
+        default: return "unknown";
+        }
+}
+
+char *get_readiness_name (pm_readiness readiness)
+{
+        switch (readiness) {
+        case READINESS_NONE: return "-";
+        case READINESS_STARTING: return "starting";
+        case READINESS_READY: return "ready";
+        case READINESS_UNREADY: return "unready";
+        default: return "unknown";
+        }
+}
+
+static void put_command_line (pm_buffer *buf, char **argv)
+{
+        size_t len = 0;
+
+        for (int i = 0; argv[i]; i++)
+                len += strlen (argv[i]) + (i > 0);
+
+        if (len > UINT16_MAX)
+                len = UINT16_MAX;
+
+        buffer_put_u16 (buf, len);
+
+        for (int i = 0; argv[i] && len > 0; i++) {
+                if (i > 0) {
+                        buffer_put_u8 (buf, ' ');
+                        len--;
+                }
+
+                size_t n = strlen (argv[i]);
+                n = n < len ? n : len;
+
+                buffer_put_bytes (buf, argv[i], n);
+                len -= n;
+        }
+}
+
+/**
+ * Returns the LIST_PROCESS encoding of the table. The encoding is kept
+ * together with the table generation it was made from, repeated listings of
+ * an unchanged table reuse it instead of walking the table again.
+ *
+ * Encoding: u32 count, then for every process u64 handle, u32 pid, u8 state,
+ * u32 restarts, u32 exit status, u64 start time, name and command line as
+ * length prefixed strings, u8 readiness, and the CPUs it is placed on as a
+ * list like 0-3,8, empty if it is not placed.
+ */
+pm_buffer *snapshot_process_table ()
+{
+        static pm_buffer snapshot = { 0 };
+        static uint64_t snapshot_generation = 0;
+        static bool valid = false;
+
+        pm_process_table *table = &config.processes;
+
+        if (valid && snapshot_generation == table->generation)
+                return &snapshot;
+
+        buffer_clear (&snapshot);
+        buffer_put_u32 (&snapshot, table->count);
+
+        for (pm_process *p = table->head; p != NULL; p = p->next) {
+                buffer_put_u64 (&snapshot, p->handle);
+                buffer_put_u32 (&snapshot, p->pid);
+                buffer_put_u8 (&snapshot, p->state);
+                buffer_put_u32 (&snapshot, p->restarts);
+                buffer_put_u32 (&snapshot, p->exit_status);
+                buffer_put_u64 (&snapshot, p->start_time);
+                buffer_put_string (&snapshot, p->name);
+                put_command_line (&snapshot, p->argv);
+                buffer_put_u8 (&snapshot, p->readiness);
+
+                char cpus[256];
+                affinity_format (p, cpus, sizeof (cpus));
+                buffer_put_string (&snapshot, cpus);
+        }
+
+        snapshot_generation = table->generation;
+        valid = true;
+
+        return &snapshot;
+}
@@ -0,0 +1,65 @@
+#include "../pm.h"
+#include "test.h"
+#include <string.h>
+
+static void test_strategies ()
+{
+        check (parse_placement_spec ("core"));
+        check (parse_placement_spec ("spread"));
+        check (parse_placement_spec ("pack"));
+
+        check (!parse_placement_spec (""));
+        check (!parse_placement_spec ("cores"));
+        check (!parse_placement_spec ("Core"));
+        check (!parse_placement_spec ("pack:1"));
+}
+
+static void test_nodes ()
+{
+        check (parse_placement_spec ("node:0"));
+        check (parse_placement_spec ("node:63"));
+
+        // at most PM_NUMA_NODES_MAX nodes
+        check (!parse_placement_spec ("node:64"));
+        check (!parse_placement_spec ("node:-1"));
+        check (!parse_placement_spec ("node:"));
+        check (!parse_placement_spec ("node:1x"));
+        check (!parse_placement_spec ("node:0,1"));
+}
+
+static void test_cpu_lists ()
+{
+        char spec[PM_PLACEMENT_SPEC_MAX + 1];
+
+        check (parse_placement_spec ("cpus:0"));
+        check (parse_placement_spec ("cpus:0-3"));
+        check (parse_placement_spec ("cpus:0-3,8,10-11"));
+        check (parse_placement_spec ("cpus:1023"));
+
+        check (!parse_placement_spec ("cpus:"));
+        check (!parse_placement_spec ("cpus:3-1"));
+        check (!parse_placement_spec ("cpus:-1"));
+        check (!parse_placement_spec ("cpus:0-"));
+        check (!parse_placement_spec ("cpus:a"));
+        check (!parse_placement_spec ("cpus:0;1"));
+
+        // beyond CPU_SETSIZE
+        check (!parse_placement_spec ("cpus:1024"));
+
+        // a valid list that does not fit PM_PLACEMENT_SPEC_MAX
+        strcpy (spec, "cpus:0");
+
+        while (strlen (spec) < PM_PLACEMENT_SPEC_MAX - 1)
+                strcat (spec, ",0");
+
+        check (!parse_placement_spec (spec));
+}
+
+int main ()
+{
+        test_strategies ();
+        test_nodes ();
+        test_cpu_lists ();
+
+        return test_result ("affinity");
+}
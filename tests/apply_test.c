@@ -0,0 +1,100 @@
+#include "../pm.h"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Returns a request of count groups, named a, b, c and so on. deps holds
+ * the names of the groups each one depends on, like "bc" for b and c.
+ */
+static pm_apply *make_apply (uint32_t count, char **deps)
+{
+        pm_apply *apply = calloc_nofail (1, sizeof (pm_apply));
+
+        apply->nodes = calloc_nofail (count, sizeof (apply_node));
+        apply->count = count;
+
+        for (uint32_t i = 0; i < count; i++) {
+                apply_node *node = &apply->nodes[i];
+                size_t depends_count = strlen (deps[i]);
+
+                snprintf (node->name, sizeof (node->name), "%c", 'a' + i);
+                node->depends_on = calloc_nofail (depends_count ? depends_count : 1, PM_NAME_MAX);
+                node->depends_count = depends_count;
+
+                for (size_t d = 0; d < depends_count; d++)
+                        snprintf (node->depends_on[d], PM_NAME_MAX, "%c", deps[i][d]);
+        }
+
+        return apply;
+}
+
+static void test_chain ()
+{
+        char error[256] = "";
+        pm_apply *apply = make_apply (3, (char *[]) { "", "a", "ab" });
+
+        check (link_nodes (apply, error, sizeof (error)));
+        check (error[0] == '\0');
+
+        // a waits for nothing, c for both others
+        check (apply->nodes[0].pending == 0);
+        check (apply->nodes[1].pending == 1);
+        check (apply->nodes[2].pending == 2);
+        check (apply->nodes[0].dependent_count == 2);
+        check (apply->nodes[1].dependent_count == 1);
+        check (apply->nodes[1].dependents[0] == 2);
+        check (apply->nodes[2].dependent_count == 0);
+
+        free_apply (apply);
+}
+
+static void test_unknown_dependency ()
+{
+        char error[256] = "";
+        pm_apply *apply = make_apply (2, (char *[]) { "", "z" });
+
+        check (!link_nodes (apply, error, sizeof (error)));
+        check (strcmp (error, "b depends on z, which is not described") == 0);
+
+        free_apply (apply);
+}
+
+static void test_cycles ()
+{
+        char error[256] = "";
+        pm_apply *apply = make_apply (1, (char *[]) { "a" });
+
+        check (!link_nodes (apply, error, sizeof (error)));
+        check (strcmp (error, "the dependencies of a form a cycle") == 0);
+        free_apply (apply);
+
+        // a is fine, b and c wait for each other and d for them
+        apply = make_apply (4, (char *[]) { "", "ac", "b", "c" });
+        check (!link_nodes (apply, error, sizeof (error)));
+        check (strcmp (error, "the dependencies of b form a cycle") == 0);
+        free_apply (apply);
+}
+
+static void test_diamond ()
+{
+        char error[256] = "";
+        pm_apply *apply = make_apply (4, (char *[]) { "bc", "d", "d", "" });
+
+        // shared dependencies are not a cycle
+        check (link_nodes (apply, error, sizeof (error)));
+        check (apply->nodes[3].dependent_count == 2);
+        check (apply->nodes[0].pending == 2);
+
+        free_apply (apply);
+}
+
+int main ()
+{
+        test_chain ();
+        test_unknown_dependency ();
+        test_cycles ();
+        test_diamond ();
+
+        return test_result ("apply");
+}
@@ -0,0 +1,74 @@
+#include "../pm.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// whether spec parses to expected, NULL if it should be rejected
+static bool parses_to (char *spec, char *expected)
+{
+        char *parsed = parse_listen_spec (spec);
+        bool same = parsed && expected ? strcmp (parsed, expected) == 0 : parsed == expected;
+
+        free (parsed);
+
+        return same;
+}
+
+static void test_tcp ()
+{
+        check (parses_to ("tcp:8080", "tcp:8080"));
+        check (parses_to ("tcp:127.0.0.1:8080", "tcp:127.0.0.1:8080"));
+        check (parses_to ("tcp:1", "tcp:1"));
+        check (parses_to ("tcp:65535", "tcp:65535"));
+
+        check (parses_to ("tcp:0", NULL));
+        check (parses_to ("tcp:65536", NULL));
+        check (parses_to ("tcp:", NULL));
+        check (parses_to ("tcp:http", NULL));
+        check (parses_to ("tcp:80x", NULL));
+        check (parses_to ("tcp:localhost:80", NULL));
+        check (parses_to ("tcp:256.0.0.1:80", NULL));
+}
+
+static void test_unix ()
+{
+        char path[200];
+
+        check (parses_to ("unix:/run/app.sock", "unix:/run/app.sock"));
+
+        // the daemon runs elsewhere, a relative path is made absolute
+        check (chdir ("/tmp") == 0);
+        check (parses_to ("unix:app.sock", "unix:/tmp/app.sock"));
+
+        check (parses_to ("unix:", NULL));
+
+        // longer than sun_path holds
+        memset (path, 'a', sizeof (path) - 1);
+        path[sizeof (path) - 1] = '\0';
+        memcpy (path, "unix:/", 6);
+        check (parses_to (path, NULL));
+}
+
+static void test_lists ()
+{
+        check (parses_to ("tcp:80,tcp:443,unix:/run/app.sock", "tcp:80,tcp:443,unix:/run/app.sock"));
+        check (parses_to ("tcp:1,tcp:2,tcp:3,tcp:4,tcp:5,tcp:6,tcp:7,tcp:8", "tcp:1,tcp:2,tcp:3,tcp:4,tcp:5,tcp:6,tcp:7,tcp:8"));
+
+        // one more than PM_LISTEN_MAX
+        check (parses_to ("tcp:1,tcp:2,tcp:3,tcp:4,tcp:5,tcp:6,tcp:7,tcp:8,tcp:9", NULL));
+
+        check (parses_to ("", NULL));
+        check (parses_to ("tcp:80,,tcp:443", NULL));
+        check (parses_to ("tcp:80,udp:53", NULL));
+        check (parses_to ("80", NULL));
+}
+
+int main ()
+{
+        test_tcp ();
+        test_unix ();
+        test_lists ();
+
+        return test_result ("listen");
+}
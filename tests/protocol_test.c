@@ -0,0 +1,142 @@
+#include "../pm.h"
+#include "test.h"
+#include <stdint.h>
+#include <string.h>
+
+static void test_frame_header ()
+{
+        char data[PM_FRAME_HEADER_SIZE];
+        pm_frame_header header;
+
+        encode_frame_header (data, 1234, SIGNAL_PROCESS, 0xdeadbeef);
+        decode_frame_header (data, &header);
+
+        check (header.size == 1234);
+        check (header.version == PM_PROTOCOL_VERSION);
+        check (header.type == SIGNAL_PROCESS);
+        check (header.id == 0xdeadbeef);
+}
+
+static void test_truncated_frames ()
+{
+        char data[PM_FRAME_HEADER_SIZE + 8] = { 0 };
+
+        encode_frame_header (data, 8, SIGNAL_PROCESS, 1);
+
+        // the header itself is incomplete
+        check (frame_size (data, 0) == 0);
+        check (frame_size (data, PM_FRAME_HEADER_SIZE - 1) == 0);
+
+        // the header is there, the body is not
+        check (frame_size (data, PM_FRAME_HEADER_SIZE) == 0);
+        check (frame_size (data, PM_FRAME_HEADER_SIZE + 7) == 0);
+
+        check (frame_size (data, PM_FRAME_HEADER_SIZE + 8) == PM_FRAME_HEADER_SIZE + 8);
+}
+
+static void test_trailing_data ()
+{
+        char data[2 * PM_FRAME_HEADER_SIZE] = { 0 };
+
+        // a frame without a body followed by the start of the next one
+        encode_frame_header (data, 0, LIST_PROCESS, 1);
+        encode_frame_header (data + PM_FRAME_HEADER_SIZE, 0, LIST_PROCESS, 2);
+
+        check (frame_size (data, sizeof (data)) == PM_FRAME_HEADER_SIZE);
+        check (frame_size (data, PM_FRAME_HEADER_SIZE + 3) == PM_FRAME_HEADER_SIZE);
+}
+
+static void test_oversized_frames ()
+{
+        char data[PM_FRAME_HEADER_SIZE];
+
+        encode_frame_header (data, PM_MAX_COMMAND_SIZE, APPLY, 1);
+        check (frame_size (data, sizeof (data)) == 0);
+
+        // rejected on its header alone, before the body is waited for
+        encode_frame_header (data, PM_MAX_COMMAND_SIZE + 1, APPLY, 1);
+        check (frame_size (data, sizeof (data)) == SIZE_MAX);
+
+        encode_frame_header (data, UINT32_MAX, APPLY, 1);
+        check (frame_size (data, sizeof (data)) == SIZE_MAX);
+}
+
+static void test_decode_request ()
+{
+        pm_buffer buf = { 0 };
+        pm_cmd cmd = { .instruction = SIGNAL_PROCESS, .id = 7, .signal_process = { .signal = 15, .pid = 4321 } };
+        pm_cmd decoded;
+
+        encode_request (&buf, &cmd);
+
+        check (frame_size (buf.data, buf.len) == buf.len);
+        check (decode_request (buf.data, buf.len, &decoded) == OK);
+        check (decoded.id == 7);
+        check (decoded.instruction == SIGNAL_PROCESS);
+        check (decoded.signal_process.signal == 15);
+        check (decoded.signal_process.pid == 4321);
+
+        buffer_free (&buf);
+}
+
+static void test_bad_version ()
+{
+        pm_buffer buf = { 0 };
+        pm_cmd cmd = { .instruction = SIGNAL_PROCESS, .id = 9, .signal_process = { .signal = 15, .pid = 1 } };
+        pm_cmd decoded;
+
+        encode_request (&buf, &cmd);
+
+        // the version is the u16 after the size
+        buf.data[4] = PM_PROTOCOL_VERSION + 1;
+        buf.data[5] = 0;
+
+        check (decode_request (buf.data, buf.len, &decoded) == UNSUPPORTED_VERSION);
+
+        // the id is still known, the failure can be answered
+        check (decoded.id == 9);
+
+        buffer_free (&buf);
+}
+
+static void test_truncated_body ()
+{
+        pm_buffer buf = { 0 };
+        pm_cmd cmd = { .instruction = SIGNAL_PROCESS, .id = 3, .signal_process = { .signal = 9, .pid = 1 } };
+        pm_cmd decoded;
+
+        encode_request (&buf, &cmd);
+
+        // a frame whose body stops after the signal, without the pid
+        encode_frame_header (buf.data, 4, SIGNAL_PROCESS, 3);
+
+        check (decode_request (buf.data, PM_FRAME_HEADER_SIZE + 4, &decoded) == INVALID_COMMAND);
+        check (decoded.id == 3);
+
+        buffer_free (&buf);
+}
+
+static void test_unknown_instruction ()
+{
+        char data[PM_FRAME_HEADER_SIZE];
+        pm_cmd decoded;
+
+        encode_frame_header (data, 0, 0xffff, 5);
+
+        check (decode_request (data, sizeof (data), &decoded) == INVALID_COMMAND);
+        check (decoded.id == 5);
+}
+
+int main ()
+{
+        test_frame_header ();
+        test_truncated_frames ();
+        test_trailing_data ();
+        test_oversized_frames ();
+        test_decode_request ();
+        test_bad_version ();
+        test_truncated_body ();
+        test_unknown_instruction ();
+
+        return test_result ("protocol");
+}
@@ -0,0 +1,36 @@
+#ifndef PM_TEST_H
+#define PM_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Tests
+ *
+ * Each test program checks one part of the daemon that does not need a
+ * running daemon. A failed check is reported with its line and the program
+ * carries on, it exits with a failure once all of its checks ran.
+ */
+
+static int test_failures;
+
+#define check(condition)                                                                          \
+        do {                                                                                      \
+                if (!(condition)) {                                                               \
+                        fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+                        test_failures++;                                                          \
+                }                                                                                 \
+        } while (0)
+
+static inline int test_result (char *name)
+{
+        if (test_failures) {
+                fprintf (stderr, "%s: %d checks failed\n", name, test_failures);
+                return EXIT_FAILURE;
+        }
+
+        printf ("%s: ok\n", name);
+        return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include "pm.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/*
+ * Timers
+ *
+ * A hierarchical timer wheel driven by a single timerfd. Level 0 holds the
+ * timers due within the next 64 ticks, one slot per tick, every further level
+ * covers 64 times the span of the one below it. Timers of an upper level are
+ * cascaded one level down when the lower wheel wraps around, so scheduling,
+ * cancelling and firing a timer are all O(1) no matter how many are pending.
+ *
+ * The timerfd only ticks while timers are pending.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+// furthest a timer can be scheduled, later ones fire at this point
+#define WHEEL_MAX_TICKS ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+extern pm_configuration config;
+
+static pm_watch timer_watch;
+static pm_timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t current_tick;
+static size_t pending;
+
+static void slot_insert (pm_timer **slot, pm_timer *timer)
+{
+        timer->prev = NULL;
+        timer->next = *slot;
+
+        if (*slot)
+                (*slot)->prev = timer;
+
+        *slot = timer;
+        timer->slot = slot;
+}
+
+static void wheel_insert (pm_timer *timer)
+{
+        uint64_t ticks = timer->expires - current_tick;
+
+        if (timer->expires < current_tick)
+                ticks = 0, timer->expires = current_tick;
+
+        if (ticks > WHEEL_MAX_TICKS) {
+                ticks = WHEEL_MAX_TICKS;
+                timer->expires = current_tick + ticks;
+        }
+
+        int level = 0;
+
+        while (level < WHEEL_LEVELS - 1 && ticks >= 1ULL << (WHEEL_BITS * (level + 1)))
+                level++;
+
+        size_t index = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+        slot_insert (&wheel[level][index], timer);
+}
+
+static void set_ticking (bool ticking)
+{
+        struct itimerspec spec = { 0 };
+
+        if (ticking) {
+                spec.it_interval.tv_nsec = PM_TIMER_TICK_MS * 1000000L;
+                spec.it_value = spec.it_interval;
+        }
+
+        timerfd_settime (timer_watch.fd, 0, &spec, NULL);
+}
+
+/**
+ * Moves the timers of one slot of an upper level down to the levels below.
+ * Returns the index of the slot so the caller knows whether this level has
+ * wrapped around as well.
+ */
+static size_t cascade (int level)
+{
+        size_t index = (current_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        pm_timer *timer = wheel[level][index];
+
+        wheel[level][index] = NULL;
+
+        while (timer) {
+                pm_timer *next = timer->next;
+                wheel_insert (timer);
+                timer = next;
+        }
+
+        return index;
+}
+
+static void run_tick ()
+{
+        size_t index = current_tick & WHEEL_MASK;
+
+        for (int level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+                index = cascade (level);
+
+        pm_timer **slot = &wheel[0][current_tick & WHEEL_MASK];
+
+        current_tick++;
+
+        // callbacks may schedule timers, possibly into this very slot
+        while (*slot) {
+                pm_timer *timer = *slot;
+
+                timer_cancel (timer);
+                timer->callback (timer);
+        }
+}
+
+static void handle_timer_event (pm_watch *watch, uint32_t events)
+{
+        uint64_t expirations;
+
+        if (read (watch->fd, &expirations, sizeof (expirations)) != sizeof (expirations))
+                return;
+
+        // a late wakeup catches up on every tick that was missed
+        while (expirations-- > 0 && pending > 0)
+                run_tick ();
+
+        if (pending == 0)
+                set_ticking (false);
+}
+
+void timer_init ()
+{
+        timer_watch.fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        timer_watch.callback = handle_timer_event;
+
+        if (timer_watch.fd < 0) {
+                perror ("timerfd_create");
+                fatal_error ();
+        }
+
+        watch_add (&timer_watch, EPOLLIN);
+
+        // timers are jittered with random (), don't share the sequence
+        srandom (time (NULL) ^ getpid ());
+}
+
+/**
+ * Calls the timer's callback after delay_ms milliseconds, rounded up to the
+ * next tick. A timer that is already pending is rescheduled.
+ */
+void timer_schedule (pm_timer *timer, uint64_t delay_ms)
+{
+        if (timer->slot)
+                timer_cancel (timer);
+
+        timer->expires = current_tick + (delay_ms + PM_TIMER_TICK_MS - 1) / PM_TIMER_TICK_MS;
+        wheel_insert (timer);
+
+        if (pending++ == 0)
+                set_ticking (true);
+}
+
+void timer_cancel (pm_timer *timer)
+{
+        if (!timer->slot)
+                return;
+
+        if (timer->prev)
+                timer->prev->next = timer->next;
+        else
+                *timer->slot = timer->next;
+
+        if (timer->next)
+                timer->next->prev = timer->prev;
+
+        timer->slot = NULL;
+        timer->next = timer->prev = NULL;
+        pending--;
+}
@@ -0,0 +1,257 @@
+#include "pm.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * io_uring
+ *
+ * A thin layer over the io_uring system calls, without liburing: a ring is
+ * set up and mapped, entries are queued on its submission queue and handed
+ * to the kernel with a single io_uring_enter that also waits for them to
+ * complete. Buffers and descriptors used over and over can be registered
+ * with the ring, the kernel then looks them up once rather than on every
+ * operation.
+ *
+ * A ring is used by a single thread, the barriers only order the accesses
+ * shared with the kernel.
+ */
+
+/**
+ * Sets up a ring with room for entries submissions and maps its queues.
+ * Returns false with errno set if the kernel has no io_uring or does not
+ * let this process use it.
+ */
+bool uring_init (pm_uring *ring, unsigned entries)
+{
+        struct io_uring_params params = { 0 };
+
+        *ring = (pm_uring) { .fd = syscall (SYS_io_uring_setup, entries, &params) };
+
+        if (ring->fd < 0)
+                return false;
+
+        ring->sq_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+        ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+
+        // both queues may live in one mapping
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+                ring->sq_size = ring->cq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+
+        ring->sq_ring = mmap (NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP
+                                ? ring->sq_ring
+                                : mmap (NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+        ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+        if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+                int err = errno;
+                uring_close (ring);
+                errno = err;
+                return false;
+        }
+
+        char *sq = ring->sq_ring, *cq = ring->cq_ring;
+
+        ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+        ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+        ring->sq_entries = params.sq_entries;
+        ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+        ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        return true;
+}
+
+void uring_close (pm_uring *ring)
+{
+        if (ring->sqes && ring->sqes != MAP_FAILED)
+                munmap (ring->sqes, ring->sqes_size);
+
+        if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+                munmap (ring->cq_ring, ring->cq_size);
+
+        if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+                munmap (ring->sq_ring, ring->sq_size);
+
+        if (ring->fd >= 0)
+                close (ring->fd);
+
+        free (ring->free_files);
+        *ring = (pm_uring) { .fd = -1 };
+}
+
+/**
+ * Returns whether the kernel knows every one of the count operations in ops.
+ */
+bool uring_supports (pm_uring *ring, uint8_t *ops, int count)
+{
+        size_t size = sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op);
+        struct io_uring_probe *probe = calloc_nofail (1, size);
+        bool supported = syscall (SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+        for (int i = 0; supported && i < count; i++)
+                supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+
+        free (probe);
+
+        return supported;
+}
+
+/**
+ * Registers buffers that operations refer to by index afterwards. Returns
+ * false with errno set if they could not be, locked memory is limited.
+ */
+bool uring_register_buffers (pm_uring *ring, struct iovec *buffers, unsigned count)
+{
+        return syscall (SYS_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+}
+
+/**
+ * Registers a table of count descriptors, empty at first, that is filled
+ * with uring_add_file. Returns false with errno set if it could not be.
+ */
+bool uring_register_files (pm_uring *ring, unsigned count)
+{
+        int *fds = malloc_nofail (count * sizeof (int));
+
+        for (unsigned i = 0; i < count; i++)
+                fds[i] = -1;
+
+        bool ok = syscall (SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count) == 0;
+
+        free (fds);
+
+        if (!ok)
+                return false;
+
+        // the free slots are handed out from the end, lowest slot first
+        ring->free_files = malloc_nofail (count * sizeof (int));
+        ring->free_file_count = count;
+
+        for (unsigned i = 0; i < count; i++)
+                ring->free_files[i] = count - 1 - i;
+
+        return true;
+}
+
+/**
+ * Puts fd in slot of the registered table, -1 empties the slot.
+ */
+bool uring_update_file (pm_uring *ring, int slot, int fd)
+{
+        struct io_uring_files_update update = { .offset = slot, .fds = (uintptr_t)&fd };
+
+        return syscall (SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+/**
+ * Registers fd in a free slot of the table. Returns the slot, or -1 if the
+ * table is full or the ring has none, the descriptor is used as it is then.
+ */
+int uring_add_file (pm_uring *ring, int fd)
+{
+        if (ring->free_file_count == 0)
+                return -1;
+
+        int slot = ring->free_files[--ring->free_file_count];
+
+        if (!uring_update_file (ring, slot, fd)) {
+                ring->free_file_count++;
+                return -1;
+        }
+
+        return slot;
+}
+
+/**
+ * Empties a slot filled by uring_add_file, -1 or a closed ring is ignored.
+ */
+void uring_remove_file (pm_uring *ring, int slot)
+{
+        if (slot < 0 || ring->fd < 0)
+                return;
+
+        uring_update_file (ring, slot, -1);
+        ring->free_files[ring->free_file_count++] = slot;
+}
+
+/**
+ * Returns a cleared submission queue entry to fill in, or NULL if the queue
+ * is full and has to be submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe (pm_uring *ring)
+{
+        if (ring->queued == ring->sq_entries)
+                return NULL;
+
+        unsigned tail = *ring->sq_tail + ring->queued;
+        struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+
+        memset (sqe, 0, sizeof (*sqe));
+        ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+        ring->queued++;
+
+        return sqe;
+}
+
+/**
+ * Hands the queued entries to the kernel and waits until all of them have
+ * completed. Returns false with errno set if they could not be submitted.
+ */
+bool uring_submit_and_wait (pm_uring *ring)
+{
+        unsigned count = ring->queued;
+
+        if (count == 0)
+                return true;
+
+        // the entries have to be visible before the new tail is
+        unsigned tail = *ring->sq_tail + count;
+
+        __atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+        ring->queued = 0;
+        ring->inflight += count;
+
+        // an interrupted call may have submitted some or all of them already
+        for (;;) {
+                unsigned unsubmitted = tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+                unsigned ready = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+
+                if (unsubmitted == 0 && ready >= ring->inflight)
+                        return true;
+
+                ring->enters++;
+
+                if (syscall (SYS_io_uring_enter, ring->fd, unsubmitted, ring->inflight - ready, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                        return false;
+        }
+}
+
+/**
+ * Returns the next completion, or NULL if there is none. It stays valid
+ * until uring_seen is called.
+ */
+struct io_uring_cqe *uring_next_cqe (pm_uring *ring)
+{
+        unsigned head = *ring->cq_head;
+
+        if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+                return NULL;
+
+        return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_seen (pm_uring *ring)
+{
+        ring->inflight--;
+        __atomic_store_n (ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -4,6 +4,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 void *malloc_nofail (size_t size)
 {
@@ -17,19 +20,116 @@ void *malloc_nofail (size_t size)
         return mem;
 }
 
-void read_nofail (int fd, void *buf, size_t size)
+void *realloc_nofail (void *ptr, size_t size)
 {
-        if (read (fd, buf, size) != size) {
-                perror ("read");
+        void *mem = realloc (ptr, size);
+
+        if (!mem) {
+                perror ("realloc");
+                exit (EXIT_FAILURE);
+        }
+
+        return mem;
+}
+
+void *calloc_nofail (size_t count, size_t size)
+{
+        void *mem = calloc (count, size);
+
+        if (!mem) {
+                perror ("calloc");
                 exit (EXIT_FAILURE);
         }
+
+        return mem;
 }
 
-void send_response (int conn_fd, pm_code err)
+void *slab_alloc (pm_slab *slab)
 {
-        pm_response response = { .code = err };
+        if (!slab->free_list) {
+                // round up so every object in the chunk stays aligned
+                size_t align = sizeof (void *) * 2;
+                size_t size = (slab->object_size + align - 1) & ~(align - 1);
+                char *chunk = calloc_nofail (slab->objects_per_chunk, size);
+
+                for (size_t i = slab->objects_per_chunk; i > 0; i--) {
+                        void **object = (void **)(chunk + (i - 1) * size);
+                        *object = slab->free_list;
+                        slab->free_list = object;
+                }
+        }
+
+        void **object = slab->free_list;
+        slab->free_list = *object;
+
+        return object;
+}
+
+void slab_free (pm_slab *slab, void *object)
+{
+        *(void **)object = slab->free_list;
+        slab->free_list = object;
+}
 
-        if (send (conn_fd, &response, sizeof (pm_response), MSG_NOSIGNAL) != sizeof (pm_response)) {
-                log_warn ("error occurred when sending response back to client: %s", strerror (errno));
+void read_nofail (int fd, void *buf, size_t size)
+{
+        while (size > 0) {
+                ssize_t n = read (fd, buf, size);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n <= 0) {
+                        if (n == 0)
+                                errno = ECONNRESET;
+
+                        perror ("read");
+                        exit (EXIT_FAILURE);
+                }
+
+                buf = (char *)buf + n;
+                size -= n;
+        }
+}
+
+/**
+ * Returns a pidfd referring to the process pid, or -1 with errno set. The
+ * pidfd keeps referring to that process even once its pid is reused.
+ */
+int open_pidfd (pid_t pid)
+{
+        return syscall (SYS_pidfd_open, pid, 0);
+}
+
+/**
+ * Returns the time in milliseconds on a clock that only moves forward, for
+ * deadlines and intervals that must not jump with the wall clock.
+ */
+uint64_t monotonic_ms ()
+{
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+
+        return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t monotonic_usec ()
+{
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+
+        return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+char *get_code_description (pm_code code)
+{
+        switch (code) {
+        case OK: return "success";
+        case NO_SUCH_PID: return "no such pid";
+        case NO_SUCH_FILE_OR_DIRECTORY: return "no such file or directory";
+        case INVALID_COMMAND: return "invalid command";
+        case SPAWN_FAILED: return "failed to start process";
+        case UNSUPPORTED_VERSION: return "unsupported protocol version";
+        default: return "unknown error";
         }
 }
\ No newline at end of file
@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+#include "pm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Zygote pools
+ *
+ * A program that is started over and over can be registered for a pool of
+ * zygotes: helpers the daemon starts ahead of time, which wait parked on a
+ * socket until a process of that program is to be started. The helper is
+ * this program run as PM_ZYGOTE_NAME. It receives the argument vector, the
+ * environment and the descriptors of its output, and execs the registered
+ * program in place, so the helper's pid becomes the process's pid. The
+ * process table never sees a helper that was not handed out.
+ *
+ * A spawn through a helper skips creating a process and searching PATH, the
+ * helper was forked, exec'd and linked while nobody was waiting. Taking a
+ * helper schedules the pool to be refilled on the next timer tick, off the
+ * path of the request. A pool that ran dry falls back to posix_spawn.
+ *
+ * Requests are SOCK_SEQPACKET messages: u32 flags, then the argument vector
+ * and the environment, each as a u32 size followed by null terminated
+ * strings. The output descriptors come along as SCM_RIGHTS. The helper's end
+ * of the socket is closed on exec: end of file tells the daemon the program
+ * is running, an int is the errno of a failed exec.
+ *
+ * Every spawn is timed, the latencies of spawns with and without a zygote
+ * are kept in two histograms.
+ */
+
+// descriptor the helper finds its socket at
+#define ZYGOTE_FD 3
+
+// zygote request flags
+#define ZYGOTE_STDOUT (1 << 0)
+#define ZYGOTE_STDERR (1 << 1)
+// stderr shares the descriptor sent for stdout
+#define ZYGOTE_SHARED (1 << 2)
+
+extern pm_configuration config;
+extern char **environ;
+
+typedef struct zygote {
+        pid_t pid;
+        int fd;
+} zygote;
+
+typedef struct zygote_pool {
+        // name runs are matched against, exactly as given for argv[0]
+        char program[PM_NAME_MAX];
+        // where the program was found when it was registered
+        char path[PATH_MAX];
+        uint32_t size;
+        uint32_t count;
+        zygote helpers[PM_ZYGOTE_POOL_MAX];
+        pm_timer refill_timer;
+} zygote_pool;
+
+static zygote_pool pools[PM_ZYGOTE_PROGRAMS];
+static uint32_t pool_count;
+
+// helpers let go of that have not been reaped yet
+static pid_t *leaving;
+static size_t leaving_count;
+static size_t leaving_cap;
+
+static pm_histogram spawn_latency[2];
+
+/**
+ * Finds the program the way posix_spawnp would, relative names are taken
+ * relative to the daemon's directory. Returns false if it is not there or
+ * cannot be run.
+ */
+static bool resolve_program (char *program, char *path)
+{
+        struct stat st;
+
+        if (strchr (program, '/')) {
+                snprintf (path, PATH_MAX, "%s", program);
+                return stat (path, &st) == 0 && S_ISREG (st.st_mode) && access (path, X_OK) == 0;
+        }
+
+        char *search = getenv ("PATH");
+
+        if (!search)
+                search = "/bin:/usr/bin";
+
+        for (char *dir = search, *end; *dir; dir = *end ? end + 1 : end) {
+                end = strchrnul (dir, ':');
+
+                // an empty entry is the current directory
+                if (end == dir)
+                        snprintf (path, PATH_MAX, "%s", program);
+                else
+                        snprintf (path, PATH_MAX, "%.*s/%s", (int)(end - dir), dir, program);
+
+                if (stat (path, &st) == 0 && S_ISREG (st.st_mode) && access (path, X_OK) == 0)
+                        return true;
+        }
+
+        return false;
+}
+
+/**
+ * Starts a helper for the pool. It is started like any process would be, in
+ * a process group of its own and with the signal state reset, whatever it
+ * execs inherits that.
+ */
+static bool start_zygote (zygote_pool *pool)
+{
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t mask, defaults;
+        int fds[2];
+        pid_t pid;
+
+        if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+                log_error ("failed to create a zygote socket: %s", strerror (errno));
+                return false;
+        }
+
+        posix_spawn_file_actions_init (&actions);
+        posix_spawnattr_init (&attr);
+
+        sigemptyset (&mask);
+        sigfillset (&defaults);
+        posix_spawnattr_setsigmask (&attr, &mask);
+        posix_spawnattr_setsigdefault (&attr, &defaults);
+        posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup (&attr, 0);
+
+        posix_spawn_file_actions_adddup2 (&actions, fds[1], ZYGOTE_FD);
+
+        char *argv[] = { PM_ZYGOTE_NAME, pool->path, NULL };
+        int err = posix_spawn (&pid, "/proc/self/exe", &actions, &attr, argv, environ);
+
+        posix_spawnattr_destroy (&attr);
+        posix_spawn_file_actions_destroy (&actions);
+        close (fds[1]);
+
+        if (err != 0) {
+                log_error ("failed to start a zygote for %s: %s", pool->program, strerror (err));
+                close (fds[0]);
+                return false;
+        }
+
+        pool->helpers[pool->count++] = (zygote) { .pid = pid, .fd = fds[0] };
+
+        return true;
+}
+
+static void handle_refill_timer (pm_timer *timer)
+{
+        zygote_pool *pool = timer->data;
+
+        while (pool->count < pool->size)
+                if (!start_zygote (pool))
+                        break;
+}
+
+static void drain_pool (zygote_pool *pool, uint32_t keep)
+{
+        // a helper exits once it sees end of file on its socket
+        while (pool->count > keep) {
+                zygote *helper = &pool->helpers[--pool->count];
+
+                if (leaving_count == leaving_cap) {
+                        leaving_cap = leaving_cap ? leaving_cap * 2 : 16;
+                        leaving = realloc_nofail (leaving, leaving_cap * sizeof (pid_t));
+                }
+
+                leaving[leaving_count++] = helper->pid;
+                close (helper->fd);
+        }
+}
+
+static zygote_pool *find_pool (char *program)
+{
+        for (uint32_t i = 0; i < pool_count; i++)
+                if (strcmp (pools[i].program, program) == 0)
+                        return &pools[i];
+
+        return NULL;
+}
+
+/**
+ * Keeps size helpers ready for program, 0 removes its pool. Returns
+ * NO_SUCH_FILE_OR_DIRECTORY if the program cannot be found.
+ */
+pm_code zygote_register (char *program, uint32_t size)
+{
+        zygote_pool *pool = find_pool (program);
+
+        if (size > PM_ZYGOTE_POOL_MAX)
+                size = PM_ZYGOTE_POOL_MAX;
+
+        if (size == 0) {
+                if (!pool)
+                        return OK;
+
+                drain_pool (pool, 0);
+                timer_cancel (&pool->refill_timer);
+
+                // keep the pools packed, a timer is only moved while it is
+                // not linked into the wheel
+                zygote_pool *last = &pools[--pool_count];
+
+                if (pool != last) {
+                        bool pending = last->refill_timer.slot != NULL;
+
+                        timer_cancel (&last->refill_timer);
+                        *pool = *last;
+                        pool->refill_timer.data = pool;
+
+                        if (pending)
+                                timer_schedule (&pool->refill_timer, 0);
+                }
+
+                return OK;
+        }
+
+        if (!pool && pool_count == PM_ZYGOTE_PROGRAMS)
+                return INVALID_COMMAND;
+
+        char path[PATH_MAX];
+
+        if (!resolve_program (program, path))
+                return NO_SUCH_FILE_OR_DIRECTORY;
+
+        if (!pool) {
+                pool = &pools[pool_count++];
+                *pool = (zygote_pool) { .refill_timer = { .callback = handle_refill_timer, .data = pool } };
+                snprintf (pool->program, sizeof (pool->program), "%s", program);
+        }
+
+        // helpers of a program that moved would run the old one
+        if (strcmp (pool->path, path) != 0)
+                drain_pool (pool, 0);
+
+        snprintf (pool->path, sizeof (pool->path), "%s", path);
+        pool->size = size;
+        drain_pool (pool, size);
+
+        if (pool->count < pool->size)
+                timer_schedule (&pool->refill_timer, 0);
+
+        return OK;
+}
+
+static void put_strings (pm_buffer *buf, char **strings)
+{
+        size_t size = 0;
+
+        for (int i = 0; strings[i]; i++)
+                size += strlen (strings[i]) + 1;
+
+        buffer_put_u32 (buf, size);
+
+        for (int i = 0; strings[i]; i++)
+                buffer_put_bytes (buf, strings[i], strlen (strings[i]) + 1);
+}
+
+/**
+ * Hands a zygote the program to exec. Returns false if the helper is gone
+ * or could not exec the program, with errno set.
+ */
+static bool hand_over (zygote *helper, char **argv, char **envp, int out_fd, int err_fd)
+{
+        static pm_buffer body = { 0 };
+        char control[CMSG_SPACE (2 * sizeof (int))] = { 0 };
+        int fds[2], fd_count = 0;
+        uint32_t flags = 0;
+
+        if (out_fd >= 0) {
+                flags |= ZYGOTE_STDOUT;
+                fds[fd_count++] = out_fd;
+        }
+
+        if (err_fd >= 0 && err_fd == out_fd) {
+                flags |= ZYGOTE_STDERR | ZYGOTE_SHARED;
+        } else if (err_fd >= 0) {
+                flags |= ZYGOTE_STDERR;
+                fds[fd_count++] = err_fd;
+        }
+
+        buffer_clear (&body);
+        buffer_put_u32 (&body, flags);
+        put_strings (&body, argv);
+        put_strings (&body, envp);
+
+        struct iovec iov = { .iov_base = body.data, .iov_len = body.len };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+        if (fd_count > 0) {
+                msg.msg_control = control;
+                msg.msg_controllen = CMSG_SPACE (fd_count * sizeof (int));
+
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN (fd_count * sizeof (int));
+                memcpy (CMSG_DATA (cmsg), fds, fd_count * sizeof (int));
+        }
+
+        if (sendmsg (helper->fd, &msg, MSG_NOSIGNAL) < 0)
+                return false;
+
+        // the helper answers once it has exec'd, or failed to
+        int err;
+        ssize_t n;
+
+        while ((n = read (helper->fd, &err, sizeof (err))) < 0 && errno == EINTR)
+                ;
+
+        if (n == sizeof (err)) {
+                // it exits right after, don't leave it to the child monitor
+                waitpid (helper->pid, NULL, 0);
+                errno = err;
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Starts argv through a zygote of its program, if it has a pool with a
+ * helper ready. Returns the pid of the new process, 0 if there is no helper
+ * to start it, or -1 with errno set if it could not be started.
+ */
+pid_t zygote_spawn (char **argv, char **envp, int out_fd, int err_fd)
+{
+        zygote_pool *pool = find_pool (argv[0]);
+
+        if (!pool)
+                return 0;
+
+        if (!pool->refill_timer.slot)
+                timer_schedule (&pool->refill_timer, 0);
+
+        while (pool->count > 0) {
+                zygote helper = pool->helpers[--pool->count];
+                bool started = hand_over (&helper, argv, envp, out_fd, err_fd);
+                int err = errno;
+
+                close (helper.fd);
+
+                if (started)
+                        return helper.pid;
+
+                // a helper that died while parked is reaped by the monitor,
+                // the next one may still be fine
+                if (err == EPIPE || err == ECONNRESET)
+                        continue;
+
+                errno = err;
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * Called for every child the monitor reaps that is not a managed process.
+ * Returns true if it was a zygote. One that exited while parked is replaced.
+ */
+bool zygote_reaped (pid_t pid)
+{
+        for (size_t i = 0; i < leaving_count; i++) {
+                if (leaving[i] == pid) {
+                        leaving[i] = leaving[--leaving_count];
+                        return true;
+                }
+        }
+
+        for (uint32_t i = 0; i < pool_count; i++) {
+                zygote_pool *pool = &pools[i];
+
+                for (uint32_t j = 0; j < pool->count; j++) {
+                        if (pool->helpers[j].pid != pid)
+                                continue;
+
+                        log_warn ("zygote %d of %s exited while parked", pid, pool->program);
+
+                        close (pool->helpers[j].fd);
+                        pool->helpers[j] = pool->helpers[--pool->count];
+                        timer_schedule (&pool->refill_timer, 0);
+
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/**
+ * Lets every parked zygote go, they exit on their own. The registrations are
+ * kept, they are journaled with the daemon's settings.
+ */
+void zygote_stop ()
+{
+        for (uint32_t i = 0; i < pool_count; i++) {
+                drain_pool (&pools[i], 0);
+                timer_cancel (&pools[i].refill_timer);
+        }
+}
+
+void record_spawn_latency (bool zygote, uint64_t usec)
+{
+        pm_histogram *histogram = &spawn_latency[zygote];
+        uint32_t bucket = 0;
+
+        while (bucket < PM_HISTOGRAM_BUCKETS - 1 && usec >> (bucket + 1))
+                bucket++;
+
+        histogram->buckets[bucket]++;
+        histogram->count++;
+        histogram->sum += usec;
+
+        if (usec > histogram->max)
+                histogram->max = usec;
+}
+
+/**
+ * Appends the registered programs and their pool sizes, as the journal keeps
+ * them: u8 count, then a string and a u32 for every program.
+ */
+void put_zygote_pools (pm_buffer *buf)
+{
+        buffer_put_u8 (buf, pool_count);
+
+        for (uint32_t i = 0; i < pool_count; i++) {
+                buffer_put_string (buf, pools[i].program);
+                buffer_put_u32 (buf, pools[i].size);
+        }
+}
+
+static void put_histogram (pm_buffer *buf, char *name, pm_histogram *histogram)
+{
+        buffer_put_string (buf, name);
+        buffer_put_u64 (buf, histogram->count);
+        buffer_put_u64 (buf, histogram->sum);
+        buffer_put_u64 (buf, histogram->max);
+        buffer_put_u8 (buf, PM_HISTOGRAM_BUCKETS);
+
+        for (int i = 0; i < PM_HISTOGRAM_BUCKETS; i++)
+                buffer_put_u64 (buf, histogram->buckets[i]);
+}
+
+/**
+ * Returns the ZYGOTE listing.
+ *
+ * Encoding: u8 count, then for every pool its program and path as strings,
+ * u32 pool size and u32 helpers ready. Then u8 count of histograms, each a
+ * name string, u64 count, u64 sum and u64 maximum in microseconds, u8 number
+ * of buckets and a u64 per bucket. Bucket i counts latencies below 2^(i+1)
+ * microseconds that did not fit the bucket before, the last one everything
+ * else.
+ */
+void encode_zygotes (pm_buffer *buf)
+{
+        buffer_clear (buf);
+        buffer_put_u8 (buf, pool_count);
+
+        for (uint32_t i = 0; i < pool_count; i++) {
+                buffer_put_string (buf, pools[i].program);
+                buffer_put_string (buf, pools[i].path);
+                buffer_put_u32 (buf, pools[i].size);
+                buffer_put_u32 (buf, pools[i].count);
+        }
+
+        buffer_put_u8 (buf, 2);
+        put_histogram (buf, "direct", &spawn_latency[false]);
+        put_histogram (buf, "zygote", &spawn_latency[true]);
+}
+
+static void split_strings (char *data, uint32_t size, char **vector)
+{
+        int count = 0;
+
+        for (char *s = data; s < data + size; s += strlen (s) + 1)
+                vector[count++] = s;
+
+        vector[count] = NULL;
+}
+
+static uint32_t count_strings (char *data, uint32_t size)
+{
+        uint32_t count = 0;
+
+        for (uint32_t i = 0; i < size; i++)
+                count += data[i] == '\0';
+
+        return count;
+}
+
+/**
+ * Runs as a zygote: waits for the daemon's request and execs program with
+ * it. Never returns.
+ */
+void zygote_main (char *program)
+{
+        char control[CMSG_SPACE (2 * sizeof (int))];
+        int fds[2] = { -1, -1 };
+
+        fcntl (ZYGOTE_FD, F_SETFD, FD_CLOEXEC);
+        prctl (PR_SET_NAME, PM_ZYGOTE_NAME);
+
+        // the size of the request is known before it is read
+        ssize_t size = recv (ZYGOTE_FD, NULL, 0, MSG_PEEK | MSG_TRUNC);
+
+        if (size <= 0)
+                _exit (0);
+
+        char *data = malloc_nofail (size);
+        struct iovec iov = { .iov_base = data, .iov_len = size };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof (control) };
+
+        if (recvmsg (ZYGOTE_FD, &msg, 0) != size)
+                _exit (0);
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len <= CMSG_LEN (sizeof (fds)))
+                        memcpy (fds, CMSG_DATA (cmsg), cmsg->cmsg_len - CMSG_LEN (0));
+
+        pm_reader reader = { .data = data, .len = size };
+        uint32_t flags = reader_get_u32 (&reader);
+        uint32_t argv_size = reader_get_u32 (&reader);
+        char *args = reader_get_bytes (&reader, argv_size);
+        uint32_t env_size = reader_get_u32 (&reader);
+        char *env = reader_get_bytes (&reader, env_size);
+        int err = EINVAL;
+
+        if (!reader.error && argv_size > 0 && args[argv_size - 1] == '\0' && (env_size == 0 || env[env_size - 1] == '\0')) {
+                char **argv = malloc_nofail ((count_strings (args, argv_size) + 1) * sizeof (char *));
+                char **envp = malloc_nofail ((count_strings (env, env_size) + 1) * sizeof (char *));
+                int next = 0;
+
+                split_strings (args, argv_size, argv);
+                split_strings (env, env_size, envp);
+
+                if (flags & ZYGOTE_STDOUT)
+                        dup2 (fds[next++], STDOUT_FILENO);
+
+                if (flags & ZYGOTE_SHARED)
+                        dup2 (STDOUT_FILENO, STDERR_FILENO);
+                else if (flags & ZYGOTE_STDERR)
+                        dup2 (fds[next], STDERR_FILENO);
+
+                for (int i = 0; i < 2; i++)
+                        if (fds[i] > STDERR_FILENO)
+                                close (fds[i]);
+
+                execve (program, argv, envp);
+                err = errno;
+        }
+
+        write (ZYGOTE_FD, &err, sizeof (err));
+        _exit (127);
+}